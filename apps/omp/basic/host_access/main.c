@@ -0,0 +1,131 @@
+// Copyright 2024 ETH Zurich and University of Bologna.
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: Apache-2.0
+//
+// Device cycles per word of the host accesses of hero_64.h: one host window
+// per access (hero_load/hero_store), one window per run of accesses as the
+// legalizer coalesces them (hero_window_*), and the block accesses
+// (hero_memcpy_host2dev, hero_memcpy_dev2host, hero_memset_host).
+//
+// Usage: host_access [size in bytes]
+
+////// HERO_1 includes /////
+#ifdef __HERO_1
+////// HOST includes /////
+#else
+#include <omp.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <libhero/hero_api.h>
+#endif
+///// ALL includes /////
+#include "hero_64.h"
+///// END includes /////
+
+#ifdef __HERO_SPATZ_CLUSTER
+#include "omp.h"
+#include "printf.h"
+#include "snrt.h"
+#endif
+
+// Words per device buffer, and per window in the coalesced variant (the
+// legalizer default, see -hero-window-max-accesses)
+#define HACC_CHUNK 256
+#define HACC_RUN 16
+
+enum { HACC_LOAD, HACC_LOAD_WINDOW, HACC_MEMCPY_H2D, HACC_STORE, HACC_STORE_WINDOW, HACC_MEMCPY_D2H, HACC_MEMSET, HACC_N };
+static const char *hacc_names[] = {"hero_load", "window load", "memcpy_host2dev", "hero_store",
+                                   "window store", "memcpy_dev2host", "memset_host"};
+
+// Device cycles to access size bytes (a multiple of the chunk) at buf_p
+uint32_t host_access(int mode, uint64_t buf_p_, uint32_t size_)
+{
+    uint32_t cycles_ = 0;
+
+#pragma omp target device(1) map(to : mode, buf_p_, size_) map(tofrom : cycles_)
+    {
+#ifdef __HERO_DEV
+        uint32_t l1[HACC_CHUNK];
+        volatile uint32_t sum = 0;
+        const uint64_t buf_p  = buf_p_;
+        const uint32_t size   = size_;
+        uint32_t t0           = read_csr(mcycle);
+
+        for (uint32_t off = 0; off < size; off += sizeof(l1)) {
+            switch (mode) {
+            case HACC_LOAD:
+                for (uint32_t i = 0; i < HACC_CHUNK; i++)
+                    l1[i] = hero_load_uint32(buf_p + off + i * 4);
+                break;
+            case HACC_LOAD_WINDOW:
+                for (uint32_t i = 0; i < HACC_CHUNK; i += HACC_RUN) {
+                    uint32_t mstatus = hero_window_open();
+                    for (uint32_t j = i; j < i + HACC_RUN; j++)
+                        l1[j] = hero_window_load_uint32(buf_p + off + j * 4);
+                    hero_window_close(mstatus);
+                }
+                break;
+            case HACC_MEMCPY_H2D:
+                hero_memcpy_host2dev(l1, buf_p + off, sizeof(l1));
+                break;
+            case HACC_STORE:
+                for (uint32_t i = 0; i < HACC_CHUNK; i++)
+                    hero_store_uint32(buf_p + off + i * 4, l1[i]);
+                break;
+            case HACC_STORE_WINDOW:
+                for (uint32_t i = 0; i < HACC_CHUNK; i += HACC_RUN) {
+                    uint32_t mstatus = hero_window_open();
+                    for (uint32_t j = i; j < i + HACC_RUN; j++)
+                        hero_window_store_uint32(buf_p + off + j * 4, l1[j]);
+                    hero_window_close(mstatus);
+                }
+                break;
+            case HACC_MEMCPY_D2H:
+                hero_memcpy_dev2host(buf_p + off, l1, sizeof(l1));
+                break;
+            case HACC_MEMSET:
+                hero_memset_host(buf_p + off, 0x5a, sizeof(l1));
+                break;
+            }
+            sum += l1[off % HACC_CHUNK];
+        }
+
+        cycles_ = read_csr(mcycle) - t0;
+#endif
+    }
+    return cycles_;
+}
+
+#ifndef __HERO_DEV
+int main(int argc, char *argv[])
+{
+    uintptr_t buf, buf_phys;
+    uint32_t size = 64 * 1024;
+    const uint32_t chunk = HACC_CHUNK * sizeof(uint32_t);
+
+    if (argc > 1)
+        size = strtol(argv[1], NULL, 10);
+    size = (size + chunk - 1) / chunk * chunk;
+
+    // Init Hero OpenMP runtime
+#pragma omp target device(1)
+    asm volatile("nop");
+
+    buf = hero_dev_l3_malloc(NULL, size, &buf_phys);
+    if (!buf) {
+        printf("Error : Can't allocate %u bytes in L3\n\r", size);
+        return -1;
+    }
+
+    for (int m = 0; m < HACC_N; m++) {
+        uint32_t cycles = host_access(m, buf_phys, size);
+        printf("%-16s %8u B : %10u cycles %6.2f cycles/word\n", hacc_names[m], size, cycles,
+               (float)cycles * sizeof(uint32_t) / size);
+    }
+
+    hero_dev_l3_free(NULL, buf, buf_phys);
+
+    return 0;
+}
+#endif
@@ -0,0 +1,127 @@
+// Copyright 2024 ETH Zurich and University of Bologna.
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: Apache-2.0
+//
+// Host fill and readback bandwidth of the memories shared with the device:
+// the device L2 and L3 heaps and a DMA buffer. The cache maintenance needed
+// to hand the data over (hero_dev_sync) is part of the measurement. Run it
+// with HERO_MAP_CACHED=0 and HERO_MAP_CACHED=1 to compare the uncached and
+// the cached mappings. On PCIe hosts, load the driver with
+// pcie_write_combine=0 and =1 to compare the uncached and the write-combined
+// mappings, the wide fill uses memcpy_toio_wide().
+//
+// Usage: host_bandwidth [size in bytes]
+
+////// HERO_1 includes /////
+#ifdef __HERO_1
+////// HOST includes /////
+#else
+#include <omp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <libhero/hero_api.h>
+#include <libhero/io.h>
+#endif
+///// ALL includes /////
+#include "hero_64.h"
+///// END includes /////
+
+#ifndef __HERO_DEV
+#define MIN(A, B) (A < B ? A : B)
+
+// Runs per measurement, the fastest is kept
+#define HOSTBW_RUNS 3
+
+static double now_s()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void measure(const char *name, uint32_t *buf, uintptr_t buf_phys, size_t size, const uint32_t *src)
+{
+    double t0, fill = 1e9, fill_wide = 1e9, readback = 1e9;
+    volatile uint32_t sum = 0;
+
+    for (int r = 0; r < HOSTBW_RUNS; r++) {
+        // Fill element by element as the apps initialize their inputs, then
+        // hand over to the device
+        t0 = now_s();
+        for (size_t i = 0; i < size / sizeof(uint32_t); i++)
+            buf[i] = i;
+        hero_dev_sync(NULL, buf_phys, size, HERO_SYNC_FOR_DEVICE);
+        fill = MIN(fill, now_s() - t0);
+
+        // Bulk copy with wide stores
+        t0 = now_s();
+        memcpy_toio_wide((uintptr_t)buf, src, size);
+        wc_flush();
+        hero_dev_sync(NULL, buf_phys, size, HERO_SYNC_FOR_DEVICE);
+        fill_wide = MIN(fill_wide, now_s() - t0);
+
+        // Take back what the device would have written, then read it
+        t0 = now_s();
+        hero_dev_sync(NULL, buf_phys, size, HERO_SYNC_FOR_CPU);
+        for (size_t i = 0; i < size / sizeof(uint32_t); i++)
+            sum += buf[i];
+        readback = MIN(readback, now_s() - t0);
+    }
+
+    printf("%-10s %10zu B : fill %8.2f MB/s fill_wide %8.2f MB/s readback %8.2f MB/s\n", name, size,
+           size / fill / 1e6, size / fill_wide / 1e6, size / readback / 1e6);
+}
+
+int main(int argc, char *argv[])
+{
+    uintptr_t l2_phys, l3_phys, dma_phys;
+    uint32_t *l2, *l3, *dma, *src;
+    size_t size = 1024 * 1024;
+    // The L2 heap is much smaller
+    size_t l2_size;
+
+    if (argc > 1)
+        size = strtol(argv[1], NULL, 10);
+    l2_size = MIN(size, 64 * 1024);
+
+    src = malloc(size);
+    if (!src)
+        return -1;
+    for (size_t i = 0; i < size / sizeof(uint32_t); i++)
+        src[i] = i;
+
+    // Init Hero OpenMP runtime
+#pragma omp target device(1)
+    asm volatile("nop");
+
+    printf("HERO_MAP_CACHED=%s\n", getenv("HERO_MAP_CACHED") ? getenv("HERO_MAP_CACHED") : "0");
+
+    l2 = (uint32_t *)hero_dev_l2_malloc(NULL, l2_size, &l2_phys);
+    if (l2)
+        measure("l2", l2, l2_phys, l2_size, src);
+    else
+        printf("Error : Can't allocate %zu bytes in L2\n\r", l2_size);
+
+    l3 = (uint32_t *)hero_dev_l3_malloc(NULL, size, &l3_phys);
+    if (l3)
+        measure("l3", l3, l3_phys, size, src);
+    else
+        printf("Error : Can't allocate %zu bytes in L3\n\r", size);
+
+    dma = (uint32_t *)hero_host_l3_malloc(NULL, size, &dma_phys);
+    if (dma)
+        measure("dma_buf", dma, dma_phys, size, src);
+    else
+        printf("Error : Can't allocate a %zu bytes DMA buffer\n\r", size);
+
+    if (l2)
+        hero_dev_l2_free(NULL, (uintptr_t)l2, l2_phys);
+    if (l3)
+        hero_dev_l3_free(NULL, (uintptr_t)l3, l3_phys);
+    free(src);
+
+    return 0;
+}
+#endif
@@ -0,0 +1,98 @@
+// Copyright 2024 ETH Zurich and University of Bologna.
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: Apache-2.0
+//
+// Throughput of memcpy and memset on mapped host memory in a kernel, which
+// the host pointer legalizer lowers to the block accesses of hero_64.h (DMA
+// from HERO_64_DMA_MIN_BYTES on). Build it with
+// HOP_LEGALIZER_ARGS=-hero-mem-inline-bytes=4294967295 to get the former loops
+// of host accesses.
+//
+// Usage: host_memcpy [max size in bytes]
+
+////// HERO_1 includes /////
+#ifdef __HERO_1
+////// HOST includes /////
+#else
+#include <omp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libhero/hero_api.h>
+#endif
+///// ALL includes /////
+#include "hero_64.h"
+///// END includes /////
+
+#ifdef __HERO_SPATZ_CLUSTER
+#include "omp.h"
+#include "printf.h"
+#include "snrt.h"
+#endif
+
+#ifdef __HERO_DEV
+#include <string.h>
+#endif
+
+enum { HMEM_H2D, HMEM_D2H, HMEM_SET, HMEM_N };
+static const char *hmem_names[] = {"host2dev", "dev2host", "memset"};
+
+// Device cycles of one copy of size bytes between a and L1
+uint32_t host_memcpy(int mode, uint8_t *a, uint32_t size)
+{
+    uint32_t cycles = 0;
+
+#pragma omp target device(1) map(tofrom : a[0:size], cycles) map(to : mode, size)
+    {
+#ifdef __HERO_DEV
+        uint8_t *l1 = (uint8_t *)snrt_l1alloc(size);
+        uint32_t t0 = read_csr(mcycle);
+        switch (mode) {
+        case HMEM_H2D:
+            memcpy(l1, a, size);
+            break;
+        case HMEM_D2H:
+            memcpy(a, l1, size);
+            break;
+        case HMEM_SET:
+            memset(a, 0x5a, size);
+            break;
+        }
+        cycles = read_csr(mcycle) - t0;
+#endif
+    }
+    return cycles;
+}
+
+#ifndef __HERO_DEV
+int main(int argc, char *argv[])
+{
+    uint32_t max_size = 32 * 1024;
+    uint8_t *a;
+
+    if (argc > 1)
+        max_size = strtol(argv[1], NULL, 10);
+
+    a = malloc(max_size);
+    if (!a)
+        return -1;
+    memset(a, 0, max_size);
+
+    // Init Hero OpenMP runtime
+#pragma omp target device(1)
+    asm volatile("nop");
+
+    for (uint32_t size = 64; size <= max_size; size *= 4) {
+        for (int m = 0; m < HMEM_N; m++) {
+            uint32_t cycles = host_memcpy(m, a, size);
+            printf("%-8s %8u B : %10u cycles %6.2f B/cycle\n", hmem_names[m], size, cycles,
+                   cycles ? (float)size / cycles : 0.0f);
+        }
+    }
+
+    free(a);
+
+    return 0;
+}
+#endif
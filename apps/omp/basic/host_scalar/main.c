@@ -0,0 +1,101 @@
+// Copyright 2024 ETH Zurich and University of Bologna.
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: Apache-2.0
+//
+// Device loops over device (L1) data that read their parameters through host
+// pointers, as kernels do with mapped scalars. Build it as is to let LLVM
+// hoist the host loads out of the loops and optimize around the host
+// accessors, and with HOP_LEGALIZER_ARGS=-hero-host-accessor-attrs=0 to keep
+// one opaque host access per use, then compare the device cycles.
+//
+// Usage: host_scalar [iterations]
+
+////// HERO_1 includes /////
+#ifdef __HERO_1
+////// HOST includes /////
+#else
+#include <omp.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <libhero/hero_api.h>
+#endif
+///// ALL includes /////
+#include "hero_64.h"
+///// END includes /////
+
+#ifdef __HERO_SPATZ_CLUSTER
+#include "omp.h"
+#include "printf.h"
+#include "snrt.h"
+#endif
+
+// Elements of the device array
+#define HSCAL_N 256
+
+struct hscal_params {
+    int32_t alpha;
+    int32_t beta;
+    uint32_t n;
+};
+
+// Device cycles of iters passes of y = alpha * y + beta over a device array,
+// alpha, beta and the length being read through host pointers
+uint32_t host_scalar(struct hscal_params *p, uint32_t iters, int32_t *checksum)
+{
+    uint32_t cycles = 0;
+    int32_t sum     = 0;
+
+#pragma omp target device(1) map(to : p[0:1], iters) map(tofrom : cycles, sum)
+    {
+        int32_t y[HSCAL_N];
+#ifdef __HERO_DEV
+        uint32_t t0 = read_csr(mcycle);
+#endif
+        for (uint32_t i = 0; i < HSCAL_N; i++)
+            y[i] = i;
+        for (uint32_t it = 0; it < iters; it++)
+            for (uint32_t i = 0; i < p->n; i++)
+                y[i] = p->alpha * y[i] + p->beta;
+        for (uint32_t i = 0; i < HSCAL_N; i++)
+            sum += y[i];
+#ifdef __HERO_DEV
+        cycles = read_csr(mcycle) - t0;
+#endif
+    }
+    *checksum = sum;
+    return cycles;
+}
+
+#ifndef __HERO_DEV
+int main(int argc, char *argv[])
+{
+    struct hscal_params p = {.alpha = 3, .beta = -1, .n = HSCAL_N};
+    uint32_t iters = 16, cycles;
+    int32_t y[HSCAL_N], ref = 0, sum;
+
+    if (argc > 1)
+        iters = strtol(argv[1], NULL, 10);
+
+    for (uint32_t i = 0; i < HSCAL_N; i++) {
+        y[i] = i;
+        for (uint32_t it = 0; it < iters; it++)
+            y[i] = p.alpha * y[i] + p.beta;
+        ref += y[i];
+    }
+
+    // Init Hero OpenMP runtime
+#pragma omp target device(1)
+    asm volatile("nop");
+
+    cycles = host_scalar(&p, iters, &sum);
+    printf("%u x %u elements : %10u cycles %6.2f cycles/element\n", iters, HSCAL_N, cycles,
+           (float)cycles / (iters * HSCAL_N));
+    if (sum != ref) {
+        printf("Error : checksum %d != %d\n", sum, ref);
+        return -1;
+    }
+
+    return 0;
+}
+#endif
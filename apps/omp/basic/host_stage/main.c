@@ -0,0 +1,158 @@
+// Copyright 2024 ETH Zurich and University of Bologna.
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: Apache-2.0
+//
+// L1 staging of the host accesses: loop kernels that work on mapped host
+// arrays chunk by chunk, as the legalizer sees them. Build it as is to get
+// the chunks staged in L1 with bulk copies, and with
+// HOP_LEGALIZER_ARGS=-hero-l1-staging=0 to get one hero_load/hero_store per
+// element, then compare the device cycles.
+//
+// Usage: host_stage [elements]
+
+////// HERO_1 includes /////
+#ifdef __HERO_1
+////// HOST includes /////
+#else
+#include <omp.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <libhero/hero_api.h>
+#endif
+///// ALL includes /////
+#include "hero_64.h"
+///// END includes /////
+
+#ifdef __HERO_SPATZ_CLUSTER
+#include "omp.h"
+#include "printf.h"
+#include "snrt.h"
+#endif
+
+// Elements per inner loop, three int32 ranges fit the 1 KiB staging buffer
+#define HSTAGE_CHUNK 64
+
+enum { HSTAGE_VADD, HSTAGE_SAXPY, HSTAGE_SUM, HSTAGE_STENCIL, HSTAGE_KERNELS };
+static const char *hstage_names[] = {"vadd", "saxpy", "sum", "stencil"};
+
+// Device cycles of one kernel over n elements (a multiple of HSTAGE_CHUNK)
+uint32_t host_stage(int kernel, int32_t *a, int32_t *b, int32_t *c, uint32_t n, int32_t *sum)
+{
+    uint32_t cycles = 0;
+    int32_t acc     = 0;
+
+#pragma omp target device(1) map(to : a[0:n], b[0:n]) map(tofrom : c[0:n], cycles, acc)
+    {
+#ifdef __HERO_DEV
+        uint32_t t0 = read_csr(mcycle);
+#endif
+        for (uint32_t i = 0; i < n; i += HSTAGE_CHUNK) {
+            switch (kernel) {
+            case HSTAGE_VADD:
+                for (uint32_t j = i; j < i + HSTAGE_CHUNK; j++)
+                    c[j] = a[j] + b[j];
+                break;
+            case HSTAGE_SAXPY:
+                for (uint32_t j = i; j < i + HSTAGE_CHUNK; j++)
+                    c[j] = 3 * a[j] + c[j];
+                break;
+            case HSTAGE_SUM:
+                for (uint32_t j = i; j < i + HSTAGE_CHUNK; j++)
+                    acc += a[j] * b[j];
+                break;
+            case HSTAGE_STENCIL:
+                // The first and the last elements have a single neighbour
+                for (uint32_t j = i ? i : 1; j < i + HSTAGE_CHUNK && j < n - 1; j++)
+                    c[j] = a[j - 1] + 2 * a[j] + a[j + 1];
+                break;
+            }
+        }
+#ifdef __HERO_DEV
+        cycles = read_csr(mcycle) - t0;
+#endif
+    }
+    *sum = acc;
+    return cycles;
+}
+
+#ifndef __HERO_DEV
+static int check(int kernel, const int32_t *a, const int32_t *b, const int32_t *c, const int32_t *c0, uint32_t n,
+                 int32_t sum)
+{
+    int32_t ref = 0;
+
+    for (uint32_t j = 0; j < n; j++) {
+        switch (kernel) {
+        case HSTAGE_VADD:
+            ref = a[j] + b[j];
+            break;
+        case HSTAGE_SAXPY:
+            ref = 3 * a[j] + c0[j];
+            break;
+        case HSTAGE_SUM:
+            continue;
+        case HSTAGE_STENCIL:
+            ref = (j == 0 || j == n - 1) ? c0[j] : a[j - 1] + 2 * a[j] + a[j + 1];
+            break;
+        }
+        if (c[j] != ref) {
+            printf("Error : %s mismatch at %u: %d != %d\n", hstage_names[kernel], j, c[j], ref);
+            return -1;
+        }
+    }
+    if (kernel == HSTAGE_SUM) {
+        for (uint32_t j = 0; j < n; j++)
+            ref += a[j] * b[j];
+        if (sum != ref) {
+            printf("Error : sum mismatch: %d != %d\n", sum, ref);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    uint32_t n = 16 * 1024;
+    int32_t *a, *b, *c, *c0;
+    int32_t sum;
+    int err = 0;
+
+    if (argc > 1)
+        n = strtol(argv[1], NULL, 10);
+    n = (n + HSTAGE_CHUNK - 1) / HSTAGE_CHUNK * HSTAGE_CHUNK;
+
+    a  = malloc(n * sizeof(int32_t));
+    b  = malloc(n * sizeof(int32_t));
+    c  = malloc(n * sizeof(int32_t));
+    c0 = malloc(n * sizeof(int32_t));
+    if (!a || !b || !c || !c0)
+        return -1;
+    for (uint32_t j = 0; j < n; j++) {
+        a[j]  = j;
+        b[j]  = n - j;
+        c0[j] = j & 0xff;
+    }
+
+    // Init Hero OpenMP runtime
+#pragma omp target device(1)
+    asm volatile("nop");
+
+    for (int k = 0; k < HSTAGE_KERNELS; k++) {
+        for (uint32_t j = 0; j < n; j++)
+            c[j] = c0[j];
+        uint32_t cycles = host_stage(k, a, b, c, n, &sum);
+        err |= check(k, a, b, c, c0, n, sum);
+        printf("%-8s %8u elements : %10u cycles %6.2f cycles/element\n", hstage_names[k], n, cycles,
+               (float)cycles / n);
+    }
+
+    free(a);
+    free(b);
+    free(c);
+    free(c0);
+
+    return err;
+}
+#endif
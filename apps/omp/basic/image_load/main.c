@@ -0,0 +1,84 @@
+// Copyright 2024 ETH Zurich and University of Bologna.
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: Apache-2.0
+//
+// Cold start of an offloading application: the first target region
+// initializes the runtime and loads the device image, the first launch of a
+// kernel then runs with cold caches. Build with and without HERO_DEVICE_GC=1
+// to compare, `make image_load_<device>.elf.dev.size` gives the image sizes.
+//
+// Usage: image_load [launches]
+
+////// HERO_1 includes /////
+#ifdef __HERO_1
+////// HOST includes /////
+#else
+#include <omp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <libhero/hero_api.h>
+#endif
+///// ALL includes /////
+#include "hero_64.h"
+///// END includes /////
+
+#define ILOAD_ELEMS 256
+
+static uint32_t iload_sum(uint32_t *a)
+{
+    uint32_t sum = 0;
+#pragma omp target device(1) map(to : a[0 : ILOAD_ELEMS]) map(from : sum)
+    {
+        uint32_t s = 0;
+        for (int i = 0; i < ILOAD_ELEMS; i++)
+            s += a[i];
+        sum = s;
+    }
+    return sum;
+}
+
+#ifndef __HERO_DEV
+static double now_s()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char *argv[])
+{
+    uint32_t a[ILOAD_ELEMS];
+    int launches = 100, err = 0;
+    double t0, t_init, t_first, t_warm;
+
+    if (argc > 1)
+        launches = strtol(argv[1], NULL, 10);
+    for (int i = 0; i < ILOAD_ELEMS; i++)
+        a[i] = i;
+
+    // Runtime initialization and image load
+    t0 = now_s();
+#pragma omp target device(1)
+    asm volatile("nop");
+    t_init = now_s() - t0;
+
+    // First launch of a kernel
+    t0 = now_s();
+    err |= iload_sum(a) != ILOAD_ELEMS * (ILOAD_ELEMS - 1) / 2;
+    t_first = now_s() - t0;
+
+    t0 = now_s();
+    for (int l = 0; l < launches; l++)
+        err |= iload_sum(a) != ILOAD_ELEMS * (ILOAD_ELEMS - 1) / 2;
+    t_warm = (now_s() - t0) / launches;
+
+    printf("image_load : init and load %8.2f ms, first launch %8.2f us, warm launch %8.2f us\n", t_init * 1e3,
+           t_first * 1e6, t_warm * 1e6);
+    if (err)
+        printf("Error : wrong sums\n");
+
+    return err;
+}
+#endif
@@ -0,0 +1,113 @@
+// Copyright 2024 ETH Zurich and University of Bologna.
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: Apache-2.0
+//
+// L2 port bandwidth: the device streams two L2 buffers at the same time, one
+// with the DMA into L1 and one with core loads, as the weights and the
+// activations of a kernel would be. The buffers are placed on the same L2 port
+// then on different ports (see hero_dev_l2_malloc_port). Run with
+// HERO_L2_1_VIEW=contiguous to measure the contiguous view of port 1.
+//
+// Usage: l2_bandwidth [size in bytes]
+
+////// HERO_1 includes /////
+#ifdef __HERO_1
+////// HOST includes /////
+#else
+#include <omp.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <libhero/hero_api.h>
+#endif
+///// ALL includes /////
+#include "hero_64.h"
+///// END includes /////
+
+#ifdef __HERO_SPATZ_CLUSTER
+#include "omp.h"
+#include "printf.h"
+#include "snrt.h"
+#endif
+
+#define MIN(A, B) (A < B ? A : B)
+
+// L1 buffer the DMA stream is written to, wraps around
+#define L2BW_L1_CHUNK (32 * 1024)
+
+// Device cycles to stream a (DMA) and b (loads), b is skipped if b_p_ is 0
+uint32_t l2_bandwidth(uint32_t a_p_, uint32_t b_p_, uint32_t size_)
+{
+    uint32_t cycles_ = 0;
+
+#pragma omp target device(1) map(to : a_p_, b_p_, size_) map(tofrom : cycles_)
+    {
+        volatile uint32_t a_p  = a_p_;
+        volatile uint32_t b_p  = b_p_;
+        volatile uint32_t size = size_;
+
+#ifdef __HERO_DEV
+        uint32_t *l1 = (uint32_t *)snrt_l1alloc(L2BW_L1_CHUNK);
+        volatile uint32_t sum = 0;
+        uint32_t t0 = read_csr(mcycle);
+
+        // Queue the whole DMA stream first so that it runs during the loads
+        if (a_p) {
+            for (uint32_t off = 0; off < size; off += L2BW_L1_CHUNK)
+                snrt_dma_start_1d_wideptr(l1, a_p + off, MIN(L2BW_L1_CHUNK, size - off));
+        }
+        if (b_p) {
+            for (uint32_t off = 0; off < size; off += sizeof(uint32_t))
+                sum += *(volatile uint32_t *)(b_p + off);
+        }
+        snrt_dma_wait_all();
+
+        cycles_ = read_csr(mcycle) - t0;
+#endif
+    }
+    return cycles_;
+}
+
+#ifndef __HERO_DEV
+static void report(const char *name, uint32_t size, uint32_t cycles, int streams)
+{
+    printf("%-24s %8u B x %d : %8u cycles %6.2f B/cycle\n", name, size, streams, cycles,
+           cycles ? (float)size * streams / cycles : 0.0f);
+}
+
+int main(int argc, char *argv[])
+{
+    uintptr_t a0_phys, b0_phys, b1_phys;
+    uintptr_t a0, b0, b1;
+    uint32_t size = 64 * 1024;
+
+    if (argc > 1)
+        size = strtol(argv[1], NULL, 10);
+
+    // Init Hero OpenMP runtime
+#pragma omp target device(1)
+    asm volatile("nop");
+
+    a0 = hero_dev_l2_malloc_port(NULL, size, &a0_phys, HERO_L2_PORT_0);
+    b0 = hero_dev_l2_malloc_port(NULL, size, &b0_phys, HERO_L2_PORT_0);
+    b1 = hero_dev_l2_malloc_port(NULL, size, &b1_phys, HERO_L2_PORT_1);
+    if (!a0 || !b0 || !b1) {
+        printf("Error : Can't allocate %u bytes per L2 buffer\n\r", size);
+        return -1;
+    }
+
+    // Single streams give the bandwidth of each port alone
+    report("dma port 0", size, l2_bandwidth(a0_phys, 0, size), 1);
+    report("loads port 0", size, l2_bandwidth(0, b0_phys, size), 1);
+    report("loads port 1", size, l2_bandwidth(0, b1_phys, size), 1);
+    // Concurrent streams
+    report("dma+loads same port", size, l2_bandwidth(a0_phys, b0_phys, size), 2);
+    report("dma+loads split ports", size, l2_bandwidth(a0_phys, b1_phys, size), 2);
+
+    hero_dev_l2_free_port(NULL, a0, a0_phys);
+    hero_dev_l2_free_port(NULL, b0, b0_phys);
+    hero_dev_l2_free_port(NULL, b1, b1_phys);
+
+    return 0;
+}
+#endif
@@ -38,17 +38,16 @@ void kernel_1()
     asm volatile("nop");
 }
 
-#define DTYPE float
-
 #ifndef __HERO_DEV
 int main(int argc, char *argv[])
 {
     // Physical addresses
     uintptr_t C_phys, D_phys, E_phys;
     // Virtual addresses
-    DTYPE *C = NULL, *D = NULL, *E;
-    // Verification matrices
-    DTYPE *C_test = NULL, *D_test = NULL, *E_test;
+    DTYPE *C = NULL, *D = NULL;
+    OTYPE *E;
+    // Verification matrices (always fp32)
+    float *C_test = NULL, *D_test = NULL, *E_test;
     // Return
     int ret;
 
@@ -66,28 +65,37 @@ int main(int argc, char *argv[])
     // Device matrices
     C = hero_dev_l3_malloc(NULL, width * height * sizeof(DTYPE), &C_phys);
     D = hero_dev_l3_malloc(NULL, width * sizeof(DTYPE), &D_phys);
-    E = hero_dev_l3_malloc(NULL, height * sizeof(DTYPE), &E_phys);
+    E = hero_dev_l3_malloc(NULL, height * sizeof(OTYPE), &E_phys);
     // Verification matrices
-    C_test = malloc(width * height * sizeof(DTYPE));
-    D_test = malloc(width * sizeof(DTYPE));
-    E_test = malloc(height * sizeof(DTYPE));
+    C_test = malloc(width * height * sizeof(float));
+    D_test = malloc(width * sizeof(float));
+    E_test = malloc(height * sizeof(float));
 
-    // Prepare data
+    // Prepare data, the reduced precisions use small values to stay in range
     for (int i = 0; i < height; i++)
         for (int j = 0; j < width; j++)
-            C[i * width + j] = (DTYPE)((i * width + j));
+            C_test[i * width + j] = (sizeof(DTYPE) == sizeof(float)) ? (float)((i * width + j))
+                                                                      : (float)((i * width + j) % 17 - 8) / 8.0f;
     for (int j = 0; j < width; j++)
-        D[j] = (j == 0) ? (DTYPE)(1) : (DTYPE)(0);
+        D_test[j] = (sizeof(DTYPE) == sizeof(float)) ? ((j == 0) ? 1.0f : 0.0f) : (float)(j % 5 - 2) / 4.0f;
 
+    // Convert at the map boundary
     for (int i = 0; i < height * width; i++)
-        C_test[i] = C[i];
+        C[i] = dtype_from_float(C_test[i]);
     for (int i = 0; i < width; i++)
-        D_test[i] = D[i];
+        D[i] = dtype_from_float(D_test[i]);
 
-    asm volatile("fence");
+    // Hand the buffers over to the device, needed with HERO_MAP_CACHED=1
+    DataDesc descs[3] = {
+        {.ptr_l3_p = (void *)C_phys, .size = width * height * sizeof(DTYPE), .type = in},
+        {.ptr_l3_p = (void *)D_phys, .size = width * sizeof(DTYPE), .type = in},
+        {.ptr_l3_p = (void *)E_phys, .size = height * sizeof(OTYPE), .type = out},
+    };
+    hero_cache_offload_enter(NULL, descs, 3);
 
     // Offload
     ret = matvec(E, E_phys, D, D_phys, C, C_phys, width, height);
+    hero_cache_offload_exit(NULL, descs, 3);
     // if(ret)
     //     ret = matvec_large(E, E_phys, D, D_phys, C, C_phys, width, height);
 
@@ -97,7 +105,7 @@ int main(int argc, char *argv[])
     hero_add_timestamp(toprint, __func__, 0);
     asm volatile("fence");
     for (int i = 0; i < height; i++) {
-        DTYPE val = 0.0f;
+        float val = 0.0f;
         for (int j = 0; j < width; j++)
             val += C_test[i * width + j] * D_test[j];
         E_test[i] = val;
@@ -106,12 +114,22 @@ int main(int argc, char *argv[])
     asm volatile("fence");
     hero_add_timestamp(toprint, __func__, 0);
 
-    // Verify result
+    // Verify result, fp32 must be exact
+    float max_abs_err = 0.0f, max_abs_ref = 0.0f;
     for (int i = 0; i < height; i++) {
-        if (E_test[i] != E[i])
+        if (sizeof(DTYPE) == sizeof(float) && E_test[i] != E[i])
             printf("nope %i\n\r", i);
+        float err = (E[i] > E_test[i]) ? E[i] - E_test[i] : E_test[i] - E[i];
+        float ref = (E_test[i] > 0) ? E_test[i] : -E_test[i];
+        max_abs_err = MAX(max_abs_err, err);
+        max_abs_ref = MAX(max_abs_ref, ref);
     }
 
+    // Accuracy and traffic report against the fp32 reference
+    printf("matvec %s %ix%i clusters %u : max_abs_err %e max_rel_err %e weight_bytes %zu\n", DTYPE_NAME, height,
+           width, matvec_clusters(), max_abs_err, max_abs_ref ? max_abs_err / max_abs_ref : 0.0f,
+           (size_t)width * height * sizeof(DTYPE));
+
     // Print all the recorded timestamps
     hero_print_timestamp();
 
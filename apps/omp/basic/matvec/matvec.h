@@ -6,8 +6,36 @@
 
 #pragma once
 
+#include "hero_tune.h"
+#include "kernels/fpconv.h"
+
+// Input precision of the weights and the vector, select with -DMATVEC_FP16,
+// -DMATVEC_BF16 or -DMATVEC_FP8 (fp32 by default). The products are always
+// accumulated in fp32 and the result vector is fp32.
+#if defined(MATVEC_FP16)
+#define DTYPE hero_fp16_t
+#define DTYPE_NAME "fp16"
+#define dtype_from_float hero_float_to_fp16
+#define dtype_to_float hero_fp16_to_float
+#elif defined(MATVEC_BF16)
+#define DTYPE hero_bf16_t
+#define DTYPE_NAME "bf16"
+#define dtype_from_float hero_float_to_bf16
+#define dtype_to_float hero_bf16_to_float
+#elif defined(MATVEC_FP8)
+#define DTYPE hero_fp8_t
+#define DTYPE_NAME "fp8"
+#define dtype_from_float hero_float_to_fp8
+#define dtype_to_float hero_fp8_to_float
+#else
 #define DTYPE float
+#define DTYPE_NAME "fp32"
+#define dtype_from_float(x) (x)
+#define dtype_to_float(x) (x)
+#endif
+#define OTYPE float
 #define MIN(A, B) (A < B ? A : B)
+#define MAX(A, B) (A > B ? A : B)
 
 #define MAX_ELEM (128 - 32) * 1024 / (sizeof(DTYPE))
 
@@ -21,7 +49,17 @@
 #define CORES 8
 #define hero_dma_1d_async dm_memcpy_async
 #define hero_dma_wait_all dm_wait
-#define fdotp_32b fdotp_simd_32b
+#if defined(MATVEC_FP16)
+#define fdotp_dtype fdotp_simd_16b
+#elif defined(MATVEC_BF16)
+#define fdotp_dtype fdotp_simd_bf16
+#elif defined(MATVEC_FP8)
+#define fdotp_dtype fdotp_simd_8b
+#else
+#define fdotp_dtype fdotp_simd_32b
+#endif
+// The SIMD kernels load 64 bits at a time, n must fill them and keep the rows aligned
+#define MATVEC_N_MULTIPLE (8 / sizeof(DTYPE))
 #endif
 
 #ifdef __HERO_SPATZ_CLUSTER
@@ -32,75 +70,156 @@
 #define CORES 2
 #define hero_dma_1d_async snrt_dma_start_1d_wideptr
 #define hero_dma_wait_all snrt_dma_wait_all
-#define fdotp_32b fdotp_rvv_32b
+// Spatz is built with scalar zfh only (no zvfh), the reduced precision inputs
+// use the scalar kernels
+#if defined(MATVEC_FP16)
+#define fdotp_dtype fdotp_naive_16b
+#elif defined(MATVEC_BF16)
+#define fdotp_dtype fdotp_naive_bf16
+#elif defined(MATVEC_FP8)
+#define fdotp_dtype fdotp_naive_8b
+#else
+#define fdotp_dtype fdotp_rvv_32b
+#define fdotp_lmul fdotp_rvv_32b_lmul
+#endif
 #endif
 
-int matvec(DTYPE *xout_, uint32_t xout_p_, DTYPE *x_, uint32_t x_p_, DTYPE *w_, uint32_t w_p_, int n_, int d_)
+#ifndef fdotp_lmul
+#define fdotp_lmul(a, b, c, n, lmul) fdotp_dtype(a, b, c, n)
+#endif
+
+#ifndef MATVEC_N_MULTIPLE
+#define MATVEC_N_MULTIPLE 1
+#endif
+
+// Shape errors found by the device, which knows its cores and kernels
+#define MATVEC_ERR_SIZE 1
+#define MATVEC_ERR_N 2
+
+// Launch parameters of matvec, looked up in the tuning table (hero_tune.h)
+// under "matvec_<dtype>"
+struct matvec_cfg {
+    // Number of cores computing the dot-products, 0 for all the cores of a cluster
+    uint32_t cores;
+    // Weight rows per DMA tile, a multiple of cores, 0 for one per core
+    uint32_t rows;
+    // Weight tile buffers in L1: 1 (serial) or 2 (double buffered)
+    uint32_t bufs;
+    // LMUL of the vector kernels (Spatz fp32 only)
+    uint32_t lmul;
+    // Clusters sharing the rows (Occamy only), 0 for all of them. Not tuned,
+    // it must match the clusters woken up by libhero (HERO_OCCAMY_CLUSTERS).
+    uint32_t clusters;
+};
+
+#define MATVEC_TUNE_NAME "matvec_" DTYPE_NAME
+#define MATVEC_DEFAULT_BUFS 2
+#define MATVEC_DEFAULT_LMUL 8
+
+int matvec_with_cfg(OTYPE *xout_, uint32_t xout_p_, DTYPE *x_, uint32_t x_p_, DTYPE *w_, uint32_t w_p_, int n_, int d_,
+                    const struct matvec_cfg *cfg)
 {
+    uint32_t cores_ = cfg->cores, rows_ = cfg->rows, bufs_ = cfg->bufs, lmul_ = cfg->lmul;
+    uint32_t clusters_ = cfg->clusters;
+    // Set by the device, MATVEC_ERR_*
+    uint32_t shape_err_ = 0;
 
-    if (n_ * 9 > MAX_ELEM) {
+    if (n_ * (bufs_ * rows_ + 1) > MAX_ELEM) {
         printf("Error : Size too large\n\r");
         return -1;
     }
 
     char toprint[128];
-    snprintf(toprint, 128, "enter_omp_matvec-%u", n_);
+    snprintf(toprint, 128, "enter_omp_matvec_" DTYPE_NAME "-%u", n_);
     hero_add_timestamp(toprint, __func__, 0);
 
-#pragma omp target device(1) map(to : n_, d_, xout_p_, x_p_, w_p_)
+#pragma omp target device(1) map(to : n_, d_, xout_p_, x_p_, w_p_, cores_, rows_, bufs_, lmul_, clusters_) \
+    map(tofrom : shape_err_)
     {
-        volatile uint32_t n      = n_;
-        volatile uint32_t d      = d_;
+        // Not volatile, so that the kernel variants of HOP_SPECIALIZE fold
+        // the shape into the loops
+        uint32_t n               = n_;
+        uint32_t d               = d_;
         volatile uint32_t xout_p = xout_p_;
         volatile uint32_t x_p    = x_p_;
         volatile uint32_t w_p    = w_p_;
+        uint32_t cores           = cores_;
+        uint32_t rows            = rows_;
+        uint32_t bufs            = bufs_;
+        uint32_t lmul            = lmul_;
+        uint32_t clusters        = clusters_;
 
 #ifdef __HERO_DEV
 
         if (!n || !d || !xout_p || !x_p || !w_p) {
             goto omp_exit;
         }
+        if (n % MATVEC_N_MULTIPLE) {
+            shape_err_ = MATVEC_ERR_N;
+            goto omp_exit;
+        }
 
-        // printf("%x - %x %x %x %x %x\n\r", (uint32_t)n, (uint32_t)d, (uint32_t)xout_p, (uint32_t)x_p,
-        // (uint32_t)w_p);
-
-        DTYPE *x_l1[2];
-        x_l1[0] = (DTYPE *)snrt_l1alloc(n * sizeof(DTYPE));
-        DTYPE *w_row_l1[2];
-        w_row_l1[0] = (DTYPE *)snrt_l1alloc(2 * n * sizeof(DTYPE));
-        w_row_l1[1] = (DTYPE *)snrt_l1alloc(2 * n * sizeof(DTYPE));
+#ifdef __HERO_OCCAMY
+        // Every cluster enters the target region, give each one a contiguous
+        // block of rows
+        uint32_t cluster = snrt_cluster_idx();
+        if (!clusters || clusters > snrt_cluster_num())
+            clusters = snrt_cluster_num();
+        if (cluster >= clusters)
+            goto omp_exit;
+        uint32_t first_row = d * cluster / clusters;
+        w_p += first_row * n * sizeof(DTYPE);
+        xout_p += first_row * sizeof(OTYPE);
+        d = d * (cluster + 1) / clusters - first_row;
+        if (!d)
+            goto omp_exit;
+#endif
 
-        for (int i = 0; i < n; i++) {
-            w_row_l1[1][i] = i;
-            w_row_l1[0][i] = (float)(i % 2);
+        if (!cores || cores > CORES)
+            cores = CORES;
+        if (rows < cores)
+            rows = cores;
+        if (bufs != 1)
+            bufs = 2;
+        // The x vector and the weight tiles have to fit in L1
+        if (n * (bufs * rows + 1) > MAX_ELEM) {
+            shape_err_ = MATVEC_ERR_SIZE;
+            goto omp_exit;
         }
 
-        hero_dma_1d_async((void *)x_l1[0], (const void *)x_p, n * sizeof(DTYPE));
-        hero_dma_1d_async((void *)w_row_l1[0], (const void *)w_p, n * 2 * sizeof(DTYPE));
+        DTYPE *x_l1;
+        x_l1 = (DTYPE *)snrt_l1alloc(n * sizeof(DTYPE));
+        DTYPE *w_row_l1[2];
+        w_row_l1[0] = (DTYPE *)snrt_l1alloc(rows * n * sizeof(DTYPE));
+        w_row_l1[1] = (bufs == 2) ? (DTYPE *)snrt_l1alloc(rows * n * sizeof(DTYPE)) : w_row_l1[0];
+
+        hero_dma_1d_async((void *)x_l1, (const void *)x_p, n * sizeof(DTYPE));
+        hero_dma_1d_async((void *)w_row_l1[0], (const void *)w_p, n * MIN(rows, d) * sizeof(DTYPE));
 
         int it      = 0;
         uint32_t t0 = 0, tot_dma = 0, tot_dotp = 0;
 
-        for (int I = 0; I < d; I += CORES) {
-            int rows_left = d - I;
+        for (int I = 0; I < d; I += rows) {
+            int tile_rows = MIN(rows, d - I);
+            int next_rows = MIN(rows, d - I - tile_rows);
+            DTYPE *w_tile = w_row_l1[it % 2];
             t0            = read_csr(mcycle);
             hero_dma_wait_all();
             tot_dma += read_csr(mcycle) - t0;
-            if (rows_left > 2)
-                hero_dma_1d_async(w_row_l1[(it + 1) % 2], w_p + n * sizeof(DTYPE) * (I + CORES),
-                                  n * MIN(rows_left - CORES, CORES) * sizeof(DTYPE));
+            // Prefetch the next tile while computing this one
+            if (bufs == 2 && next_rows > 0)
+                hero_dma_1d_async(w_row_l1[(it + 1) % 2], w_p + n * sizeof(DTYPE) * (I + rows),
+                                  n * next_rows * sizeof(DTYPE));
 
             t0 = read_csr(mcycle);
-#pragma omp parallel for
-            for (int i = 0; i < CORES; i++) {
-                DTYPE val = 0.0f;
-                if (I + i >= d)
-                    goto end;
-                fdotp_32b(x_l1[0], &(w_row_l1[it % 2][snrt_cluster_core_idx() * n]), &((DTYPE *)xout_p)[i + I], n);
-
-            end:;
-            }
+#pragma omp parallel for num_threads(cores)
+            for (int i = 0; i < tile_rows; i++)
+                fdotp_lmul(x_l1, &w_tile[i * n], &((OTYPE *)xout_p)[i + I], n, lmul);
             tot_dotp += read_csr(mcycle) - t0;
+
+            // Single buffer, the next tile can only be loaded now
+            if (bufs == 1 && next_rows > 0)
+                hero_dma_1d_async(w_row_l1[0], w_p + n * sizeof(DTYPE) * (I + rows), n * next_rows * sizeof(DTYPE));
             it++;
         }
         // printf("%i %i %i\n\r", tot_dma, tot_dotp);
@@ -110,9 +229,44 @@ int matvec(DTYPE *xout_, uint32_t xout_p_, DTYPE *x_, uint32_t x_p_, DTYPE *w_,
     omp_exit:;
     }
     hero_add_timestamp("enter_omp_end", __func__, 1);
+    if (shape_err_ == MATVEC_ERR_SIZE) {
+        printf("Error : Size too large\n\r");
+        return -1;
+    }
+    if (shape_err_ == MATVEC_ERR_N) {
+        printf("Error : n is not a multiple of the SIMD width of the device\n\r");
+        return -1;
+    }
+    return 0;
+}
+
+// Clusters woken up by libhero for the offloads, 0 if all of them
+static inline uint32_t matvec_clusters()
+{
+#ifndef __HERO_DEV
+    char *env = getenv("HERO_OCCAMY_CLUSTERS");
+    if (env)
+        return strtol(env, NULL, 10);
+#endif
     return 0;
 }
 
+int matvec(OTYPE *xout_, uint32_t xout_p_, DTYPE *x_, uint32_t x_p_, DTYPE *w_, uint32_t w_p_, int n_, int d_)
+{
+    uint32_t params[HERO_TUNE_MAX_PARAMS];
+    // Without tuning, a double buffered tile of one row per core of the device
+    struct matvec_cfg cfg = {0, 0, MATVEC_DEFAULT_BUFS, MATVEC_DEFAULT_LMUL, matvec_clusters()};
+
+    // Use the tuned parameters for this shape if any
+    if (!hero_tune_lookup(MATVEC_TUNE_NAME, n_, d_, params)) {
+        cfg.cores = params[0];
+        cfg.rows  = params[1];
+        cfg.bufs  = params[2];
+        cfg.lmul  = params[3];
+    }
+    return matvec_with_cfg(xout_, xout_p_, x_, x_p_, w_, w_p_, n_, d_, &cfg);
+}
+
 #if 0
 int matvec_large(DTYPE *xout_, uint32_t xout_p_, DTYPE *x_, uint32_t x_p_, DTYPE *w_, uint32_t w_p_, int n_, int d_) {
 
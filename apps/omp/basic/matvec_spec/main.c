@@ -0,0 +1,113 @@
+// Copyright 2024 ETH Zurich and University of Bologna.
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: Apache-2.0
+//
+// Speedup of the matvec kernel variants specialized on the vector length
+// (HOP_SPECIALIZE in the Makefile) over the generic kernel. The sizes without
+// variant show the cost of the dispatch.
+//
+// Usage: matvec_spec [size...]
+
+////// HERO_1 includes /////
+#ifdef __HERO_1
+////// HOST includes /////
+#else
+#include <omp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libhero/hero_api.h>
+
+#endif
+///// ALL includes /////
+#include "hero_64.h"
+#include "matvec.h"
+///// END includes /////
+
+#ifndef __HERO_DEV
+
+// Set by the specialized launches to run the generic kernels, defined here in
+// case nothing is specialized
+__attribute__((weak)) int hero_specialize_generic = 0;
+
+static const uint32_t spec_sizes[] = {64, 128, 192, 256};
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+// Runs per measurement, the minimum is kept
+#define SPEC_RUNS 5
+#define SPEC_MAX_SIZE 512
+
+static inline uint64_t read_cycles()
+{
+    uint64_t cycles;
+    asm volatile("rdcycle %0" : "=r"(cycles));
+    return cycles;
+}
+
+struct spec_data {
+    DTYPE *x, *w;
+    OTYPE *y;
+    uintptr_t x_phys, w_phys, y_phys;
+};
+
+static uint64_t measure(struct spec_data *b, uint32_t n, int generic)
+{
+    uint64_t best = UINT64_MAX, t0, t1;
+
+    hero_specialize_generic = generic;
+    for (int r = 0; r < SPEC_RUNS; r++) {
+        t0 = read_cycles();
+        if (matvec(b->y, b->y_phys, b->x, b->x_phys, b->w, b->w_phys, n, n))
+            return UINT64_MAX;
+        t1 = read_cycles();
+        best = MIN(best, t1 - t0);
+        hero_num_timestamps    = 0;
+        hero_num_device_cycles = 0;
+    }
+    return best;
+}
+
+int main(int argc, char *argv[])
+{
+    struct spec_data b;
+    uint32_t sizes[16];
+    int num_sizes = 0;
+
+    for (int i = 1; i < argc && num_sizes < ARRAY_SIZE(sizes); i++)
+        sizes[num_sizes++] = MIN(strtol(argv[i], NULL, 10), SPEC_MAX_SIZE);
+    if (!num_sizes) {
+        memcpy(sizes, spec_sizes, sizeof(spec_sizes));
+        num_sizes = ARRAY_SIZE(spec_sizes);
+    }
+
+    // Init Hero OpenMP runtime
+#pragma omp target device(1)
+    asm volatile("nop");
+
+    b.w = hero_dev_l3_malloc(NULL, SPEC_MAX_SIZE * SPEC_MAX_SIZE * sizeof(DTYPE), &b.w_phys);
+    b.x = hero_dev_l3_malloc(NULL, SPEC_MAX_SIZE * sizeof(DTYPE), &b.x_phys);
+    b.y = hero_dev_l3_malloc(NULL, SPEC_MAX_SIZE * sizeof(OTYPE), &b.y_phys);
+    if (!b.w || !b.x || !b.y) {
+        printf("Error : Can't allocate the buffers\n\r");
+        return -1;
+    }
+    for (uint32_t i = 0; i < SPEC_MAX_SIZE * SPEC_MAX_SIZE; i++)
+        b.w[i] = dtype_from_float((float)(i % 7) / 8.0f);
+    for (uint32_t i = 0; i < SPEC_MAX_SIZE; i++)
+        b.x[i] = dtype_from_float((float)(i % 3) / 4.0f);
+
+    for (int i = 0; i < num_sizes; i++) {
+        uint64_t generic = measure(&b, sizes[i], 1);
+        uint64_t spec    = measure(&b, sizes[i], 0);
+        printf("matvec_spec %s %ux%u : generic %llu cycles, dispatched %llu cycles, speedup %.3f\n", DTYPE_NAME,
+               sizes[i], sizes[i], (unsigned long long)generic, (unsigned long long)spec,
+               spec ? (double)generic / spec : 0.0);
+    }
+
+    hero_dev_l3_free(NULL, b.w, b.w_phys);
+    hero_dev_l3_free(NULL, b.x, b.x_phys);
+    hero_dev_l3_free(NULL, b.y, b.y_phys);
+
+    return 0;
+}
+#endif
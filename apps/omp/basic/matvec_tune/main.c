@@ -0,0 +1,199 @@
+// Copyright 2024 ETH Zurich and University of Bologna.
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: Apache-2.0
+//
+// Offline tuner of matvec: sweeps the launch parameters (cores, rows per
+// tile, buffers and LMUL) for a set of shapes and stores the fastest ones in
+// the tuning table read by matvec() (see hero_tune.h).
+//
+// Usage: matvec_tune [--quick] [table]
+//   --quick only re-measures the candidates already in the table, use it
+//           after a bitstream or frequency change.
+
+////// HERO_1 includes /////
+#ifdef __HERO_1
+////// HOST includes /////
+#else
+#include <omp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libhero/hero_api.h>
+
+#endif
+///// ALL includes /////
+#include "hero_64.h"
+#include "matvec.h"
+///// END includes /////
+
+// Cores per cluster of the device, matvec() runs larger counts on these.
+// Also initializes the Hero OpenMP runtime.
+uint32_t device_cores()
+{
+    uint32_t cores = 0;
+#pragma omp target device(1) map(from : cores)
+    {
+#ifdef __HERO_DEV
+        cores = CORES;
+#endif
+    }
+    return cores;
+}
+
+#ifndef __HERO_DEV
+
+static const uint32_t tune_sizes[] = {64, 128, 256, 512, 1024};
+static const uint32_t tune_cores[] = {1, 2, 4, 8};
+static const uint32_t tune_rows[]  = {1, 2, 4};
+static const uint32_t tune_bufs[]  = {1, 2};
+static const uint32_t tune_lmuls[] = {1, 2, 4, 8};
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+// Runs per candidate, the minimum is kept
+#define TUNE_RUNS 3
+
+static uint32_t dev_cores;
+
+static inline uint64_t read_cycles()
+{
+    uint64_t cycles;
+    asm volatile("rdcycle %0" : "=r"(cycles));
+    return cycles;
+}
+
+struct tune_data {
+    DTYPE *x, *w;
+    OTYPE *y;
+    uintptr_t x_phys, w_phys, y_phys;
+};
+
+static uint64_t measure(struct tune_data *b, uint32_t n, uint32_t d, const uint32_t *params)
+{
+    struct matvec_cfg cfg = {params[0], params[1], params[2], params[3], matvec_clusters()};
+    uint64_t best = UINT64_MAX, t0, t1;
+
+    for (int r = 0; r < TUNE_RUNS; r++) {
+        t0 = read_cycles();
+        if (matvec_with_cfg(b->y, b->y_phys, b->x, b->x_phys, b->w, b->w_phys, n, d, &cfg))
+            return UINT64_MAX;
+        t1 = read_cycles();
+        best = MIN(best, t1 - t0);
+        // Don't overflow the timestamp buffers over a long sweep
+        hero_num_timestamps    = 0;
+        hero_num_device_cycles = 0;
+    }
+    return best;
+}
+
+static void tune_full(struct tune_data *b, uint32_t n, uint32_t d)
+{
+    uint32_t params[HERO_TUNE_MAX_PARAMS];
+    uint64_t cycles;
+
+    for (int c = 0; c < ARRAY_SIZE(tune_cores); c++)
+        for (int r = 0; r < ARRAY_SIZE(tune_rows); r++)
+            for (int bu = 0; bu < ARRAY_SIZE(tune_bufs); bu++)
+                for (int l = 0; l < ARRAY_SIZE(tune_lmuls); l++) {
+                    params[0] = tune_cores[c];
+                    params[1] = tune_rows[r] * tune_cores[c];
+                    params[2] = tune_bufs[bu];
+                    params[3] = tune_lmuls[l];
+                    // The device would run it on fewer cores, another candidate
+                    if (params[0] > dev_cores)
+                        continue;
+                    // The LMUL only matters for the vector kernels
+                    if (strcmp(DTYPE_NAME, "fp32") && params[3] != MATVEC_DEFAULT_LMUL)
+                        continue;
+                    // Skip what doesn't fit in L1, with the rows the device uses
+                    if (n * (params[2] * MAX(params[1], params[0]) + 1) > MAX_ELEM)
+                        continue;
+                    cycles = measure(b, n, d, params);
+                    if (cycles == UINT64_MAX)
+                        continue;
+                    hero_tune_record(MATVEC_TUNE_NAME, n, d, params, cycles);
+                    printf("%s %ux%u cores %u rows %u bufs %u lmul %u : %llu cycles\n", MATVEC_TUNE_NAME, d, n,
+                           params[0], params[1], params[2], params[3], (unsigned long long)cycles);
+                }
+}
+
+static void tune_quick(struct tune_data *b, uint32_t n, uint32_t d)
+{
+    uint32_t bn = hero_tune_bucket(n), bd = hero_tune_bucket(d);
+    uint32_t params[HERO_TUNE_MAX_PARAMS];
+    uint64_t cycles;
+
+    // Only the stored candidates of this bucket are re-measured
+    for (int i = 0; i < hero_tune_num_entries; i++) {
+        struct hero_tune_entry *e = &hero_tune_table[i];
+        if (e->bucket_n != bn || e->bucket_d != bd || strcmp(e->kernel, MATVEC_TUNE_NAME))
+            continue;
+        memcpy(params, e->params, sizeof(params));
+        cycles = measure(b, n, d, params);
+        if (cycles == UINT64_MAX)
+            continue;
+        hero_tune_record(MATVEC_TUNE_NAME, n, d, params, cycles);
+        printf("%s %ux%u rank %u : %llu cycles\n", MATVEC_TUNE_NAME, d, n, e->rank, (unsigned long long)cycles);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    struct tune_data b;
+    const char *table = NULL;
+    int quick         = 0;
+    uint32_t max_size = tune_sizes[ARRAY_SIZE(tune_sizes) - 1];
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--quick"))
+            quick = 1;
+        else
+            table = argv[i];
+    }
+
+    // The quick mode needs the previous table, the full mode starts from scratch
+    if (quick && hero_tune_load(table) <= 0) {
+        printf("Error : No tuning table to re-tune\n\r");
+        return -1;
+    }
+    if (!quick)
+        hero_tune_num_entries = 0;
+
+    // Init Hero OpenMP runtime
+    dev_cores = device_cores();
+    if (!dev_cores) {
+        printf("Error : Can't get the device cores\n\r");
+        return -1;
+    }
+
+    b.w = hero_dev_l3_malloc(NULL, max_size * max_size * sizeof(DTYPE), &b.w_phys);
+    b.x = hero_dev_l3_malloc(NULL, max_size * sizeof(DTYPE), &b.x_phys);
+    b.y = hero_dev_l3_malloc(NULL, max_size * sizeof(OTYPE), &b.y_phys);
+    if (!b.w || !b.x || !b.y) {
+        printf("Error : Can't allocate the tuning buffers\n\r");
+        return -1;
+    }
+    for (uint32_t i = 0; i < max_size * max_size; i++)
+        b.w[i] = dtype_from_float((float)(i % 7) / 8.0f);
+    for (uint32_t i = 0; i < max_size; i++)
+        b.x[i] = dtype_from_float((float)(i % 3) / 4.0f);
+
+    for (int i = 0; i < ARRAY_SIZE(tune_sizes); i++)
+        for (int j = 0; j < ARRAY_SIZE(tune_sizes); j++) {
+            if (quick)
+                tune_quick(&b, tune_sizes[i], tune_sizes[j]);
+            else
+                tune_full(&b, tune_sizes[i], tune_sizes[j]);
+        }
+
+    if (hero_tune_save(table)) {
+        printf("Error : Can't write the tuning table\n\r");
+        return -1;
+    }
+
+    hero_dev_l3_free(NULL, b.w, b.w_phys);
+    hero_dev_l3_free(NULL, b.x, b.x_phys);
+    hero_dev_l3_free(NULL, b.y, b.y_phys);
+
+    return 0;
+}
+#endif
@@ -0,0 +1,116 @@
+// Copyright 2024 ETH Zurich and University of Bologna.
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: Apache-2.0
+//
+// Launch latency per kernel argument. The kernels take 1, 4, 8 or 16
+// scalars, either firstprivate (passed by value in the argument block) or
+// mapped with map(to:) (one mapped allocation and copy each, read through a
+// host pointer). The device wrapper copies the argument block in one burst,
+// build with HOP_WRAPPER_ARGS=-hero-packed-args=0 to compare with one host
+// load per argument.
+//
+// Usage: offload_args [launches]
+
+////// HERO_1 includes /////
+#ifdef __HERO_1
+////// HOST includes /////
+#else
+#include <omp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <libhero/hero_api.h>
+#endif
+///// ALL includes /////
+#include "hero_64.h"
+///// END includes /////
+
+// Arguments 1 to n-1 of the kernels, argument 0 is s0
+#define OARGS_REST_1(m)
+#define OARGS_REST_4(m) m(1) m(2) m(3)
+#define OARGS_REST_8(m) OARGS_REST_4(m) m(4) m(5) m(6) m(7)
+#define OARGS_REST_16(m) OARGS_REST_8(m) m(8) m(9) m(10) m(11) m(12) m(13) m(14) m(15)
+#define OARGS_DECL(i) , s##i = s[i]
+#define OARGS_VAR(i) , s##i
+#define OARGS_SUM(i) +s##i
+#define OARGS_STR_(x) #x
+#define OARGS_STR(x) OARGS_STR_(x)
+#define OARGS_PRAGMA_firstprivate(n)                                                                                   \
+    OARGS_STR(omp target device(1) firstprivate(s0 OARGS_REST_##n(OARGS_VAR)) map(from : sum))
+#define OARGS_PRAGMA_mapped(n) OARGS_STR(omp target device(1) map(to : s0 OARGS_REST_##n(OARGS_VAR)) map(from : sum))
+
+// One kernel with n scalar arguments passed with clause, the sum is written
+// back so that all the arguments are used
+#define OARGS_KERNEL(n, clause)                                                                                        \
+    static uint32_t oargs_##n##_##clause(uint32_t *s)                                                                 \
+    {                                                                                                                  \
+        uint32_t s0 = s[0] OARGS_REST_##n(OARGS_DECL);                                                                 \
+        uint32_t sum = 0;                                                                                              \
+        _Pragma(OARGS_PRAGMA_##clause(n)) { sum = s0 OARGS_REST_##n(OARGS_SUM); }                                      \
+        return sum;                                                                                                    \
+    }
+
+OARGS_KERNEL(1, firstprivate)
+OARGS_KERNEL(4, firstprivate)
+OARGS_KERNEL(8, firstprivate)
+OARGS_KERNEL(16, firstprivate)
+OARGS_KERNEL(1, mapped)
+OARGS_KERNEL(4, mapped)
+OARGS_KERNEL(8, mapped)
+OARGS_KERNEL(16, mapped)
+
+#ifndef __HERO_DEV
+static double now_s()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static const struct {
+    const char *name;
+    unsigned n_args;
+    uint32_t (*fn)(uint32_t *);
+} oargs_kernels[] = {
+    {"firstprivate", 1, oargs_1_firstprivate}, {"firstprivate", 4, oargs_4_firstprivate},
+    {"firstprivate", 8, oargs_8_firstprivate}, {"firstprivate", 16, oargs_16_firstprivate},
+    {"map(to)", 1, oargs_1_mapped},            {"map(to)", 4, oargs_4_mapped},
+    {"map(to)", 8, oargs_8_mapped},            {"map(to)", 16, oargs_16_mapped},
+};
+
+int main(int argc, char *argv[])
+{
+    uint32_t s[16];
+    int launches = 100, err = 0;
+    double base = 0;
+
+    if (argc > 1)
+        launches = strtol(argv[1], NULL, 10);
+    for (int i = 0; i < 16; i++)
+        s[i] = i + 1;
+
+    // Init Hero OpenMP runtime
+#pragma omp target device(1)
+    asm volatile("nop");
+
+    for (unsigned k = 0; k < sizeof(oargs_kernels) / sizeof(oargs_kernels[0]); k++) {
+        unsigned n = oargs_kernels[k].n_args;
+        double t0 = now_s();
+        for (int l = 0; l < launches; l++) {
+            if (oargs_kernels[k].fn(s) != n * (n + 1) / 2)
+                err = -1;
+        }
+        double t = (now_s() - t0) / launches * 1e6;
+        // Per argument cost relative to the single argument kernel of the same kind
+        if (n == 1)
+            base = t;
+        printf("%-13s %2u args : %8.2f us/launch %6.2f us/extra arg\n", oargs_kernels[k].name, n, t,
+               n > 1 ? (t - base) / (n - 1) : 0.0);
+    }
+    if (err)
+        printf("Error : wrong sums\n");
+
+    return err;
+}
+#endif
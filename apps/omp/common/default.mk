@@ -21,9 +21,39 @@ LINK := $(HERO_INSTALL)/bin/ld.lld
 COB  := $(HERO_INSTALL)/bin/clang-offload-bundler
 DIS  := $(HERO_INSTALL)/bin/llvm-dis
 HOP  := $(HERO_INSTALL)/bin/hc-omp-pass
+# Extra options of the host pointer legalizer, e.g. -hero-l1-staging=0 to
+# keep one host access per element instead of staging the loops in L1
+HOP_LEGALIZER_ARGS ?=
+# Extra options of the kernel wrapper, e.g. -hero-packed-args=0 to load the
+# kernel arguments one by one from the host
+HOP_WRAPPER_ARGS ?=
+# Extra options of the map clause minimizer, e.g. -hero-map-minimize=0 to keep
+# the map clauses as written
+HOP_MAP_ARGS ?=
+# The minimizer reads the accesses of the device kernels, the specialized
+# variants are not in the unbundled device modules and keep their maps
+HOP_MAP_DEVICE_IR = $(foreach dev,$(HERO_DEVICES),-hero-map-device-ir=$(<:-host.ll=-$(dev).ll))
+# Target regions to specialize for argument values, space separated
+# function:arg=value[,value...] (e.g. matvec_with_cfg:0=64,128 for variants of
+# the kernels of matvec_with_cfg with 64 or 128 as first kernel argument).
+# Applied to the host and the devices alike, the host picks the variant at launch.
+HOP_SPECIALIZE ?=
+HOP_SPECIALIZE_ARGS = $(foreach spec,$(HOP_SPECIALIZE),-hero-specialize=$(spec))
+# Input of the kernel wrapper, after the specializer if any
+HOP_WRAPPER_IN = $(if $(HOP_SPECIALIZE),$(@:.OMP.ll=.TMP.0.ll),$<)
+# Set to strip the device images down to what the offload entries reach: the
+# legalizer drops the unused host accessors of hero_64.h, the device linker the
+# unused sections of the runtime
+HERO_DEVICE_GC ?=
+# Set to write the offload cost reports of the passes next to the IR
+# (%.wrapper.json, %.legalizer.json, %.maps.json). Add -pass-remarks-analysis=hero to the
+# args above to get the same as remarks, with -g for their source locations.
+HOP_REPORT ?=
 GCC  := $(HERO_INSTALL)/bin/$(TARGET_HOST)-gcc
 HOST_OBJDUMP := $(RISCV)/bin/riscv64-buildroot-linux-gnu-objdump
 DEV_OBJDUMP  := $(HERO_INSTALL)/bin/llvm-objdump
+DEV_NM       := $(HERO_INSTALL)/bin/llvm-nm
+DEV_SIZE     := $(HERO_INSTALL)/bin/llvm-size
 
 # Device flags definitions
 -include $(HERO_ROOT)/apps/omp/common/devices.mk
@@ -43,6 +73,7 @@ CFLAGS   += -fopenmp=libomp -fopenmp-targets=$(subst $(space),$(comma),$(foreach
 # Include files used by the OpenMP target RTL
 CFLAGS   += -I$(HERO_ROOT)/sw/libhero/include
 CFLAGS   += -I$(HERO_ROOT)/apps/omp/common
+CFLAGS   += -I$(HERO_ROOT)/apps/omp
 # Dependancy managements
 DEPDIR   := .deps
 CFLAGS   += -MT $@ -MMD -MP -MF $(DEPDIR)/$*.d
@@ -88,15 +119,18 @@ $(foreach host-obj, $(patsubst %.c, %-host.ll, $(CSRCS)), $(eval $(call add_host
 %-host.OMP.ll: %-host.ll
 	echo "there"
 	@echo "HOP    <= $<"
-	@LLVM_INSTALL=$(HERO_INSTALL)/ $(HOP) $(<) OmpKernelWrapper "HERCULES-omp-kernel-wrapper" $(@:.OMP.ll=.TMP.1.ll)
-	@cp $(@:.OMP.ll=.TMP.1.ll) $@
+	$(if $(HOP_SPECIALIZE),@LLVM_INSTALL=$(HERO_INSTALL)/ $(HOP) $(<) OmpKernelSpecializer "HERCULES-omp-kernel-specializer" $(@:.OMP.ll=.TMP.0.ll) "$(HOP_SPECIALIZE_ARGS)")
+	@LLVM_INSTALL=$(HERO_INSTALL)/ $(HOP) $(HOP_WRAPPER_IN) OmpKernelWrapper "HERCULES-omp-kernel-wrapper" $(@:.OMP.ll=.TMP.1.ll) "$(HOP_WRAPPER_ARGS) $(if $(HOP_REPORT),-hero-wrapper-report=$(@:.OMP.ll=.wrapper.json))"
+	@LLVM_INSTALL=$(HERO_INSTALL)/ $(HOP) $(@:.OMP.ll=.TMP.1.ll) OmpMapMinimizer "HERCULES-omp-map-minimizer" $(@:.OMP.ll=.TMP.2.ll) "$(HOP_MAP_DEVICE_IR) $(HOP_MAP_ARGS) $(if $(HOP_REPORT),-hero-map-report=$(@:.OMP.ll=.maps.json))"
+	@cp $(@:.OMP.ll=.TMP.2.ll) $@
 
 # Different custom LLVMs passes to be applied on devices regions
 %.OMP.ll: %.ll
 	echo "here"
 	@echo "HOP    <= $<"
-	@LLVM_INSTALL=$(HERO_INSTALL) $(HOP) $(<) OmpKernelWrapper "HERCULES-omp-kernel-wrapper" $(@:.OMP.ll=.TMP.1.ll)
-	@LLVM_INSTALL=$(HERO_INSTALL) $(HOP) $(@:.OMP.ll=.TMP.1.ll) OmpHostPointerLegalizer "HERCULES-omp-host-pointer-legalizer" $(@:.OMP.ll=.TMP.2.ll)
+	$(if $(HOP_SPECIALIZE),@LLVM_INSTALL=$(HERO_INSTALL) $(HOP) $(<) OmpKernelSpecializer "HERCULES-omp-kernel-specializer" $(@:.OMP.ll=.TMP.0.ll) "$(HOP_SPECIALIZE_ARGS)")
+	@LLVM_INSTALL=$(HERO_INSTALL) $(HOP) $(HOP_WRAPPER_IN) OmpKernelWrapper "HERCULES-omp-kernel-wrapper" $(@:.OMP.ll=.TMP.1.ll) "$(HOP_WRAPPER_ARGS) $(if $(HOP_REPORT),-hero-wrapper-report=$(@:.OMP.ll=.wrapper.json))"
+	@LLVM_INSTALL=$(HERO_INSTALL) $(HOP) $(@:.OMP.ll=.TMP.1.ll) OmpHostPointerLegalizer "HERCULES-omp-host-pointer-legalizer" $(@:.OMP.ll=.TMP.2.ll) "$(HOP_LEGALIZER_ARGS) $(if $(HERO_DEVICE_GC),-hero-device-gc) $(if $(HOP_REPORT),-hero-legalizer-report=$(@:.OMP.ll=.legalizer.json))"
 	@cp $(@:.OMP.ll=.TMP.2.ll) $@
 
 # Use COB to re-gather all the targets.OMP.ll into a unique output
@@ -128,6 +162,17 @@ $(EXE).dev.dis: $(EXE)
 			| bash \
 			&& $(DEV_OBJDUMP) -S $^_riscv.elf > $@
 
+# Device image size, per section and per kernel (the kernel, its wrapper and
+# its specialized variants, without the parallel regions it outlines)
+$(EXE).dev.size: $(EXE).dev.dis
+	@echo "SIZE   <= $(EXE)_riscv.elf"
+	@$(DEV_SIZE) -A $(EXE)_riscv.elf > $@
+	@$(DEV_NM) -S --radix=d $(EXE)_riscv.elf \
+			| awk '$$3 ~ /^[tTwW]$$/ && match($$4, /__omp_offloading_.*_l[0-9]+(\.spec[_a0-9]*)?/) \
+				{ k[substr($$4, RSTART, RLENGTH)] += $$2 } END { for (n in k) printf "%-64s %8d\n", n, k[n] }' \
+			| sort >> $@
+	@cat $@
+
 # Dep
 $(DEPDIR):
 	@mkdir -p $@
@@ -139,7 +184,7 @@ include $(wildcard $(DEPFILES))
 
 # Phony
 clean:
-	-rm -vf __hmpp* $(EXE) *~ *.bc *.dis *.elf *.i *.lh *.lk *.ll *.o *.s *.slm a.out* *.dump
+	-rm -vf __hmpp* $(EXE) *~ *.bc *.dis *.elf *.i *.lh *.lk *.ll *.o *.s *.slm a.out* *.dump *.wrapper.json *.legalizer.json *.maps.json *.size
 	-rm -rvf $(DEPDIR)
 	-rm -vf *-host-llvm *-host-gnu
 
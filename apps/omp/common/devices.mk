@@ -21,6 +21,12 @@ LDFLAGS  += --hero$(NUM_DEVICES)-ld-path=$(HERO_INSTALL)/bin/ld.lld
 LDFLAGS  +=  -L$(HERO_ROOT)/sw/libhero/lib
 # Common includes
 CFLAGS   += -hero$(NUM_DEVICES)-I$(HERO_ROOT)/apps/omp
+# Drop the unused sections of the image (HERO_DEVICE_GC), the host finds the
+# kernels by name so nothing references them on the device
+ifneq ($(HERO_DEVICE_GC),)
+CFLAGS   += -hero$(NUM_DEVICES)-ffunction-sections -hero$(NUM_DEVICES)-fdata-sections
+LDFLAGS  += -hero$(NUM_DEVICES)-Wl,--gc-sections '-hero$(NUM_DEVICES)-Wl,--undefined-glob=__omp_offloading_*'
+endif
 
 ifeq ($(1),occamy)
 # ABI march
@@ -47,6 +47,40 @@ inline static __attribute__((used)) void hero_store_uint8(const uint64_t addr, c
 inline static __attribute__((used)) int hero_load_uint8_noblock(const uint64_t addr, __device uint8_t *const val);
 inline static __attribute__((used)) int hero_store_uint8_noblock(const uint64_t addr, const uint8_t val);
 
+// Block accesses to host memory.  Copies of at least `HERO_64_DMA_MIN_BYTES` use the cluster DMA
+// with 64-bit addresses when one is available (see below).  The others, and `hero_memset_host`,
+// open the host window (interrupts disabled, MSEG set) once for the whole range, which is then
+// streamed with word accesses (byte accesses for the unaligned head and tail).  Use them instead of
+// loops over the functions above to move more than a few words.  The host pointer legalizer lowers
+// `memcpy`, `memmove` and `memset` on host memory to them.
+inline static __attribute__((used)) void hero_memcpy_host2dev(__device void *dst, const uint64_t src, const uint32_t size);
+inline static __attribute__((used)) void hero_memcpy_dev2host(const uint64_t dst, __device const void *src, const uint32_t size);
+inline static __attribute__((used)) void hero_memcpy_host2host(const uint64_t dst, const uint64_t src, const uint32_t size);
+inline static __attribute__((used)) void hero_memmove_host(const uint64_t dst, const uint64_t src, const uint32_t size);
+inline static __attribute__((used)) void hero_memset_host(const uint64_t dst, const uint8_t val, const uint32_t size);
+
+// Host window for a sequence of accesses.  `hero_window_open` returns the state that has to be
+// passed to `hero_window_close`; the `hero_window_*` accesses in between are plain accesses and are
+// only valid within a window.  Keep windows short, the interrupts are disabled.  The host pointer
+// legalizer brackets runs of adjacent host accesses of a basic block with them.
+inline static __attribute__((used)) uint32_t hero_window_open(void);
+inline static __attribute__((used)) void hero_window_close(const uint32_t mstatus);
+inline static __attribute__((used)) uint64_t hero_window_load_uint64(const uint64_t addr);
+inline static __attribute__((used)) void hero_window_store_uint64(const uint64_t addr, const uint64_t val);
+inline static __attribute__((used)) uint32_t hero_window_load_uint32(const uint64_t addr);
+inline static __attribute__((used)) void hero_window_store_uint32(const uint64_t addr, const uint32_t val);
+inline static __attribute__((used)) uint16_t hero_window_load_uint16(const uint64_t addr);
+inline static __attribute__((used)) void hero_window_store_uint16(const uint64_t addr, const uint16_t val);
+inline static __attribute__((used)) uint8_t hero_window_load_uint8(const uint64_t addr);
+inline static __attribute__((used)) void hero_window_store_uint8(const uint64_t addr, const uint8_t val);
+
+// Bulk copies between a host range and a device (L1) range of `size` bytes, both given as integer
+// addresses.  The host pointer legalizer calls them around the loops whose host accesses it moves
+// to L1 (see `-hero-l1-staging`), so that a loop pays for the host window once per range instead of
+// once per access.  They are the block accesses above.
+inline static __attribute__((used)) void hero_stage_host2dev(const uint32_t dst, const uint64_t src, const uint32_t size);
+inline static __attribute__((used)) void hero_stage_dev2host(const uint64_t dst, const uint32_t src, const uint32_t size);
+
 /***************************************************************************************************
  * Implementation Internals
  **************************************************************************************************/
@@ -59,6 +93,33 @@ inline static __attribute__((used)) int hero_store_uint8_noblock(const uint64_t
 
 #ifdef __HERO_DEV
 
+// Cluster DMA of the block accesses.  Applications can provide theirs by defining `hero_dma_1d_async`
+// (32-bit addresses) and `hero_dma_wait_all` before including this file, the Spatz runtime DMA takes
+// 64-bit addresses and is used by default.  Define `HERO_64_NO_DMA` to always use the cores.  Only
+// the DM core of the cluster issues transfers, the other cores (e.g. in `omp parallel`) copy through
+// the host window; define `hero_dma_core()` if the DMA of the application can be used by any core.
+#ifndef HERO_64_DMA_MIN_BYTES
+#define HERO_64_DMA_MIN_BYTES 256
+#endif
+
+#if defined(HERO_64_NO_DMA)
+#elif defined(hero_dma_1d_async) && defined(hero_dma_wait_all)
+#define __hero_64_dma_1d(dst, src, size)                                                                               \
+    hero_dma_1d_async((void *)__lower32(dst), (const void *)__lower32(src), size)
+#define __hero_64_dma_wait() hero_dma_wait_all()
+#elif defined(__HERO_SPATZ_CLUSTER)
+#include <stddef.h>
+uint32_t snrt_dma_start_1d_wideptr(uint64_t dst, uint64_t src, size_t size);
+void snrt_dma_wait_all();
+#define __hero_64_dma_1d(dst, src, size) snrt_dma_start_1d_wideptr(dst, src, size)
+#define __hero_64_dma_wait() snrt_dma_wait_all()
+#endif
+
+#if defined(__hero_64_dma_1d) && !defined(hero_dma_core)
+uint32_t snrt_is_dm_core();
+#define hero_dma_core() snrt_is_dm_core()
+#endif
+
 #pragma clang diagnostic push
 // NOTE: Clang currently incorrectly labels casts from integers to device pointers as being of different size
 #pragma clang diagnostic ignored "-Wint-to-pointer-cast"
@@ -155,9 +216,20 @@ inline static void __loop_forever()
         __hero_64_check_mem_access                                                                                     \
     }
 
+// The upper 32 address bits are zero as for the accesses above
+#define __hero_64_define_window(size)                                                                                  \
+    inline static uint##size##_t hero_window_load_uint##size(const uint64_t addr)                                      \
+    {                                                                                                                  \
+        return *(__device volatile uint##size##_t *)__lower32(addr);                                                   \
+    }                                                                                                                  \
+    inline static void hero_window_store_uint##size(const uint64_t addr, const uint##size##_t val)                     \
+    {                                                                                                                  \
+        *(__device volatile uint##size##_t *)__lower32(addr) = val;                                                    \
+    }
+
 #define __hero_64_define(size)                                                                                         \
     __hero_64_define_load_noblock(size) __hero_64_define_load(size) __hero_64_define_store_noblock(size)               \
-        __hero_64_define_store(size)
+        __hero_64_define_store(size) __hero_64_define_window(size)
 
 // FIXME: investigate error when this is put at start of the file
 #pragma omp declare target
@@ -197,6 +269,125 @@ int hero_store_uint64_noblock(const uint64_t addr, const uint64_t val)
     const int res_upper  = hero_store_uint32_noblock(addr + 4, upper);
     return res_lower | res_upper;
 }
+
+uint64_t hero_window_load_uint64(const uint64_t addr)
+{
+    const uint32_t lower = hero_window_load_uint32(addr);
+    const uint32_t upper = hero_window_load_uint32(addr + 4);
+    return ((uint64_t)upper << 32) | lower;
+}
+
+void hero_window_store_uint64(const uint64_t addr, const uint64_t val)
+{
+    hero_window_store_uint32(addr, (uint32_t)val);
+    hero_window_store_uint32(addr + 4, (uint32_t)(val >> 32));
+}
+
+uint32_t hero_window_open(void)
+{
+    uint32_t mstatus;
+    __asm__ volatile(__hero_64_disable_mirq_asm "\n\t"
+                                                "csrw 0xbc0, zero\n\t"
+                     : [mstatus] "=&r"(mstatus)
+                     :
+                     : "memory");
+    return mstatus;
+}
+
+void hero_window_close(const uint32_t mstatus)
+{
+    __asm__ volatile("csrw 0xbc0, zero\n\t" __hero_64_restore_mstatus_asm : : [mstatus] "r"(mstatus) : "memory");
+}
+
+// Words when both sides are equally aligned, bytes otherwise
+inline static void __hero_64_window_copy(uint32_t dst, uint32_t src, uint32_t size)
+{
+    if ((dst & 3) == (src & 3)) {
+        for (; size && (dst & 3); size--, dst++, src++)
+            *(__device volatile uint8_t *)dst = *(__device volatile uint8_t *)src;
+        for (; size >= 4; size -= 4, dst += 4, src += 4)
+            *(__device volatile uint32_t *)dst = *(__device volatile uint32_t *)src;
+    }
+    for (; size; size--, dst++, src++)
+        *(__device volatile uint8_t *)dst = *(__device volatile uint8_t *)src;
+}
+
+// Through the DMA if there is one and the copy is large enough, returns 0 if done
+inline static int __hero_64_dma_copy(const uint64_t dst, const uint64_t src, const uint32_t size)
+{
+#ifdef __hero_64_dma_1d
+    if (size >= HERO_64_DMA_MIN_BYTES && hero_dma_core()) {
+        __hero_64_dma_1d(dst, src, size);
+        __hero_64_dma_wait();
+        return 0;
+    }
+#endif
+    return -1;
+}
+
+void hero_memcpy_host2dev(__device void *dst, const uint64_t src, const uint32_t size)
+{
+    if (!__hero_64_dma_copy((uint32_t)dst, src, size))
+        return;
+    const uint32_t mstatus = hero_window_open();
+    __hero_64_window_copy((uint32_t)dst, __lower32(src), size);
+    hero_window_close(mstatus);
+}
+
+void hero_memcpy_dev2host(const uint64_t dst, __device const void *src, const uint32_t size)
+{
+    if (!__hero_64_dma_copy(dst, (uint32_t)src, size))
+        return;
+    const uint32_t mstatus = hero_window_open();
+    __hero_64_window_copy(__lower32(dst), (uint32_t)src, size);
+    hero_window_close(mstatus);
+}
+
+void hero_memcpy_host2host(const uint64_t dst, const uint64_t src, const uint32_t size)
+{
+    if (!__hero_64_dma_copy(dst, src, size))
+        return;
+    const uint32_t mstatus = hero_window_open();
+    __hero_64_window_copy(__lower32(dst), __lower32(src), size);
+    hero_window_close(mstatus);
+}
+
+void hero_memmove_host(const uint64_t dst, const uint64_t src, const uint32_t size)
+{
+    // Forward copies are fine unless the destination starts within the source
+    if (dst <= src || dst >= src + size) {
+        hero_memcpy_host2host(dst, src, size);
+        return;
+    }
+    const uint32_t mstatus = hero_window_open();
+    for (uint32_t i = size; i; i--)
+        *(__device volatile uint8_t *)(__lower32(dst) + i - 1) = *(__device volatile uint8_t *)(__lower32(src) + i - 1);
+    hero_window_close(mstatus);
+}
+
+void hero_memset_host(const uint64_t dst, const uint8_t val, const uint32_t size)
+{
+    const uint32_t mstatus = hero_window_open();
+    const uint32_t word    = val * 0x01010101u;
+    uint32_t addr = __lower32(dst), n = size;
+    for (; n && (addr & 3); n--, addr++)
+        *(__device volatile uint8_t *)addr = val;
+    for (; n >= 4; n -= 4, addr += 4)
+        *(__device volatile uint32_t *)addr = word;
+    for (; n; n--, addr++)
+        *(__device volatile uint8_t *)addr = val;
+    hero_window_close(mstatus);
+}
+
+void hero_stage_host2dev(const uint32_t dst, const uint64_t src, const uint32_t size)
+{
+    hero_memcpy_host2dev((__device void *)dst, src, size);
+}
+
+void hero_stage_dev2host(const uint64_t dst, const uint32_t src, const uint32_t size)
+{
+    hero_memcpy_dev2host(dst, (__device const void *)src, size);
+}
 #pragma omp end declare target
 
 #pragma clang diagnostic pop
@@ -0,0 +1,205 @@
+// Copyright 2024 ETH Zurich and University of Bologna.
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: Apache-2.0
+//
+// Kernel tuning table: an offline tuner (see apps/omp/basic/matvec_tune)
+// records the fastest launch parameters per kernel and shape bucket, the host
+// side of the kernels looks them up at launch.
+//
+// The table is a text file (HERO_TUNE_TABLE, default ./hero_tune.txt) with
+// one candidate per line, the best candidate of a bucket has rank 0:
+//   <kernel> <bucket_n> <bucket_d> <rank> <p0> <p1> <p2> <p3> <cycles>
+
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define HERO_TUNE_MAX_PARAMS 4
+#define HERO_TUNE_MAX_ENTRIES 512
+// Number of candidates kept per bucket, re-measured by a quick re-tune
+#define HERO_TUNE_TOP_K 3
+#define HERO_TUNE_DEFAULT_TABLE "hero_tune.txt"
+
+struct hero_tune_entry {
+    char kernel[32];
+    uint32_t bucket_n;
+    uint32_t bucket_d;
+    uint32_t rank;
+    uint32_t params[HERO_TUNE_MAX_PARAMS];
+    uint64_t cycles;
+};
+
+// Shape bucket: ceil(log2(x))
+static inline uint32_t hero_tune_bucket(uint32_t x)
+{
+    uint32_t b = 0;
+    while ((1U << b) < x && b < 31)
+        b++;
+    return b;
+}
+
+#ifndef __HERO_DEV
+
+static struct hero_tune_entry hero_tune_table[HERO_TUNE_MAX_ENTRIES];
+static int hero_tune_num_entries = -1;
+
+static inline const char *hero_tune_path(const char *path)
+{
+    if (path)
+        return path;
+    if (getenv("HERO_TUNE_TABLE"))
+        return getenv("HERO_TUNE_TABLE");
+    return HERO_TUNE_DEFAULT_TABLE;
+}
+
+/** Load a tuning table, replacing the one in memory.
+
+  \param    path table file, NULL for the default one
+
+  \return   number of entries loaded; negative value if the file can't be read.
+ */
+static inline int hero_tune_load(const char *path)
+{
+    FILE *f = fopen(hero_tune_path(path), "r");
+    char line[256];
+    hero_tune_num_entries = 0;
+    if (!f)
+        return -1;
+    while (fgets(line, sizeof(line), f) && hero_tune_num_entries < HERO_TUNE_MAX_ENTRIES) {
+        struct hero_tune_entry *e = &hero_tune_table[hero_tune_num_entries];
+        unsigned long long cycles;
+        if (line[0] == '#')
+            continue;
+        if (sscanf(line, "%31s %u %u %u %u %u %u %u %llu", e->kernel, &e->bucket_n, &e->bucket_d, &e->rank,
+                   &e->params[0], &e->params[1], &e->params[2], &e->params[3], &cycles) != 9)
+            continue;
+        e->cycles = cycles;
+        hero_tune_num_entries++;
+    }
+    fclose(f);
+    return hero_tune_num_entries;
+}
+
+/** Write the table in memory to a file.
+
+  \param    path table file, NULL for the default one
+
+  \return   0 on success; negative value if the file can't be written.
+ */
+static inline int hero_tune_save(const char *path)
+{
+    FILE *f = fopen(hero_tune_path(path), "w");
+    if (!f)
+        return -1;
+    fprintf(f, "# kernel bucket_n bucket_d rank p0 p1 p2 p3 cycles\n");
+    for (int i = 0; i < hero_tune_num_entries; i++) {
+        struct hero_tune_entry *e = &hero_tune_table[i];
+        fprintf(f, "%s %u %u %u %u %u %u %u %llu\n", e->kernel, e->bucket_n, e->bucket_d, e->rank, e->params[0],
+                e->params[1], e->params[2], e->params[3], (unsigned long long)e->cycles);
+    }
+    fclose(f);
+    return 0;
+}
+
+/** Get the best parameters for a kernel and a problem shape. The table is
+  loaded on the first call.
+
+  \param    kernel kernel name
+  \param    n, d   problem shape
+  \param    params array of HERO_TUNE_MAX_PARAMS, left untouched on a miss
+
+  \return   0 on success; -1 if the shape was never tuned.
+ */
+static inline int hero_tune_lookup(const char *kernel, uint32_t n, uint32_t d, uint32_t *params)
+{
+    uint32_t bn = hero_tune_bucket(n), bd = hero_tune_bucket(d);
+    if (hero_tune_num_entries < 0)
+        hero_tune_load(NULL);
+    for (int i = 0; i < hero_tune_num_entries; i++) {
+        struct hero_tune_entry *e = &hero_tune_table[i];
+        if (e->rank == 0 && e->bucket_n == bn && e->bucket_d == bd && !strcmp(e->kernel, kernel)) {
+            memcpy(params, e->params, sizeof(e->params));
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/** Offer a measured candidate for a bucket. Only the HERO_TUNE_TOP_K fastest
+  candidates are kept, ranked by cycles.
+
+  \return   0 if the candidate was kept; -1 otherwise.
+ */
+static inline int hero_tune_record(const char *kernel, uint32_t n, uint32_t d, const uint32_t *params,
+                                   uint64_t cycles)
+{
+    uint32_t bn = hero_tune_bucket(n), bd = hero_tune_bucket(d);
+    struct hero_tune_entry *slowest = NULL, *e;
+    int count = 0;
+
+    if (hero_tune_num_entries < 0)
+        hero_tune_num_entries = 0;
+
+    // Find the bucket candidates, updating an existing measurement in place
+    for (int i = 0; i < hero_tune_num_entries; i++) {
+        e = &hero_tune_table[i];
+        if (e->bucket_n != bn || e->bucket_d != bd || strcmp(e->kernel, kernel))
+            continue;
+        if (!memcmp(e->params, params, sizeof(e->params))) {
+            e->cycles = cycles;
+            slowest   = NULL;
+            count     = -1;
+            break;
+        }
+        if (!slowest || e->cycles > slowest->cycles)
+            slowest = e;
+        count++;
+    }
+
+    if (count >= HERO_TUNE_TOP_K) {
+        if (slowest->cycles <= cycles)
+            return -1;
+        e = slowest;
+    } else if (count >= 0) {
+        if (hero_tune_num_entries >= HERO_TUNE_MAX_ENTRIES)
+            return -1;
+        e = &hero_tune_table[hero_tune_num_entries++];
+    }
+
+    if (count >= 0) {
+        strncpy(e->kernel, kernel, sizeof(e->kernel) - 1);
+        e->kernel[sizeof(e->kernel) - 1] = '\0';
+        e->bucket_n                      = bn;
+        e->bucket_d                      = bd;
+        memcpy(e->params, params, sizeof(e->params));
+        e->cycles = cycles;
+    }
+
+    // Re-rank the bucket
+    for (int i = 0; i < hero_tune_num_entries; i++) {
+        struct hero_tune_entry *a = &hero_tune_table[i];
+        if (a->bucket_n != bn || a->bucket_d != bd || strcmp(a->kernel, kernel))
+            continue;
+        a->rank = 0;
+        for (int j = 0; j < hero_tune_num_entries; j++) {
+            struct hero_tune_entry *b = &hero_tune_table[j];
+            if (j == i || b->bucket_n != bn || b->bucket_d != bd || strcmp(b->kernel, kernel))
+                continue;
+            if (b->cycles < a->cycles || (b->cycles == a->cycles && j < i))
+                a->rank++;
+        }
+    }
+    return 0;
+}
+
+#else
+
+static inline int hero_tune_lookup(const char *kernel, uint32_t n, uint32_t d, uint32_t *params)
+{
+    return -1;
+}
+
+#endif
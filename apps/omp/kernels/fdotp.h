@@ -8,6 +8,8 @@
 
 #include <inttypes.h>
 
+#include "fpconv.h"
+
 // 32-bit dot-product: a * b
 float fdotp_simd_32b(const float *a, const float *b, float *c, unsigned int K)
 {
@@ -42,19 +44,26 @@ float fdotp_simd_32b(const float *a, const float *b, float *c, unsigned int K)
 #endif
 }
 
-// 32-bit dot-product: a * b
-float fdotp_rvv_32b(const float *a, const float *b, float *c, unsigned int avl)
+// 32-bit dot-product with a runtime LMUL (1, 2, 4 or 8): a * b
+float fdotp_rvv_32b_lmul(const float *a, const float *b, float *c, unsigned int avl, unsigned int lmul)
 {
 #ifdef __HERO_SPATZ_CLUSTER
     const unsigned int orig_avl = avl;
-    unsigned int vl;
+    unsigned int vl, first_vl, vtype;
 
     float red;
 
+    // vtype = e32, m<lmul>, tu, ma. The registers below are aligned on 8 so
+    // they are legal groups for any LMUL. Keep the tail undisturbed as the
+    // last chunk can be shorter than the first one.
+    if (lmul != 1 && lmul != 2 && lmul != 4)
+        lmul = 8;
+    vtype = (1U << 7) | (2U << 3) | __builtin_ctz(lmul);
+
     // Stripmine and accumulate a partial reduced vector
     do {
         // Set the vl
-        asm volatile("vsetvli %0, %1, e32, m8, ta, ma" : "=r"(vl) : "r"(avl));
+        asm volatile("vsetvl %0, %1, %2" : "=r"(vl) : "r"(avl), "r"(vtype));
 
         // Load chunk a and b
         asm volatile("vle32.v v8,  (%0)" ::"r"(a));
@@ -62,6 +71,7 @@ float fdotp_rvv_32b(const float *a, const float *b, float *c, unsigned int avl)
 
         // Multiply and accumulate
         if (avl == orig_avl) {
+            first_vl = vl;
             asm volatile("vfmul.vv v24, v8, v16");
         } else {
             asm volatile("vfmacc.vv v24, v8, v16");
@@ -73,7 +83,8 @@ float fdotp_rvv_32b(const float *a, const float *b, float *c, unsigned int avl)
         avl -= vl;
     } while (avl > 0);
 
-    // Reduce and return
+    // Reduce over the whole accumulator and return
+    asm volatile("vsetvl zero, %0, %1" ::"r"(first_vl), "r"(vtype));
     asm volatile("vmv.v.i v0, 0");
     asm volatile("vfredusum.vs v0, v24, v0");
     asm volatile("vfmv.f.s %0, v0" : "=f"(red));
@@ -81,6 +92,12 @@ float fdotp_rvv_32b(const float *a, const float *b, float *c, unsigned int avl)
 #endif
 }
 
+// 32-bit dot-product: a * b
+float fdotp_rvv_32b(const float *a, const float *b, float *c, unsigned int avl)
+{
+    return fdotp_rvv_32b_lmul(a, b, c, avl, 8);
+}
+
 // 32-bit dot-product: a * b
 float fdotp_naive_32b(const float *a, const float *b, float *c, unsigned int K)
 {
@@ -91,3 +108,129 @@ float fdotp_naive_32b(const float *a, const float *b, float *c, unsigned int K)
     *c = value;
     return value;
 }
+
+// Reduced precision dot-products: the inputs are fp16, bf16 or fp8 (E5M2) and
+// the products are accumulated in fp32. Like the 32-bit kernels, K must be a
+// multiple of the SIMD width (4 for 16-bit and 8 for 8-bit on Occamy), the
+// callers check it (see MATVEC_N_MULTIPLE).
+
+// 16-bit dot-product with fp32 accumulation: a * b
+float fdotp_simd_16b(const hero_fp16_t *a, const hero_fp16_t *b, float *c, unsigned int K)
+{
+#ifdef __HERO_OCCAMY
+    const register float zero = 0.0;
+
+    asm volatile("vfcpka.s.s ft3, %[zero], %[zero]\n"
+                 "vfcpka.s.s ft4, %[zero], %[zero]\n"
+                 // loop over the expanding MACs (4 halfs -> 2 singles)
+                 "li     t0, 0 \n"
+                 "3: \n"
+                 "fld ft1, 0(%[a]) \n"
+                 "fld ft2, 0(%[b]) \n"
+                 "vfdotpex.s.h ft4, ft1, ft2 \n"
+                 "add %[a], %[a], 8 \n"
+                 "add %[b], %[b], 8 \n"
+                 "addi  t0, t0, 4 \n"
+                 "blt   t0, %[K], 3b \n"
+                 // Sum reduce vector
+                 "vfsum.s ft3, ft4 \n"
+                 // Store results
+                 "fsw ft3, 0(%[c]) \n"
+                 : [a] "+r"(a), [b] "+r"(b)
+                 : [c] "r"(c), [K] "r"(K), [zero] "f"(zero)
+                 : "ft0", "ft1", "ft2", "ft3", "ft4", "t0");
+#endif
+}
+
+// bfloat16 dot-product with fp32 accumulation: a * b
+float fdotp_simd_bf16(const hero_bf16_t *a, const hero_bf16_t *b, float *c, unsigned int K)
+{
+#ifdef __HERO_OCCAMY
+    const register float zero = 0.0;
+
+    asm volatile("vfcpka.s.s ft3, %[zero], %[zero]\n"
+                 "vfcpka.s.s ft4, %[zero], %[zero]\n"
+                 // loop over the expanding MACs (4 alt halfs -> 2 singles)
+                 "li     t0, 0 \n"
+                 "3: \n"
+                 "fld ft1, 0(%[a]) \n"
+                 "fld ft2, 0(%[b]) \n"
+                 "vfdotpex.s.ah ft4, ft1, ft2 \n"
+                 "add %[a], %[a], 8 \n"
+                 "add %[b], %[b], 8 \n"
+                 "addi  t0, t0, 4 \n"
+                 "blt   t0, %[K], 3b \n"
+                 // Sum reduce vector
+                 "vfsum.s ft3, ft4 \n"
+                 // Store results
+                 "fsw ft3, 0(%[c]) \n"
+                 : [a] "+r"(a), [b] "+r"(b)
+                 : [c] "r"(c), [K] "r"(K), [zero] "f"(zero)
+                 : "ft0", "ft1", "ft2", "ft3", "ft4", "t0");
+#endif
+}
+
+// 8-bit dot-product with fp32 accumulation: a * b
+float fdotp_simd_8b(const hero_fp8_t *a, const hero_fp8_t *b, float *c, unsigned int K)
+{
+#ifdef __HERO_OCCAMY
+    const register float zero = 0.0;
+
+    asm volatile("vfcpka.s.s ft3, %[zero], %[zero]\n"
+                 "vfcpka.s.s ft4, %[zero], %[zero]\n"
+                 "vfcpka.s.s ft0, %[zero], %[zero]\n"
+                 // loop over the expanding MACs (8 quarters -> 4 halfs -> 2 singles)
+                 // the fp16 partial sums never hold more than two products
+                 "li     t0, 0 \n"
+                 "3: \n"
+                 "fld ft1, 0(%[a]) \n"
+                 "fld ft2, 0(%[b]) \n"
+                 "fmv.d ft5, ft0 \n"
+                 "vfdotpex.h.b ft5, ft1, ft2 \n"
+                 "vfsumex.s.h ft4, ft5 \n"
+                 "add %[a], %[a], 8 \n"
+                 "add %[b], %[b], 8 \n"
+                 "addi  t0, t0, 8 \n"
+                 "blt   t0, %[K], 3b \n"
+                 // Sum reduce vector
+                 "vfsum.s ft3, ft4 \n"
+                 // Store results
+                 "fsw ft3, 0(%[c]) \n"
+                 : [a] "+r"(a), [b] "+r"(b)
+                 : [c] "r"(c), [K] "r"(K), [zero] "f"(zero)
+                 : "ft0", "ft1", "ft2", "ft3", "ft4", "ft5", "t0");
+#endif
+}
+
+// 16-bit dot-product with fp32 accumulation: a * b
+float fdotp_naive_16b(const hero_fp16_t *a, const hero_fp16_t *b, float *c, unsigned int K)
+{
+    float value = 0;
+    for (int i = 0; i < K; i++) {
+        value += hero_fp16_to_float(a[i]) * hero_fp16_to_float(b[i]);
+    }
+    *c = value;
+    return value;
+}
+
+// bfloat16 dot-product with fp32 accumulation: a * b
+float fdotp_naive_bf16(const hero_bf16_t *a, const hero_bf16_t *b, float *c, unsigned int K)
+{
+    float value = 0;
+    for (int i = 0; i < K; i++) {
+        value += hero_bf16_to_float(a[i]) * hero_bf16_to_float(b[i]);
+    }
+    *c = value;
+    return value;
+}
+
+// 8-bit dot-product with fp32 accumulation: a * b
+float fdotp_naive_8b(const hero_fp8_t *a, const hero_fp8_t *b, float *c, unsigned int K)
+{
+    float value = 0;
+    for (int i = 0; i < K; i++) {
+        value += hero_fp8_to_float(a[i]) * hero_fp8_to_float(b[i]);
+    }
+    *c = value;
+    return value;
+}
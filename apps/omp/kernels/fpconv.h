@@ -0,0 +1,143 @@
+// Copyright 2024 ETH Zurich and University of Bologna.
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: Apache-2.0
+//
+// Software conversions between fp32 and the reduced precision formats used by
+// the devices (fp16, bf16 and fp8 E5M2). They are used by the host to pack
+// buffers before a `map` and by the naive device kernels.
+
+#pragma once
+
+#include <inttypes.h>
+#include <string.h>
+
+typedef uint16_t hero_fp16_t;
+typedef uint16_t hero_bf16_t;
+typedef uint8_t hero_fp8_t;
+
+static inline uint32_t __hero_f32_bits(float f)
+{
+    uint32_t x;
+    memcpy(&x, &f, sizeof(x));
+    return x;
+}
+
+static inline float __hero_bits_f32(uint32_t x)
+{
+    float f;
+    memcpy(&f, &x, sizeof(f));
+    return f;
+}
+
+// fp32 to a 5-bit exponent format (fp16 or fp8 E5M2) with `mbits` mantissa
+// bits, rounding to nearest even
+static inline uint32_t __hero_f32_to_e5(float f, unsigned int mbits)
+{
+    uint32_t x     = __hero_f32_bits(f);
+    uint32_t sign  = (x >> 31) << (5 + mbits);
+    uint32_t inf   = 0x1fU << mbits;
+    int32_t exp    = (int32_t)((x >> 23) & 0xff) - 127 + 15;
+    uint32_t mant  = x & 0x7fffff;
+    uint32_t shift = 23 - mbits;
+    uint32_t res, rem, mid;
+
+    // NaN and infinities
+    if (((x >> 23) & 0xff) == 0xff)
+        return sign | inf | (mant ? 1U << (mbits - 1) : 0);
+    // Overflow
+    if (exp >= 0x1f)
+        return sign | inf;
+    // Subnormals
+    if (exp <= 0) {
+        if (exp < -(int32_t)mbits)
+            return sign;
+        mant |= 0x800000;
+        shift += 1 - exp;
+    }
+
+    res = (exp > 0 ? (uint32_t)exp << mbits : 0) | (mant >> shift);
+    rem = mant & ((1U << shift) - 1);
+    mid = 1U << (shift - 1);
+    if (rem > mid || (rem == mid && (res & 1)))
+        res++;
+    return sign | res;
+}
+
+static inline float __hero_e5_to_f32(uint32_t h, unsigned int mbits)
+{
+    uint32_t sign = ((h >> (5 + mbits)) & 1) << 31;
+    int32_t exp   = (h >> mbits) & 0x1f;
+    uint32_t mant = h & ((1U << mbits) - 1);
+
+    if (exp == 0x1f)
+        return __hero_bits_f32(sign | 0x7f800000 | (mant << (23 - mbits)));
+    if (exp == 0) {
+        if (!mant)
+            return __hero_bits_f32(sign);
+        // Normalize the subnormal
+        exp = 1;
+        while (!(mant & (1U << mbits))) {
+            mant <<= 1;
+            exp--;
+        }
+        mant &= (1U << mbits) - 1;
+    }
+    return __hero_bits_f32(sign | ((uint32_t)(exp + 112) << 23) | (mant << (23 - mbits)));
+}
+
+////////////////////
+///// SCALARS  /////
+////////////////////
+
+static inline hero_fp16_t hero_float_to_fp16(float f)
+{
+    return (hero_fp16_t)__hero_f32_to_e5(f, 10);
+}
+
+static inline float hero_fp16_to_float(hero_fp16_t h)
+{
+    return __hero_e5_to_f32(h, 10);
+}
+
+static inline hero_fp8_t hero_float_to_fp8(float f)
+{
+    return (hero_fp8_t)__hero_f32_to_e5(f, 2);
+}
+
+static inline float hero_fp8_to_float(hero_fp8_t q)
+{
+    return __hero_e5_to_f32(q, 2);
+}
+
+static inline hero_bf16_t hero_float_to_bf16(float f)
+{
+    uint32_t x = __hero_f32_bits(f);
+    // Keep NaNs quiet instead of rounding them to infinities
+    if ((x & 0x7fffffff) > 0x7f800000)
+        return (hero_bf16_t)((x >> 16) | 0x40);
+    x += 0x7fff + ((x >> 16) & 1);
+    return (hero_bf16_t)(x >> 16);
+}
+
+static inline float hero_bf16_to_float(hero_bf16_t b)
+{
+    return __hero_bits_f32((uint32_t)b << 16);
+}
+
+////////////////////
+///// ARRAYS   /////
+////////////////////
+
+#define __HERO_FPCONV_ARRAY(name, dst_t, src_t, conv)                                                                 \
+    static inline void name(dst_t *dst, const src_t *src, unsigned int n)                                             \
+    {                                                                                                                  \
+        for (unsigned int i = 0; i < n; i++)                                                                           \
+            dst[i] = conv(src[i]);                                                                                     \
+    }
+
+__HERO_FPCONV_ARRAY(hero_convert_f32_to_f16, hero_fp16_t, float, hero_float_to_fp16)
+__HERO_FPCONV_ARRAY(hero_convert_f16_to_f32, float, hero_fp16_t, hero_fp16_to_float)
+__HERO_FPCONV_ARRAY(hero_convert_f32_to_bf16, hero_bf16_t, float, hero_float_to_bf16)
+__HERO_FPCONV_ARRAY(hero_convert_bf16_to_f32, float, hero_bf16_t, hero_bf16_to_float)
+__HERO_FPCONV_ARRAY(hero_convert_f32_to_f8, hero_fp8_t, float, hero_float_to_fp8)
+__HERO_FPCONV_ARRAY(hero_convert_f8_to_f32, float, hero_fp8_t, hero_fp8_to_float)
@@ -10,6 +10,8 @@
 
 HERO_OCCAMY_ROOT ?= $(HERO_PLATFORMS_DIR)/occamy
 HERO_OCCAMY_BIT := $(HERO_OCCAMY_ROOT)/target/fpga/occamy_vcu128/occamy_vcu128.runs/impl_1/occamy_vcu128_wrapper.bit
+# Hardware configuration (quadrants and clusters), libhero enumerates them from the driver
+HERO_OCCAMY_CFG ?= cfg/single-cluster.hjson
 
 # Clone Occamy
 $(HERO_OCCAMY_ROOT)/Bender.yml:
@@ -18,7 +20,7 @@ $(HERO_OCCAMY_ROOT)/Bender.yml:
 
 # (Re)generate RTL
 $(HERO_OCCAMY_ROOT)/target/sim/cfg/lru.hjson: $(HERO_OCCAMY_ROOT)/Bender.yml
-	make -C $(HERO_OCCAMY_ROOT)/target/sim CFG_OVERRIDE=cfg/single-cluster.hjson rtl
+	make -C $(HERO_OCCAMY_ROOT)/target/sim CFG_OVERRIDE=$(HERO_OCCAMY_CFG) rtl
 .PRECIOUS: $(HERO_OCCAMY_ROOT)/target/sim/cfg/lru.hjson
 
 # Build a bitstream
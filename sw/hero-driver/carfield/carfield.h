@@ -6,6 +6,7 @@
 
 #pragma once
 
+#include "hero_arbiter.h"
 #include "hero_iommu.h"
 
 // General description of memory region
@@ -18,6 +19,10 @@ struct shared_mem {
 struct k_list {
     struct list_head list;
     struct shared_mem *data;
+    // DMA API mapping of the buffer, for the cache maintenance
+    dma_addr_t dma;
+    // Context of the file that allocated it, NULL once the file is closed
+    struct hero_arb_ctx *ctx;
 };
 
 // Device private data structure
@@ -38,12 +43,19 @@ struct cardev_private_data {
     struct shared_mem l3_mem;
     // Not accessible from the host (> 4GB)
     struct shared_mem pcie_axi_bar_mem;
-    // DMA buffer list
+    // DMA buffer list, of all the files
     struct list_head test_head;
+    struct mutex test_lock;
     // IOMMU regions list
     struct list_head iommu_region_list;
     // IOMMU
     struct iommu_domain *iommu_domain;
+    // Device-to-host doorbell, 0 if the host has to poll
+    int mbox_irq;
+    atomic_t mbox_irq_count;
+    wait_queue_head_t mbox_wq;
+    // Contexts of the processes that opened the device
+    struct hero_arbiter arb;
     // Char device
     char *buffer;
     unsigned int buffer_size;
@@ -62,6 +74,13 @@ struct cardrv_private_data {
 // File operations (carfield_fops.c)
 extern struct file_operations card_fops;
 
+// Write-combined mappings of the memories on PCIe hosts (carfield_driver.c)
+extern bool pcie_write_combine;
+
+// Contexts and launch arbitration (carfield_driver.c)
+extern unsigned int max_contexts;
+extern bool arb_fifo;
+
 // File
 #define RDWR 0x11
 #define RDONLY 0x01
@@ -82,3 +101,5 @@ extern struct file_operations card_fops;
 #define ISOLATE_END_OFFSET 20 * 4
 #define CARFIELD_GPIO_N_IRQS 4
 #define CARFIELD_GPIO_FIRST_IRQ 19
+// MSI vector of the mailbox doorbell on PCIe hosts (see hero_pcie_dts.h)
+#define CARFIELD_MBOX_MSI_VECTOR 0
@@ -22,6 +22,7 @@
 #include <linux/of_device.h>
 #include <linux/of_irq.h>
 #include <linux/of_platform.h>
+#include <linux/pci.h>
 #include <linux/platform_device.h>
 #include <linux/slab.h>
 #include <linux/uaccess.h>
@@ -38,6 +39,21 @@ MODULE_DESCRIPTION("Carfield driver");
 
 struct cardrv_private_data cardrv_data;
 
+bool pcie_write_combine = true;
+module_param(pcie_write_combine, bool, 0444);
+MODULE_PARM_DESC(pcie_write_combine,
+                 "Map L2, L3 and the DMA buffers write-combined on PCIe hosts");
+
+unsigned int max_contexts = 1;
+module_param(max_contexts, uint, 0444);
+MODULE_PARM_DESC(max_contexts,
+                 "Processes with their own heap slice and mailboxes (1: one at a time)");
+
+bool arb_fifo = false;
+module_param(arb_fifo, bool, 0444);
+MODULE_PARM_DESC(arb_fifo,
+                 "Grant the device in request order instead of by fair share");
+
 // Handle GPIO interrupts to clear the GPIO register
 // (Note: other drivers, as ethernet, might handle the same irq)
 int already_entered[64];
@@ -63,6 +79,42 @@ static irqreturn_t carfield_handle_irq(int irq, void *_pdev) {
     return IRQ_HANDLED;
 }
 
+// Doorbell from the device, raised through a PCIe MSI vector
+static irqreturn_t carfield_handle_mbox_irq(int irq, void *_dev_data) {
+    struct cardev_private_data *dev_data = _dev_data;
+    atomic_inc(&dev_data->mbox_irq_count);
+    wake_up_interruptible(&dev_data->mbox_wq);
+    return IRQ_HANDLED;
+}
+
+// The vectors are allocated by hero_pcie_dts on the PCI device that
+// populated this platform device
+static int carfield_request_mbox_irq(struct platform_device *pdev,
+                                     struct cardev_private_data *dev_data) {
+    struct device *parent;
+    int irq, ret;
+
+    init_waitqueue_head(&dev_data->mbox_wq);
+    atomic_set(&dev_data->mbox_irq_count, 0);
+
+    for (parent = pdev->dev.parent; parent; parent = parent->parent)
+        if (dev_is_pci(parent))
+            break;
+    if (!parent)
+        return -ENODEV;
+
+    irq = pci_irq_vector(to_pci_dev(parent), CARFIELD_MBOX_MSI_VECTOR);
+    if (irq < 0)
+        return irq;
+    ret = request_irq(irq, carfield_handle_mbox_irq, 0, "carfield-mbox",
+                      dev_data);
+    if (ret)
+        return ret;
+    dev_data->mbox_irq = irq;
+    pr_info("Mailbox doorbell on MSI irq %i\n", irq);
+    return 0;
+}
+
 int probe_node(struct platform_device *pdev,
                struct cardev_private_data *dev_data, struct shared_mem *result,
                const char *name) {
@@ -214,6 +266,11 @@ int card_platform_driver_probe(struct platform_device *pdev) {
     *((uint32_t *)(dev_data->gpio_mem.vbase + 0x34)) = (uint32_t)0xffffffff;
 #endif
 
+    // Doorbell interrupt on PCIe hosts
+    if (dev_data->pcie_axi_bar_mem.pbase &&
+        carfield_request_mbox_irq(pdev, dev_data))
+        pr_warn("No mailbox doorbell, the host will poll\n");
+
     // Deisolate all islands
     for (i = ISOLATE_BEGIN_OFFSET; i < ISOLATE_END_OFFSET; i += 4)
         *((uint32_t *)(dev_data->soc_ctrl_mem.vbase + i)) = (uint32_t)0x0;
@@ -302,6 +359,9 @@ int card_platform_driver_probe(struct platform_device *pdev) {
 
     // DMA buffer list
     INIT_LIST_HEAD(&dev_data->test_head);
+    mutex_init(&dev_data->test_lock);
+
+    hero_arb_init(&dev_data->arb, max_contexts, arb_fifo);
 
     // Char device
     ret = cdev_add(&dev_data->cdev, dev_data->dev_num, 1);
@@ -362,6 +422,9 @@ int card_platform_driver_remove(struct platform_device *pdev) {
     iommu_domain_free(dev_data->iommu_domain);
 #endif
 
+    if (dev_data->mbox_irq)
+        free_irq(dev_data->mbox_irq, dev_data);
+
     // Remove a device that was created with device_create()
     device_destroy(cardrv_data.class_card, dev_data->dev_num);
 
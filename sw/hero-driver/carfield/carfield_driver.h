@@ -23,6 +23,9 @@
 #define SAFETY_ISLAND_MMAP_ID 100
 #define INTEGER_CLUSTER_MMAP_ID 200
 #define SPATZ_CLUSTER_MMAP_ID 300
+// Or'ed to L3_MMAP_ID or DMA_BUFS_MMAP_ID for a cacheable mapping, the host
+// then keeps the shared ranges coherent with IOCTL_SYNC_FOR_DEVICE/CPU
+#define MMAP_CACHED_FLAG 0x1000
 
 // For now keep all the ioctl args in the same struct
 struct card_ioctl_arg {
@@ -36,6 +39,45 @@ struct card_ioctl_arg {
 #define IOCTL_DMA_ALLOC _IOWR('C', 1, struct card_ioctl_arg *)
 #define IOCTL_MEM_INFOS _IOWR('C', 2, struct card_ioctl_arg *)
 #define IOCTL_IOMMU_MAP _IOWR('C', 3, struct card_ioctl_arg *)
+// Clean (for device) or invalidate (for cpu) the host caches on the range
+// [result_phys_addr, result_phys_addr + size) of the L3 or of a DMA buffer
+#define IOCTL_SYNC_FOR_DEVICE _IOWR('C', 4, struct card_ioctl_arg *)
+#define IOCTL_SYNC_FOR_CPU _IOWR('C', 5, struct card_ioctl_arg *)
+// Wait up to size ms for a device-to-host doorbell (PCIe MSI), returns
+// immediately if the event count differs from result_phys_addr. The event
+// count is returned in result_phys_addr.
+#define IOCTL_WAIT_EVENT _IOWR('C', 6, struct card_ioctl_arg *)
+// Copy the table of the regions (struct card_mem_entry) to the user array at
+// result_virt_addr, of size entries. The number of regions is returned in size.
+#define IOCTL_MEM_MAP_ALL _IOWR('C', 7, struct card_ioctl_arg *)
+// Wait until the device is granted to this file, a non-zero size sets the
+// weight of the file in the fair share (16 by default). result_phys_addr is
+// set if another file held the device since this one last did.
+#define IOCTL_CTX_ACQUIRE _IOWR('C', 8, struct card_ioctl_arg *)
+#define IOCTL_CTX_RELEASE _IOWR('C', 9, struct card_ioctl_arg *)
+// Heap slot of the file in size, number of slots in result_phys_addr, and the
+// statistics (struct card_ctx_stats) copied to result_virt_addr if non-zero
+#define IOCTL_CTX_INFO _IOWR('C', 10, struct card_ioctl_arg *)
+
+struct card_mem_entry {
+    int32_t mmap_id;
+    uint32_t reserved;
+    uint64_t size;
+    uint64_t phys_addr;
+};
+
+// Same layout as struct hero_arb_stats
+struct card_ctx_stats {
+    uint64_t launches;
+    uint64_t busy_ns;
+    uint64_t wait_ns;
+    uint64_t dev_busy_ns;
+    uint64_t dev_uptime_ns;
+    uint32_t slot;
+    uint32_t n_slots;
+    uint32_t n_contexts;
+    uint32_t n_waiters;
+};
 
 #define PTR_TO_DEVDATA_REGION(VAR, DEVDATA, X)                                 \
     switch (X) {                                                               \
@@ -33,8 +33,8 @@
 
 ssize_t card_read(struct file *filp, char __user *buff, size_t count,
                   loff_t *f_pos) {
-    struct cardev_private_data *cardev_data =
-        (struct cardev_private_data *)filp->private_data;
+    struct hero_arb_ctx *ctx = filp->private_data;
+    struct cardev_private_data *cardev_data = ctx->dev;
 
     int max_size = cardev_data->buffer_size;
 
@@ -73,24 +73,110 @@ int check_permission(int dev_perm, int acc_mode) {
 int card_open(struct inode *inode, struct file *filp) {
     int ret;
     struct cardev_private_data *cardev_data;
+    struct hero_arb_ctx *ctx;
     cardev_data = container_of(inode->i_cdev, struct cardev_private_data, cdev);
-    filp->private_data = cardev_data;
     ret = check_permission(PDATA_PERM, filp->f_mode);
-    return ret;
+    if (ret)
+        return ret;
+    // One context per open, it holds the heap slot and the device grant
+    ctx = hero_arb_open(&cardev_data->arb, cardev_data);
+    if (IS_ERR(ctx))
+        return PTR_ERR(ctx);
+    filp->private_data = ctx;
+    return 0;
 }
 
 int card_release(struct inode *inode, struct file *filp) {
-    // pr_info("release was successful \n");
+    struct hero_arb_ctx *ctx = filp->private_data;
+    struct cardev_private_data *cardev_data = ctx->dev;
+    struct k_list *buf;
+
+    // The buffers stay allocated, a later file may get the same context address
+    mutex_lock(&cardev_data->test_lock);
+    list_for_each_entry(buf, &cardev_data->test_head, list)
+        if (buf->ctx == ctx)
+            buf->ctx = NULL;
+    mutex_unlock(&cardev_data->test_lock);
+    // Hands the device over if the process exits while holding it
+    hero_arb_close(ctx);
     return 0;
 }
 
+// Cache maintenance on a range of a cacheable mapping
+static int card_sync_range(struct hero_arb_ctx *ctx, uint64_t pbase,
+                           size_t size, int for_device) {
+    struct cardev_private_data *cardev_data = ctx->dev;
+    struct k_list *buf;
+
+    // Empty or wrapping ranges would pass the bound checks below
+    if (!size || pbase + size < pbase)
+        return -EINVAL;
+
+    // The reserved L3 is outside of the linear map, CVA6 writes back and
+    // invalidates its data cache on a fence
+    if (pbase >= cardev_data->l3_mem.pbase &&
+        pbase + size <= cardev_data->l3_mem.pbase + cardev_data->l3_mem.size) {
+        mb();
+        return 0;
+    }
+
+    // The DMA buffers of this file are mapped by IOCTL_DMA_ALLOC, the DMA API
+    // does the CMOs, the bouncing, or nothing on a coherent host
+    mutex_lock(&cardev_data->test_lock);
+    list_for_each_entry(buf, &cardev_data->test_head, list) {
+        if (buf->ctx == ctx && pbase >= buf->data->pbase &&
+            pbase + size <= buf->data->pbase + buf->data->size) {
+            if (for_device)
+                dma_sync_single_range_for_device(&cardev_data->pdev->dev, buf->dma,
+                                                 pbase - buf->data->pbase, size,
+                                                 DMA_BIDIRECTIONAL);
+            else
+                dma_sync_single_range_for_cpu(&cardev_data->pdev->dev, buf->dma,
+                                              pbase - buf->data->pbase, size,
+                                              DMA_BIDIRECTIONAL);
+            mutex_unlock(&cardev_data->test_lock);
+            return 0;
+        }
+    }
+    mutex_unlock(&cardev_data->test_lock);
+    pr_err("Can't sync %#llx (%#zx), not in a cacheable region\n", pbase, size);
+    return -EINVAL;
+}
+
+// Across PCIe, the memories are mapped write-combined so that bulk stores
+// become bursts, the registers stay uncached
+static int card_mmap_write_combine(struct cardev_private_data *cardev_data,
+                                   unsigned long mmap_id) {
+    if (!pcie_write_combine || !cardev_data->pcie_axi_bar_mem.pbase)
+        return 0;
+    switch (mmap_id) {
+    case L2_INTL_0_MMAP_ID:
+    case L2_CONT_0_MMAP_ID:
+    case L2_INTL_1_MMAP_ID:
+    case L2_CONT_1_MMAP_ID:
+    case L3_MMAP_ID:
+    case DMA_BUFS_MMAP_ID:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
 int card_mmap(struct file *filp, struct vm_area_struct *vma) {
     struct k_list *bufs_tail = NULL;
     unsigned long mapoffset, vsize, psize;
     char type[20];
     int ret;
-    struct cardev_private_data *cardev_data =
-        (struct cardev_private_data *)filp->private_data;
+    struct hero_arb_ctx *ctx = filp->private_data;
+    struct cardev_private_data *cardev_data = ctx->dev;
+    int cached = !!(vma->vm_pgoff & MMAP_CACHED_FLAG);
+
+    vma->vm_pgoff &= ~MMAP_CACHED_FLAG;
+    if (cached && vma->vm_pgoff != L3_MMAP_ID &&
+        vma->vm_pgoff != DMA_BUFS_MMAP_ID) {
+        pr_err("Only the L3 and the DMA buffers can be mapped cached\n");
+        return -EINVAL;
+    }
 
     switch (vma->vm_pgoff) {
     case SOC_CTRL_MMAP_ID:
@@ -132,10 +218,19 @@ int card_mmap(struct file *filp, struct vm_area_struct *vma) {
     case DMA_BUFS_MMAP_ID:
         strncpy(type, "buffer", sizeof(type));
         pr_debug("Ready to map latest buffer\n");
-        bufs_tail =
-            list_last_entry(&cardev_data->test_head, struct k_list, list);
-        mapoffset = bufs_tail->data->pbase;
-        psize = bufs_tail->data->size;
+        // The latest buffer of this file, other processes may allocate too
+        mutex_lock(&cardev_data->test_lock);
+        bufs_tail = ctx->last_buf;
+        if (bufs_tail) {
+            // The list holds the device view of the buffers
+            mapoffset = virt_to_phys(bufs_tail->data->vbase);
+            psize = bufs_tail->data->size;
+        }
+        mutex_unlock(&cardev_data->test_lock);
+        if (!bufs_tail) {
+            pr_err("No buffer allocated\n");
+            return -EINVAL;
+        }
         break;
     default:
         pr_err("Unknown page offset\n");
@@ -150,13 +245,17 @@ int card_mmap(struct file *filp, struct vm_area_struct *vma) {
         // return -EINVAL;
     }
 
-    // set protection flags to avoid caching and paging
+    // set protection flags to avoid paging, and caching unless requested
+    // (write-combining for the memories behind PCIe)
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(6,5,0)
     vm_flags_set(vma, VM_IO);
 #else
     vma->vm_flags |= VM_IO | VM_DONTEXPAND | VM_DONTDUMP | VM_PFNMAP;
 #endif
-    vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
+    if (!cached && card_mmap_write_combine(cardev_data, vma->vm_pgoff))
+        vma->vm_page_prot = pgprot_writecombine(vma->vm_page_prot);
+    else if (!cached)
+        vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
 
     pr_debug("%s mmap: phys: %#lx, virt: %#lx vsize: %#lx psize: %#lx\n", type,
             mapoffset, vma->vm_start, vsize, psize);
@@ -176,8 +275,8 @@ static long card_ioctl(struct file *file, unsigned int cmd,
     int err;
     void __user *argp = (void __user *)arg_user_addr;
     // Get driver data
-    struct cardev_private_data *cardev_data =
-        (struct cardev_private_data *)file->private_data;
+    struct hero_arb_ctx *ctx = file->private_data;
+    struct cardev_private_data *cardev_data = ctx->dev;
     // Fetch user arguments
     struct card_ioctl_arg arg;
     if (copy_from_user(&arg, argp, sizeof(struct card_ioctl_arg)))
@@ -193,13 +292,21 @@ static long card_ioctl(struct file *file, unsigned int cmd,
         pr_debug("dma_alloc_coherent %p, %llx (%llx pages)\n",
                &cardev_data->pdev->dev, arg.size,
                1 << order_base_2(ALIGN(arg.size, PAGE_SIZE) / PAGE_SIZE));
-        // Alloc memory region (note PHY address = DMA address), issue with
-        // dma_alloc_coherent on milk-v
+        // Alloc memory region, issue with dma_alloc_coherent on milk-v
 
         result_virt = __get_free_pages(
             GFP_KERNEL | GFP_DMA32,
             order_base_2(ALIGN(arg.size, PAGE_SIZE) / PAGE_SIZE));
-        result_phys = virt_to_phys(result_virt);
+        if (!result_virt)
+            return -ENOMEM;
+        // The device sees the buffer at its DMA address (the PHY address
+        // without an IOMMU), the mapping serves the IOCTL_SYNC_* as well
+        result_phys = dma_map_single(&cardev_data->pdev->dev, (void *)result_virt,
+                                     ALIGN(arg.size, PAGE_SIZE), DMA_BIDIRECTIONAL);
+        if (dma_mapping_error(&cardev_data->pdev->dev, result_phys)) {
+            free_pages(result_virt, order_base_2(ALIGN(arg.size, PAGE_SIZE) / PAGE_SIZE));
+            return -ENOMEM;
+        }
 
         // err = iommu_map(cardev_data->iommu_domain, result_virt, result_phys,
         // 	ALIGN(arg.size, PAGE_SIZE), IOMMU_READ | IOMMU_WRITE,
@@ -214,8 +321,6 @@ static long card_ioctl(struct file *file, unsigned int cmd,
 
         pr_debug("dma_alloc_coherent returns %llx %llx\n", result_virt,
                result_phys);
-        if (!result_virt)
-            return -ENOMEM;
         arg.result_virt_addr = result_virt;
         arg.result_phys_addr = result_phys;
 
@@ -228,11 +333,23 @@ static long card_ioctl(struct file *file, unsigned int cmd,
 
         // Add to the buffer list
         struct k_list *new = kmalloc(sizeof(struct k_list), GFP_KERNEL);
-        new->data = kmalloc(sizeof(struct shared_mem), GFP_KERNEL);
+        if (new)
+            new->data = kmalloc(sizeof(struct shared_mem), GFP_KERNEL);
+        if (!new || !new->data) {
+            kfree(new);
+            dma_unmap_single(&cardev_data->pdev->dev, result_phys,
+                             ALIGN(arg.size, PAGE_SIZE), DMA_BIDIRECTIONAL);
+            free_pages(result_virt, order_base_2(ALIGN(arg.size, PAGE_SIZE) / PAGE_SIZE));
+            return -ENOMEM;
+        }
         new->data->pbase = arg.result_phys_addr;
         new->data->vbase = arg.result_virt_addr;
         new->data->size = arg.size;
+        new->dma = result_phys;
+        new->ctx = ctx;
+        mutex_lock(&cardev_data->test_lock);
         list_add_tail(&new->list, &cardev_data->test_head);
+        ctx->last_buf = new;
 
         // Print the buffer list for debug
         pr_debug("Reading list :\n");
@@ -243,6 +360,7 @@ static long card_ioctl(struct file *file, unsigned int cmd,
             pr_debug("pbase = %#llx, psize = %#llx\n", my->data->pbase,
                     my->data->size);
         }
+        mutex_unlock(&cardev_data->test_lock);
         break;
     }
     case IOCTL_IOMMU_MAP: {
@@ -276,6 +394,71 @@ static long card_ioctl(struct file *file, unsigned int cmd,
         arg.result_phys_addr = requested_mem->pbase;
         break;
     }
+    case IOCTL_MEM_MAP_ALL: {
+        static const int mmap_ids[] = {
+            SOC_CTRL_MMAP_ID,      MBOXES_MMAP_ID,        L3_MMAP_ID,
+            CTRL_REGS_MMAP_ID,     L2_INTL_0_MMAP_ID,     L2_CONT_0_MMAP_ID,
+            L2_INTL_1_MMAP_ID,     L2_CONT_1_MMAP_ID,     IDMA_MMAP_ID,
+            SAFETY_ISLAND_MMAP_ID, INTEGER_CLUSTER_MMAP_ID, SPATZ_CLUSTER_MMAP_ID};
+        struct card_mem_entry __user *table =
+            (struct card_mem_entry __user *)arg.result_virt_addr;
+        struct card_mem_entry entry = {0};
+        struct shared_mem *mem;
+        size_t n = 0;
+        // Only the regions found in the device tree are returned
+        for (int i = 0; i < ARRAY_SIZE(mmap_ids); i++) {
+            PTR_TO_DEVDATA_REGION(mem, cardev_data, mmap_ids[i])
+            if (!mem || !mem->size)
+                continue;
+            if (n < arg.size) {
+                entry.mmap_id = mmap_ids[i];
+                entry.size = mem->size;
+                entry.phys_addr = mem->pbase;
+                if (copy_to_user(&table[n], &entry, sizeof(entry)))
+                    return -EFAULT;
+            }
+            n++;
+        }
+        arg.size = n;
+        break;
+    }
+    case IOCTL_WAIT_EVENT: {
+        long left;
+        if (!cardev_data->mbox_irq)
+            return -ENODEV;
+        left = wait_event_interruptible_timeout(
+            cardev_data->mbox_wq,
+            (u64)atomic_read(&cardev_data->mbox_irq_count) !=
+                arg.result_phys_addr,
+            msecs_to_jiffies(arg.size));
+        if (left < 0)
+            return left;
+        arg.result_phys_addr = atomic_read(&cardev_data->mbox_irq_count);
+        break;
+    }
+    case IOCTL_SYNC_FOR_DEVICE:
+    case IOCTL_SYNC_FOR_CPU:
+        return card_sync_range(ctx, arg.result_phys_addr, arg.size,
+                               cmd == IOCTL_SYNC_FOR_DEVICE);
+    case IOCTL_CTX_ACQUIRE:
+        err = hero_arb_acquire(ctx, arg.size);
+        if (err)
+            return err;
+        arg.result_phys_addr = ctx->handed_over;
+        break;
+    case IOCTL_CTX_RELEASE:
+        return hero_arb_release(ctx);
+    case IOCTL_CTX_INFO: {
+        struct hero_arb_stats stats;
+        hero_arb_get_stats(ctx, &stats);
+        arg.size = stats.slot;
+        arg.result_phys_addr = stats.n_slots;
+        if (arg.result_virt_addr &&
+            copy_to_user((void __user *)arg.result_virt_addr, &stats,
+                         sizeof(struct card_ctx_stats)))
+            return -EFAULT;
+        break;
+    }
     default:
         return -1;
     }
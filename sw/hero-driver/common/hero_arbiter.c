@@ -0,0 +1,183 @@
+// Copyright 2024 ETH Zurich and University of Bologna.
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: GPL-2.0 OR Apache-2.0
+
+#include <linux/bitops.h>
+#include <linux/err.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include "hero_arbiter.h"
+
+void hero_arb_init(struct hero_arbiter *arb, unsigned int n_slots, bool fifo) {
+    mutex_init(&arb->lock);
+    init_waitqueue_head(&arb->wq);
+    INIT_LIST_HEAD(&arb->waiters);
+    arb->owner = NULL;
+    arb->last_owner = NULL;
+    arb->fifo = fifo;
+    arb->n_slots = clamp(n_slots, 1U, (unsigned int)HERO_ARB_MAX_SLOTS);
+    arb->used_slots = 0;
+    arb->n_contexts = 0;
+    arb->busy_ns = 0;
+    arb->created_ns = ktime_get_ns();
+    arb->min_vruntime = 0;
+}
+
+struct hero_arb_ctx *hero_arb_open(struct hero_arbiter *arb, void *dev) {
+    struct hero_arb_ctx *ctx;
+    unsigned int slot = 0;
+
+    ctx = kzalloc(sizeof(*ctx), GFP_KERNEL);
+    if (!ctx)
+        return ERR_PTR(-ENOMEM);
+
+    mutex_lock(&arb->lock);
+    // A slot is never shared, the heaps of its processes would overlap
+    slot = find_first_zero_bit(&arb->used_slots, arb->n_slots);
+    if (slot >= arb->n_slots) {
+        mutex_unlock(&arb->lock);
+        kfree(ctx);
+        return ERR_PTR(-EBUSY);
+    }
+    set_bit(slot, &arb->used_slots);
+    arb->n_contexts++;
+    // Start level with the others, a new context doesn't get a head start
+    ctx->vruntime = arb->min_vruntime;
+    mutex_unlock(&arb->lock);
+
+    ctx->arb = arb;
+    ctx->dev = dev;
+    ctx->slot = slot;
+    ctx->weight = HERO_ARB_DEFAULT_WEIGHT;
+    INIT_LIST_HEAD(&ctx->waiter);
+    return ctx;
+}
+
+// Give the device to the next waiter, arb->lock held and no owner
+static void hero_arb_grant(struct hero_arbiter *arb) {
+    struct hero_arb_ctx *ctx, *next = NULL;
+    u64 now = ktime_get_ns();
+
+    list_for_each_entry(ctx, &arb->waiters, waiter) {
+        if (!next || (!arb->fifo && ctx->vruntime < next->vruntime))
+            next = ctx;
+        if (arb->fifo)
+            break;
+    }
+    if (!next)
+        return;
+
+    list_del_init(&next->waiter);
+    next->wait_ns += now - next->wait_start_ns;
+    next->hold_start_ns = now;
+    next->launches++;
+    next->handed_over = arb->last_owner != next;
+    arb->owner = next;
+    arb->last_owner = next;
+    arb->min_vruntime = max(arb->min_vruntime, next->vruntime);
+    wake_up_all(&arb->wq);
+}
+
+static void hero_arb_do_release(struct hero_arb_ctx *ctx) {
+    struct hero_arbiter *arb = ctx->arb;
+    u64 held = ktime_get_ns() - ctx->hold_start_ns;
+
+    ctx->busy_ns += held;
+    ctx->vruntime += div_u64(held * HERO_ARB_DEFAULT_WEIGHT, ctx->weight);
+    arb->busy_ns += held;
+    arb->owner = NULL;
+    hero_arb_grant(arb);
+}
+
+int hero_arb_acquire(struct hero_arb_ctx *ctx, u32 weight) {
+    struct hero_arbiter *arb = ctx->arb;
+    int ret;
+
+    mutex_lock(&arb->lock);
+    if (weight)
+        ctx->weight = weight;
+    if (arb->owner == ctx) {
+        ctx->handed_over = false;
+        mutex_unlock(&arb->lock);
+        return 0;
+    }
+    // Another thread of the context is already waiting, the node can only be queued once
+    if (!list_empty(&ctx->waiter)) {
+        mutex_unlock(&arb->lock);
+        return -EBUSY;
+    }
+    ctx->wait_start_ns = ktime_get_ns();
+    list_add_tail(&ctx->waiter, &arb->waiters);
+    if (!arb->owner)
+        hero_arb_grant(arb);
+    mutex_unlock(&arb->lock);
+
+    ret = wait_event_interruptible(arb->wq, READ_ONCE(arb->owner) == ctx);
+
+    mutex_lock(&arb->lock);
+    // Keep the device if it was granted while being interrupted
+    if (ret && arb->owner != ctx)
+        list_del_init(&ctx->waiter);
+    else
+        ret = 0;
+    mutex_unlock(&arb->lock);
+    return ret;
+}
+
+int hero_arb_release(struct hero_arb_ctx *ctx) {
+    struct hero_arbiter *arb = ctx->arb;
+    int ret = 0;
+
+    mutex_lock(&arb->lock);
+    if (arb->owner == ctx)
+        hero_arb_do_release(ctx);
+    else
+        ret = -EPERM;
+    mutex_unlock(&arb->lock);
+    return ret;
+}
+
+void hero_arb_close(struct hero_arb_ctx *ctx) {
+    struct hero_arbiter *arb = ctx->arb;
+
+    mutex_lock(&arb->lock);
+    if (arb->owner == ctx)
+        hero_arb_do_release(ctx);
+    if (arb->last_owner == ctx)
+        arb->last_owner = NULL;
+    list_del_init(&ctx->waiter);
+    clear_bit(ctx->slot, &arb->used_slots);
+    arb->n_contexts--;
+    pr_debug("Context %u closed: %llu launches, busy %llu ns, waited %llu ns\n", ctx->slot, ctx->launches,
+             ctx->busy_ns, ctx->wait_ns);
+    mutex_unlock(&arb->lock);
+    kfree(ctx);
+}
+
+void hero_arb_get_stats(struct hero_arb_ctx *ctx, struct hero_arb_stats *stats) {
+    struct hero_arbiter *arb = ctx->arb;
+    struct hero_arb_ctx *waiter;
+    u64 now = ktime_get_ns();
+
+    mutex_lock(&arb->lock);
+    stats->launches = ctx->launches;
+    stats->busy_ns = ctx->busy_ns;
+    stats->wait_ns = ctx->wait_ns;
+    stats->dev_busy_ns = arb->busy_ns;
+    // Count the running launch
+    if (arb->owner) {
+        stats->dev_busy_ns += now - arb->owner->hold_start_ns;
+        if (arb->owner == ctx)
+            stats->busy_ns += now - ctx->hold_start_ns;
+    }
+    stats->dev_uptime_ns = now - arb->created_ns;
+    stats->slot = ctx->slot;
+    stats->n_slots = arb->n_slots;
+    stats->n_contexts = arb->n_contexts;
+    stats->n_waiters = 0;
+    list_for_each_entry(waiter, &arb->waiters, waiter)
+        stats->n_waiters++;
+    mutex_unlock(&arb->lock);
+}
@@ -0,0 +1,88 @@
+// Copyright 2024 ETH Zurich and University of Bologna.
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: GPL-2.0 OR Apache-2.0
+
+#pragma once
+
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/types.h>
+#include <linux/wait.h>
+
+// Every open() of a device gets a context. A context owns a slot, that is a
+// slice of the heaps where libhero keeps its mailboxes and buffers, and has to
+// hold the device to launch on it. When the device is released, it goes to
+// the waiting context with the least weighted device time (fair share), or to
+// the first one that asked for it (FIFO).
+
+#define HERO_ARB_MAX_SLOTS 8
+#define HERO_ARB_DEFAULT_WEIGHT 16
+
+struct hero_arbiter {
+    struct mutex lock;
+    wait_queue_head_t wq;
+    struct hero_arb_ctx *owner;
+    // Last context granted the device, NULL once it is closed
+    struct hero_arb_ctx *last_owner;
+    struct list_head waiters;
+    bool fifo;
+    // Heap slices, one per context, with a single slot one open at a time
+    unsigned int n_slots;
+    unsigned long used_slots;
+    unsigned int n_contexts;
+    // Device time of the contexts that were closed is kept in busy_ns
+    u64 busy_ns;
+    u64 created_ns;
+    u64 min_vruntime;
+};
+
+struct hero_arb_ctx {
+    struct hero_arbiter *arb;
+    // Driver data of the device
+    void *dev;
+    // Last DMA buffer allocated by the context, mapped by its next mmap
+    void *last_buf;
+    unsigned int slot;
+    u32 weight;
+    // Another context held the device since this one last did, its state on
+    // the device (mailbox pointers, TLBs) has to be restored
+    bool handed_over;
+    // Device time scaled by the weight, the lowest is served first
+    u64 vruntime;
+    u64 hold_start_ns;
+    u64 wait_start_ns;
+    struct list_head waiter;
+    // Statistics
+    u64 launches;
+    u64 busy_ns;
+    u64 wait_ns;
+};
+
+// Returned to the user by the drivers (struct card_ctx_stats)
+struct hero_arb_stats {
+    u64 launches;
+    u64 busy_ns;
+    u64 wait_ns;
+    u64 dev_busy_ns;
+    u64 dev_uptime_ns;
+    u32 slot;
+    u32 n_slots;
+    u32 n_contexts;
+    u32 n_waiters;
+};
+
+void hero_arb_init(struct hero_arbiter *arb, unsigned int n_slots, bool fifo);
+
+// Create the context of an open(), ERR_PTR(-EBUSY) if all the slots are used
+struct hero_arb_ctx *hero_arb_open(struct hero_arbiter *arb, void *dev);
+
+// Release the device if held and free the context
+void hero_arb_close(struct hero_arb_ctx *ctx);
+
+// Wait for the device, weight 0 keeps the current weight. -EBUSY if another
+// thread of the context is already waiting.
+int hero_arb_acquire(struct hero_arb_ctx *ctx, u32 weight);
+
+int hero_arb_release(struct hero_arb_ctx *ctx);
+
+void hero_arb_get_stats(struct hero_arb_ctx *ctx, struct hero_arb_stats *stats);
@@ -6,6 +6,8 @@
 
 #pragma once
 
+#include "hero_arbiter.h"
+
 // General description of memory region
 struct shared_mem {
     phys_addr_t pbase;
@@ -16,6 +18,10 @@ struct shared_mem {
 struct k_list {
     struct list_head list;
     struct shared_mem *data;
+    // DMA API mapping of the buffer, for the cache maintenance
+    dma_addr_t dma;
+    // Context of the file that allocated it, NULL once the file is closed
+    struct hero_arb_ctx *ctx;
 };
 
 // Device private data structure
@@ -23,19 +29,22 @@ struct cardev_private_data {
     struct platform_device *pdev;
     // Hw device memory regions
     struct shared_mem soc_ctrl_mem;
-    struct shared_mem quadrant_ctrl_mem;
+    struct shared_mem quadrant_ctrl_mem[OCCAMY_MAX_QUADRANTS];
     struct shared_mem clint_mem;
-    struct shared_mem snitch_cluster_mem;
+    struct shared_mem snitch_cluster_mem[OCCAMY_MAX_CLUSTERS];
     struct shared_mem spm_wide_mem;
     struct shared_mem l3_mem;
     // Not accessible from the host (> 4GB)
     struct shared_mem pcie_axi_bar_mem;
-    // Buffer allocated list
+    // Buffer allocated list, of all the files
     struct list_head test_head;
+    struct mutex test_lock;
     // Hw device infos
     u32 n_quadrants;
     u32 n_clusters;
     u32 n_cores;
+    // Contexts of the processes that opened the device
+    struct hero_arbiter arb;
     // Chardev
     dev_t dev_num;
     struct cdev cdev;
@@ -55,6 +64,10 @@ struct cardrv_private_data {
 // File operations (carfield_fops.c)
 extern struct file_operations card_fops;
 
+// Contexts and launch arbitration (occamy_driver.c)
+extern unsigned int max_contexts;
+extern bool arb_fifo;
+
 // File
 #define RDWR 0x11
 #define RDONLY 0x01
@@ -34,6 +34,16 @@ MODULE_DESCRIPTION("Occamy driver");
 
 struct cardrv_private_data cardrv_data;
 
+unsigned int max_contexts = 1;
+module_param(max_contexts, uint, 0444);
+MODULE_PARM_DESC(max_contexts,
+                 "Processes with their own heap slice and mailboxes (1: one at a time)");
+
+bool arb_fifo = false;
+module_param(arb_fifo, bool, 0444);
+MODULE_PARM_DESC(arb_fifo,
+                 "Grant the device in request order instead of by fair share");
+
 int read_snitch_cluster(struct cardev_private_data *dev_data,
                         struct device_node *np) {
     int err = 0;
@@ -41,20 +51,17 @@ int read_snitch_cluster(struct cardev_private_data *dev_data,
         return 1;
     err |= of_property_read_u32(np, "eth,compute-cores", &dev_data->n_cores);
     dev_data->n_clusters += 1;
-    dev_data->n_quadrants += 1;
     return err;
 }
 
-int probe_node(struct platform_device *pdev,
-               struct cardev_private_data *dev_data, struct shared_mem *result,
-               const char *name) {
-    int err;
-    struct device_node *tmp_np, *tmp_mem_np;
+int probe_np(struct platform_device *pdev,
+             struct cardev_private_data *dev_data, struct shared_mem *result,
+             const char *name, struct device_node *tmp_np) {
+    int err = 0;
+    struct device_node *tmp_mem_np;
     struct reserved_mem *tmp_mem;
     struct resource tmp_res, tmp_mem_res;
 
-    // Get the node in the DTS
-    tmp_np = of_get_child_by_name(pdev->dev.of_node, name);
     if (tmp_np) {
 
         // Check for reserved L3 memory
@@ -103,7 +110,7 @@ int probe_node(struct platform_device *pdev,
                 dev_data->buffer + dev_data->buffer_size, "%s: %px size = %x\n",
                 name, result->pbase, result->size);
             // Check for additional parsing
-            if (name == "snitch-cluster")
+            if (!strcmp(name, "snitch-cluster") && result->pbase)
                 err = read_snitch_cluster(dev_data, tmp_np);
         }
         return err;
@@ -115,6 +122,38 @@ probe_node_error:
     return -1;
 }
 
+int probe_node(struct platform_device *pdev,
+               struct cardev_private_data *dev_data, struct shared_mem *result,
+               const char *name) {
+    // Get the node in the DTS
+    return probe_np(pdev, dev_data, result, name,
+                    of_get_child_by_name(pdev->dev.of_node, name));
+}
+
+// Probe all the nodes called name (e.g. one per quadrant or per cluster),
+// returns the number of nodes found
+int probe_nodes(struct platform_device *pdev,
+                struct cardev_private_data *dev_data, struct shared_mem *results,
+                int max, const char *name) {
+    struct device_node *tmp_np;
+    int n = 0;
+
+    for_each_child_of_node(pdev->dev.of_node, tmp_np) {
+        if (!of_node_name_eq(tmp_np, name))
+            continue;
+        if (n == max) {
+            pr_warn("Ignoring %s beyond %i\n", name, max);
+            of_node_put(tmp_np);
+            break;
+        }
+        if (!probe_np(pdev, dev_data, &results[n], name, tmp_np) && results[n].pbase)
+            n++;
+    }
+    if (!n)
+        pr_err("No %s in device tree\n", name);
+    return n;
+}
+
 // gets called when matched platform device
 int card_platform_driver_probe(struct platform_device *pdev) {
     int ret, irq, i;
@@ -157,14 +196,16 @@ int card_platform_driver_probe(struct platform_device *pdev) {
     // Probe soc_ctrl
     probe_node(pdev, dev_data, &dev_data->soc_ctrl_mem, "soc-control");
 
-    // Probe quadrant-control
-    probe_node(pdev, dev_data, &dev_data->quadrant_ctrl_mem, "quadrant-control");
+    // Probe quadrant-control, one per quadrant
+    dev_data->n_quadrants = probe_nodes(pdev, dev_data, dev_data->quadrant_ctrl_mem,
+                                        OCCAMY_MAX_QUADRANTS, "quadrant-control");
 
     // Probe clint
     probe_node(pdev, dev_data, &dev_data->clint_mem, "clint");
 
-    // Probe snitch-cluster
-    probe_node(pdev, dev_data, &dev_data->snitch_cluster_mem, "snitch-cluster");
+    // Probe snitch-cluster, one per cluster in quadrant order
+    probe_nodes(pdev, dev_data, dev_data->snitch_cluster_mem, OCCAMY_MAX_CLUSTERS,
+                "snitch-cluster");
 
     // Probe spm-wide
     probe_node(pdev, dev_data, &dev_data->spm_wide_mem, "spm-wide");
@@ -180,6 +221,9 @@ int card_platform_driver_probe(struct platform_device *pdev) {
 
     // Buffer list
     INIT_LIST_HEAD(&dev_data->test_head);
+    mutex_init(&dev_data->test_lock);
+
+    hero_arb_init(&dev_data->arb, max_contexts, arb_fifo);
 
     // DMA mask
     ret =dma_set_mask_and_coherent(&pdev->dev, DMA_BIT_MASK(32));
@@ -15,20 +15,72 @@
 #define SNITCH_CLUSTER_MMAP_ID 100
 #define SCRATCHPAD_WIDE_MMAP_ID 10
 
+// Multi-quadrant / multi-cluster configurations: quadrant 0 and cluster 0
+// keep the IDs above, the others follow
+#define OCCAMY_MAX_QUADRANTS 8
+#define OCCAMY_MAX_CLUSTERS 32
+#define QUADRANT_CTRL_N_MMAP_ID 20
+#define QUADRANT_CTRL_X_MMAP_ID(q) ((q) ? QUADRANT_CTRL_N_MMAP_ID + (q) : QUADRANT_CTRL_MMAP_ID)
+#define SNITCH_CLUSTER_X_MMAP_ID(c) (SNITCH_CLUSTER_MMAP_ID + (c))
+// Or'ed to L3_MMAP_ID or DMA_BUFS_MMAP_ID for a cacheable mapping, the host
+// then keeps the shared ranges coherent with IOCTL_SYNC_FOR_DEVICE/CPU
+#define MMAP_CACHED_FLAG 0x1000
+
 // TODO: Define properly with the Linux API
 #define IOCTL_DMA_ALLOC 0
 #define IOCTL_MEM_INFOS 1
+// Returns size = n_clusters, result_phys_addr = n_quadrants and
+// result_virt_addr = n_cores (per cluster)
+#define IOCTL_DEV_INFOS 2
+// Clean (for device) or invalidate (for cpu) the host caches on the range
+// [result_phys_addr, result_phys_addr + size) of the L3 or of a DMA buffer
+#define IOCTL_SYNC_FOR_DEVICE 3
+#define IOCTL_SYNC_FOR_CPU 4
+// Copy the table of the regions (struct card_mem_entry) to the user array at
+// result_virt_addr, of size entries. The number of regions is returned in size.
+#define IOCTL_MEM_MAP_ALL 5
+// Wait until the device is granted to this file, a non-zero size sets the
+// weight of the file in the fair share (16 by default). result_phys_addr is
+// set if another file held the device since this one last did.
+#define IOCTL_CTX_ACQUIRE 6
+#define IOCTL_CTX_RELEASE 7
+// Heap slot of the file in size, number of slots in result_phys_addr, and the
+// statistics (struct card_ctx_stats) copied to result_virt_addr if non-zero
+#define IOCTL_CTX_INFO 8
+
+struct card_mem_entry {
+    int32_t mmap_id;
+    uint32_t reserved;
+    uint64_t size;
+    uint64_t phys_addr;
+};
+
+// Same layout as struct hero_arb_stats
+struct card_ctx_stats {
+    uint64_t launches;
+    uint64_t busy_ns;
+    uint64_t wait_ns;
+    uint64_t dev_busy_ns;
+    uint64_t dev_uptime_ns;
+    uint32_t slot;
+    uint32_t n_slots;
+    uint32_t n_contexts;
+    uint32_t n_waiters;
+};
 
 #define PTR_TO_DEVDATA_REGION(VAR,DEVDATA,X) \
     switch(X) { \
         case(SOC_CTRL_MMAP_ID         ): VAR = &DEVDATA->soc_ctrl_mem         ; break; \
-        case(QUADRANT_CTRL_MMAP_ID    ): VAR = &DEVDATA->quadrant_ctrl_mem    ; break; \
+        case(QUADRANT_CTRL_MMAP_ID    ): VAR = &DEVDATA->quadrant_ctrl_mem[0] ; break; \
         case(CLINT_MMAP_ID            ): VAR = &DEVDATA->clint_mem            ; break; \
-        case(SNITCH_CLUSTER_MMAP_ID   ): VAR = &DEVDATA->snitch_cluster_mem   ; break; \
         case(SCRATCHPAD_WIDE_MMAP_ID  ): VAR = &DEVDATA->spm_wide_mem         ; break; \
         case(L3_MMAP_ID               ): VAR = &DEVDATA->l3_mem               ; break; \
         default                      : VAR = NULL                           ; break; \
-    }
+    } \
+    if ((X) > QUADRANT_CTRL_N_MMAP_ID && (X) < QUADRANT_CTRL_N_MMAP_ID + OCCAMY_MAX_QUADRANTS) \
+        VAR = &DEVDATA->quadrant_ctrl_mem[(X) - QUADRANT_CTRL_N_MMAP_ID]; \
+    if ((X) >= SNITCH_CLUSTER_MMAP_ID && (X) < SNITCH_CLUSTER_MMAP_ID + OCCAMY_MAX_CLUSTERS) \
+        VAR = &DEVDATA->snitch_cluster_mem[(X) - SNITCH_CLUSTER_MMAP_ID];
 
 // For now keep all the ioctl args in the same struct
 struct card_ioctl_arg {
@@ -30,8 +30,8 @@
 
 ssize_t card_read(struct file *filp, char __user *buff, size_t count,
                   loff_t *f_pos) {
-    struct cardev_private_data *cardev_data =
-        (struct cardev_private_data *)filp->private_data;
+    struct hero_arb_ctx *ctx = filp->private_data;
+    struct cardev_private_data *cardev_data = ctx->dev;
 
     int max_size = cardev_data->buffer_size;
 
@@ -70,38 +70,103 @@ int check_permission(int dev_perm, int acc_mode) {
 int card_open(struct inode *inode, struct file *filp) {
     int ret;
     struct cardev_private_data *cardev_data;
+    struct hero_arb_ctx *ctx;
     cardev_data = container_of(inode->i_cdev, struct cardev_private_data, cdev);
-    filp->private_data = cardev_data;
     ret = check_permission(PDATA_PERM, filp->f_mode);
-    return ret;
+    if (ret)
+        return ret;
+    // One context per open, it holds the heap slot and the device grant
+    ctx = hero_arb_open(&cardev_data->arb, cardev_data);
+    if (IS_ERR(ctx))
+        return PTR_ERR(ctx);
+    filp->private_data = ctx;
+    return 0;
 }
 
 int card_release(struct inode *inode, struct file *filp) {
-    // pr_info("release was successful \n");
+    struct hero_arb_ctx *ctx = filp->private_data;
+    struct cardev_private_data *cardev_data = ctx->dev;
+    struct k_list *buf;
+
+    // The buffers stay allocated, a later file may get the same context address
+    mutex_lock(&cardev_data->test_lock);
+    list_for_each_entry(buf, &cardev_data->test_head, list)
+        if (buf->ctx == ctx)
+            buf->ctx = NULL;
+    mutex_unlock(&cardev_data->test_lock);
+    // Hands the device over if the process exits while holding it
+    hero_arb_close(ctx);
     return 0;
 }
 
+// Cache maintenance on a range of a cacheable mapping
+static int card_sync_range(struct hero_arb_ctx *ctx, uint64_t pbase,
+                           size_t size, int for_device) {
+    struct cardev_private_data *cardev_data = ctx->dev;
+    struct k_list *buf;
+
+    // Empty or wrapping ranges would pass the bound checks below
+    if (!size || pbase + size < pbase)
+        return -EINVAL;
+
+    // The reserved L3 is outside of the linear map, CVA6 writes back and
+    // invalidates its data cache on a fence
+    if (pbase >= cardev_data->l3_mem.pbase &&
+        pbase + size <= cardev_data->l3_mem.pbase + cardev_data->l3_mem.size) {
+        mb();
+        return 0;
+    }
+
+    // The DMA buffers of this file are mapped by IOCTL_DMA_ALLOC, the DMA API
+    // does the CMOs, the bouncing, or nothing on a coherent host
+    mutex_lock(&cardev_data->test_lock);
+    list_for_each_entry(buf, &cardev_data->test_head, list) {
+        if (buf->ctx == ctx && pbase >= buf->data->pbase &&
+            pbase + size <= buf->data->pbase + buf->data->size) {
+            if (for_device)
+                dma_sync_single_range_for_device(&cardev_data->pdev->dev, buf->dma,
+                                                 pbase - buf->data->pbase, size,
+                                                 DMA_BIDIRECTIONAL);
+            else
+                dma_sync_single_range_for_cpu(&cardev_data->pdev->dev, buf->dma,
+                                              pbase - buf->data->pbase, size,
+                                              DMA_BIDIRECTIONAL);
+            mutex_unlock(&cardev_data->test_lock);
+            return 0;
+        }
+    }
+    mutex_unlock(&cardev_data->test_lock);
+    pr_err("Can't sync %#llx (%#zx), not in a cacheable region\n", pbase, size);
+    return -EINVAL;
+}
+
 int card_mmap(struct file *filp, struct vm_area_struct *vma) {
     struct k_list *bufs_tail;
+    struct shared_mem *region;
     unsigned long mapoffset, vsize, psize;
     char type[20];
     int ret;
-    struct cardev_private_data *cardev_data =
-        (struct cardev_private_data *)filp->private_data;
+    struct hero_arb_ctx *ctx = filp->private_data;
+    struct cardev_private_data *cardev_data = ctx->dev;
+    int cached = !!(vma->vm_pgoff & MMAP_CACHED_FLAG);
+
+    vma->vm_pgoff &= ~MMAP_CACHED_FLAG;
+    if (cached && vma->vm_pgoff != L3_MMAP_ID &&
+        vma->vm_pgoff != DMA_BUFS_MMAP_ID) {
+        pr_err("Only the L3 and the DMA buffers can be mapped cached\n");
+        return -EINVAL;
+    }
 
     switch (vma->vm_pgoff) {
     case SOC_CTRL_MMAP_ID:
         MAP_DEVICE_REGION("soc_ctrl", soc_ctrl_mem);
         break;
     case QUADRANT_CTRL_MMAP_ID:
-        MAP_DEVICE_REGION("quadrant_ctrl", quadrant_ctrl_mem);
+        MAP_DEVICE_REGION("quadrant_ctrl", quadrant_ctrl_mem[0]);
         break;
     case CLINT_MMAP_ID:
         MAP_DEVICE_REGION("clint", clint_mem);
         break;
-    case SNITCH_CLUSTER_MMAP_ID:
-        MAP_DEVICE_REGION("snitch_cluster", snitch_cluster_mem);
-        break;
     case SCRATCHPAD_WIDE_MMAP_ID:
         MAP_DEVICE_REGION("spm_wide", spm_wide_mem);
         break;
@@ -111,14 +176,31 @@ int card_mmap(struct file *filp, struct vm_area_struct *vma) {
     case DMA_BUFS_MMAP_ID:
         strncpy(type, "buffer", sizeof(type));
         pr_info("Ready to map latest buffer\n");
-        bufs_tail =
-            list_last_entry(&cardev_data->test_head, struct k_list, list);
-        mapoffset = bufs_tail->data->pbase;
-        psize = bufs_tail->data->size;
+        // The latest buffer of this file, other processes may allocate too
+        mutex_lock(&cardev_data->test_lock);
+        bufs_tail = ctx->last_buf;
+        if (bufs_tail) {
+            // The list holds the device view of the buffers
+            mapoffset = virt_to_phys(bufs_tail->data->vbase);
+            psize = bufs_tail->data->size;
+        }
+        mutex_unlock(&cardev_data->test_lock);
+        if (!bufs_tail) {
+            pr_err("No buffer allocated\n");
+            return -EINVAL;
+        }
         break;
     default:
-        pr_err("Unknown page offset\n");
-        return -EINVAL;
+        // Other quadrants and clusters
+        PTR_TO_DEVDATA_REGION(region, cardev_data, vma->vm_pgoff)
+        if (!region || !region->pbase) {
+            pr_err("Unknown page offset\n");
+            return -EINVAL;
+        }
+        snprintf(type, sizeof(type), "region_%lu", vma->vm_pgoff);
+        mapoffset = region->pbase;
+        psize = region->size;
+        break;
     }
 
     vsize = vma->vm_end - vma->vm_start;
@@ -129,9 +211,10 @@ int card_mmap(struct file *filp, struct vm_area_struct *vma) {
         // return -EINVAL;
     }
 
-    // set protection flags to avoid caching and paging
+    // set protection flags to avoid paging, and caching unless requested
     vma->vm_flags |= VM_IO | VM_DONTEXPAND | VM_DONTDUMP;
-    vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
+    if (!cached)
+        vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
 
     pr_info("%s mmap: phys: %#lx, virt: %#lx vsize: %#lx psize: %#lx\n", type,
             mapoffset, vma->vm_start, vsize, psize);
@@ -149,10 +232,11 @@ static long card_ioctl(struct file *file, unsigned int cmd, unsigned long arg_us
     // Pointers to user arguments
     void __user *argp = (void __user *)arg_user_addr;
     // Get driver data
-    struct cardev_private_data *cardev_data =
-        (struct cardev_private_data *)file->private_data;
+    struct hero_arb_ctx *ctx = file->private_data;
+    struct cardev_private_data *cardev_data = ctx->dev;
     // Fetch user arguments
     struct card_ioctl_arg arg;
+    int err;
     if (copy_from_user(&arg, argp, sizeof(struct card_ioctl_arg)))
         return -EFAULT;
 
@@ -162,12 +246,19 @@ static long card_ioctl(struct file *file, unsigned int cmd, unsigned long arg_us
         dma_addr_t result_phys = 0;
         void *result_virt = 0;
         printk("dma_alloc_coherent %p, %llx (%llx pages)\n", &cardev_data->pdev->dev, arg.size, 1 << order_base_2(ALIGN(arg.size, PAGE_SIZE)/PAGE_SIZE));
-        // Alloc memory region (note PHY address = DMA address), issue with dma_alloc_coherent on milk-v
+        // Alloc memory region, issue with dma_alloc_coherent on milk-v
         result_virt = __get_free_pages(GFP_KERNEL | GFP_DMA32, order_base_2(ALIGN(arg.size, PAGE_SIZE)/PAGE_SIZE));
-        result_phys = virt_to_phys(result_virt);
-        printk("dma_alloc_coherent returns %llx %llx\n", result_virt, result_phys);
         if (!result_virt)
             return -ENOMEM;
+        // The device sees the buffer at its DMA address (the PHY address
+        // without an IOMMU), the mapping serves the IOCTL_SYNC_* as well
+        result_phys = dma_map_single(&cardev_data->pdev->dev, (void *)result_virt,
+                                     ALIGN(arg.size, PAGE_SIZE), DMA_BIDIRECTIONAL);
+        if (dma_mapping_error(&cardev_data->pdev->dev, result_phys)) {
+            free_pages(result_virt, order_base_2(ALIGN(arg.size, PAGE_SIZE) / PAGE_SIZE));
+            return -ENOMEM;
+        }
+        printk("dma_alloc_coherent returns %llx %llx\n", result_virt, result_phys);
         arg.result_virt_addr = result_virt;
         arg.result_phys_addr = result_phys;
 
@@ -178,11 +269,23 @@ static long card_ioctl(struct file *file, unsigned int cmd, unsigned long arg_us
 
         // Add to the buffer list
         struct k_list *new = kmalloc(sizeof(struct k_list), GFP_KERNEL);
-        new->data = kmalloc(sizeof(struct shared_mem), GFP_KERNEL);
+        if (new)
+            new->data = kmalloc(sizeof(struct shared_mem), GFP_KERNEL);
+        if (!new || !new->data) {
+            kfree(new);
+            dma_unmap_single(&cardev_data->pdev->dev, result_phys,
+                             ALIGN(arg.size, PAGE_SIZE), DMA_BIDIRECTIONAL);
+            free_pages(result_virt, order_base_2(ALIGN(arg.size, PAGE_SIZE) / PAGE_SIZE));
+            return -ENOMEM;
+        }
         new->data->pbase = arg.result_phys_addr;
         new->data->vbase = arg.result_virt_addr;
         new->data->size = arg.size;
+        new->dma = result_phys;
+        new->ctx = ctx;
+        mutex_lock(&cardev_data->test_lock);
         list_add_tail(&new->list, &cardev_data->test_head);
+        ctx->last_buf = new;
 
         // Print the buffer list for debug
         pr_info("Reading list :\n");
@@ -192,6 +295,7 @@ static long card_ioctl(struct file *file, unsigned int cmd, unsigned long arg_us
             my = list_entry(p, struct k_list, list);
             pr_info("pbase = %#llx, psize = %#llx\n", my->data->pbase, my->data->size);
         }
+        mutex_unlock(&cardev_data->test_lock);
         break;
     }
     case IOCTL_MEM_INFOS: {
@@ -207,6 +311,67 @@ static long card_ioctl(struct file *file, unsigned int cmd, unsigned long arg_us
         arg.result_phys_addr = requested_mem->pbase;
         break;
     }
+    case IOCTL_DEV_INFOS: {
+        arg.size = cardev_data->n_clusters;
+        arg.result_phys_addr = cardev_data->n_quadrants;
+        arg.result_virt_addr = cardev_data->n_cores;
+        break;
+    }
+    case IOCTL_MEM_MAP_ALL: {
+        static const int fixed_ids[] = {SOC_CTRL_MMAP_ID, CLINT_MMAP_ID, SCRATCHPAD_WIDE_MMAP_ID, L3_MMAP_ID};
+        struct card_mem_entry __user *table = (struct card_mem_entry __user *)arg.result_virt_addr;
+        struct card_mem_entry entry = {0};
+        struct shared_mem *mem;
+        size_t n = 0;
+        int n_fixed = ARRAY_SIZE(fixed_ids);
+        int n_ids = n_fixed + cardev_data->n_quadrants + cardev_data->n_clusters;
+        // The fixed regions, then the quadrant controls and the clusters
+        for (int i = 0; i < n_ids; i++) {
+            int mmap_id;
+            if (i < n_fixed)
+                mmap_id = fixed_ids[i];
+            else if (i < n_fixed + cardev_data->n_quadrants)
+                mmap_id = QUADRANT_CTRL_X_MMAP_ID(i - n_fixed);
+            else
+                mmap_id = SNITCH_CLUSTER_X_MMAP_ID(i - n_fixed - cardev_data->n_quadrants);
+            PTR_TO_DEVDATA_REGION(mem, cardev_data, mmap_id)
+            if (!mem || !mem->size)
+                continue;
+            if (n < arg.size) {
+                entry.mmap_id   = mmap_id;
+                entry.size      = mem->size;
+                entry.phys_addr = mem->pbase;
+                if (copy_to_user(&table[n], &entry, sizeof(entry)))
+                    return -EFAULT;
+            }
+            n++;
+        }
+        arg.size = n;
+        break;
+    }
+    case IOCTL_SYNC_FOR_DEVICE:
+    case IOCTL_SYNC_FOR_CPU:
+        return card_sync_range(ctx, arg.result_phys_addr, arg.size,
+                               cmd == IOCTL_SYNC_FOR_DEVICE);
+    case IOCTL_CTX_ACQUIRE:
+        err = hero_arb_acquire(ctx, arg.size);
+        if (err)
+            return err;
+        arg.result_phys_addr = ctx->handed_over;
+        break;
+    case IOCTL_CTX_RELEASE:
+        return hero_arb_release(ctx);
+    case IOCTL_CTX_INFO: {
+        struct hero_arb_stats stats;
+        hero_arb_get_stats(ctx, &stats);
+        arg.size = stats.slot;
+        arg.result_phys_addr = stats.n_slots;
+        if (arg.result_virt_addr &&
+            copy_to_user((void __user *)arg.result_virt_addr, &stats,
+                         sizeof(struct card_ctx_stats)))
+            return -EFAULT;
+        break;
+    }
     default:
         return -1;
     }
@@ -97,6 +97,7 @@ struct hero_pci {
   void *dtb_blob;
   u32 dtb_size;
   bool populated;
+  int n_vectors;
 };
 
 // extern struct device_node *of_root;
@@ -145,6 +146,15 @@ static int hero_pci_probe(struct pci_dev *pdev, const struct pci_device_id *id)
   data->ovcs_id = -1;
   data->populated = 0;
 
+  // Allocate the doorbell vectors before the platform drivers probe
+  ret = pci_alloc_irq_vectors(pdev, 1, HERO_PCI_MAX_VECTORS, PCI_IRQ_MSIX | PCI_IRQ_MSI);
+  if (ret < 0) {
+    dev_warn(dev, "No MSI vectors (%i), the host will poll the device\n", ret);
+  } else {
+    data->n_vectors = ret;
+    dev_info(dev, "Allocated %i MSI vectors\n", ret);
+  }
+
   dev_info(dev, "Read BAR\n");
 
   ret = bar_read_dtb(pdev, 0, 0, &data->dtb_blob, &data->dtb_size);
@@ -184,6 +194,8 @@ static void hero_pci_remove(struct pci_dev *pdev) {
 
   if (data->ovcs_id > 0) of_overlay_remove(&data->ovcs_id);
 
+  if (data->n_vectors > 0) pci_free_irq_vectors(pdev);
+
   pci_clear_master(pdev);
 }
 
@@ -12,3 +12,9 @@
 
 // Arbitrary allow 10KiB to map were the DTB is written
 #define DTB_MAP_SIZE 1024 * 10
+
+// MSI vectors for the device-to-host doorbells. The user interrupts of the
+// PCIe endpoint are routed to the vectors in order, vector 0 being the
+// mailbox doorbell, and the platform drivers populated below the PCI device
+// get them with pci_irq_vector().
+#define HERO_PCI_MAX_VECTORS 4
@@ -112,6 +112,8 @@ typedef struct HeroSubDev {
 typedef struct {
     volatile struct ring_buf *a2h_mbox;
     HeroSubDev_t a2h_mbox_mem;
+    // a2h data and head mirrored in a host DMA buffer, NULL if not
+    struct ring_buf_mirror *a2h_mirror;
     volatile struct ring_buf *h2a_mbox;
     HeroSubDev_t h2a_mbox_mem;
     volatile struct ring_buf *rb_mbox;
@@ -156,6 +158,18 @@ int hero_dev_mbox_read(const HeroDev *dev, uint32_t *buffer, size_t n_words);
  */
 int hero_dev_mbox_write(HeroDev *dev, uint32_t word);
 
+/** Wait for a device-to-host doorbell (MSI vector 0 on PCIe hosts). No device
+ runtime in this tree raises it yet, hence hero_dev_mbox_read still polls.
+
+  \param    dev        pointer to the HeroDev structure
+  \param    seq        last event count seen, updated on return
+  \param    timeout_ms maximum time to wait
+
+  \return   0 on an event or on timeout; -ENOSYS or -ENODEV if the platform
+            has no doorbell.
+ */
+int hero_dev_wait_event(HeroDev *dev, uint64_t *seq, unsigned timeout_ms);
+
 //!@}
 
 /** @name PULP library setup functions
@@ -231,6 +245,29 @@ int hero_dev_init(HeroDev *dev);
  */
 void hero_dev_reset(HeroDev *dev, unsigned full);
 
+// Attributes of a region mapped by hero_dev_mmap
+#define HERO_REGION_CACHED (1U << 0) // mapped cacheable by the host
+#define HERO_REGION_REGS   (1U << 1) // control registers, accesses may have side effects
+
+typedef struct {
+    const char *name;
+    volatile void *v_addr;
+    uintptr_t p_addr;
+    size_t size;
+    unsigned flags;
+} HeroRegion;
+
+/** List the device regions mapped in the host address space, including the
+  control registers. The default lists the local_mems and global_mems.
+
+  \param    pulp        pointer to the HeroDev structure
+  \param    regions     array to fill
+  \param    max_regions size of the array
+
+  \return   number of regions written.
+ */
+int hero_dev_get_regions(HeroDev *dev, HeroRegion *regions, int max_regions);
+
 //!@}
 
 /** Load binaries to the start of the TCDM and the start of the L2 memory inside
@@ -280,6 +317,59 @@ void hero_dev_exe_stop(HeroDev *dev);
  */
 int hero_dev_exe_wait(const HeroDev *dev, int timeout_s);
 
+/** @name Device sharing between processes
+ *
+ * Each process that opens the device gets its own slice of the heaps, hence
+ * its own mailboxes, when the driver is loaded with max_contexts > 1. The
+ * driver grants the device to one process at a time.
+ *
+ * @{
+ */
+
+typedef struct {
+    uint64_t launches;      // grants of this process
+    uint64_t busy_ns;       // time this process held the device
+    uint64_t wait_ns;       // time this process waited for the device
+    uint64_t dev_busy_ns;   // time the device was held by any process
+    uint64_t dev_uptime_ns; // time since the driver was loaded
+    uint32_t slot;          // heap slice of this process
+    uint32_t n_slots;
+    uint32_t n_contexts;    // processes that opened the device
+    uint32_t n_waiters;     // processes waiting for the device
+} HeroDevStats;
+
+/** Wait until the device is granted to this process, hero_dev_exe_start and
+  hero_dev_mbox_write do it before using the device. Does nothing if already
+  granted.
+
+  \param    dev    pointer to the HeroDev structure
+  \param    weight share of the device against the other processes (16 is the
+                   default), 0 to keep the current one
+  \return   0 on success; 1 if another process held the device since this one
+            last did, the state of this process on the device has to be
+            restored; negative value with an errno on errors.
+ */
+int hero_dev_acquire(HeroDev *dev, unsigned weight);
+
+/** Hand the device over to the next process. hero_cache_offload_exit does it
+  at the end of an offload, closing the device does it as well. A process that
+  doesn't call either keeps the device between its offloads.
+
+  \param    dev    pointer to the HeroDev structure
+  \return   0 on success; negative value with an errno on errors.
+ */
+int hero_dev_release(HeroDev *dev);
+
+/** Get the arbitration statistics of this process and of the device.
+
+  \param    dev    pointer to the HeroDev structure
+  \param    stats  statistics to fill
+  \return   0 on success; -ENOSYS if the driver does not arbitrate.
+ */
+int hero_dev_get_stats(HeroDev *dev, HeroDevStats *stats);
+
+//!@}
+
 /** @name Contiguous memory allocation functions
  *
  * @{
@@ -295,6 +385,33 @@ uintptr_t hero_dev_l3_malloc(HeroDev *dev, unsigned size_b, uintptr_t *p_addr);
 
 uintptr_t hero_dev_l2_malloc(HeroDev *dev, unsigned size_b, uintptr_t *p_addr);
 
+/** Drop every allocation of the L2 and L3 heaps, used by herod between two
+  clients. The mailboxes must be allocated again.
+  \param    pulp   pointer to the HeroDev structure
+ */
+void hero_dev_reset_heaps(HeroDev *dev);
+
+void hero_dev_l2_free(HeroDev *dev, uintptr_t v_addr, uintptr_t p_addr);
+
+// Device L2 ports, buffers streamed concurrently should sit on different ports
+#define HERO_L2_PORT_ANY (-1)
+#define HERO_L2_PORT_0 0
+#define HERO_L2_PORT_1 1
+#define HERO_L2_NUM_PORTS 2
+
+/** Allocate a chunk of memory in the L2 behind a given port. Platforms with a
+  single L2 port fall back to hero_dev_l2_malloc.
+  \param    pulp   pointer to the HeroDev structure
+  \param    size_b size in Bytes of the requested chunk
+  \param    p_addr pointer to store the physical address to
+  \param    port   L2 port, HERO_L2_PORT_ANY to alternate between the ports
+  \return   virtual user-space address for host
+ */
+uintptr_t hero_dev_l2_malloc_port(HeroDev *dev, unsigned size_b, uintptr_t *p_addr, int port);
+
+/** Free memory previously allocated with hero_dev_l2_malloc_port. */
+void hero_dev_l2_free_port(HeroDev *dev, uintptr_t v_addr, uintptr_t p_addr);
+
 /** Allocate a DMA-able buffer host L3.
   \param    pulp   pointer to the HeroDev structure
   \param    size_b size in Bytes of the requested chunk
@@ -307,6 +424,75 @@ uintptr_t hero_iommu_map_virt(HeroDev *dev, unsigned size_b, void *v_addr);
 
 int hero_iommu_map_virt_to_phys(HeroDev *dev, unsigned size_b, void *v_addr, uintptr_t p_addr);
 
+typedef enum {
+    // Host writes are made visible to the device
+    HERO_SYNC_FOR_DEVICE = 0,
+    // Device writes are made visible to the host
+    HERO_SYNC_FOR_CPU = 1,
+} HeroSyncDir;
+
+/** Keep a range of the L3 or of a DMA buffer coherent between the host and the
+  device. Needed when the L3 and the DMA buffers are mapped cached
+  (HERO_MAP_CACHED=1), a fence otherwise.
+  \param    dev    pointer to the HeroDev structure
+  \param    p_addr physical address of the range
+  \param    size_b size in Bytes of the range
+  \param    dir    HERO_SYNC_FOR_DEVICE before an offload reads the range,
+                   HERO_SYNC_FOR_CPU before the host reads what the device wrote
+  \return   0 on success; negative value with an errno on errors.
+ */
+int hero_dev_sync(HeroDev *dev, uintptr_t p_addr, size_t size_b, HeroSyncDir dir);
+
+/** @name Cache coherence of the shared buffers
+ *
+ * The buffers shared with the device are tracked so that only the needed
+ * cache maintenance is done at the offload boundaries, depending on the
+ * DataDesc type: the host caches are cleaned on entry for the buffers the
+ * host wrote, and invalidated on exit for the buffers the device may have
+ * written (out, inout). DataDesc.cache_ctrl = 1 skips the maintenance.
+ *
+ * @{
+ */
+
+#define HERO_CACHE_MAX_BUFS 64
+
+struct hero_cache_stats {
+    uint64_t clean_bytes;
+    uint64_t clean_avoided_bytes;
+    uint64_t inval_bytes;
+    uint64_t inval_avoided_bytes;
+    uint64_t fences;
+};
+
+extern struct hero_cache_stats hero_cache_stats;
+
+/** Track a buffer shared with the device (desc->ptr_l3_p, desc->size). It is
+  considered written by the host until the next offload entry.
+  \return   0 on success; negative value with an errno on errors.
+ */
+int hero_cache_share(HeroDev *dev, const DataDesc *desc);
+
+/** Stop tracking a shared buffer. */
+void hero_cache_unshare(HeroDev *dev, const DataDesc *desc);
+
+/** Declare a host write to a shared buffer between two offloads. */
+void hero_cache_host_wrote(HeroDev *dev, const DataDesc *desc);
+
+/** Cache maintenance before an offload using the buffers in descs.
+  \return   0 on success; negative value with an errno on errors.
+ */
+int hero_cache_offload_enter(HeroDev *dev, const DataDesc *descs, unsigned n_descs);
+
+/** Cache maintenance after an offload using the buffers in descs, then
+  hand the device over to the next process (hero_dev_release).
+  \return   0 on success; negative value with an errno on errors.
+ */
+int hero_cache_offload_exit(HeroDev *dev, const DataDesc *descs, unsigned n_descs);
+
+void hero_cache_print_stats();
+
+//!@}
+
 /** Free memory previously allocated in contiguous L3.
  \param    pulp   pointer to the HeroDev structure
  \param    v_addr pointer to unsigned containing the virtual address
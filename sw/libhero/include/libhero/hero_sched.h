@@ -0,0 +1,128 @@
+// Copyright 2024 ETH Zurich and University of Bologna.
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "libhero/hero_api.h"
+
+////////////////////
+///// SCHEDULER ////
+////////////////////
+
+// The platform libraries (libhero_<platform>.so) keep their state in globals,
+// hence the scheduler loads one private copy of the library per device with
+// dlmopen(). Devices of different platforms, or several boards of the same
+// platform, can then be driven by a single process.
+
+#define HERO_SCHED_MAX_DEVICES 8
+// Let the policy pick the device, used for device(omp_get_default_device())
+#define HERO_SCHED_AUTO (-1)
+
+typedef enum {
+    // Device with the smallest outstanding cost
+    HERO_SCHED_LEAST_LOADED = 0,
+    // Device that ran the same affinity key last, unless it is much busier
+    HERO_SCHED_AFFINITY = 1,
+    // Next device, ignoring the load
+    HERO_SCHED_ROUND_ROBIN = 2,
+} HeroSchedPolicy;
+
+// Entry points of a platform library
+typedef struct {
+    int (*mmap)(HeroDev *dev);
+    int (*munmap)(HeroDev *dev);
+    int (*init)(HeroDev *dev);
+    void (*reset)(HeroDev *dev, unsigned full);
+    void (*exe_start)(HeroDev *dev);
+    int (*mbox_read)(const HeroDev *dev, uint32_t *buffer, size_t n_words);
+    int (*mbox_write)(HeroDev *dev, uint32_t word);
+    uintptr_t (*l2_malloc)(HeroDev *dev, unsigned size_b, uintptr_t *p_addr);
+    uintptr_t (*l3_malloc)(HeroDev *dev, unsigned size_b, uintptr_t *p_addr);
+    void (*l3_free)(HeroDev *dev, uintptr_t v_addr, uintptr_t p_addr);
+} HeroDevOps;
+
+// A target region, run by the worker of the selected device
+typedef int (*hero_sched_fn)(int device, HeroDev *dev, const HeroDevOps *ops, void *arg);
+
+typedef struct HeroSchedJob {
+    hero_sched_fn fn;
+    void *arg;
+    uint64_t cost;
+    struct HeroSchedJob *next;
+} HeroSchedJob;
+
+// Per-device queue, the device runs one target region at a time
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    HeroSchedJob *head, *tail;
+    unsigned pending;
+    // Sum of the cost of the queued and running jobs
+    uint64_t load;
+    // Statistics
+    unsigned completed;
+    int last_err;
+    int stop;
+    pthread_t worker;
+} HeroSchedQueue;
+
+typedef struct {
+    char platform[32];
+    char node[64];
+    void *lib;
+    HeroDev dev;
+    HeroDevOps ops;
+    HeroSchedQueue queue;
+} HeroSchedDev;
+
+/** Open and initialize a device (hero_dev_mmap, hero_dev_init), then start its worker.
+
+  \param    platform platform library to use (occamy, spatz_cluster, safety_island)
+  \param    node     driver character device, NULL for the platform default
+
+  \return   device index on success; negative value with an errno on errors.
+ */
+int hero_sched_add_device(const char *platform, const char *node);
+
+/** Open the devices listed in HERO_DEVICES, e.g.
+  "spatz_cluster:/dev/cardev-0,safety_island:/dev/cardev-1". The policy is
+  read from HERO_SCHED_POLICY (least_loaded, affinity or round_robin).
+
+  \return   number of devices opened; negative value with an errno on errors.
+ */
+int hero_sched_init_from_env();
+
+int hero_sched_num_devices();
+
+void hero_sched_set_policy(HeroSchedPolicy policy);
+
+/** Select the device that will run a target region, without queuing it.
+
+  \param    device   device index or HERO_SCHED_AUTO
+  \param    affinity affinity key (e.g. the kernel or the data it works on), 0 for none
+  \param    cost     estimated cost of the region in any unit, 0 for unknown
+
+  \return   device index; negative value with an errno on errors.
+ */
+int hero_sched_select(int device, uint32_t affinity, uint64_t cost);
+
+/** Queue a target region on a device.
+
+  \return   index of the device it was queued on; negative value with an errno on errors.
+ */
+int hero_sched_submit(int device, uint32_t affinity, uint64_t cost, hero_sched_fn fn, void *arg);
+
+/** Wait for the queue of a device (or of all devices with HERO_SCHED_AUTO) to drain.
+
+  \return   0 on success; the last error of a job otherwise.
+ */
+int hero_sched_wait(int device);
+
+HeroSchedDev *hero_sched_get_device(int device);
+
+/** Stop the workers and close all the devices. */
+void hero_sched_fini();
@@ -9,7 +9,9 @@
 
 #pragma once
 
+#include <stddef.h>
 #include <stdint.h>
+#include <string.h>
 
 /* generic I/O write */
 static inline void writeb(uint8_t val, uintptr_t addr)
@@ -88,3 +90,39 @@ static inline uint64_t readd(const uintptr_t addr)
 		     : "memory");
 	return val;
 }
+
+/* Bulk copy into a device window. Write-combined windows (PCIe hosts) merge
+ * consecutive stores into bursts, hence the aligned body is copied with
+ * unrolled 64-bit stores and only the head and tail are written bytewise.
+ * Call wc_flush() before handing the data to the device. */
+static inline void memcpy_toio_wide(uintptr_t dst, const void *src, size_t size)
+{
+	const uint8_t *s = src;
+	uint64_t v[4];
+
+	for (; size && (dst & 0x7); size--)
+		writeb(*s++, dst++);
+	for (; size >= sizeof(v); size -= sizeof(v)) {
+		memcpy(v, s, sizeof(v));
+		writed(v[0], dst);
+		writed(v[1], dst + 8);
+		writed(v[2], dst + 16);
+		writed(v[3], dst + 24);
+		s += sizeof(v);
+		dst += sizeof(v);
+	}
+	for (; size >= sizeof(uint64_t); size -= sizeof(uint64_t)) {
+		memcpy(v, s, sizeof(uint64_t));
+		writed(v[0], dst);
+		s += sizeof(uint64_t);
+		dst += sizeof(uint64_t);
+	}
+	for (; size; size--)
+		writeb(*s++, dst++);
+}
+
+/* Drain the pending (combined) stores to the device */
+static inline void wc_flush(void)
+{
+	asm volatile("fence iorw, iorw" ::: "memory");
+}
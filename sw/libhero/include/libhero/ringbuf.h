@@ -12,6 +12,8 @@
 #include <stdint.h>
 #include <string.h>
 
+#include "libhero/io.h"
+
 /**
  * @brief Ring buffer for simple communication from accelerator to host.
  * @tail: Points to the element in `data` which is read next
@@ -20,6 +22,11 @@
  * @element_size: Size of each element in bytes
  * @data_p: points to the base of the data buffer in physical address
  * @data_v: points to the base of the data buffer in virtual address space
+ * @head_mirror_p: if not 0, device address of a copy of `head` kept in host
+ *                 memory (see `struct ring_buf_mirror`), `data_p` then points
+ *                 to host memory as well
+ *
+ * The layout is shared with the device runtime, rebuild both when changing it.
  */
 // Make sure this is 128-bits aligned for CVA6 d-cache
 struct ring_buf {
@@ -29,6 +36,27 @@ struct ring_buf {
   uint32_t element_size;
   uint64_t data_v;
   uint64_t data_p;
+  uint64_t head_mirror_p;
+  uint64_t reserved;
+};
+
+/**
+ * @brief Host view of a device-to-host ring whose data and head live in host
+ * memory. The device only issues posted writes to the host, the host polls
+ * its local memory and only writes `tail` back to the device-resident ring.
+ * @head: host copy of the ring head, written by the device
+ * @tail: host copy of the ring tail, the host is the only writer
+ * @size, @element_size: copies of the ring fields
+ * @data: host virtual address of the data buffer
+ * @rb: the device-resident ring
+ */
+struct ring_buf_mirror {
+  volatile uint32_t *head;
+  uint32_t tail;
+  uint32_t size;
+  uint32_t element_size;
+  volatile uint8_t *data;
+  volatile struct ring_buf *rb;
 };
 
 /**
@@ -46,6 +74,9 @@ static inline int rb_device_put(volatile struct ring_buf *rb, void *el) {
   for (uint32_t i = 0; i < rb->element_size; i++)
     *((uint8_t *)rb->data_p + rb->element_size * rb->head + i) = *((uint8_t *)el + i);
   rb->head = next_head;
+  // The data and the mirrored head are posted to the host in order
+  if (rb->head_mirror_p)
+    *(volatile uint32_t *)(uintptr_t)rb->head_mirror_p = next_head;
   return 0;
 }
 /**
@@ -65,6 +96,26 @@ static inline int rb_host_get(volatile struct ring_buf *rb, void *el) {
   return 0;
 }
 
+/**
+ * @brief Pop element from a ring mirrored in host memory
+ *
+ * @param m pointer to the host view of the ring
+ * @param el pointer to where element is copied to
+ * @return 0 on success, -1 if no element could be popped
+ */
+static inline int rb_host_get_mirror(struct ring_buf_mirror *m, void *el) {
+  // caught the head, can't get data. The data is read after the head, even
+  // when the host is coherent and hero_cache_mbox_fence is empty.
+  if (m->tail == __atomic_load_n(m->head, __ATOMIC_ACQUIRE))
+    return -1;
+  for (uint32_t i = 0; i < m->element_size; i++)
+    *((uint8_t *)el + i) = m->data[m->element_size * m->tail + i];
+  m->tail = (m->tail + 1) % m->size;
+  // Only access to the device
+  m->rb->tail = m->tail;
+  return 0;
+}
+
 /**
  * @brief Copy data from `el` in the next free slot in the ring-buffer on the virtual addresses
  *
@@ -80,7 +131,11 @@ static inline int rb_host_put(volatile struct ring_buf *rb, void *el) {
   for (uint32_t i = 0; i < rb->element_size; i++) {
     *((uint8_t *)rb->data_v + rb->element_size * rb->head + i) = *((uint8_t *)el + i);
   }
+  // L2 may be mapped write-combined (PCIe hosts), the element has to reach
+  // the device before the head, and the head without waiting for more stores
+  wc_flush();
   rb->head = next_head;
+  wc_flush();
   return 0;
 }
 /**
@@ -107,4 +162,5 @@ static inline void rb_init(volatile struct ring_buf *rb, uint32_t size, uint32_t
   rb->head = 0;
   rb->size = size;
   rb->element_size = element_size;
+  rb->head_mirror_p = 0;
 }
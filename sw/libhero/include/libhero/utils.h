@@ -30,4 +30,5 @@ static inline uint64_t get_mcycle() {
 }
 
 #define MIN(a, b) (((a) <= (b)) ? (a) : (b))
+#define MAX(a, b) (((a) >= (b)) ? (a) : (b))
 #define ALIGN_UP(x, p) (((x) + (p)-1) & ~((p)-1))
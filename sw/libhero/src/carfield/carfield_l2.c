@@ -0,0 +1,138 @@
+// Copyright 2024 ETH Zurich and University of Bologna.
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: Apache-2.0
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libhero/debug.h"
+#include "libhero/hero_api.h"
+
+#include "allocators.h"
+#include "carfield_l2.h"
+#include "hero_session.h"
+
+struct car_l2_port car_l2_ports[HERO_L2_NUM_PORTS];
+// Next port for HERO_L2_PORT_ANY
+static int car_l2_next_port;
+
+int car_l2_1_contiguous() {
+    char *env = getenv("HERO_L2_1_VIEW");
+    return env && !strcmp(env, "contiguous");
+}
+
+static int car_l2_ports_init(volatile void *virt, uint64_t phys, uint64_t size) {
+    struct car_l2_port *port;
+
+    // Port 0 is the default L2 heap
+    port = &car_l2_ports[0];
+    memset(port, 0, sizeof(*port));
+    port->view = "l2_intl_0";
+    port->virt = l2_heap_start_virt;
+    port->phys = l2_heap_start_phy;
+    port->size = l2_heap_size;
+    port->heap = l2_heap_manager;
+
+    // Port 1 is only used through hero_dev_l2_malloc_port, give it the whole port
+    port = &car_l2_ports[1];
+    memset(port, 0, sizeof(*port));
+    port->view = car_l2_1_contiguous() ? "l2_cont_1" : "l2_intl_1";
+    port->virt = (uint64_t)virt;
+    port->phys = phys;
+    port->size = size;
+    if (!virt || !size) {
+        pr_warn("L2 port 1 is not mapped, only port 0 will be used\n");
+        return 0;
+    }
+    // herod initialized the heap, o1heap keeps its instance at the arena base
+    if (hero_dev_attached)
+        port->heap = (struct O1HeapInstance *)port->virt;
+    else
+        port->heap = o1heapInit((void *)port->virt, port->size, NULL, NULL);
+    if (!port->heap) {
+        pr_error("Failed to initialize the L2 port 1 heap manager.\n");
+        return -ENOMEM;
+    }
+    pr_debug("L2 port 1 heap in %s at %p (%lx) size %lx\n", port->view, (void *)port->virt, port->phys, port->size);
+
+    car_l2_next_port = 0;
+    return 0;
+}
+
+int car_l2_init(volatile void *virt, uint64_t phys, uint64_t size) {
+    uintptr_t virt_addr = (uintptr_t)virt, phys_addr = phys;
+    size_t size_b = size;
+
+    // Port 1 is sliced between the processes as the default heaps
+    if (virt)
+        hero_dev_heap_slice(&phys_addr, &virt_addr, &size_b);
+    return car_l2_ports_init((volatile void *)virt_addr, phys_addr, size_b);
+}
+
+void hero_dev_reset_heaps(HeroDev *dev) {
+    struct car_l2_port port_1 = car_l2_ports[1];
+
+    l2_heap_manager = NULL;
+    l3_heap_manager = NULL;
+    hero_dev_l2_init(dev);
+    hero_dev_l3_init(dev);
+    // Port 0 follows the default L2 heap, port 1 is initialized again in its
+    // slice
+    car_l2_ports_init((volatile void *)port_1.virt, port_1.phys, port_1.size);
+}
+
+static uintptr_t car_l2_port_malloc(int p, unsigned size_b, uintptr_t *p_addr) {
+    struct car_l2_port *port = &car_l2_ports[p];
+    void *result;
+
+    if (!port->heap)
+        return 0;
+    result = o1heapAllocate(port->heap, size_b);
+    if (!result)
+        return 0;
+    port->allocs++;
+    port->allocated += size_b;
+    *p_addr = (uintptr_t)result - port->virt + port->phys;
+    pr_trace("%s Allocated %u bytes at %lx (%p) in %s\n", __func__, size_b, *p_addr, result, port->view);
+    return (uintptr_t)result;
+}
+
+uintptr_t hero_dev_l2_malloc_port(HeroDev *dev, unsigned size_b, uintptr_t *p_addr, int port) {
+    uintptr_t result;
+
+    if (port >= HERO_L2_NUM_PORTS) {
+        pr_error("Invalid L2 port %d\n", port);
+        return 0;
+    }
+
+    // Alternate the ports so that buffers streamed together (e.g. the weights
+    // and the activations) are served by different ports
+    if (port == HERO_L2_PORT_ANY) {
+        port = car_l2_next_port;
+        car_l2_next_port = (car_l2_next_port + 1) % HERO_L2_NUM_PORTS;
+    }
+
+    result = car_l2_port_malloc(port, size_b, p_addr);
+    if (!result) {
+        // Rather fall back to the other port than fail
+        pr_debug("L2 port %d is full, trying port %d\n", port, !port);
+        result = car_l2_port_malloc(!port, size_b, p_addr);
+    }
+    if (!result)
+        pr_error("Can't allocate %u bytes in L2\n", size_b);
+    return result;
+}
+
+void hero_dev_l2_free_port(HeroDev *dev, uintptr_t v_addr, uintptr_t p_addr) {
+    for (int p = 0; p < HERO_L2_NUM_PORTS; p++) {
+        struct car_l2_port *port = &car_l2_ports[p];
+        if (port->heap && v_addr >= port->virt && v_addr < port->virt + port->size) {
+            o1heapFree(port->heap, (void *)v_addr);
+            port->allocs--;
+            return;
+        }
+    }
+    pr_error("%lx is not in an L2 port\n", v_addr);
+}
@@ -0,0 +1,36 @@
+// Copyright 2024 ETH Zurich and University of Bologna.
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Carfield has two L2 ports. Each port is mapped twice, interleaved across its
+// banks (L2_INTL_X) and contiguous (L2_CONT_X), and both views alias the same
+// memory. A heap hence owns one view of a port: port 0 is the default L2 heap
+// in the interleaved view, port 1 uses the view selected by HERO_L2_1_VIEW
+// (interleaved by default, "contiguous" otherwise).
+
+struct car_l2_port {
+    const char *view;
+    uint64_t virt, phys, size;
+    struct O1HeapInstance *heap;
+    // Live allocations and total bytes allocated
+    unsigned allocs;
+    uint64_t allocated;
+};
+
+extern struct car_l2_port car_l2_ports[];
+
+// Whether HERO_L2_1_VIEW asks for the contiguous view of port 1
+int car_l2_1_contiguous();
+
+/** Register the L2 ports. The default L2 heap (port 0) must be initialized.
+
+  \param    virt, phys, size mapping of the selected view of port 1
+
+  \return   0 on success; negative value with an errno on errors.
+ */
+int car_l2_init(volatile void *virt, uint64_t phys, uint64_t size);
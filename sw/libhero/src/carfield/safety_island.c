@@ -13,6 +13,7 @@
 
 #include "allocators.h"
 #include "carfield_driver.h"
+#include "carfield_l2.h"
 #include "driver.h"
 #include "safety_island.h"
 
@@ -59,7 +60,7 @@ int hero_dev_mmap(HeroDev *dev) {
     if(env_libhero_log)
         libhero_log_level = strtol(env_libhero_log, NULL, 10);
 
-    device_fd = open("/dev/cardev--1", O_RDWR | O_SYNC);
+    device_fd = driver_open("/dev/cardev--1");
     pr_trace("%s safety_island\n", __func__);
     // Call card_mmap from the driver map address spaces
     if (driver_lookup_mmap(device_fd, SOC_CTRL_MMAP_ID, &car_soc_ctrl))
@@ -71,19 +72,20 @@ int hero_dev_mmap(HeroDev *dev) {
     if (driver_lookup_mmap(device_fd, L2_INTL_0_MMAP_ID, &car_l2_intl_0))
         goto error_driver;
 
-    if (driver_lookup_mmap(device_fd, L2_CONT_0_MMAP_ID, &car_l2_cont_0))
+    // The other L2 views and the iDMA are only mapped when used (driver_lazy_get)
+    if (driver_lazy_mmap(device_fd, L2_CONT_0_MMAP_ID, &car_l2_cont_0))
         goto error_driver;
 
-    if (driver_lookup_mmap(device_fd, L2_INTL_1_MMAP_ID, &car_l2_intl_1))
+    if (driver_lazy_mmap(device_fd, L2_INTL_1_MMAP_ID, &car_l2_intl_1))
         goto error_driver;
 
-    if (driver_lookup_mmap(device_fd, L2_CONT_1_MMAP_ID, &car_l2_cont_1))
+    if (driver_lazy_mmap(device_fd, L2_CONT_1_MMAP_ID, &car_l2_cont_1))
         goto error_driver;
     
-    if (driver_lookup_mmap(device_fd, L3_MMAP_ID, &car_l3))
+    if (driver_lookup_mmap(device_fd, driver_cached_mmap_id(L3_MMAP_ID), &car_l3))
         goto error_driver;
     
-    if (driver_lookup_mmap(device_fd, IDMA_MMAP_ID, &chs_idma))
+    if (driver_lazy_mmap(device_fd, IDMA_MMAP_ID, &chs_idma))
         goto error_driver;
 
     if (driver_lookup_mmap(device_fd, SAFETY_ISLAND_MMAP_ID, &car_safety_island))
@@ -128,6 +130,7 @@ int hero_dev_mmap(HeroDev *dev) {
     l2_heap_start_phy = car_l2_phys + ALIGN_UP(car_l2_size / 2, O1HEAP_ALIGNMENT);
     l2_heap_start_virt = car_l2_intl_0 + ALIGN_UP(car_l2_size / 2, O1HEAP_ALIGNMENT);
     l2_heap_size = car_l2_size / 2;
+    hero_dev_heap_slice(&l2_heap_start_phy, &l2_heap_start_virt, &l2_heap_size);
     pr_trace("%llx %llx %llx %llx\n", car_l2_phys, car_l2_size, car_l2_size / 2, l2_heap_size);
     err = hero_dev_l2_init(dev);
     if(err) {
@@ -135,6 +138,18 @@ int hero_dev_mmap(HeroDev *dev) {
         goto end;
     }
 
+    // Register the second L2 port for hero_dev_l2_malloc_port
+    size_t car_l2_1_size;
+    uintptr_t car_l2_1_phys;
+    int car_l2_1_cont = car_l2_1_contiguous();
+    driver_lookup_mem(device_fd, car_l2_1_cont ? L2_CONT_1_MMAP_ID : L2_INTL_1_MMAP_ID, &car_l2_1_size, &car_l2_1_phys);
+    err = car_l2_init(driver_lazy_get(car_l2_1_cont ? &car_l2_cont_1 : &car_l2_intl_1), car_l2_1_phys,
+                      car_l2_1_size);
+    if(err) {
+        pr_error("Error when initializing L2 ports.\n");
+        goto end;
+    }
+
     // Use the L3 mem for heap allocator
     // TODO: Get phy addresses from the driver
     size_t car_l3_size; 
@@ -143,6 +158,7 @@ int hero_dev_mmap(HeroDev *dev) {
     l3_heap_start_phy = car_l3_phys + ALIGN_UP(car_l3_size / 2, O1HEAP_ALIGNMENT);
     l3_heap_start_virt = car_l3 + ALIGN_UP(car_l3_size / 2, O1HEAP_ALIGNMENT);
     l3_heap_size = car_l3_size / 2;
+    hero_dev_heap_slice(&l3_heap_start_phy, &l3_heap_start_virt, &l3_heap_size);
     err = hero_dev_l3_init(dev);
     if(err) {
         pr_error("Error when initializing L3 mem.\n");
@@ -157,11 +173,26 @@ end:
     return err;
 }
 
+// Point the device to the mailboxes of this process
+static void car_set_mboxes(HeroDev *dev) {
+    writew(dev->mboxes.h2a_mbox_mem.p_addr, chs_ctrl_regs + 0x0);
+    writew(dev->mboxes.a2h_mbox_mem.p_addr, chs_ctrl_regs + 0x4);
+}
+
 void hero_dev_exe_start(HeroDev *dev) {
     int err;
 
     pr_trace("%s safety_island : TODO get bootadress from OMP\n", __func__);
 
+    // Wait for the other processes, then take the device over
+    err = hero_dev_acquire(dev, 0);
+    if (err) {
+        pr_error("Can't acquire the device: %s\n", strerror(-err));
+        return;
+    }
+    car_set_mboxes(dev);
+    hero_dev_started = 1;
+
     // Reset Safety Island
     car_set_isolate(1);
     writew(0, car_soc_ctrl + CARFIELD_SAFETY_ISLAND_CLK_EN_OFFSET);
@@ -186,12 +217,32 @@ void hero_dev_exe_start(HeroDev *dev) {
 	writew(1, car_soc_ctrl + CARFIELD_SAFETY_ISLAND_FETCH_ENABLE_OFFSET);
 }
 
+int hero_dev_get_regions(HeroDev *dev, HeroRegion *regions, int max_regions) {
+    int n = 0;
+    n = driver_add_region(regions, n, max_regions, "soc_ctrl", SOC_CTRL_MMAP_ID, car_soc_ctrl, 0, HERO_REGION_REGS);
+    n = driver_add_region(regions, n, max_regions, "ctrl_regs", CTRL_REGS_MMAP_ID, chs_ctrl_regs, 0, HERO_REGION_REGS);
+    n = driver_add_region(regions, n, max_regions, "idma", IDMA_MMAP_ID, driver_lazy_get(&chs_idma), 0, HERO_REGION_REGS);
+    // The safety island control registers follow the memory
+    n = driver_add_region(regions, n, max_regions, "l1_safety_island", SAFETY_ISLAND_MMAP_ID, car_safety_island,
+                          SAFETY_ISLAND_BOOT_ADDR_OFFSET, 0);
+    n = driver_add_region(regions, n, max_regions, "l2_intl_0", L2_INTL_0_MMAP_ID, car_l2_intl_0, 0, 0);
+    n = driver_add_region(regions, n, max_regions, "l2_cont_0", L2_CONT_0_MMAP_ID, driver_lazy_get(&car_l2_cont_0), 0, 0);
+    n = driver_add_region(regions, n, max_regions, "l2_intl_1", L2_INTL_1_MMAP_ID, driver_lazy_get(&car_l2_intl_1), 0, 0);
+    n = driver_add_region(regions, n, max_regions, "l2_cont_1", L2_CONT_1_MMAP_ID, driver_lazy_get(&car_l2_cont_1), 0, 0);
+    n = driver_add_region(regions, n, max_regions, "l3", driver_cached_mmap_id(L3_MMAP_ID), car_l3, 0, 0);
+    return n;
+}
+
 int hero_dev_init(HeroDev *dev) {
     pr_trace("%s safety_island implementation\n", __func__);
     // Allocate sw mailboxes
     hero_dev_alloc_mboxes(dev);
-    writew(dev->mboxes.h2a_mbox_mem.p_addr, chs_ctrl_regs + 0x0);
-    writew(dev->mboxes.a2h_mbox_mem.p_addr, chs_ctrl_regs + 0x4);
+    // Another process may be running, wait for the end of its offload
+    int err = hero_dev_acquire(dev, 0);
+    if (err < 0)
+        return err;
+    car_set_mboxes(dev);
+    hero_dev_release(dev);
     return 0;
 }
 
@@ -8,9 +8,27 @@
 
 #include <inttypes.h>
 
+#include "libhero/hero_api.h"
 #include "o1heap.h"
 
 extern struct O1HeapInstance *l2_heap_manager;
 extern uint64_t l2_heap_start_phy, l2_heap_start_virt, l2_heap_size;
 extern struct O1HeapInstance *l3_heap_manager;
 extern uint64_t l3_heap_start_phy, l3_heap_start_virt, l3_heap_size;
+
+// Slot of this process, each one allocates in its own slice of the heaps
+extern unsigned hero_dev_slot, hero_dev_n_slots;
+// Set by hero_dev_exe_start, the device is started again when this process
+// takes it back from another one
+extern int hero_dev_started;
+
+// Restore the state of this process on the device after another process held
+// it, hero_dev_exe_start by default
+void hero_dev_restore(HeroDev *dev);
+
+// Restrict a heap range to the slice of this process, before initializing it
+void hero_dev_heap_slice(uintptr_t *start_phy, uintptr_t *start_virt, size_t *size);
+
+// Initialize the heaps once their start and size are set
+int hero_dev_l2_init(HeroDev *dev);
+int hero_dev_l3_init(HeroDev *dev);
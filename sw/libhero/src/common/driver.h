@@ -12,8 +12,18 @@
 #include "libhero/debug.h"
 #include "libhero/utils.h"
 
+#include "allocators.h"
+#include "hero_session.h"
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
 // The device driver file
 extern int device_fd;
+// Character device to open instead of the platform default, set by the
+// scheduler when several devices are driven by one process
+extern const char *hero_dev_node;
 
 struct driver_ioctl_arg {
     size_t size;
@@ -22,9 +32,96 @@ struct driver_ioctl_arg {
     int mmap_id;
 };
 
+// Map the L3 and the DMA buffers cached (HERO_MAP_CACHED=1), the ranges
+// shared with the device are then kept coherent with hero_dev_sync
+int driver_map_cached() {
+    static int cached = -1;
+    if (cached < 0) {
+        char *env = getenv("HERO_MAP_CACHED");
+        cached = env ? strtol(env, NULL, 10) : 0;
+    }
+    return cached;
+}
+
+// The mmap_id to map a region with, cached when enabled
+int driver_cached_mmap_id(int mmap_id) {
+    return driver_map_cached() ? (mmap_id | MMAP_CACHED_FLAG) : mmap_id;
+}
+
+// Set when the driver arbitrates the device between the processes
+static int driver_has_ctx;
+static int driver_ctx_held;
+
+// Open the driver file, attaching to herod first if HERO_DAEMON_SOCKET is set
+int driver_open(const char *default_node) {
+    const char *node = hero_dev_node ? hero_dev_node : default_node;
+    int fd;
+
+    if (!hero_session_attach(node))
+        strncpy(hero_session.node, node, sizeof(hero_session.node) - 1);
+    fd = open(node, O_RDWR | O_SYNC);
+#ifdef IOCTL_CTX_INFO
+    // Heap slot of this process, the open fails if the driver has no free one
+    struct driver_ioctl_arg chunk = {0};
+    if (fd >= 0 && !ioctl(fd, IOCTL_CTX_INFO, &chunk)) {
+        driver_has_ctx = 1;
+        hero_dev_slot = chunk.size;
+        hero_dev_n_slots = chunk.result_phys_addr;
+        pr_debug("Context in slot %u/%u\n", hero_dev_slot, hero_dev_n_slots);
+    }
+#endif
+    return fd;
+}
+
+#ifdef IOCTL_MEM_MAP_ALL
+#define DRIVER_MAX_REGIONS 64
+// Region table of the driver, fetched with a single ioctl on the first lookup
+static struct card_mem_entry driver_mem_table[DRIVER_MAX_REGIONS];
+static int driver_mem_table_size = -1;
+
+static struct card_mem_entry *driver_mem_table_lookup(int device_fd, int mmap_id) {
+    struct driver_ioctl_arg chunk;
+
+    if (driver_mem_table_size < 0) {
+        chunk.size = DRIVER_MAX_REGIONS;
+        chunk.result_virt_addr = (uintptr_t)driver_mem_table;
+        // Older drivers only have IOCTL_MEM_INFOS
+        if (ioctl(device_fd, IOCTL_MEM_MAP_ALL, &chunk))
+            driver_mem_table_size = 0;
+        else
+            driver_mem_table_size = MIN(chunk.size, DRIVER_MAX_REGIONS);
+        pr_trace("%d regions in the driver table\n", driver_mem_table_size);
+    }
+    for (int i = 0; i < driver_mem_table_size; i++)
+        if (driver_mem_table[i].mmap_id == mmap_id)
+            return &driver_mem_table[i];
+    return NULL;
+}
+#endif
+
 int driver_lookup_mem(int device_fd, int mmap_id, size_t *size_b, uintptr_t *p_addr) {
     struct driver_ioctl_arg chunk;
-    chunk.mmap_id = mmap_id;
+    struct hero_session_region *region;
+
+    // Looked up by herod already
+    region = hero_dev_attached ? hero_session_region(mmap_id & ~MMAP_CACHED_FLAG) : NULL;
+    if (region && region->size) {
+        *size_b = region->size;
+        *p_addr = region->p_addr;
+        return 0;
+    }
+
+#ifdef IOCTL_MEM_MAP_ALL
+    struct card_mem_entry *entry = driver_mem_table_lookup(device_fd, mmap_id & ~MMAP_CACHED_FLAG);
+    if (entry) {
+        *size_b = entry->size;
+        *p_addr = entry->phys_addr;
+        hero_session_record(mmap_id & ~MMAP_CACHED_FLAG, entry->size, entry->phys_addr, 0);
+        return 0;
+    }
+#endif
+
+    chunk.mmap_id = mmap_id & ~MMAP_CACHED_FLAG;
     int err = ioctl(device_fd, IOCTL_MEM_INFOS, &chunk);
     pr_trace("Lookup %llx %llx\n", chunk.size, chunk.result_phys_addr);
     if (err) {
@@ -33,6 +130,7 @@ int driver_lookup_mem(int device_fd, int mmap_id, size_t *size_b, uintptr_t *p_a
     }
     *size_b = chunk.size;
     *p_addr = chunk.result_phys_addr;
+    hero_session_record(mmap_id & ~MMAP_CACHED_FLAG, chunk.size, chunk.result_phys_addr, 0);
 
     return err;
 }
@@ -53,12 +151,93 @@ int driver_mmap(int device_fd, int mmap_id, size_t length,
 }
 
 int driver_lookup_mmap(int device_fd, int mmap_id, void **res) {
+    struct hero_session_region *region;
     size_t phy_len = 0;
     uintptr_t phy_base = NULL;
+    int err;
 
     driver_lookup_mem(device_fd, mmap_id, &phy_len, &phy_base);
 
-    return driver_mmap(device_fd, mmap_id, phy_len, res);
+    // Map where herod did, its heaps and mailboxes hold pointers in the regions
+    region = hero_dev_attached ? hero_session_region(mmap_id & ~MMAP_CACHED_FLAG) : NULL;
+    if (region && region->v_addr) {
+        *res = mmap((void *)region->v_addr, phy_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED_NOREPLACE,
+                    device_fd, mmap_id * getpagesize());
+        if (*res == (void *)region->v_addr)
+            return 0;
+        // Something of this process sits there (kernels before 4.17 take the
+        // address as a hint instead), initialize the device cold instead
+        if (*res != MAP_FAILED || errno == EEXIST) {
+            pr_warn("Can't map %x at %lx as herod did, initializing the device\n", mmap_id, region->v_addr);
+            if (*res != MAP_FAILED)
+                munmap(*res, phy_len);
+            hero_session_fallback();
+        } else {
+            pr_error("Can't map %x at %lx: %s\n", mmap_id, region->v_addr, strerror(errno));
+            *res = NULL;
+            return -EIO;
+        }
+    }
+
+    err = driver_mmap(device_fd, mmap_id, phy_len, res);
+    if (!err)
+        hero_session_record(mmap_id & ~MMAP_CACHED_FLAG, 0, 0, (uintptr_t)*res);
+    return err;
+}
+
+// Regions mapped on first use, see driver_lazy_mmap
+#define DRIVER_MAX_LAZY 16
+static struct {
+    int mmap_id;
+    volatile void **res;
+} driver_lazy[DRIVER_MAX_LAZY];
+
+// Defer the mapping of a region to its first driver_lazy_get, *res is NULL until then
+int driver_lazy_mmap(int device_fd, int mmap_id, volatile void **res) {
+    struct hero_session_region *region;
+
+    *res = NULL;
+    // Take herod's address now, a collision must fall back before the heaps are adopted
+    region = hero_dev_attached ? hero_session_region(mmap_id & ~MMAP_CACHED_FLAG) : NULL;
+    if (region && region->v_addr)
+        return driver_lookup_mmap(device_fd, mmap_id, (void **)res);
+    for (int i = 0; i < DRIVER_MAX_LAZY; i++) {
+        if (!driver_lazy[i].res) {
+            driver_lazy[i].mmap_id = mmap_id;
+            driver_lazy[i].res = res;
+            return 0;
+        }
+    }
+    return driver_lookup_mmap(device_fd, mmap_id, (void **)res);
+}
+
+// Get a region registered with driver_lazy_mmap, mapping it if needed
+volatile void *driver_lazy_get(volatile void **res) {
+    for (int i = 0; i < DRIVER_MAX_LAZY && !*res; i++) {
+        if (driver_lazy[i].res == res) {
+            driver_lazy[i].res = NULL;
+            if (driver_lookup_mmap(device_fd, driver_lazy[i].mmap_id, (void **)res))
+                pr_error("Can't map region %d\n", driver_lazy[i].mmap_id);
+        }
+    }
+    return *res;
+}
+
+// Append a region mapped with driver_lookup_mmap to the list returned by
+// hero_dev_get_regions, size_b overrides the driver size if not 0
+int driver_add_region(HeroRegion *regions, int n, int max_regions, const char *name, int mmap_id,
+                      volatile void *v_addr, size_t size_b, unsigned flags) {
+    size_t size;
+    uintptr_t p_addr;
+
+    if (n >= max_regions || !v_addr || driver_lookup_mem(device_fd, mmap_id, &size, &p_addr))
+        return n;
+    regions[n].name = name;
+    regions[n].v_addr = v_addr;
+    regions[n].p_addr = p_addr;
+    regions[n].size = size_b ? size_b : size;
+    regions[n].flags = flags | ((mmap_id & MMAP_CACHED_FLAG) ? HERO_REGION_CACHED : 0);
+    return n + 1;
 }
 
 uintptr_t hero_host_l3_malloc(HeroDev *dev, unsigned size_b, uintptr_t *p_addr) {
@@ -78,7 +257,7 @@ uintptr_t hero_host_l3_malloc(HeroDev *dev, unsigned size_b, uintptr_t *p_addr)
 
     *p_addr = chunk.result_phys_addr;
 
-    if(driver_mmap(device_fd, DMA_BUFS_MMAP_ID, size_b, &user_virt_address)) {
+    if(driver_mmap(device_fd, driver_cached_mmap_id(DMA_BUFS_MMAP_ID), size_b, &user_virt_address)) {
         pr_error("mmap error!\n");
     }
 
@@ -87,6 +266,79 @@ uintptr_t hero_host_l3_malloc(HeroDev *dev, unsigned size_b, uintptr_t *p_addr)
     return user_virt_address;
 }
 
+int hero_dev_sync(HeroDev *dev, uintptr_t p_addr, size_t size_b, HeroSyncDir dir) {
+    struct driver_ioctl_arg chunk;
+    int err;
+
+    fence();
+#ifdef HOST_COHERENT_IO
+    // The host caches snoop the device accesses
+    return 0;
+#else
+    if (!driver_map_cached() || !size_b)
+        return 0;
+    chunk.size = size_b;
+    chunk.result_phys_addr = p_addr;
+    err = ioctl(device_fd, (dir == HERO_SYNC_FOR_DEVICE) ? IOCTL_SYNC_FOR_DEVICE : IOCTL_SYNC_FOR_CPU, &chunk);
+    if (err)
+        pr_error("%s failed on %lx (%lx)\n", __func__, p_addr, size_b);
+    return err;
+#endif
+}
+
+#ifdef IOCTL_WAIT_EVENT
+int hero_dev_wait_event(HeroDev *dev, uint64_t *seq, unsigned timeout_ms) {
+    struct driver_ioctl_arg chunk;
+    int err;
+
+    chunk.size = timeout_ms;
+    chunk.result_phys_addr = *seq;
+    err = ioctl(device_fd, IOCTL_WAIT_EVENT, &chunk);
+    if (err)
+        return -errno;
+    *seq = chunk.result_phys_addr;
+    return 0;
+}
+#endif
+
+#ifdef IOCTL_CTX_ACQUIRE
+int hero_dev_acquire(HeroDev *dev, unsigned weight) {
+    struct driver_ioctl_arg chunk = {0};
+
+    if (!driver_has_ctx || (driver_ctx_held && !weight))
+        return 0;
+    chunk.size = weight;
+    if (ioctl(device_fd, IOCTL_CTX_ACQUIRE, &chunk))
+        return -errno;
+    driver_ctx_held = 1;
+    // Another process held the device in between
+    return chunk.result_phys_addr ? 1 : 0;
+}
+
+int hero_dev_release(HeroDev *dev) {
+    struct driver_ioctl_arg chunk = {0};
+
+    if (!driver_has_ctx || !driver_ctx_held)
+        return 0;
+    driver_ctx_held = 0;
+    if (ioctl(device_fd, IOCTL_CTX_RELEASE, &chunk))
+        return -errno;
+    return 0;
+}
+
+int hero_dev_get_stats(HeroDev *dev, HeroDevStats *stats) {
+    _Static_assert(sizeof(HeroDevStats) == sizeof(struct card_ctx_stats), "HeroDevStats mismatch");
+    struct driver_ioctl_arg chunk = {0};
+
+    if (!driver_has_ctx)
+        return -ENOSYS;
+    chunk.result_virt_addr = (uintptr_t)stats;
+    if (ioctl(device_fd, IOCTL_CTX_INFO, &chunk))
+        return -errno;
+    return 0;
+}
+#endif
+
 #ifdef DEVICE_IOMMU
 uintptr_t hero_iommu_map_virt(HeroDev *dev, unsigned size_b, void *v_addr) {
     struct driver_ioctl_arg chunk;
@@ -12,9 +12,14 @@
 #include "libhero/hero_api.h"
 #include "libhero/io.h"
 #include "libhero/ringbuf.h"
+#include "libhero/utils.h"
+
+#include "allocators.h"
+#include "hero_session.h"
 
 int libhero_log_level = LOG_MAX;
 int device_fd;
+const char *hero_dev_node;
 
 ///////////////////////
 ///// TIMESTAMPS //////
@@ -88,14 +93,207 @@ uintptr_t l2_heap_start_phy, l2_heap_start_virt;
 size_t l2_heap_size;
 uintptr_t l3_heap_start_phy, l3_heap_start_virt;
 size_t l3_heap_size;
+// Slice of the heaps of this process (IOCTL_CTX_INFO), all of them with 1 slot
+unsigned hero_dev_slot, hero_dev_n_slots = 1;
+int hero_dev_started;
+
+void hero_dev_heap_slice(uintptr_t *start_phy, uintptr_t *start_virt, size_t *size) {
+    size_t slice;
+
+    // herod initialized the heaps of its own slot, the clients adopt them
+    if (hero_dev_n_slots <= 1 || hero_dev_attached)
+        return;
+    slice = (*size / hero_dev_n_slots) & ~(size_t)(O1HEAP_ALIGNMENT - 1);
+    *start_phy += hero_dev_slot * slice;
+    *start_virt += hero_dev_slot * slice;
+    *size = slice;
+    pr_debug("Heap slice %u/%u at %lx size %lx\n", hero_dev_slot, hero_dev_n_slots, *start_phy, *size);
+}
+
+//////////////////////////////
+///// CACHE COHERENCE   //////
+//////////////////////////////
+
+struct hero_cache_stats hero_cache_stats;
+
+// Shared buffers, host_dirty is set when the host may hold lines to clean
+static struct {
+    uintptr_t p_addr;
+    unsigned size;
+    int host_dirty;
+} hero_cache_bufs[HERO_CACHE_MAX_BUFS];
+static int hero_cache_num_bufs;
+
+static inline void hero_cache_mbox_fence() {
+#ifndef HOST_COHERENT_IO
+    fence();
+    hero_cache_stats.fences++;
+#endif
+}
+
+static int hero_cache_lookup(uintptr_t p_addr) {
+    for (int i = 0; i < hero_cache_num_bufs; i++)
+        if (hero_cache_bufs[i].p_addr == p_addr)
+            return i;
+    return -1;
+}
+
+int hero_cache_share(HeroDev *dev, const DataDesc *desc) {
+    int i = hero_cache_lookup((uintptr_t)desc->ptr_l3_p);
+    if (i < 0) {
+        if (hero_cache_num_bufs >= HERO_CACHE_MAX_BUFS) {
+            pr_warn("Too many shared buffers, %p is synced at every offload\n", desc->ptr_l3_p);
+            return -ENOSPC;
+        }
+        i = hero_cache_num_bufs++;
+    }
+    hero_cache_bufs[i].p_addr = (uintptr_t)desc->ptr_l3_p;
+    hero_cache_bufs[i].size = desc->size;
+    hero_cache_bufs[i].host_dirty = 1;
+    return 0;
+}
+
+void hero_cache_unshare(HeroDev *dev, const DataDesc *desc) {
+    int i = hero_cache_lookup((uintptr_t)desc->ptr_l3_p);
+    if (i < 0)
+        return;
+    hero_cache_bufs[i] = hero_cache_bufs[--hero_cache_num_bufs];
+}
+
+void hero_cache_host_wrote(HeroDev *dev, const DataDesc *desc) {
+    int i = hero_cache_lookup((uintptr_t)desc->ptr_l3_p);
+    if (i >= 0)
+        hero_cache_bufs[i].host_dirty = 1;
+}
+
+int hero_cache_offload_enter(HeroDev *dev, const DataDesc *descs, unsigned n_descs) {
+    int err = 0;
+
+    for (unsigned d = 0; d < n_descs; d++) {
+        const DataDesc *desc = &descs[d];
+        int i = hero_cache_lookup((uintptr_t)desc->ptr_l3_p);
+        // Untracked buffers may have been written by the host
+#ifndef HOST_COHERENT_IO
+        if (desc->cache_ctrl != 1 && (i < 0 || hero_cache_bufs[i].host_dirty)) {
+            err |= hero_dev_sync(dev, (uintptr_t)desc->ptr_l3_p, desc->size, HERO_SYNC_FOR_DEVICE);
+            hero_cache_stats.clean_bytes += desc->size;
+        } else
+#endif
+        {
+            hero_cache_stats.clean_avoided_bytes += desc->size;
+        }
+        if (i >= 0)
+            hero_cache_bufs[i].host_dirty = 0;
+    }
+    hero_cache_stats.fences++;
+    fence();
+    return err;
+}
+
+int hero_cache_offload_exit(HeroDev *dev, const DataDesc *descs, unsigned n_descs) {
+    int err = 0;
+
+    for (unsigned d = 0; d < n_descs; d++) {
+        const DataDesc *desc = &descs[d];
+        // The device only read the in buffers
+#ifndef HOST_COHERENT_IO
+        if (desc->cache_ctrl != 1 && desc->type != in) {
+            err |= hero_dev_sync(dev, (uintptr_t)desc->ptr_l3_p, desc->size, HERO_SYNC_FOR_CPU);
+            hero_cache_stats.inval_bytes += desc->size;
+        } else
+#endif
+        {
+            hero_cache_stats.inval_avoided_bytes += desc->size;
+        }
+    }
+    // The offload completed, let the other processes launch. The mailbox can't
+    // tell MBOX_DEVICE_DONE from a payload word, hence here.
+    err |= hero_dev_release(dev);
+    return err;
+}
+
+void hero_cache_print_stats() {
+    printf("cache: clean %lu B (avoided %lu B) inval %lu B (avoided %lu B) fences %lu\n",
+           hero_cache_stats.clean_bytes, hero_cache_stats.clean_avoided_bytes, hero_cache_stats.inval_bytes,
+           hero_cache_stats.inval_avoided_bytes, hero_cache_stats.fences);
+}
 
 //////////////////////////////
 ///// MAILBOXES         //////
 //////////////////////////////
 
+// Layout of the mirror buffer: head, then the data on its own cache line
+#define HERO_MBOX_MIRROR_DATA_OFFSET 64
+
+// Address of a host DMA buffer as seen by the device. The driver gives the
+// buffers in the device view of the host memory (through the PCIe window on
+// PCIe hosts), they still have to be mapped in the device IOMMU or TLBs, and
+// the device only has 32-bit pointers. 0 if the device can't reach it.
+static uintptr_t hero_dev_host_addr(HeroDev *dev, void *v_addr, uintptr_t p_addr, unsigned size_b) {
+#ifdef DEVICE_IOMMU
+    p_addr = hero_iommu_map_virt(dev, size_b, v_addr);
+#else
+    if (hero_iommu_map_virt_to_phys(dev, size_b, v_addr, p_addr))
+        p_addr = 0;
+#endif
+    return (p_addr > UINT32_MAX) ? 0 : p_addr;
+}
+
+static int hero_dev_mirror_a2h_mbox(HeroDev *dev) {
+    volatile struct ring_buf *rb = dev->mboxes.a2h_mbox;
+    struct ring_buf_mirror *m;
+    uintptr_t mirror_p, mirror_dev;
+    unsigned mirror_size;
+    uint8_t *mirror;
+
+    // The DMA buffers can't be freed before closing the driver, allocate it last
+    m = malloc(sizeof(*m));
+    if (!m) {
+        pr_warn("Can't mirror the a2h mailbox, using the device ring\n");
+        return -ENOMEM;
+    }
+    mirror_size = HERO_MBOX_MIRROR_DATA_OFFSET + rb->size * rb->element_size;
+    mirror = (uint8_t *)hero_host_l3_malloc(dev, mirror_size, &mirror_p);
+    if (!mirror) {
+        pr_warn("Can't mirror the a2h mailbox, using the device ring\n");
+        free(m);
+        return -ENOMEM;
+    }
+    // The buffer is released with the driver file
+    mirror_dev = hero_dev_host_addr(dev, mirror, mirror_p, mirror_size);
+    if (!mirror_dev) {
+        pr_warn("The device can't reach the a2h mailbox mirror (%lx), using the device ring\n", mirror_p);
+        free(m);
+        return -EFAULT;
+    }
+
+    m->head = (volatile uint32_t *)mirror;
+    *m->head = rb->head;
+    m->tail = rb->tail;
+    m->size = rb->size;
+    m->element_size = rb->element_size;
+    m->data = mirror + HERO_MBOX_MIRROR_DATA_OFFSET;
+    m->rb = rb;
+
+    hero_dev_l2_free(dev, rb->data_v, rb->data_p);
+    rb->data_v = (uintptr_t)m->data;
+    rb->data_p = mirror_dev + HERO_MBOX_MIRROR_DATA_OFFSET;
+    fence();
+    rb->head_mirror_p = mirror_dev;
+    dev->mboxes.a2h_mirror = m;
+    pr_debug("a2h mailbox mirrored at %p (%lx, %lx on the device)\n", mirror, mirror_p, mirror_dev);
+    return 0;
+}
+
 int hero_dev_alloc_mboxes(HeroDev *dev) {
     pr_trace("%s default\n", __func__);
 
+    // Use the mailboxes herod allocated
+    if (hero_dev_attached) {
+        dev->mboxes = hero_session.mboxes;
+        return 0;
+    }
+
     // Alloc ringbuf structure
     dev->mboxes.h2a_mbox = hero_dev_l2_malloc(dev, sizeof(struct ring_buf), &dev->mboxes.h2a_mbox_mem.p_addr);
     // Alloc data array for ringbuf
@@ -117,34 +315,53 @@ int hero_dev_alloc_mboxes(HeroDev *dev) {
     rb_init(dev->mboxes.h2a_mbox, 16, sizeof(uint32_t));
     rb_init(dev->mboxes.rb_mbox, 16, sizeof(uint32_t));
 
+    // On PCIe boards, move the a2h data and head to host memory so that the
+    // host polls its DRAM instead of the BAR
+    dev->mboxes.a2h_mirror = NULL;
+    if (getenv("HERO_MBOX_MIRROR") && strtol(getenv("HERO_MBOX_MIRROR"), NULL, 10))
+        hero_dev_mirror_a2h_mbox(dev);
+
     return 0;
 }
 
 int hero_dev_free_mboxes(HeroDev *dev) {
     pr_trace("%s default\n", __func__);
 
-    hero_dev_l2_free(dev, dev->mboxes.h2a_mbox->data_v, NULL);
-    hero_dev_l2_free(dev, dev->mboxes.h2a_mbox, NULL);
+    // They belong to herod
+    if (hero_dev_attached)
+        return 0;
+
+    hero_dev_l2_free(dev, dev->mboxes.h2a_mbox->data_v, dev->mboxes.h2a_mbox->data_p);
+    hero_dev_l2_free(dev, (uintptr_t)dev->mboxes.h2a_mbox, dev->mboxes.h2a_mbox_mem.p_addr);
 
-    hero_dev_l2_free(dev, dev->mboxes.a2h_mbox->data_v, NULL);
-    hero_dev_l2_free(dev, dev->mboxes.a2h_mbox, NULL);
+    // The mirror lives in a DMA buffer, released with the driver file
+    if (dev->mboxes.a2h_mirror)
+        free(dev->mboxes.a2h_mirror);
+    else
+        hero_dev_l2_free(dev, dev->mboxes.a2h_mbox->data_v, dev->mboxes.a2h_mbox->data_p);
+    hero_dev_l2_free(dev, (uintptr_t)dev->mboxes.a2h_mbox, dev->mboxes.a2h_mbox_mem.p_addr);
 
-    hero_dev_l2_free(dev, dev->mboxes.rb_mbox->data_v, NULL);
-    hero_dev_l2_free(dev, dev->mboxes.rb_mbox, NULL);
+    hero_dev_l2_free(dev, dev->mboxes.rb_mbox->data_v, dev->mboxes.rb_mbox->data_p);
+    hero_dev_l2_free(dev, (uintptr_t)dev->mboxes.rb_mbox, dev->mboxes.rb_mbox_mem.p_addr);
 
     return 0;
 }
 
+__attribute__((weak)) int hero_dev_wait_event(HeroDev *dev, uint64_t *seq, unsigned timeout_ms) {
+    return -ENOSYS;
+}
+
 int hero_dev_mbox_read(const HeroDev *dev, uint32_t *buffer, size_t n_words) {
     pr_trace("%s default\n", __func__);
     int ret, retry = 0;
     while (n_words--) {
         do {
-        // If this region is cached and no cache coherency, need a fence
-#ifndef HOST_COHERENT_IO
-            asm volatile ("fence");
-#endif
-            ret = rb_host_get(dev->mboxes.a2h_mbox, &buffer[n_words]);
+            // The ring may be cached by the host, the PMAs decide on CVA6
+            hero_cache_mbox_fence();
+            if (dev->mboxes.a2h_mirror)
+                ret = rb_host_get_mirror(dev->mboxes.a2h_mirror, &buffer[n_words]);
+            else
+                ret = rb_host_get(dev->mboxes.a2h_mbox, &buffer[n_words]);
             if (ret) {
                 if (++retry == 100)
                     pr_warn("high retry on mbox read()\n");
@@ -159,14 +376,26 @@ int hero_dev_mbox_read(const HeroDev *dev, uint32_t *buffer, size_t n_words) {
     return 0;
 }
 
+// Called with the device held
+__attribute__((weak)) void hero_dev_restore(HeroDev *dev) {
+    if (hero_dev_started)
+        hero_dev_exe_start(dev);
+}
+
 int hero_dev_mbox_write(HeroDev *dev, uint32_t word) {
     pr_trace("%s default\n", __func__);
     int ret, retry = 0;
+    // The device is released at the end of every offload, take it back
+    ret = hero_dev_acquire(dev, 0);
+    if (ret < 0) {
+        pr_error("Can't acquire the device: %s\n", strerror(-ret));
+        return ret;
+    }
+    if (ret)
+        hero_dev_restore(dev);
     do {
-        // If this region is cached and no cache coherency, need a fence
-#ifndef HOST_COHERENT_IO
-            asm volatile ("fence");
-#endif
+        // The ring may be cached by the host, the PMAs decide on CVA6
+        hero_cache_mbox_fence();
         ret = rb_host_put(dev->mboxes.h2a_mbox, &word);
         if (ret) {
             if (++retry == 100)
@@ -204,6 +433,22 @@ __attribute__((weak)) void hero_dev_reset(HeroDev *dev, unsigned full) {
     pr_warn("%s unimplemented\n", __func__);
 }
 
+__attribute__((weak)) int hero_dev_get_regions(HeroDev *dev, HeroRegion *regions, int max_regions) {
+    HeroSubDev_t *lists[] = {dev->local_mems, dev->global_mems};
+    int n = 0;
+
+    for (int l = 0; l < 2; l++)
+        for (HeroSubDev_t *m = lists[l]; m && n < max_regions; m = m->next) {
+            regions[n].name = m->alias;
+            regions[n].v_addr = m->v_addr;
+            regions[n].p_addr = m->p_addr;
+            regions[n].size = m->size;
+            regions[n].flags = 0;
+            n++;
+        }
+    return n;
+}
+
 //////////////////////////////
 ///// EXECUTION         //////
 //////////////////////////////
@@ -227,6 +472,19 @@ int hero_dev_exe_wait(const HeroDev *dev, int timeout_s) {
     return 0;
 }
 
+// Without arbitration in the driver, the processes share the device as before
+__attribute__((weak)) int hero_dev_acquire(HeroDev *dev, unsigned weight) {
+    return 0;
+}
+
+__attribute__((weak)) int hero_dev_release(HeroDev *dev) {
+    return 0;
+}
+
+__attribute__((weak)) int hero_dev_get_stats(HeroDev *dev, HeroDevStats *stats) {
+    return -ENOSYS;
+}
+
 //////////////////////////////
 ///// MEMORY MANAGEMENT //////
 //////////////////////////////
@@ -241,7 +499,11 @@ int hero_dev_l2_init(HeroDev *dev) {
             return -1;
         }
         pr_trace("Initializing o1heap at %p (%p) size %x\n", (void *) l2_heap_start_phy, (void *) l2_heap_start_virt, l2_heap_size);
-        l2_heap_manager = o1heapInit((void *) l2_heap_start_virt, l2_heap_size, NULL, NULL);
+        // herod initialized the heap, o1heap keeps its instance at the arena base
+        if (hero_dev_attached)
+            l2_heap_manager = (struct O1HeapInstance *)l2_heap_start_virt;
+        else
+            l2_heap_manager = o1heapInit((void *) l2_heap_start_virt, l2_heap_size, NULL, NULL);
         if (l2_heap_manager == NULL) {
             pr_error("Failed to initialize L2 heap manager.\n");
             return -ENOMEM;
@@ -263,7 +525,11 @@ int hero_dev_l3_init(HeroDev *dev) {
             return -1;
         }
         pr_trace("Initializing o1heap at %p (%p) size %lx\n", (void *)(l3_heap_start_phy), (void *)(l3_heap_start_virt), l3_heap_size);
-        l3_heap_manager = o1heapInit((void *)(l3_heap_start_virt), l3_heap_size, NULL, NULL);
+        // herod initialized the heap, o1heap keeps its instance at the arena base
+        if (hero_dev_attached)
+            l3_heap_manager = (struct O1HeapInstance *)l3_heap_start_virt;
+        else
+            l3_heap_manager = o1heapInit((void *)(l3_heap_start_virt), l3_heap_size, NULL, NULL);
         if (l3_heap_manager == NULL) {
             pr_error("Failed to initialize L3 heap manager.\n");
             return -ENOMEM;
@@ -292,12 +558,30 @@ uintptr_t hero_dev_l3_malloc(HeroDev *dev, unsigned size_b, uintptr_t *p_addr) {
     return result;
 }
 
+__attribute__((weak)) void hero_dev_reset_heaps(HeroDev *dev) {
+    pr_trace("%s default\n", __func__);
+    l2_heap_manager = NULL;
+    l3_heap_manager = NULL;
+    hero_dev_l2_init(dev);
+    hero_dev_l3_init(dev);
+}
+
 void hero_dev_l2_free(HeroDev *dev, uintptr_t v_addr, uintptr_t p_addr) {
     pr_trace("%p - %p\n", l2_heap_manager, v_addr);
     fflush(stdout);
     o1heapFree(l2_heap_manager, v_addr);
 }
 
+__attribute__((weak)) uintptr_t hero_dev_l2_malloc_port(HeroDev *dev, unsigned size_b, uintptr_t *p_addr, int port) {
+    pr_trace("%s default\n", __func__);
+    return hero_dev_l2_malloc(dev, size_b, p_addr);
+}
+
+__attribute__((weak)) void hero_dev_l2_free_port(HeroDev *dev, uintptr_t v_addr, uintptr_t p_addr) {
+    pr_trace("%s default\n", __func__);
+    hero_dev_l2_free(dev, v_addr, p_addr);
+}
+
 void hero_dev_l3_free(HeroDev *dev, uintptr_t v_addr, uintptr_t p_addr) {
     pr_trace("%p - %p\n", l3_heap_manager, v_addr);
     o1heapFree(l3_heap_manager, v_addr);
@@ -314,12 +598,20 @@ __attribute__((weak)) uintptr_t hero_host_l3_malloc(HeroDev *dev, unsigned size_
     return NULL;
 }
 
+__attribute__((weak)) int hero_dev_sync(HeroDev *dev, uintptr_t p_addr, size_t size_b, HeroSyncDir dir) {
+    pr_trace("%s default\n", __func__);
+    // Uncached mappings only need the accesses to be ordered
+    fence();
+    return 0;
+}
+
 __attribute__((weak)) uintptr_t hero_iommu_map_virt(HeroDev *dev, unsigned size_b, void *v_addr) {
     pr_warn("%s unimplemented\n", __func__);
     return 0;
 }
 
+// Without a translation the device can't be assumed to reach the buffer
 __attribute__((weak)) int hero_iommu_map_virt_to_phys(HeroDev *dev, unsigned size_b, void *v_addr, uintptr_t p_addr) {
     pr_warn("%s unimplemented\n", __func__);
-    return 0;
+    return -ENOSYS;
 }
@@ -0,0 +1,381 @@
+// Copyright 2024 ETH Zurich and University of Bologna.
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: Apache-2.0
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// The application may also link a libhero_<platform>, which defines libhero_log_level.
+// The scheduler logs use their own level, forwarded to the libraries it loads
+#define libhero_log_level hero_sched_log_level
+#include "libhero/debug.h"
+#include "libhero/hero_api.h"
+#include "libhero/hero_sched.h"
+
+int hero_sched_log_level = LOG_MAX;
+
+static HeroSchedDev sched_devs[HERO_SCHED_MAX_DEVICES];
+static int sched_num_devs;
+static HeroSchedPolicy sched_policy = HERO_SCHED_LEAST_LOADED;
+static pthread_mutex_t sched_lock = PTHREAD_MUTEX_INITIALIZER;
+// Serializes hero_sched_add_device and hero_sched_fini, held across the slow device init
+static pthread_mutex_t sched_add_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned sched_rr_next;
+
+// Last device used per affinity key (direct mapped)
+#define SCHED_AFFINITY_SLOTS 64
+static struct {
+    uint32_t key;
+    int device;
+} sched_affinity[SCHED_AFFINITY_SLOTS];
+// An affine device is skipped if its load is above this factor of the least loaded one
+#define SCHED_AFFINITY_SLACK 2
+
+//////////////////////////////
+///// WORKERS           //////
+//////////////////////////////
+
+static void *sched_worker(void *arg) {
+    HeroSchedDev *sdev = arg;
+    HeroSchedQueue *q = &sdev->queue;
+    int device = sdev - sched_devs;
+
+    pthread_mutex_lock(&q->lock);
+    while (1) {
+        while (!q->head && !q->stop)
+            pthread_cond_wait(&q->cond, &q->lock);
+        if (!q->head)
+            break;
+        HeroSchedJob *job = q->head;
+        pthread_mutex_unlock(&q->lock);
+
+        int err = job->fn(device, &sdev->dev, &sdev->ops, job->arg);
+
+        pthread_mutex_lock(&q->lock);
+        // Only dequeue now so that the load accounts for the running job
+        q->head = job->next;
+        if (!q->head)
+            q->tail = NULL;
+        q->pending--;
+        q->load -= job->cost;
+        q->completed++;
+        if (err)
+            q->last_err = err;
+        pthread_cond_broadcast(&q->cond);
+        free(job);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return NULL;
+}
+
+//////////////////////////////
+///// DEVICES           //////
+//////////////////////////////
+
+// Devices may be added concurrently
+static int sched_count() {
+    int n;
+    pthread_mutex_lock(&sched_lock);
+    n = sched_num_devs;
+    pthread_mutex_unlock(&sched_lock);
+    return n;
+}
+
+#define SCHED_DLSYM(sdev, field, sym)                                          \
+    ({                                                                         \
+        *(void **)&(sdev)->ops.field = dlsym((sdev)->lib, sym);                \
+        if (!(sdev)->ops.field)                                                \
+            pr_error("%s missing in libhero_%s\n", sym, (sdev)->platform);     \
+        (sdev)->ops.field != NULL;                                             \
+    })
+
+int hero_sched_add_device(const char *platform, const char *node) {
+    char lib_name[64];
+    HeroSchedDev *sdev;
+    const char **lib_node;
+    int *lib_log_level;
+    int err, device;
+
+    // Devices are added one at a time. The slot past sched_num_devs is not visible to the
+    // scheduler yet, so sched_lock is only taken to publish it once the device is ready
+    pthread_mutex_lock(&sched_add_lock);
+    if (sched_num_devs >= HERO_SCHED_MAX_DEVICES) {
+        pr_error("Too many devices\n");
+        err = -ENOSPC;
+        goto end;
+    }
+    device = sched_num_devs;
+    sdev = &sched_devs[device];
+    memset(sdev, 0, sizeof(*sdev));
+
+    strncpy(sdev->platform, platform, sizeof(sdev->platform) - 1);
+    if (node)
+        strncpy(sdev->node, node, sizeof(sdev->node) - 1);
+
+    // A new link-map namespace gives this device its own copy of the library globals
+    snprintf(lib_name, sizeof(lib_name), "libhero_%s.so", platform);
+    sdev->lib = dlmopen(LM_ID_NEWLM, lib_name, RTLD_NOW | RTLD_LOCAL);
+    if (!sdev->lib) {
+        pr_error("Can't load %s: %s\n", lib_name, dlerror());
+        err = -ENOENT;
+        goto end;
+    }
+
+    if (!(SCHED_DLSYM(sdev, mmap, "hero_dev_mmap") && SCHED_DLSYM(sdev, munmap, "hero_dev_munmap") &&
+          SCHED_DLSYM(sdev, init, "hero_dev_init") && SCHED_DLSYM(sdev, reset, "hero_dev_reset") &&
+          SCHED_DLSYM(sdev, exe_start, "hero_dev_exe_start") &&
+          SCHED_DLSYM(sdev, mbox_read, "hero_dev_mbox_read") &&
+          SCHED_DLSYM(sdev, mbox_write, "hero_dev_mbox_write") &&
+          SCHED_DLSYM(sdev, l2_malloc, "hero_dev_l2_malloc") &&
+          SCHED_DLSYM(sdev, l3_malloc, "hero_dev_l3_malloc") && SCHED_DLSYM(sdev, l3_free, "hero_dev_l3_free"))) {
+        err = -ENOSYS;
+        goto error_lib;
+    }
+
+    // Forward the device node and the log level to this copy of the library
+    lib_node = dlsym(sdev->lib, "hero_dev_node");
+    if (lib_node && node)
+        *lib_node = sdev->node;
+    lib_log_level = dlsym(sdev->lib, "libhero_log_level");
+    if (lib_log_level)
+        *lib_log_level = hero_sched_log_level;
+
+    snprintf(sdev->dev.alias, sizeof(sdev->dev.alias), "%s%d", platform, device);
+    err = sdev->ops.mmap(&sdev->dev);
+    if (err) {
+        pr_error("Can't map %s\n", sdev->dev.alias);
+        goto error_lib;
+    }
+    // The jobs get a device ready to run, as after hero_dev_init in a single device application
+    err = sdev->ops.init(&sdev->dev);
+    if (err) {
+        pr_error("Can't initialize %s\n", sdev->dev.alias);
+        goto error_mmap;
+    }
+
+    pthread_mutex_init(&sdev->queue.lock, NULL);
+    pthread_cond_init(&sdev->queue.cond, NULL);
+    err = pthread_create(&sdev->queue.worker, NULL, sched_worker, sdev);
+    if (err) {
+        err = -err;
+        goto error_mmap;
+    }
+
+    pthread_mutex_lock(&sched_lock);
+    sched_num_devs++;
+    pthread_mutex_unlock(&sched_lock);
+    err = device;
+    pr_info("Device %d: %s on %s\n", device, platform, node ? node : "default node");
+    goto end;
+
+error_mmap:
+    sdev->ops.munmap(&sdev->dev);
+error_lib:
+    dlclose(sdev->lib);
+    sdev->lib = NULL;
+end:
+    pthread_mutex_unlock(&sched_add_lock);
+    return err;
+}
+
+int hero_sched_init_from_env() {
+    char *env, *list, *save, *tok;
+    int err = 0;
+
+    env = getenv("LIBHERO_LOG");
+    if (env)
+        hero_sched_log_level = strtol(env, NULL, 10);
+
+    env = getenv("HERO_SCHED_POLICY");
+    if (env) {
+        if (!strcmp(env, "affinity"))
+            hero_sched_set_policy(HERO_SCHED_AFFINITY);
+        else if (!strcmp(env, "round_robin"))
+            hero_sched_set_policy(HERO_SCHED_ROUND_ROBIN);
+        else
+            hero_sched_set_policy(HERO_SCHED_LEAST_LOADED);
+    }
+
+    env = getenv("HERO_DEVICES");
+    if (!env) {
+        pr_error("HERO_DEVICES is not set\n");
+        return -EINVAL;
+    }
+
+    list = strdup(env);
+    for (tok = strtok_r(list, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        char *node = strchr(tok, ':');
+        if (node)
+            *node++ = '\0';
+        err = hero_sched_add_device(tok, node);
+        if (err < 0)
+            break;
+    }
+    free(list);
+
+    return (err < 0) ? err : sched_count();
+}
+
+int hero_sched_num_devices() {
+    return sched_count();
+}
+
+void hero_sched_set_policy(HeroSchedPolicy policy) {
+    sched_policy = policy;
+}
+
+HeroSchedDev *hero_sched_get_device(int device) {
+    if (device < 0 || device >= sched_count())
+        return NULL;
+    return &sched_devs[device];
+}
+
+//////////////////////////////
+///// SCHEDULING        //////
+//////////////////////////////
+
+static uint64_t sched_load(int device) {
+    HeroSchedQueue *q = &sched_devs[device].queue;
+    uint64_t load;
+    pthread_mutex_lock(&q->lock);
+    load = q->load;
+    pthread_mutex_unlock(&q->lock);
+    return load;
+}
+
+static int sched_least_loaded(uint64_t *min_load) {
+    int best = 0;
+    *min_load = UINT64_MAX;
+    for (int i = 0; i < sched_num_devs; i++) {
+        uint64_t load = sched_load(i);
+        if (load < *min_load) {
+            *min_load = load;
+            best = i;
+        }
+    }
+    return best;
+}
+
+int hero_sched_select(int device, uint32_t affinity, uint64_t cost) {
+    uint64_t min_load;
+    int best;
+
+    pthread_mutex_lock(&sched_lock);
+    if (!sched_num_devs || (device != HERO_SCHED_AUTO && (device < 0 || device >= sched_num_devs))) {
+        pthread_mutex_unlock(&sched_lock);
+        return -ENODEV;
+    }
+    if (device != HERO_SCHED_AUTO) {
+        pthread_mutex_unlock(&sched_lock);
+        return device;
+    }
+
+    switch (sched_policy) {
+    case HERO_SCHED_ROUND_ROBIN:
+        best = sched_rr_next++ % sched_num_devs;
+        break;
+    case HERO_SCHED_AFFINITY:
+        best = sched_least_loaded(&min_load);
+        if (affinity) {
+            unsigned slot = affinity % SCHED_AFFINITY_SLOTS;
+            int prev = sched_affinity[slot].device;
+            // Stay on the previous device unless the others are much less busy
+            if (sched_affinity[slot].key == affinity &&
+                sched_load(prev) <= SCHED_AFFINITY_SLACK * (min_load + cost))
+                best = prev;
+            sched_affinity[slot].key = affinity;
+            sched_affinity[slot].device = best;
+        }
+        break;
+    case HERO_SCHED_LEAST_LOADED:
+    default:
+        best = sched_least_loaded(&min_load);
+        break;
+    }
+    pthread_mutex_unlock(&sched_lock);
+
+    pr_trace("Selected device %d (cost %lu)\n", best, cost);
+    return best;
+}
+
+int hero_sched_submit(int device, uint32_t affinity, uint64_t cost, hero_sched_fn fn, void *arg) {
+    HeroSchedJob *job;
+    HeroSchedQueue *q;
+
+    device = hero_sched_select(device, affinity, cost);
+    if (device < 0)
+        return device;
+
+    job = malloc(sizeof(*job));
+    if (!job)
+        return -ENOMEM;
+    job->fn = fn;
+    job->arg = arg;
+    // Unknown costs still count so that the queue length is balanced
+    job->cost = cost ? cost : 1;
+    job->next = NULL;
+
+    q = &sched_devs[device].queue;
+    pthread_mutex_lock(&q->lock);
+    if (q->tail)
+        q->tail->next = job;
+    else
+        q->head = job;
+    q->tail = job;
+    q->pending++;
+    q->load += job->cost;
+    pthread_cond_broadcast(&q->cond);
+    pthread_mutex_unlock(&q->lock);
+
+    return device;
+}
+
+int hero_sched_wait(int device) {
+    int num_devs = sched_count();
+    int err = 0;
+
+    for (int i = 0; i < num_devs; i++) {
+        HeroSchedQueue *q = &sched_devs[i].queue;
+        if (device != HERO_SCHED_AUTO && device != i)
+            continue;
+        pthread_mutex_lock(&q->lock);
+        while (q->pending)
+            pthread_cond_wait(&q->cond, &q->lock);
+        if (q->last_err)
+            err = q->last_err;
+        q->last_err = 0;
+        pthread_mutex_unlock(&q->lock);
+    }
+    return err;
+}
+
+void hero_sched_fini() {
+    int num_devs;
+
+    // Hide the devices from the scheduler before stopping them
+    pthread_mutex_lock(&sched_add_lock);
+    pthread_mutex_lock(&sched_lock);
+    num_devs = sched_num_devs;
+    sched_num_devs = 0;
+    pthread_mutex_unlock(&sched_lock);
+
+    for (int i = 0; i < num_devs; i++) {
+        HeroSchedDev *sdev = &sched_devs[i];
+        pthread_mutex_lock(&sdev->queue.lock);
+        sdev->queue.stop = 1;
+        pthread_cond_broadcast(&sdev->queue.cond);
+        pthread_mutex_unlock(&sdev->queue.lock);
+        pthread_join(sdev->queue.worker, NULL);
+        sdev->ops.munmap(&sdev->dev);
+        dlclose(sdev->lib);
+        pthread_mutex_destroy(&sdev->queue.lock);
+        pthread_cond_destroy(&sdev->queue.cond);
+    }
+    pthread_mutex_unlock(&sched_add_lock);
+}
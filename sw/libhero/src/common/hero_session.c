@@ -0,0 +1,185 @@
+// Copyright 2024 ETH Zurich and University of Bologna.
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: Apache-2.0
+
+#include <errno.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "libhero/debug.h"
+#include "libhero/hero_api.h"
+
+#include "allocators.h"
+#include "hero_session.h"
+
+struct hero_session hero_session;
+int hero_dev_attached;
+// Kept open while attached, herod hands the device over when it is closed
+static int hero_session_fd = -1;
+
+//////////////////////////////
+///// REGIONS           //////
+//////////////////////////////
+
+struct hero_session_region *hero_session_region(int mmap_id) {
+    for (uint32_t i = 0; i < hero_session.n_regions; i++)
+        if (hero_session.regions[i].mmap_id == mmap_id)
+            return &hero_session.regions[i];
+    return NULL;
+}
+
+void hero_session_record(int mmap_id, uint64_t size, uint64_t p_addr, uint64_t v_addr) {
+    struct hero_session_region *region = hero_session_region(mmap_id);
+
+    if (!region) {
+        if (hero_session.n_regions >= HERO_SESSION_MAX_REGIONS) {
+            pr_warn("Too many regions to record %d\n", mmap_id);
+            return;
+        }
+        region = &hero_session.regions[hero_session.n_regions++];
+        region->mmap_id = mmap_id;
+        region->v_addr = 0;
+    }
+    if (size) {
+        region->size = size;
+        region->p_addr = p_addr;
+    }
+    if (v_addr)
+        region->v_addr = v_addr;
+}
+
+//////////////////////////////
+///// CLIENT            //////
+//////////////////////////////
+
+static int session_xfer(int fd, void *buf, size_t size, int send) {
+    for (size_t done = 0; done < size;) {
+        ssize_t n = send ? write(fd, (char *)buf + done, size - done) : read(fd, (char *)buf + done, size - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -EIO;
+        done += n;
+    }
+    return 0;
+}
+
+int hero_session_attach(const char *node) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    char *path = getenv("HERO_DAEMON_SOCKET");
+    int sock;
+
+    if (!path || hero_dev_attached)
+        return hero_dev_attached;
+
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0)
+        return 0;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr))) {
+        pr_debug("herod is not running on %s\n", path);
+        goto error;
+    }
+
+    // Blocks until the previous client is done
+    if (session_xfer(sock, &hero_session, sizeof(hero_session), 0) || hero_session.magic != HERO_SESSION_MAGIC) {
+        pr_warn("Invalid session from herod\n");
+        goto error;
+    }
+    if (strncmp(hero_session.node, node, sizeof(hero_session.node))) {
+        pr_warn("herod serves %s, not %s\n", hero_session.node, node);
+        goto error;
+    }
+
+    hero_session_fd = sock;
+    hero_dev_attached = 1;
+    pr_debug("Attached to herod on %s\n", path);
+    return 1;
+
+error:
+    memset(&hero_session, 0, sizeof(hero_session));
+    close(sock);
+    return 0;
+}
+
+void hero_session_fallback(void) {
+    if (!hero_dev_attached)
+        return;
+    pr_debug("Not using the session of herod\n");
+    hero_dev_attached = 0;
+}
+
+//////////////////////////////
+///// DAEMON            //////
+//////////////////////////////
+
+// Heaps and mailboxes for the next client, whatever the last one left
+static void hero_session_reset(HeroDev *dev) {
+    hero_dev_reset_heaps(dev);
+    hero_dev_init(dev);
+    hero_session.mboxes = dev->mboxes;
+}
+
+int hero_session_serve(HeroDev *dev, const char *path) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    struct stat node_st;
+    int sock, client, err;
+    mode_t mask;
+    ssize_t n;
+    char byte;
+
+    // The mirror is host memory of this process, it can't be shared
+    if (dev->mboxes.a2h_mirror) {
+        pr_error("The mailbox mirror can't be used with herod\n");
+        return -EINVAL;
+    }
+
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0)
+        return -errno;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    unlink(path);
+    // Only the users who can open the device may attach, the socket gets its
+    // group and no access for the others from the start
+    mask = umask(S_IRWXO | S_IXUSR | S_IXGRP);
+    err = bind(sock, (struct sockaddr *)&addr, sizeof(addr));
+    umask(mask);
+    if (err || listen(sock, 16)) {
+        err = -errno;
+        pr_error("Can't listen on %s: %s\n", path, strerror(errno));
+        close(sock);
+        return err;
+    }
+    if (stat(hero_session.node, &node_st) || chown(path, -1, node_st.st_gid))
+        pr_warn("Can't give %s the group of %s: %s\n", path, hero_session.node, strerror(errno));
+
+    hero_session.magic = HERO_SESSION_MAGIC;
+    hero_session.mboxes = dev->mboxes;
+    pr_info("Serving %s on %s\n", hero_session.node, path);
+
+    while (1) {
+        client = accept(sock, NULL, NULL);
+        if (client < 0) {
+            if (errno == EINTR)
+                continue;
+            pr_error("accept failed: %s\n", strerror(errno));
+            break;
+        }
+        if (session_xfer(client, &hero_session, sizeof(hero_session), 1)) {
+            close(client);
+            continue;
+        }
+        // The client owns the device until it closes the socket
+        do {
+            n = read(client, &byte, 1);
+        } while (n > 0 || (n < 0 && errno == EINTR));
+        close(client);
+        pr_debug("Client detached\n");
+        hero_session_reset(dev);
+    }
+    close(sock);
+    return -EIO;
+}
@@ -0,0 +1,68 @@
+// Copyright 2024 ETH Zurich and University of Bologna.
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include <stdint.h>
+
+#include "libhero/hero_api.h"
+
+// A session is the state herod (tools/herod.c) built when it mapped and
+// initialized the device: the driver memory infos, the virtual address of
+// every mapping, and the mailboxes. A client attaching to herod maps the
+// regions at the same virtual addresses, so that the heaps (o1heap keeps its
+// state in the arena) and the mailboxes allocated by herod are valid in the
+// client as well, and skips their initialization.
+//
+// herod serves one client at a time: a client owns the device until it closes
+// the socket, then herod resets the heaps and the mailboxes for the next one.
+
+#define HERO_SESSION_MAGIC 0x4845524fU
+#define HERO_SESSION_MAX_REGIONS 64
+
+struct hero_session_region {
+    int mmap_id;
+    uint64_t size;
+    uint64_t p_addr;
+    // 0 if the region was only looked up
+    uint64_t v_addr;
+};
+
+struct hero_session {
+    uint32_t magic;
+    uint32_t n_regions;
+    char node[64];
+    struct hero_session_region regions[HERO_SESSION_MAX_REGIONS];
+    HeroMboxes_t mboxes;
+};
+
+// Recorded by herod, received by an attached client
+extern struct hero_session hero_session;
+// Set when this process attached to herod
+extern int hero_dev_attached;
+
+/** Attach to herod if HERO_DAEMON_SOCKET is set and herod serves this node.
+  Blocks while another client owns the device.
+
+  \return   1 if attached; 0 otherwise, the device is then initialized as usual.
+ */
+int hero_session_attach(const char *node);
+
+/** Stop using the session, the rest of the device is initialized as without
+  herod. The socket stays open so that no other client attaches meanwhile, herod
+  resets the heaps and the mailboxes when this process exits.
+ */
+void hero_session_fallback(void);
+
+/** Get the recorded region of an mmap_id, NULL if not recorded. */
+struct hero_session_region *hero_session_region(int mmap_id);
+
+/** Record the memory infos or the mapping of a region (herod side). */
+void hero_session_record(int mmap_id, uint64_t size, uint64_t p_addr, uint64_t v_addr);
+
+/** Serve the clients on a UNIX socket, one at a time, never returns on success.
+
+  \return   negative value with an errno on errors.
+ */
+int hero_session_serve(HeroDev *dev, const char *path);
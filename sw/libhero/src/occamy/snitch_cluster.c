@@ -16,12 +16,18 @@
 #include "driver.h"
 #include "snitch_cluster.h"
 
+// Clusters woken up by hero_dev_exe_start (HERO_OCCAMY_CLUSTERS, all by default)
+static uint32_t occ_n_active_clusters = 1;
+// Layout of the mailboxes of this process, given to the device on exe_start
+static uint32_t occ_l3_layout_phy;
+
 static void occamy_set_isolation(int iso) {
     uint32_t mask, val;
     val = iso ? 1U : 0U;
     mask = (val << QCTL_ISOLATE_NARROW_IN_BIT) | (val << QCTL_ISOLATE_NARROW_OUT_BIT) |
            (val << QCTL_ISOLATE_WIDE_IN_BIT) | (val << QCTL_ISOLATE_WIDE_OUT_BIT);
-    writew(mask, occ_quad_ctrl + QCTL_ISOLATE_REG_OFFSET);
+    for (uint32_t q = 0; q < occ_n_quadrants; q++)
+        writew(mask, occ_quad_ctrls[q] + QCTL_ISOLATE_REG_OFFSET);
     fence();
 }
 
@@ -35,8 +41,22 @@ void clint_clear_irq(uint32_t irq) {
     writew(val & ~irq, (uint32_t *)occ_clint);
 }
 
-// Set up transparent TLB
-static int occamy_tlb_write(uint32_t idx, uint64_t addr_begin, uint64_t addr_end, uint32_t flags) {
+// Set or clear the software interrupt of the Snitch harts of the first
+// n_clusters clusters (hart 0 is the CVA6), one bit per hart. Each cluster
+// has occ_n_cores compute cores and one DMA core.
+static void clint_set_clusters_irq(uint32_t n_clusters, int set) {
+    uint32_t first = 1, last = 1 + n_clusters * (occ_n_cores + 1);
+    for (uint32_t word = first / 32; word * 32 < last; word++) {
+        uint32_t lo = MAX(first, word * 32) - word * 32;
+        uint32_t hi = MIN(last, (word + 1) * 32) - word * 32;
+        uint32_t mask = (hi == 32 ? 0xFFFFFFFFU : (1U << hi) - 1) & ~((1U << lo) - 1);
+        uint32_t *reg = (uint32_t *)(occ_clint + 4 * word);
+        writew(set ? (readw(reg) | mask) : (readw(reg) & ~mask), reg);
+    }
+}
+
+// Set up transparent TLB of one quadrant
+static int occamy_quad_tlb_write(volatile void *occ_quad_ctrl, uint32_t idx, uint64_t addr_begin, uint64_t addr_end, uint32_t flags) {
     uint64_t page_num_base = addr_begin >> 12;
     uint64_t page_num_first = addr_begin >> 12;
     uint64_t page_num_last = addr_end >> 12;
@@ -58,18 +78,96 @@ static int occamy_tlb_write(uint32_t idx, uint64_t addr_begin, uint64_t addr_end
     return 0;
 }
 
+// Set up the same transparent TLB entry in all the quadrants, the hardware
+// is only written if the entry changed
+static int occamy_tlb_write(uint32_t idx, uint64_t addr_begin, uint64_t addr_end, uint32_t flags) {
+    struct occ_tlb_entry *e = &occ_tlb[idx];
+    e->last_use = ++occ_tlb_clock;
+    if (e->addr_begin == addr_begin && e->addr_end == addr_end && e->flags == flags)
+        return 0;
+    e->addr_begin = addr_begin;
+    e->addr_end = addr_end;
+    e->flags = flags;
+    for (uint32_t q = 0; q < occ_n_quadrants; q++)
+        occamy_quad_tlb_write(occ_quad_ctrls[q], idx, addr_begin, addr_end, flags);
+    fence();
+    return 0;
+}
+
+// The quadrant TLBs are shared with the other processes, which may have
+// reprogrammed the dynamic entries while they held the device
+static void occamy_tlb_invalidate(void) {
+    for (int i = QCTL_TLB_NUM_STATIC; i < QCTL_TLB_NUM_ENTRIES; i++)
+        occ_tlb[i].flags = 0;
+}
+
+// Hold the device, forgetting the dynamic entries if another process held it
+static int occamy_acquire(HeroDev *dev) {
+    int err = hero_dev_acquire(dev, 0);
+    if (err > 0)
+        occamy_tlb_invalidate();
+    return err;
+}
+
+// Make [addr_begin, addr_end] reachable by the device. Reuses an entry
+// covering the range, otherwise takes a free dynamic entry or evicts the least
+// recently used one. Returns the entry index.
+static int occamy_tlb_map(uint64_t addr_begin, uint64_t addr_end, uint32_t flags) {
+    int victim = -1;
+
+    addr_begin &= ~0xfffULL;
+    addr_end |= 0xfffULL;
+
+    for (int i = 0; i < QCTL_TLB_NUM_ENTRIES; i++) {
+        struct occ_tlb_entry *e = &occ_tlb[i];
+        if (!(e->flags & QCTL_TLB_FLAG_VALID))
+            continue;
+        // A read-only entry does not cover a read-write request
+        if (e->addr_begin <= addr_begin && addr_end <= e->addr_end &&
+            (!(e->flags & QCTL_TLB_FLAG_READ_ONLY) || (flags & QCTL_TLB_FLAG_READ_ONLY))) {
+            e->last_use = ++occ_tlb_clock;
+            occ_tlb_hits++;
+            return i;
+        }
+    }
+
+    occ_tlb_misses++;
+    for (int i = QCTL_TLB_NUM_STATIC; i < QCTL_TLB_NUM_ENTRIES; i++) {
+        if (!(occ_tlb[i].flags & QCTL_TLB_FLAG_VALID)) {
+            victim = i;
+            break;
+        }
+        if (victim < 0 || occ_tlb[i].last_use < occ_tlb[victim].last_use)
+            victim = i;
+    }
+    if (victim < 0) {
+        pr_error("No dynamic TLB entry\n");
+        return -ENOSPC;
+    }
+    if (occ_tlb[victim].flags & QCTL_TLB_FLAG_VALID) {
+        occ_tlb_evictions++;
+        pr_debug("Evicting TLB entry %i (%lx-%lx)\n", victim, occ_tlb[victim].addr_begin, occ_tlb[victim].addr_end);
+    }
+
+    occamy_tlb_write(victim, addr_begin, addr_end, flags);
+    pr_trace("TLB entry %i : %lx-%lx\n", victim, addr_begin, addr_end);
+    return victim;
+}
+
 void hero_dev_reset(HeroDev *dev, unsigned full) {
     pr_trace("%s snitch_cluster\n", __func__);
     // Isolate
     occamy_set_isolation(1);
     // Reset
-    writew(0, occ_quad_ctrl + QCTL_RESET_N_REG_OFFSET);
-    clint_clear_irq(0x1FF << 1);
+    for (uint32_t q = 0; q < occ_n_quadrants; q++)
+        writew(0, occ_quad_ctrls[q] + QCTL_RESET_N_REG_OFFSET);
+    clint_set_clusters_irq(occ_n_clusters, 0);
     fence();
     for (volatile int i = 0; i < 16; i++)
 	;
     // De-reset
-    writew(1, occ_quad_ctrl + QCTL_RESET_N_REG_OFFSET);
+    for (uint32_t q = 0; q < occ_n_quadrants; q++)
+        writew(1, occ_quad_ctrls[q] + QCTL_RESET_N_REG_OFFSET);
     fence();
     // De-isolate
     occamy_set_isolation(0);
@@ -86,14 +184,30 @@ int hero_dev_mmap(HeroDev *dev) {
 
     pr_trace("\n");
 
-    device_fd = open("/dev/occamydev--1", O_RDWR | O_SYNC);
+    device_fd = driver_open("/dev/occamydev--1");
     CHECK_ASSERT(-1, device_fd > 0, "Can't open driver chardev\n");
 
+    // Get the number of quadrants and clusters, older drivers only have one
+    struct driver_ioctl_arg infos;
+    if (!ioctl(device_fd, IOCTL_DEV_INFOS, &infos) && infos.size && infos.result_phys_addr) {
+        occ_n_clusters = MIN(infos.size, OCCAMY_MAX_CLUSTERS);
+        occ_n_quadrants = MIN(infos.result_phys_addr, OCCAMY_MAX_QUADRANTS);
+        occ_n_cores = infos.result_virt_addr;
+    }
+    occ_n_active_clusters = occ_n_clusters;
+    char *env_clusters = getenv("HERO_OCCAMY_CLUSTERS");
+    if (env_clusters)
+        occ_n_active_clusters = MAX(1, MIN(strtol(env_clusters, NULL, 10), occ_n_clusters));
+    pr_debug("%u quadrants, %u clusters of %u cores, %u active\n", occ_n_quadrants, occ_n_clusters, occ_n_cores,
+             occ_n_active_clusters);
+
     // Call card_mmap from the driver map address spaces
-    err |= driver_lookup_mmap(device_fd, SNITCH_CLUSTER_MMAP_ID, &occ_snitch_cluster);
-    err |= driver_lookup_mmap(device_fd, QUADRANT_CTRL_MMAP_ID, &occ_quad_ctrl);
+    for (uint32_t c = 0; c < occ_n_clusters; c++)
+        err |= driver_lookup_mmap(device_fd, SNITCH_CLUSTER_X_MMAP_ID(c), &occ_snitch_clusters[c]);
+    for (uint32_t q = 0; q < occ_n_quadrants; q++)
+        err |= driver_lookup_mmap(device_fd, QUADRANT_CTRL_X_MMAP_ID(q), &occ_quad_ctrls[q]);
     err |= driver_lookup_mmap(device_fd, SOC_CTRL_MMAP_ID, &occ_soc_ctrl);
-    err |= driver_lookup_mmap(device_fd, L3_MMAP_ID, &occ_l3);
+    err |= driver_lookup_mmap(device_fd, driver_cached_mmap_id(L3_MMAP_ID), &occ_l3);
     err |= driver_lookup_mmap(device_fd, SCRATCHPAD_WIDE_MMAP_ID, &occ_l2);
     err |= driver_lookup_mmap(device_fd, CLINT_MMAP_ID, &occ_clint);
 
@@ -102,21 +216,28 @@ int hero_dev_mmap(HeroDev *dev) {
     if (err)
         goto error_driver;
     
-    // Put the occamy tcdm in the local_mems list for OpenMP to use
-    HeroSubDev_t *local_mems_tail = malloc(sizeof(HeroSubDev_t));
-    size_t occ_snitch_cluster_size; 
-    uintptr_t occ_snitch_cluster_phys;
-    driver_lookup_mem(device_fd, SNITCH_CLUSTER_MMAP_ID, &occ_snitch_cluster_size, &occ_snitch_cluster_phys);
-    if(!local_mems_tail){
-        pr_error("Error when allocating local_mems_tail.\n");
-        goto error_driver;
+    // Put the tcdm of every cluster in the local_mems list for OpenMP to use
+    HeroSubDev_t **local_mems_tail = &dev->local_mems;
+    for (uint32_t c = 0; c < occ_n_clusters; c++) {
+        HeroSubDev_t *local_mem = malloc(sizeof(HeroSubDev_t));
+        size_t occ_snitch_cluster_size;
+        uintptr_t occ_snitch_cluster_phys;
+        driver_lookup_mem(device_fd, SNITCH_CLUSTER_X_MMAP_ID(c), &occ_snitch_cluster_size, &occ_snitch_cluster_phys);
+        if(!local_mem){
+            pr_error("Error when allocating local_mems_tail.\n");
+            goto error_driver;
+        }
+        local_mem->v_addr = occ_snitch_clusters[c];
+        // TODO: Split lookup between device and host phy addr
+        local_mem->p_addr = 0xFFFFFFFF & occ_snitch_cluster_phys;
+        local_mem->size   = occ_snitch_cluster_size;
+        local_mem->alias  = malloc(32);
+        if (local_mem->alias)
+            snprintf(local_mem->alias, 32, c ? "l1_snitch_cluster%u" : "l1_snitch_cluster", c);
+        local_mem->next   = NULL;
+        *local_mems_tail = local_mem;
+        local_mems_tail = &local_mem->next;
     }
-    local_mems_tail->v_addr = occ_snitch_cluster;
-    // TODO: Split lookup between device and host phy addr
-    local_mems_tail->p_addr = 0xFFFFFFFF & occ_snitch_cluster_phys;
-    local_mems_tail->size   = occ_snitch_cluster_size;
-    local_mems_tail->alias  = "l1_snitch_cluster";
-    dev->local_mems = local_mems_tail;
 
     // Put half of the l2 memory map in the global_mems list
     // (We give the first half to openmp and the top half to o1heap)
@@ -128,6 +249,7 @@ int hero_dev_mmap(HeroDev *dev) {
     l2_heap_start_phy = occ_l2_phys + ALIGN_UP(occ_l2_size / 2, O1HEAP_ALIGNMENT);
     l2_heap_start_virt = occ_l2 + ALIGN_UP(occ_l2_size / 2, O1HEAP_ALIGNMENT);
     l2_heap_size = occ_l2_size / 2;
+    hero_dev_heap_slice(&l2_heap_start_phy, &l2_heap_start_virt, &l2_heap_size);
     err = hero_dev_l2_init(dev);
     if(err) {
         pr_error("Error when initializing L2 mem.\n");
@@ -141,6 +263,7 @@ int hero_dev_mmap(HeroDev *dev) {
     l3_heap_start_phy = occ_l3_phys + ALIGN_UP(occ_l3_size / 2, O1HEAP_ALIGNMENT);
     l3_heap_start_virt = occ_l3 + ALIGN_UP(occ_l3_size / 2, O1HEAP_ALIGNMENT);
     l3_heap_size = occ_l3_size / 2;
+    hero_dev_heap_slice(&l3_heap_start_phy, &l3_heap_start_virt, &l3_heap_size);
     err = hero_dev_l3_init(dev);
     if(err) {
         pr_error("Error when initializing L3 mem.\n");
@@ -169,9 +292,36 @@ end:
     return err;
 }
 
+int hero_dev_get_regions(HeroDev *dev, HeroRegion *regions, int max_regions) {
+    static char cluster_names[OCCAMY_MAX_CLUSTERS][32];
+    static char quad_names[OCCAMY_MAX_QUADRANTS][32];
+    int n = 0;
+
+    n = driver_add_region(regions, n, max_regions, "soc_ctrl", SOC_CTRL_MMAP_ID, occ_soc_ctrl, 0, HERO_REGION_REGS);
+    n = driver_add_region(regions, n, max_regions, "clint", CLINT_MMAP_ID, occ_clint, 0, HERO_REGION_REGS);
+    for (uint32_t q = 0; q < occ_n_quadrants; q++) {
+        snprintf(quad_names[q], sizeof(quad_names[q]), "quad_ctrl%u", q);
+        n = driver_add_region(regions, n, max_regions, quad_names[q], QUADRANT_CTRL_X_MMAP_ID(q), occ_quad_ctrls[q],
+                              0, HERO_REGION_REGS);
+    }
+    for (uint32_t c = 0; c < occ_n_clusters; c++) {
+        snprintf(cluster_names[c], sizeof(cluster_names[c]), "l1_snitch_cluster%u", c);
+        n = driver_add_region(regions, n, max_regions, cluster_names[c], SNITCH_CLUSTER_X_MMAP_ID(c),
+                              occ_snitch_clusters[c], 0, 0);
+    }
+    n = driver_add_region(regions, n, max_regions, "l2", SCRATCHPAD_WIDE_MMAP_ID, occ_l2, 0, 0);
+    n = driver_add_region(regions, n, max_regions, "l3", driver_cached_mmap_id(L3_MMAP_ID), occ_l3, 0, 0);
+    return n;
+}
+
 int hero_dev_init(HeroDev *dev) {
     pr_trace("%p\n", dev);
 
+    // The TLBs are shared with the other processes, set them up when holding
+    // the device
+    if (hero_dev_acquire(dev, 0) < 0)
+        return -EBUSY;
+
     // Allocate sw mailboxes
     hero_dev_alloc_mboxes(dev);
     // Point to the mailboxes
@@ -182,10 +332,17 @@ int hero_dev_init(HeroDev *dev) {
     mbox_ptrs->a2h_mbox = (uint32_t) dev->mboxes.a2h_mbox_mem.p_addr;
     mbox_ptrs->a2h_rb = (uint32_t) dev->mboxes.rb_mbox_mem.p_addr;
     mbox_ptrs->heap = l3_heap_start_phy;
+    mbox_ptrs->n_clusters = occ_n_active_clusters;
+    hero_dev_sync(dev, mbox_ptrs_phy, sizeof(struct l3_layout), HERO_SYNC_FOR_DEVICE);
     // Give the poiter to the mailboxes to the device
-    writew(mbox_ptrs_phy, occ_soc_ctrl + SCTL_SCRATCH_2_REG_OFFSET);
+    occ_l3_layout_phy = mbox_ptrs_phy;
+    writew(occ_l3_layout_phy, occ_soc_ctrl + SCTL_SCRATCH_2_REG_OFFSET);
 
-    // Setup the TLBs
+    // Setup the static TLB entries, the others are mapped on demand
+    memset(occ_tlb, 0, sizeof(occ_tlb));
+    for (int i = QCTL_TLB_NUM_STATIC; i < QCTL_TLB_NUM_ENTRIES; i++)
+        for (uint32_t q = 0; q < occ_n_quadrants; q++)
+            occamy_quad_tlb_write(occ_quad_ctrls[q], i, 0, 0, 0);
     occamy_tlb_write(0, 0x01000000, 0x0101ffff, 0x3);  // BOOTROM
     occamy_tlb_write(1, 0x02000000, 0x02000fff, 0x3);  // SoC Control
     occamy_tlb_write(2, 0x04000000, 0x040fffff, 0x1);  // CLINT
@@ -194,27 +351,95 @@ int hero_dev_init(HeroDev *dev) {
     occamy_tlb_write(5, 0x71000000, 0x71100000, 0x1);  // SPM wide
 
     // Enable the TLBs
-    writew(1, occ_quad_ctrl + 0x18);
-    writew(1, occ_quad_ctrl + 0x1c);
+    for (uint32_t q = 0; q < occ_n_quadrants; q++) {
+        writew(1, occ_quad_ctrls[q] + QCTL_TLB_WIDE_ENABLE_OFFSET);
+        writew(1, occ_quad_ctrls[q] + QCTL_TLB_NARROW_ENABLE_OFFSET);
+    }
 
+    hero_dev_release(dev);
     return 0;
 }
 
 void hero_dev_exe_start(HeroDev *dev) {
+    int err;
+
     pr_trace("%p\n", dev);
 
+    // Wait for the other processes, then take the device over
+    err = occamy_acquire(dev);
+    if (err < 0) {
+        pr_error("Can't acquire the device: %s\n", strerror(-err));
+        return;
+    }
+    hero_dev_started = 1;
+
     // Set entry-point, bootrom pointer and l3 layout struct pointer
     writew((uint32_t) 0xc0000000             , occ_soc_ctrl + SCTL_SCRATCH_0_REG_OFFSET);
     writew((uint32_t)(uint64_t)0             , occ_soc_ctrl + SCTL_SCRATCH_1_REG_OFFSET);
+    writew(occ_l3_layout_phy                 , occ_soc_ctrl + SCTL_SCRATCH_2_REG_OFFSET);
 
     fence();
 
-    clint_set_irq(0x1FF << 1);
+    // Wake up all the cores of the active clusters, they share the offload
+    clint_set_clusters_irq(occ_n_active_clusters, 1);
+}
+
+void hero_dev_restore(HeroDev *dev) {
+    occamy_tlb_invalidate();
+    if (hero_dev_started)
+        hero_dev_exe_start(dev);
+}
+
+// The quadrant TLBs are transparent, mapping a buffer only opens its
+// physical range to the device. The device is held until the end of the
+// offload, the other processes can't remap the entry in between.
+int hero_iommu_map_virt_to_phys(HeroDev *dev, unsigned size_b, void *v_addr, uintptr_t p_addr) {
+    int idx = occamy_acquire(dev);
+    if (idx < 0)
+        return idx;
+    idx = occamy_tlb_map(p_addr, p_addr + size_b - 1, QCTL_TLB_FLAG_VALID);
+    return (idx < 0) ? idx : 0;
+}
+
+// Map a pinned (mlock'ed) user buffer, it has to be physically contiguous
+uintptr_t hero_iommu_map_virt(HeroDev *dev, unsigned size_b, void *v_addr) {
+    long page_size = getpagesize();
+    uintptr_t first = (uintptr_t) v_addr & ~(page_size - 1);
+    uintptr_t last = ((uintptr_t) v_addr + size_b - 1) & ~(page_size - 1);
+    uint64_t entry, p_first = 0;
+    int fd;
+
+    fd = open("/proc/self/pagemap", O_RDONLY);
+    CHECK_ASSERT(0, fd >= 0, "Can't open pagemap\n");
+    for (uintptr_t page = first; page <= last; page += page_size) {
+        if (pread(fd, &entry, sizeof(entry), page / page_size * sizeof(entry)) != sizeof(entry) ||
+            !(entry & (1ULL << 63))) {
+            pr_error("%lx is not present\n", page);
+            close(fd);
+            return 0;
+        }
+        // Page frame number in bits 0-54
+        entry = (entry & ((1ULL << 55) - 1)) * page_size;
+        if (page == first)
+            p_first = entry;
+        else if (entry != p_first + (page - first)) {
+            pr_error("%p is not physically contiguous\n", v_addr);
+            close(fd);
+            return 0;
+        }
+    }
+    close(fd);
+
+    p_first += (uintptr_t) v_addr - first;
+    if (hero_iommu_map_virt_to_phys(dev, size_b, v_addr, p_first))
+        return 0;
+    return p_first;
 }
 
 int hero_dev_munmap(HeroDev *dev) {
     int err = 0;
     pr_trace("%p\n", dev);
+    pr_debug("TLB hits %u misses %u evictions %u\n", occ_tlb_hits, occ_tlb_misses, occ_tlb_evictions);
     hero_dev_free_mboxes(dev);
     close(device_fd);
 }
@@ -7,18 +7,25 @@
 #pragma once
 
 // The virtual addresses of the hardware
-static volatile void* occ_quad_ctrl;
+static volatile void* occ_quad_ctrls[OCCAMY_MAX_QUADRANTS];
 static volatile void* occ_soc_ctrl;
-static volatile void* occ_snitch_cluster;
+static volatile void* occ_snitch_clusters[OCCAMY_MAX_CLUSTERS];
 static volatile void* occ_l3;
 static volatile void* occ_l2;
 static volatile void* occ_clint;
 
+// Hardware configuration reported by the driver
+static uint32_t occ_n_quadrants = 1;
+static uint32_t occ_n_clusters = 1;
+static uint32_t occ_n_cores = 8;
+
 struct l3_layout {
   uint32_t a2h_rb;
   uint32_t a2h_mbox;
   uint32_t h2a_mbox;
   uint32_t heap;
+  // Number of clusters woken up for the offloads
+  uint32_t n_clusters;
 };
 
 #define QCTL_RESET_N_REG_OFFSET 0x4
@@ -29,6 +36,25 @@ struct l3_layout {
 #define QCTL_TLB_WIDE_REG_OFFSET 0x1000
 
 #define QCTL_TLB_REG_STRIDE 0x20
+// Entries of the narrow and wide quadrant TLBs
+#define QCTL_TLB_NUM_ENTRIES 8
+// Entries below this index hold the static windows set by hero_dev_init
+#define QCTL_TLB_NUM_STATIC 6
+#define QCTL_TLB_FLAG_VALID 0x1
+#define QCTL_TLB_FLAG_READ_ONLY 0x2
+
+// Shadow of the TLB entries, shared by all the quadrants
+struct occ_tlb_entry {
+  uint64_t addr_begin;
+  uint64_t addr_end;
+  uint32_t flags;
+  // Last use for the LRU replacement of the dynamic entries
+  uint64_t last_use;
+};
+
+static struct occ_tlb_entry occ_tlb[QCTL_TLB_NUM_ENTRIES];
+static uint64_t occ_tlb_clock;
+static unsigned occ_tlb_hits, occ_tlb_misses, occ_tlb_evictions;
 
 #define QCTL_ISOLATE_NARROW_IN_BIT 0
 #define QCTL_ISOLATE_NARROW_OUT_BIT 1
@@ -0,0 +1,352 @@
+// Copyright 2024 ETH Zurich and University of Bologna.
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: Apache-2.0
+//
+// hero-membench: host read, write and copy bandwidth and read latency of every
+// device region mapped by libhero (hero_dev_get_regions) and of a DMA buffer,
+// for each access width and thread count. Use the table to place the buffers
+// and to spot a bitstream or a driver mapping the regions with the wrong
+// attributes. The control registers are only probed for read latency, on
+// their first word.
+//
+// The device is reset first and must not run concurrently.
+//
+// Usage: hero-membench [-s window_bytes] [-t threads,...] [-r runs] [-c]
+//   -s bytes benchmarked per region (default 64 KiB, capped to the region)
+//   -t thread counts (default 1,2,4)
+//   -r runs per measurement, the fastest is kept (default 3)
+//   -c print CSV instead of a table
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "libhero/hero_api.h"
+#include "libhero/utils.h"
+
+#define MEMBENCH_MAX_REGIONS 64
+#define MEMBENCH_MAX_THREADS 16
+#define MEMBENCH_LAT_ACCESSES 4096
+// Stride of the latency pointer chase, one access per cache line
+#define MEMBENCH_LAT_STRIDE 64
+
+typedef enum { OP_READ, OP_WRITE, OP_COPY } membench_op;
+
+typedef struct {
+    const char *name;
+    unsigned bytes; // 0 for the vector accesses
+} membench_width;
+
+static const membench_width widths[] = {
+    {"8", 1}, {"16", 2}, {"32", 4}, {"64", 8},
+#ifdef __riscv_vector
+    {"vec", 0},
+#endif
+};
+#define NUM_WIDTHS (sizeof(widths) / sizeof(widths[0]))
+
+typedef struct {
+    pthread_t thread;
+    pthread_barrier_t *barrier;
+    volatile uint8_t *base;
+    size_t size;
+    unsigned width;
+    membench_op op;
+    double t0, t1;
+} membench_job;
+
+static size_t window = 64 * 1024;
+static unsigned runs = 3;
+static unsigned threads[MEMBENCH_MAX_THREADS] = {1, 2, 4};
+static unsigned num_threads = 3;
+static int csv;
+
+static double now_s() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+//////////////////////////////
+///// ACCESS KERNELS    //////
+//////////////////////////////
+
+#define MEMBENCH_LOOPS(T)                                                      \
+    static void read_##T(volatile uint8_t *p, size_t size) {                   \
+        volatile T *s = (volatile T *)p;                                       \
+        T acc = 0;                                                             \
+        for (size_t i = 0; i < size / sizeof(T); i++)                          \
+            acc += s[i];                                                       \
+        asm volatile("" ::"r"(acc));                                           \
+    }                                                                          \
+    static void write_##T(volatile uint8_t *p, size_t size) {                  \
+        volatile T *d = (volatile T *)p;                                       \
+        for (size_t i = 0; i < size / sizeof(T); i++)                          \
+            d[i] = (T)i;                                                       \
+    }                                                                          \
+    static void copy_##T(volatile uint8_t *p, size_t size) {                   \
+        volatile T *s = (volatile T *)p;                                       \
+        volatile T *d = (volatile T *)(p + size / 2);                          \
+        for (size_t i = 0; i < size / 2 / sizeof(T); i++)                      \
+            d[i] = s[i];                                                       \
+    }
+
+MEMBENCH_LOOPS(uint8_t)
+MEMBENCH_LOOPS(uint16_t)
+MEMBENCH_LOOPS(uint32_t)
+MEMBENCH_LOOPS(uint64_t)
+
+#ifdef __riscv_vector
+static void read_vec(volatile uint8_t *p, size_t size) {
+    size_t vl;
+    for (size_t i = 0; i < size; i += vl) {
+        asm volatile("vsetvli %0, %1, e8, m8, ta, ma" : "=r"(vl) : "r"(size - i));
+        asm volatile("vle8.v v0, (%0)" ::"r"(p + i) : "memory");
+    }
+}
+
+static void write_vec(volatile uint8_t *p, size_t size) {
+    size_t vl;
+    asm volatile("vsetvli %0, %1, e8, m8, ta, ma" : "=r"(vl) : "r"(size));
+    asm volatile("vmv.v.i v0, 0");
+    for (size_t i = 0; i < size; i += vl) {
+        asm volatile("vsetvli %0, %1, e8, m8, ta, ma" : "=r"(vl) : "r"(size - i));
+        asm volatile("vse8.v v0, (%0)" ::"r"(p + i) : "memory");
+    }
+}
+
+static void copy_vec(volatile uint8_t *p, size_t size) {
+    size_t vl;
+    for (size_t i = 0; i < size / 2; i += vl) {
+        asm volatile("vsetvli %0, %1, e8, m8, ta, ma" : "=r"(vl) : "r"(size / 2 - i));
+        asm volatile("vle8.v v0, (%0)" ::"r"(p + i) : "memory");
+        asm volatile("vse8.v v0, (%0)" ::"r"(p + size / 2 + i) : "memory");
+    }
+}
+#endif
+
+static void run_kernel(volatile uint8_t *p, size_t size, unsigned width, membench_op op) {
+    switch (width) {
+#define MEMBENCH_CASE(W, T)                                                    \
+    case W:                                                                    \
+        if (op == OP_READ)                                                     \
+            read_##T(p, size);                                                 \
+        else if (op == OP_WRITE)                                               \
+            write_##T(p, size);                                                \
+        else                                                                   \
+            copy_##T(p, size);                                                 \
+        break;
+    MEMBENCH_CASE(1, uint8_t)
+    MEMBENCH_CASE(2, uint16_t)
+    MEMBENCH_CASE(4, uint32_t)
+    MEMBENCH_CASE(8, uint64_t)
+#undef MEMBENCH_CASE
+#ifdef __riscv_vector
+    case 0:
+        if (op == OP_READ)
+            read_vec(p, size);
+        else if (op == OP_WRITE)
+            write_vec(p, size);
+        else
+            copy_vec(p, size);
+        break;
+#endif
+    }
+    fence();
+}
+
+//////////////////////////////
+///// MEASUREMENTS      //////
+//////////////////////////////
+
+static void *membench_worker(void *arg) {
+    membench_job *job = arg;
+    pthread_barrier_wait(job->barrier);
+    job->t0 = now_s();
+    run_kernel(job->base, job->size, job->width, job->op);
+    job->t1 = now_s();
+    return NULL;
+}
+
+// Bandwidth in MB/s of n_threads threads each working on a slice of the window
+static double bandwidth(volatile uint8_t *base, size_t size, unsigned width, membench_op op, unsigned n_threads) {
+    membench_job jobs[MEMBENCH_MAX_THREADS];
+    pthread_barrier_t barrier;
+    // Slices stay aligned to the widest access
+    size_t slice = (size / n_threads) & ~(size_t)63;
+    double best = 0;
+
+    if (!slice)
+        return 0;
+
+    for (unsigned r = 0; r < runs; r++) {
+        double t0 = 1e30, t1 = 0;
+        pthread_barrier_init(&barrier, NULL, n_threads);
+        for (unsigned t = 0; t < n_threads; t++) {
+            jobs[t] = (membench_job){.barrier = &barrier, .base = base + t * slice, .size = slice, .width = width,
+                                     .op = op};
+            pthread_create(&jobs[t].thread, NULL, membench_worker, &jobs[t]);
+        }
+        for (unsigned t = 0; t < n_threads; t++) {
+            pthread_join(jobs[t].thread, NULL);
+            t0 = MIN(t0, jobs[t].t0);
+            t1 = MAX(t1, jobs[t].t1);
+        }
+        pthread_barrier_destroy(&barrier);
+        // A copy moves each byte twice
+        best = MAX(best, (op == OP_COPY ? 2 : 1) * slice * n_threads / (t1 - t0) / 1e6);
+    }
+    return best;
+}
+
+// Average latency in ns of dependent 64-bit reads over the window
+static double latency(volatile uint8_t *base, size_t size) {
+    size_t n_lines = size / MEMBENCH_LAT_STRIDE;
+    volatile uint64_t *line;
+    double best = 1e30, t0;
+    uint64_t off = 0;
+
+    if (n_lines < 2)
+        return 0;
+
+    // Chain the lines with a large odd step so that they are not prefetched
+    size_t step = (n_lines / 2) | 1;
+    while (n_lines % step == 0 && step > 1)
+        step += 2;
+    for (size_t i = 0; i < n_lines; i++) {
+        line = (volatile uint64_t *)(base + i * MEMBENCH_LAT_STRIDE);
+        *line = ((i + step) % n_lines) * MEMBENCH_LAT_STRIDE;
+    }
+    fence();
+
+    for (unsigned r = 0; r < runs; r++) {
+        t0 = now_s();
+        for (unsigned i = 0; i < MEMBENCH_LAT_ACCESSES; i++)
+            off = *(volatile uint64_t *)(base + off);
+        best = MIN(best, (now_s() - t0) / MEMBENCH_LAT_ACCESSES * 1e9);
+    }
+    asm volatile("" ::"r"(off));
+    return best;
+}
+
+// Registers are only read, on their first word
+static double register_latency(volatile uint8_t *base) {
+    double best = 1e30, t0;
+    uint32_t acc = 0;
+
+    for (unsigned r = 0; r < runs; r++) {
+        t0 = now_s();
+        for (unsigned i = 0; i < MEMBENCH_LAT_ACCESSES; i++)
+            acc += *(volatile uint32_t *)base;
+        best = MIN(best, (now_s() - t0) / MEMBENCH_LAT_ACCESSES * 1e9);
+    }
+    asm volatile("" ::"r"(acc));
+    return best;
+}
+
+//////////////////////////////
+///// REPORT            //////
+//////////////////////////////
+
+static const char *attributes(const HeroRegion *r) {
+    if (r->flags & HERO_REGION_REGS)
+        return "regs";
+    return (r->flags & HERO_REGION_CACHED) ? "cached" : "uncached";
+}
+
+static void print_header() {
+    if (csv)
+        printf("region,phys,size,attr,width,threads,read_MBps,write_MBps,copy_MBps,latency_ns\n");
+    else
+        printf("%-20s %-12s %10s %-8s %5s %3s %10s %10s %10s %10s\n", "region", "phys", "size", "attr", "width", "thr",
+               "read MB/s", "write MB/s", "copy MB/s", "lat ns");
+}
+
+static void print_row(const HeroRegion *r, const char *width, unsigned n_threads, double rd, double wr, double cp,
+                      double lat) {
+    if (csv)
+        printf("%s,0x%lx,%zu,%s,%s,%u,%.2f,%.2f,%.2f,%.1f\n", r->name, (unsigned long)r->p_addr, r->size,
+               attributes(r), width, n_threads, rd, wr, cp, lat);
+    else
+        printf("%-20s 0x%-10lx %10zu %-8s %5s %3u %10.2f %10.2f %10.2f %10.1f\n", r->name, (unsigned long)r->p_addr,
+               r->size, attributes(r), width, n_threads, rd, wr, cp, lat);
+}
+
+static void bench_region(const HeroRegion *r) {
+    volatile uint8_t *base = (volatile uint8_t *)r->v_addr;
+    size_t size = MIN(window, r->size);
+
+    if (r->flags & HERO_REGION_REGS) {
+        print_row(r, "32", 1, 0, 0, 0, register_latency(base));
+        return;
+    }
+
+    double lat = latency(base, size);
+    for (unsigned w = 0; w < NUM_WIDTHS; w++)
+        for (unsigned t = 0; t < num_threads; t++) {
+            double rd = bandwidth(base, size, widths[w].bytes, OP_READ, threads[t]);
+            double wr = bandwidth(base, size, widths[w].bytes, OP_WRITE, threads[t]);
+            double cp = bandwidth(base, size, widths[w].bytes, OP_COPY, threads[t]);
+            print_row(r, widths[w].name, threads[t], rd, wr, cp, lat);
+        }
+}
+
+static int parse_args(int argc, char *argv[]) {
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-c")) {
+            csv = 1;
+        } else if (!strcmp(argv[i], "-s") && i + 1 < argc) {
+            window = strtoul(argv[++i], NULL, 0);
+        } else if (!strcmp(argv[i], "-r") && i + 1 < argc) {
+            runs = MAX(1, strtoul(argv[++i], NULL, 0));
+        } else if (!strcmp(argv[i], "-t") && i + 1 < argc) {
+            char *tok, *save;
+            num_threads = 0;
+            for (tok = strtok_r(argv[++i], ",", &save); tok && num_threads < MEMBENCH_MAX_THREADS;
+                 tok = strtok_r(NULL, ",", &save))
+                threads[num_threads++] = MAX(1, MIN(strtoul(tok, NULL, 0), MEMBENCH_MAX_THREADS));
+        } else {
+            fprintf(stderr, "Usage: %s [-s window_bytes] [-t threads,...] [-r runs] [-c]\n", argv[0]);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    HeroRegion regions[MEMBENCH_MAX_REGIONS + 1];
+    HeroDev dev = {0};
+    uintptr_t dma_v, dma_p;
+    int n;
+
+    if (parse_args(argc, argv))
+        return -1;
+
+    if (hero_dev_mmap(&dev)) {
+        fprintf(stderr, "Can't map the device\n");
+        return -1;
+    }
+    // Nothing may run on the device while its memories are overwritten
+    hero_dev_reset(&dev, 0);
+
+    n = hero_dev_get_regions(&dev, regions, MEMBENCH_MAX_REGIONS);
+
+    dma_v = hero_host_l3_malloc(&dev, window, &dma_p);
+    if (dma_v) {
+        char *cached = getenv("HERO_MAP_CACHED");
+        regions[n++] = (HeroRegion){.name = "dma_buf", .v_addr = (volatile void *)dma_v, .p_addr = dma_p,
+                                    .size = window, .flags = (cached && atoi(cached)) ? HERO_REGION_CACHED : 0};
+    } else {
+        fprintf(stderr, "Can't allocate a DMA buffer, skipping it\n");
+    }
+
+    print_header();
+    for (int i = 0; i < n; i++)
+        bench_region(&regions[i]);
+
+    // The mailboxes were never allocated, the driver file is closed on exit
+    return 0;
+}
@@ -0,0 +1,151 @@
+// Copyright 2024 ETH Zurich and University of Bologna.
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: Apache-2.0
+//
+// herod: keeps the device mapped and initialized (heaps, mailboxes) so that
+// applications started with HERO_DAEMON_SOCKET=<socket> attach to it instead
+// of initializing the device again (see src/common/hero_session.h). Clients
+// are served one at a time.
+//
+// Usage: herod [-s socket] [-b runs]
+//   -s socket path (default HERO_DAEMON_SOCKET or /tmp/herod.sock)
+//   -b measure the cold (no daemon) and warm (attached) hero_dev_mmap +
+//      hero_dev_init time over runs processes, then exit
+
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libhero/hero_api.h"
+#include "libhero/utils.h"
+
+#include "hero_session.h"
+
+#define HEROD_DEFAULT_SOCKET "/tmp/herod.sock"
+
+static double now_s() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int serve(const char *path) {
+    HeroDev dev = {0};
+    int err;
+
+    // The mirror lives in the memory of this process
+    unsetenv("HERO_MBOX_MIRROR");
+    unsetenv("HERO_DAEMON_SOCKET");
+
+    err = hero_dev_mmap(&dev);
+    if (err) {
+        fprintf(stderr, "Can't map the device\n");
+        return err;
+    }
+    err = hero_dev_init(&dev);
+    if (err) {
+        fprintf(stderr, "Can't initialize the device\n");
+        return err;
+    }
+    return hero_session_serve(&dev, path);
+}
+
+//////////////////////////////
+///// ATTACH BENCHMARK  //////
+//////////////////////////////
+
+// Time to get a usable device in a fresh process, as an application would
+static double attach_time(const char *socket) {
+    int pipe_fd[2];
+    double t = -1;
+
+    if (pipe(pipe_fd))
+        return -1;
+    if (!fork()) {
+        HeroDev dev = {0};
+        double t0;
+        if (socket)
+            setenv("HERO_DAEMON_SOCKET", socket, 1);
+        else
+            unsetenv("HERO_DAEMON_SOCKET");
+        t0 = now_s();
+        if (!hero_dev_mmap(&dev) && !hero_dev_init(&dev))
+            t = now_s() - t0;
+        if (write(pipe_fd[1], &t, sizeof(t)) != sizeof(t))
+            _exit(1);
+        hero_dev_munmap(&dev);
+        _exit(0);
+    }
+    if (read(pipe_fd[0], &t, sizeof(t)) != sizeof(t))
+        t = -1;
+    wait(NULL);
+    close(pipe_fd[0]);
+    close(pipe_fd[1]);
+    return t;
+}
+
+static void attach_stats(const char *name, const char *socket, int runs) {
+    double t, min = 1e30, sum = 0;
+    int ok = 0;
+
+    for (int r = 0; r < runs; r++) {
+        t = attach_time(socket);
+        if (t < 0)
+            continue;
+        min = MIN(min, t);
+        sum += t;
+        ok++;
+    }
+    if (ok)
+        printf("%-5s attach : min %10.1f us avg %10.1f us (%d runs)\n", name, min * 1e6, sum / ok * 1e6, ok);
+    else
+        printf("%-5s attach : failed\n", name);
+}
+
+static int bench(const char *path, int runs) {
+    struct stat st;
+    pid_t daemon;
+
+    // Cold first, the daemon must not own the device yet
+    attach_stats("cold", NULL, runs);
+
+    unlink(path);
+    daemon = fork();
+    if (!daemon)
+        _exit(serve(path) ? 1 : 0);
+    for (int i = 0; i < 1000 && stat(path, &st); i++)
+        usleep(1000);
+
+    attach_stats("warm", path, runs);
+
+    kill(daemon, SIGTERM);
+    waitpid(daemon, NULL, 0);
+    unlink(path);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    const char *path = getenv("HERO_DAEMON_SOCKET") ? getenv("HERO_DAEMON_SOCKET") : HEROD_DEFAULT_SOCKET;
+    int runs = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-s") && i + 1 < argc) {
+            path = argv[++i];
+        } else if (!strcmp(argv[i], "-b") && i + 1 < argc) {
+            runs = MAX(1, atoi(argv[++i]));
+        } else {
+            fprintf(stderr, "Usage: %s [-s socket] [-b runs]\n", argv[0]);
+            return -1;
+        }
+    }
+
+    if (runs)
+        return bench(path, runs);
+    return serve(path);
+}
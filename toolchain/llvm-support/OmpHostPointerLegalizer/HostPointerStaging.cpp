@@ -0,0 +1,440 @@
+// Copyright 2024 ETH Zurich and University of Bologna.
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: Apache-2.0
+//
+// This file is part of the HERCULES Compiler Passes for PREM transformation
+// of code.
+
+#include "HostPointerStaging.h"
+
+#include <llvm/ADT/STLExtras.h>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/Analysis/OptimizationRemarkEmitter.h>
+#include <llvm/Analysis/ScalarEvolutionExpressions.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/IntrinsicInst.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Transforms/Utils/BasicBlockUtils.h>
+#include <llvm/Transforms/Utils/Cloning.h>
+#include <llvm/Transforms/Utils/LoopUtils.h>
+#include <llvm/Transforms/Utils/ScalarEvolutionExpander.h>
+#include <llvm/Transforms/Utils/ValueMapper.h>
+
+#include <cmath>
+
+#define DEBUG_TYPE "hero-l1-staging"
+
+// Bulk copies between the host and L1, see hero_64.h
+#define OMP_STAGE_IN "hero_stage_host2dev"
+#define OMP_STAGE_OUT "hero_stage_dev2host"
+
+using namespace llvm;
+using namespace hrcl;
+
+static cl::opt<bool>
+    EnableStaging("hero-l1-staging", cl::init(true),
+                  cl::desc("Stage the host memory accessed by affine loops "
+                           "in L1 with bulk copies"));
+
+// The buffer is on the stack, which is in L1 (TCDM) on the HERO devices
+static cl::opt<unsigned>
+    StageMaxBytes("hero-l1-stage-max-bytes", cl::init(1024),
+                  cl::desc("L1 bytes available to stage the ranges of a loop"));
+
+// Cost model, in device cycles
+static cl::opt<unsigned> HostAccessCost(
+    "hero-l1-stage-access-cost", cl::init(12),
+    cl::desc("Cycles of one host access through hero_load/hero_store"));
+static cl::opt<unsigned>
+    StageCallCost("hero-l1-stage-call-cost", cl::init(60),
+                  cl::desc("Fixed cycles of one bulk copy"));
+static cl::opt<unsigned> StageBytesPerCycle(
+    "hero-l1-stage-bytes-per-cycle", cl::init(4),
+    cl::desc("Throughput of the bulk copies between the host and L1"));
+
+namespace {
+
+// Host accesses of a loop that fall in one contiguous range. The offsets are
+// relative to the start of the first access of the group.
+struct StageGroup {
+  const SCEV *Base;
+  const SCEV *FirstStart;
+  int64_t Step;
+  int64_t MinOff;
+  int64_t MaxEnd;
+  bool Stores = false;
+  // [Off, Off + Size) of the stores run by every iteration
+  SmallVector<std::pair<int64_t, int64_t>, 4> Stored;
+  SmallVector<Instruction *, 4> Accesses;
+  // Expanded in the preheader
+  Value *HostStart = nullptr;
+  Value *Bytes = nullptr;
+  Value *L1Offset = nullptr;
+  Value *L1Ptr = nullptr;
+};
+
+struct StagePlan {
+  Loop *L;
+  const SCEV *TripCount;
+  uint64_t MinTrip;
+  SmallVector<StageGroup, 4> Groups;
+};
+
+} // namespace
+
+static int64_t groupSpan(const StageGroup &G) { return G.MaxEnd - G.MinOff; }
+
+// The written ranges are copied back whole, so every byte of them has to be
+// stored by the loop. Otherwise the gaps would be overwritten with the data
+// staged before the loop, losing the writes of the other cores (e.g. with a
+// cyclic split of the iterations).
+static bool storesCoverGroup(StageGroup &G) {
+  if (G.Step != groupSpan(G))
+    return false;
+  llvm::sort(G.Stored);
+  int64_t Covered = G.MinOff;
+  for (auto &S : G.Stored) {
+    if (S.first > Covered)
+      return false;
+    Covered = std::max(Covered, S.second);
+  }
+  return Covered >= G.MaxEnd;
+}
+
+// Bytes of L1 needed to stage the groups for TripCount iterations, each range
+// keeps the alignment of the host address modulo 8
+static uint64_t stagedBytes(const StagePlan &Plan, uint64_t TripCount) {
+  uint64_t Bytes = 0;
+  for (const StageGroup &G : Plan.Groups)
+    Bytes += alignTo((TripCount - 1) * G.Step + groupSpan(G) + 8, 8);
+  return Bytes;
+}
+
+// Check that all the host accesses of L are affine and group them by range
+static bool planLoop(StagePlan &Plan, DominatorTree &DT, ScalarEvolution &SE,
+                     OptimizationRemarkEmitter &ORE,
+                     const DataLayout &DL, unsigned HostAS) {
+  Loop *L = Plan.L;
+  unsigned NumAccesses = 0;
+
+  if (!L->isLoopSimplifyForm() || !L->getExitingBlock() || !L->getExitBlock())
+    return false;
+  const SCEV *BTC = SE.getBackedgeTakenCount(L);
+  if (isa<SCEVCouldNotCompute>(BTC))
+    return false;
+  Type *HostIntTy = DL.getIntPtrType(L->getHeader()->getContext(), HostAS);
+  if (SE.getTypeSizeInBits(BTC->getType()) > DL.getTypeSizeInBits(HostIntTy))
+    return false;
+
+  for (BasicBlock *BB : L->blocks()) {
+    for (Instruction &I : *BB) {
+      // A call could access the staged ranges behind our back
+      if (auto *CB = dyn_cast<CallBase>(&I)) {
+        auto *II = dyn_cast<IntrinsicInst>(CB);
+        if (CB->mayReadOrWriteMemory() && !(II && II->isAssumeLikeIntrinsic()))
+          return false;
+        continue;
+      }
+      if (auto *RMW = dyn_cast<AtomicRMWInst>(&I))
+        if (RMW->getPointerAddressSpace() == HostAS)
+          return false;
+      if (auto *CX = dyn_cast<AtomicCmpXchgInst>(&I))
+        if (CX->getPointerAddressSpace() == HostAS)
+          return false;
+      Value *Ptr = getLoadStorePointerOperand(&I);
+      if (!Ptr || Ptr->getType()->getPointerAddressSpace() != HostAS)
+        continue;
+
+      // Volatile and atomic accesses stay on the host
+      bool IsStore = isa<StoreInst>(I);
+      if (IsStore ? !cast<StoreInst>(I).isSimple()
+                  : !cast<LoadInst>(I).isSimple())
+        return false;
+      int64_t Size = DL.getTypeStoreSize(getLoadStoreType(&I));
+      auto *AR = dyn_cast<SCEVAddRecExpr>(SE.getSCEV(Ptr));
+      if (!AR || AR->getLoop() != L || !AR->isAffine())
+        return false;
+      auto *StepC = dyn_cast<SCEVConstant>(AR->getStepRecurrence(SE));
+      if (!StepC)
+        return false;
+      // Forward only, the elements must not overlap
+      int64_t Step = StepC->getAPInt().getSExtValue();
+      if (Step < Size)
+        return false;
+      const SCEV *Start = AR->getStart();
+      if (!isSafeToExpandAt(Start, L->getLoopPreheader()->getTerminator(), SE))
+        return false;
+
+      // Accesses to the same object have to be at constant distances, or we
+      // can't tell which copy holds the data
+      const SCEV *Base = SE.getPointerBase(Start);
+      StageGroup *G = nullptr;
+      int64_t Off = 0;
+      for (StageGroup &Cand : Plan.Groups) {
+        if (Cand.Base != Base)
+          continue;
+        auto *D = dyn_cast<SCEVConstant>(SE.getMinusSCEV(Start, Cand.FirstStart));
+        if (!D || Cand.Step != Step)
+          return false;
+        G = &Cand;
+        Off = D->getAPInt().getSExtValue();
+        break;
+      }
+      if (!G) {
+        Plan.Groups.emplace_back();
+        G = &Plan.Groups.back();
+        G->Base = Base;
+        G->FirstStart = Start;
+        G->Step = Step;
+        G->MinOff = 0;
+        G->MaxEnd = Size;
+      }
+      G->MinOff = std::min(G->MinOff, Off);
+      G->MaxEnd = std::max(G->MaxEnd, Off + Size);
+      G->Stores |= IsStore;
+      if (IsStore && DT.dominates(BB, L->getLoopLatch()) &&
+          DT.dominates(BB, L->getExitingBlock()))
+        G->Stored.emplace_back(Off, Off + Size);
+      G->Accesses.push_back(&I);
+      NumAccesses++;
+    }
+  }
+  if (!NumAccesses)
+    return false;
+  for (StageGroup &G : Plan.Groups) {
+    if (G.Stores && !storesCoverGroup(G)) {
+      ORE.emit([&]() {
+        return OptimizationRemarkMissed(DEBUG_TYPE, "NotStaged",
+                                        L->getStartLoc(), L->getHeader())
+               << "host accesses of the loop not staged in L1: the stores "
+                  "don't cover the written range";
+      });
+      return false;
+    }
+  }
+
+  // Each host access of an iteration is replaced by an L1 access, for the
+  // price of copying the ranges in (and out if written)
+  double Fixed = 0, Saved = NumAccesses * (double)HostAccessCost;
+  for (StageGroup &G : Plan.Groups) {
+    unsigned Copies = G.Stores ? 2 : 1;
+    Fixed += Copies * (StageCallCost + (double)groupSpan(G) / StageBytesPerCycle);
+    Saved -= Copies * (double)G.Step / StageBytesPerCycle;
+  }
+  if (Saved <= 0) {
+    ORE.emit([&]() {
+      return OptimizationRemarkMissed(DEBUG_TYPE, "NotStaged", L->getStartLoc(),
+                                      L->getHeader())
+             << "host accesses of the loop not staged in L1: the bulk copies "
+                "don't pay off";
+    });
+    return false;
+  }
+  Plan.MinTrip = std::max<uint64_t>(1, std::ceil(Fixed / Saved));
+  if (stagedBytes(Plan, Plan.MinTrip) > StageMaxBytes) {
+    ORE.emit([&]() {
+      return OptimizationRemarkMissed(DEBUG_TYPE, "NotStaged", L->getStartLoc(),
+                                      L->getHeader())
+             << "host accesses of the loop not staged in L1: pays off after "
+             << ore::NV("MinTrip", Plan.MinTrip)
+             << " iterations, which don't fit in L1";
+    });
+    return false;
+  }
+
+  Plan.TripCount = SE.getAddExpr(SE.getZeroExtendExpr(BTC, HostIntTy),
+                                 SE.getOne(HostIntTy));
+  if (auto *TC = dyn_cast<SCEVConstant>(Plan.TripCount)) {
+    uint64_t N = TC->getAPInt().getZExtValue();
+    if (N < Plan.MinTrip || stagedBytes(Plan, N) > StageMaxBytes) {
+      ORE.emit([&]() {
+        return OptimizationRemarkMissed(DEBUG_TYPE, "NotStaged",
+                                        L->getStartLoc(), L->getHeader())
+               << "host accesses of the loop not staged in L1: "
+               << ore::NV("TripCount", N) << " iterations";
+      });
+      return false;
+    }
+  }
+  return true;
+}
+
+static void stageLoop(StagePlan &Plan, AllocaInst *Buf, LoopInfo &LI,
+                      OptimizationRemarkEmitter &ORE,
+                      DominatorTree &DT, ScalarEvolution &SE,
+                      unsigned HostAS, unsigned DeviceAS) {
+  Loop *L = Plan.L;
+  Function &F = *L->getHeader()->getParent();
+  Module &M = *F.getParent();
+  const DataLayout &DL = M.getDataLayout();
+  LLVMContext &Ctx = F.getContext();
+  Type *HostIntTy = DL.getIntPtrType(Ctx, HostAS);
+  Type *DevIntTy = DL.getIntPtrType(Ctx, DeviceAS);
+  Type *Int8Ty = Type::getInt8Ty(Ctx);
+  DebugLoc Loc = L->getStartLoc();
+
+  formLCSSA(*L, DT, &LI, &SE);
+  BasicBlock *PH = L->getLoopPreheader();
+  BasicBlock *Exiting = L->getExitingBlock();
+  BasicBlock *Exit = L->getExitBlock();
+
+  // Ranges and L1 layout, in the preheader
+  Instruction *At = PH->getTerminator();
+  IRBuilder<> B(At);
+  SCEVExpander Exp(SE, DL, "hero.stage");
+  Value *TripCount = Exp.expandCodeFor(Plan.TripCount, HostIntTy, At);
+  Value *Iters = B.CreateSub(TripCount, ConstantInt::get(HostIntTy, 1));
+  Value *L1End = nullptr;
+  for (StageGroup &G : Plan.Groups) {
+    const SCEV *Start =
+        SE.getAddExpr(SE.getPtrToIntExpr(G.FirstStart, HostIntTy),
+                      SE.getConstant(HostIntTy, G.MinOff, true));
+    G.HostStart = Exp.expandCodeFor(Start, HostIntTy, At);
+    G.Bytes = B.CreateAdd(B.CreateMul(Iters, ConstantInt::get(HostIntTy, G.Step)),
+                          ConstantInt::get(HostIntTy, groupSpan(G)));
+    G.L1Offset = B.CreateAnd(G.HostStart, 7);
+    if (L1End)
+      G.L1Offset = B.CreateAdd(L1End, G.L1Offset);
+    L1End = B.CreateAnd(B.CreateAdd(B.CreateAdd(G.L1Offset, G.Bytes),
+                                    ConstantInt::get(HostIntTy, 7)),
+                        ConstantInt::get(HostIntTy, ~7ULL));
+  }
+
+  // Stage when it pays off, it fits and the written ranges don't overlap
+  // the others. Constant trip counts have been checked already.
+  Value *Cond = nullptr;
+  auto AddCheck = [&](Value *Check) {
+    Cond = Cond ? B.CreateAnd(Cond, Check) : Check;
+  };
+  if (!isa<SCEVConstant>(Plan.TripCount)) {
+    AddCheck(B.CreateICmpUGE(TripCount, ConstantInt::get(HostIntTy, Plan.MinTrip)));
+    AddCheck(B.CreateICmpULE(L1End, ConstantInt::get(HostIntTy, StageMaxBytes)));
+  }
+  for (unsigned I = 0; I < Plan.Groups.size(); I++) {
+    for (unsigned J = I + 1; J < Plan.Groups.size(); J++) {
+      StageGroup &A = Plan.Groups[I], &C = Plan.Groups[J];
+      if (!A.Stores && !C.Stores)
+        continue;
+      Value *AEnd = B.CreateAdd(A.HostStart, A.Bytes);
+      Value *CEnd = B.CreateAdd(C.HostStart, C.Bytes);
+      AddCheck(B.CreateOr(B.CreateICmpULE(AEnd, C.HostStart),
+                          B.CreateICmpULE(CEnd, A.HostStart)));
+    }
+  }
+
+  BasicBlock *StagePH = PH;
+  if (Cond) {
+    // Keep the original loop for the other cases, the host accesses are
+    // legalized one by one there
+    StagePH = SplitBlock(PH, At, &DT, &LI, nullptr,
+                         L->getHeader()->getName() + ".stage.ph");
+    ValueToValueMapTy VMap;
+    SmallVector<BasicBlock *, 8> Blocks;
+    Loop *Fallback = cloneLoopWithPreheader(StagePH, PH, L, VMap, ".nostage",
+                                            &LI, &DT, Blocks);
+    remapInstructionsInBlocks(Blocks, VMap);
+    Instruction *Term = PH->getTerminator();
+    BranchInst::Create(StagePH, Fallback->getLoopPreheader(), Cond, Term);
+    Term->eraseFromParent();
+    DT.changeImmediateDominator(Exit, PH);
+
+    // Both loops leave through the exit block (LCSSA)
+    BasicBlock *FallbackExiting = cast<BasicBlock>(VMap[Exiting]);
+    for (PHINode &PN : Exit->phis()) {
+      Value *V = PN.getIncomingValueForBlock(Exiting);
+      Value *NV = VMap.lookup(V);
+      PN.addIncoming(NV ? NV : V, FallbackExiting);
+    }
+  }
+
+  // Copy the ranges to L1
+  FunctionType *InTy = FunctionType::get(Type::getVoidTy(Ctx),
+                                         {DevIntTy, HostIntTy, DevIntTy}, false);
+  FunctionCallee StageIn = M.getOrInsertFunction(OMP_STAGE_IN, InTy);
+  Type *IdxTy = DL.getIndexType(Buf->getType());
+  B.SetInsertPoint(StagePH->getTerminator());
+  Value *BufI8 = B.CreatePointerCast(Buf, Int8Ty->getPointerTo(DeviceAS));
+  for (StageGroup &G : Plan.Groups) {
+    G.L1Ptr = B.CreateGEP(Int8Ty, BufI8, B.CreateZExtOrTrunc(G.L1Offset, IdxTy));
+    CallInst *CI = B.CreateCall(StageIn, {B.CreatePtrToInt(G.L1Ptr, DevIntTy), G.HostStart,
+                                          B.CreateTrunc(G.Bytes, DevIntTy)});
+    CI->setDebugLoc(Loc);
+  }
+
+  // Write the modified ranges back on the staged path only
+  BasicBlock *Out = SplitEdge(Exiting, Exit, &DT, &LI);
+  B.SetInsertPoint(Out->getTerminator());
+  FunctionType *OutTy = FunctionType::get(Type::getVoidTy(Ctx),
+                                          {HostIntTy, DevIntTy, DevIntTy}, false);
+  for (StageGroup &G : Plan.Groups) {
+    if (!G.Stores)
+      continue;
+    FunctionCallee StageOut = M.getOrInsertFunction(OMP_STAGE_OUT, OutTy);
+    CallInst *CI = B.CreateCall(StageOut, {G.HostStart, B.CreatePtrToInt(G.L1Ptr, DevIntTy),
+                                           B.CreateTrunc(G.Bytes, DevIntTy)});
+    CI->setDebugLoc(Loc);
+  }
+
+  // Redirect the accesses to the staged copy
+  for (StageGroup &G : Plan.Groups) {
+    for (Instruction *I : G.Accesses) {
+      unsigned Idx = isa<LoadInst>(I) ? LoadInst::getPointerOperandIndex()
+                                      : StoreInst::getPointerOperandIndex();
+      Value *Ptr = I->getOperand(Idx);
+      B.SetInsertPoint(I);
+      Value *Off = B.CreateSub(B.CreatePtrToInt(Ptr, HostIntTy), G.HostStart);
+      Value *L1 = B.CreateGEP(Int8Ty, G.L1Ptr, B.CreateZExtOrTrunc(Off, IdxTy));
+      I->setOperand(Idx, B.CreatePointerCast(
+                             L1, PointerType::getWithSamePointeeType(
+                                     cast<PointerType>(Ptr->getType()), DeviceAS)));
+    }
+  }
+
+  SE.forgetLoop(L);
+  ORE.emit([&]() {
+    return OptimizationRemark(DEBUG_TYPE, "Staged", L->getStartLoc(),
+                              L->getHeader())
+           << "staged " << ore::NV("Ranges", (unsigned)Plan.Groups.size())
+           << " host ranges of the loop in L1, pays off after "
+           << ore::NV("MinTrip", Plan.MinTrip) << " iterations";
+  });
+}
+
+bool hrcl::stageHostPointerLoops(Function &F, LoopInfo &LI, DominatorTree &DT,
+                                 ScalarEvolution &SE, unsigned HostAS,
+                                 unsigned DeviceAS) {
+  const DataLayout &DL = F.getParent()->getDataLayout();
+  AllocaInst *Buf = nullptr;
+  bool Changed = false;
+
+  // Not in the support functions, nor without an L1 stack
+  if (!EnableStaging || F.isDeclaration() || F.getName().startswith("hero_") ||
+      DL.getAllocaAddrSpace() != DeviceAS)
+    return false;
+
+  OptimizationRemarkEmitter ORE(&F);
+  SmallVector<Loop *, 8> Loops;
+  for (Loop *L : LI.getLoopsInPreorder())
+    if (L->isInnermost())
+      Loops.push_back(L);
+
+  for (Loop *L : Loops) {
+    StagePlan Plan;
+    Plan.L = L;
+    if (!planLoop(Plan, DT, SE, ORE, DL, HostAS))
+      continue;
+    // The innermost loops run one after the other, they share the buffer
+    if (!Buf) {
+      BasicBlock &Entry = F.getEntryBlock();
+      Buf = new AllocaInst(ArrayType::get(Type::getInt8Ty(F.getContext()), StageMaxBytes),
+                           DL.getAllocaAddrSpace(), nullptr, Align(8), "hero.stage.buf",
+                           &*Entry.getFirstInsertionPt());
+    }
+    stageLoop(Plan, Buf, LI, ORE, DT, SE, HostAS, DeviceAS);
+    Changed = true;
+  }
+  return Changed;
+}
@@ -0,0 +1,29 @@
+// Copyright 2024 ETH Zurich and University of Bologna.
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: Apache-2.0
+//
+// This file is part of the HERCULES Compiler Passes for PREM transformation
+// of code.
+
+#ifndef HOST_POINTER_STAGING_H
+#define HOST_POINTER_STAGING_H
+
+#include <llvm/Analysis/LoopInfo.h>
+#include <llvm/Analysis/ScalarEvolution.h>
+#include <llvm/IR/Dominators.h>
+#include <llvm/IR/Function.h>
+
+namespace hrcl {
+
+// Copy the host memory accessed by the affine innermost loops of F to an L1
+// (stack) buffer before the loop and back after it, so that the loop accesses
+// L1 instead of going through hero_load/hero_store for every element. When
+// the cost model can't tell at compile time, the loop is versioned and the
+// original loop is kept for the small trip counts and the overlapping ranges.
+bool stageHostPointerLoops(llvm::Function &F, llvm::LoopInfo &LI,
+                           llvm::DominatorTree &DT, llvm::ScalarEvolution &SE,
+                           unsigned HostAS, unsigned DeviceAS);
+
+} // namespace hrcl
+
+#endif
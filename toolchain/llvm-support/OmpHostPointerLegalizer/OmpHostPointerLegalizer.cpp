@@ -6,40 +6,121 @@
 // of code.
 
 #include "OmpHostPointerLegalizer.h"
+#include "HostPointerStaging.h"
 
 #include "llvm/Transforms/Utils/LowerMemIntrinsics.h"
+#include <llvm/ADT/SmallPtrSet.h>
 #include <llvm/ADT/SmallVector.h>
+#include <llvm/Analysis/MustExecute.h>
+#include <llvm/Analysis/OptimizationRemarkEmitter.h>
 #include <llvm/IR/AbstractCallSite.h>
 #include <llvm/IR/Constants.h>
 #include <llvm/IR/Function.h>
 #include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/InstIterator.h>
 #include <llvm/IR/InstVisitor.h>
 #include <llvm/IR/InstrTypes.h>
+#include <llvm/IR/IntrinsicInst.h>
 #include <llvm/IR/Instructions.h>
 #include <llvm/IR/LegacyPassManager.h>
 #include <llvm/IR/Operator.h>
 #include <llvm/IR/Value.h>
+#include <llvm/Passes/PassBuilder.h>
+#include <llvm/Passes/PassPlugin.h>
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/JSON.h>
+#include <llvm/Support/raw_ostream.h>
 #include <llvm/Transforms/IPO.h>
 #include <llvm/Transforms/IPO/PassManagerBuilder.h>
 #include <llvm/Transforms/Utils/BasicBlockUtils.h>
 #include <llvm/Transforms/Utils/Cloning.h>
+#include <llvm/Transforms/Utils/ModuleUtils.h>
 
 #include <vector>
 
+#define DEBUG_TYPE "hero-host-pointer-legalizer"
+
 #define OMP_LOAD_PREFIX "hero_load"
 #define OMP_STORE_PREFIX "hero_store"
+// Accesses within a host window, see hero_64.h
+#define OMP_WINDOW_LOAD_PREFIX "hero_window_load"
+#define OMP_WINDOW_STORE_PREFIX "hero_window_store"
+#define OMP_WINDOW_OPEN "hero_window_open"
+#define OMP_WINDOW_CLOSE "hero_window_close"
+// Block accesses, see hero_64.h
+#define OMP_BLOCK_PREFIXES                                                     \
+  { "hero_memcpy_", "hero_memmove_host", "hero_memset_host", "hero_stage_" }
 
 using namespace llvm;
 using namespace hrcl;
 
+// Interrupts are disabled within a window, bound its length
+static cl::opt<unsigned> WindowMaxAccesses(
+    "hero-window-max-accesses", cl::init(16),
+    cl::desc("Host accesses coalesced in one host window, 1 disables the "
+             "coalescing"));
+
+// The accessors only take integer addresses, so LLVM has to assume they
+// clobber all the memory unless told otherwise
+static cl::opt<bool> AccessorAttrs(
+    "hero-host-accessor-attrs", cl::init(true),
+    cl::desc("Model the host memory as inaccessible memory on the host "
+             "accessor calls, assumes that a buffer is not accessed through "
+             "both a host and a device pointer in a kernel"));
+
+// Smaller constant-size intrinsics are expanded inline as before
+static cl::opt<unsigned> MemInlineBytes(
+    "hero-mem-inline-bytes", cl::init(16),
+    cl::desc("Largest constant-size host memcpy/memmove/memset expanded as "
+             "a loop of host accesses instead of a block access call"));
+
+// The remarks tell where, the report sums up per function
+static cl::opt<std::string> ReportFile(
+    "hero-legalizer-report", cl::value_desc("filename"),
+    cl::desc("Write the static count of host accesses of each function after "
+             "legalization to a JSON file"));
+
+// Functions of other objects may still call the global ones, the linker's
+// --gc-sections takes care of these
+static cl::opt<bool> DeviceGC(
+    "hero-device-gc", cl::init(false),
+    cl::desc("Remove the host accessors of hero_64.h that are not "
+             "reachable from the offload entries after legalization, "
+             "although hero_64.h marks them as used"));
+
 static unsigned HostAS = 0;
 static unsigned DeviceAS = 0;
 
+// Host memory is only reached through the accessors: as memory the module
+// can't access, device accesses are independent of the accessors and host
+// loads can be hoisted and CSE'd as long as there is no host store between
+// them. Volatile and atomic accesses keep opaque calls.
+static void setAccessorAttrs(CallInst *CI, bool IsStore) {
+  if (!AccessorAttrs) {
+    return;
+  }
+  CI->addFnAttr(Attribute::InaccessibleMemOnly);
+  CI->addFnAttr(IsStore ? Attribute::WriteOnly : Attribute::ReadOnly);
+  CI->addFnAttr(Attribute::NoUnwind);
+  CI->addFnAttr(Attribute::WillReturn);
+}
+
+static bool isCoalescableHostAccess(Instruction &I) {
+  if (auto *LI = dyn_cast<LoadInst>(&I))
+    return LI->getPointerAddressSpace() == HostAS && !LI->isAtomic();
+  if (auto *SI = dyn_cast<StoreInst>(&I))
+    return SI->getPointerAddressSpace() == HostAS && !SI->isAtomic();
+  return false;
+}
+
 class HostPointerVisitor : public InstVisitor<HostPointerVisitor> {
   Module *M;
+  const SmallPtrSetImpl<Instruction *> &Windowed;
 
 public:
-  HostPointerVisitor(Module *IM) : M(IM) {}
+  HostPointerVisitor(Module *IM, const SmallPtrSetImpl<Instruction *> &W)
+      : M(IM), Windowed(W) {}
 
   void visitLoadInst(LoadInst &LI) {
     // Do not modify loads in support functions
@@ -60,7 +141,8 @@ public:
     if (!DS) {
       DS = M->getDataLayout().getTypeAllocSizeInBits(PDT);
     }
-    std::string FName = OMP_LOAD_PREFIX;
+    std::string FName =
+        Windowed.count(&LI) ? OMP_WINDOW_LOAD_PREFIX : OMP_LOAD_PREFIX;
     FName += "_uint";
     FName += std::to_string(DS);
 
@@ -77,6 +159,9 @@ public:
     DebugLoc DL = LI.getDebugLoc();
     CallInst *CI = CallInst::Create(FTy, F, {PII}, "", &LI);
     CI->setDebugLoc(DL);
+    if (LI.isSimple()) {
+      setAccessorAttrs(CI, false);
+    }
     Instruction *CTI = CI;
     // If the type we are trying to load is not the same as dictated by the
     // hero_store function, we need to cast it. For pointers we use the IntToPtr
@@ -124,7 +209,8 @@ public:
     if (!DS) {
       DS = M->getDataLayout().getTypeAllocSizeInBits(PDT);
     }
-    std::string FName = OMP_STORE_PREFIX;
+    std::string FName =
+        Windowed.count(&SI) ? OMP_WINDOW_STORE_PREFIX : OMP_STORE_PREFIX;
     FName += "_uint";
     FName += std::to_string(DS);
 
@@ -172,6 +258,9 @@ public:
     DebugLoc DL = SI.getDebugLoc();
     CallInst *CI = CallInst::Create(FTy, F, {PII, SVI}, "", &SI);
     CI->setDebugLoc(DL);
+    if (SI.isSimple()) {
+      setAccessorAttrs(CI, true);
+    }
 
     // Replace store with call
     SI.replaceAllUsesWith(CI);
@@ -204,8 +293,12 @@ public:
   }
 };
 
-static void handleConstExpr(ConstantExpr *CE, HostPointerVisitor &HPV,
-                            Module *M) {
+// Shared constant expressions are only walked once
+static void handleConstExpr(ConstantExpr *CE, Module *M,
+                            SmallPtrSetImpl<ConstantExpr *> &Visited) {
+  if (!Visited.insert(CE).second) {
+    return;
+  }
   // Replace address space conversion
   if (CE->getOpcode() == Instruction::AddrSpaceCast) {
     Type *PST = CE->getOperand(0)->getType();
@@ -239,10 +332,95 @@ static void handleConstExpr(ConstantExpr *CE, HostPointerVisitor &HPV,
     if (!NCE) {
       continue;
     }
-    handleConstExpr(NCE, HPV, M);
+    handleConstExpr(NCE, M, Visited);
   }
 }
 
+// Lower a memory intrinsic on host memory to the block accesses of hero_64.h,
+// which use the DMA for large copies. Returns false if it has to be expanded
+// as a loop instead.
+static bool lowerToBlockAccess(MemIntrinsic *MI) {
+  Module *M = MI->getModule();
+  LLVMContext &Ctx = M->getContext();
+  const DataLayout &DL = M->getDataLayout();
+  Type *HostIntTy = DL.getIntPtrType(Ctx, HostAS);
+  Type *SizeTy = DL.getIntPtrType(Ctx, DeviceAS);
+  Type *DevPtrTy = Type::getInt8PtrTy(Ctx, DeviceAS);
+  auto *ConstLen = dyn_cast<ConstantInt>(MI->getLength());
+
+  if (MI->isVolatile() ||
+      (ConstLen && ConstLen->getZExtValue() <= MemInlineBytes)) {
+    return false;
+  }
+
+  IRBuilder<> B(MI);
+  // Host addresses are integers, device addresses stay pointers
+  auto Addr = [&](Value *Ptr) -> Value * {
+    if (Ptr->getType()->getPointerAddressSpace() == HostAS) {
+      return B.CreatePtrToInt(Ptr, HostIntTy);
+    }
+    return B.CreatePointerCast(Ptr, DevPtrTy);
+  };
+  Value *Dst = Addr(MI->getRawDest());
+  Value *Len = B.CreateZExtOrTrunc(MI->getLength(), SizeTy);
+  bool DstHost = MI->getDestAddressSpace() == HostAS;
+  std::string FName;
+  SmallVector<Value *, 3> Args = {Dst};
+
+  if (auto *MS = dyn_cast<MemSetInst>(MI)) {
+    FName = "hero_memset_host";
+    Args.push_back(MS->getValue());
+  } else {
+    auto *MT = cast<MemTransferInst>(MI);
+    bool SrcHost = MT->getSourceAddressSpace() == HostAS;
+    Args.push_back(Addr(MT->getRawSource()));
+    // Host and device memory don't overlap, memmove is only needed within
+    // the host memory
+    if (SrcHost && DstHost) {
+      FName = isa<MemMoveInst>(MT) ? "hero_memmove_host" : "hero_memcpy_host2host";
+    } else {
+      FName = SrcHost ? "hero_memcpy_host2dev" : "hero_memcpy_dev2host";
+    }
+  }
+  Args.push_back(Len);
+
+  SmallVector<Type *, 3> ArgTys;
+  for (Value *Arg : Args) {
+    ArgTys.push_back(Arg->getType());
+  }
+  FunctionType *FTy =
+      FunctionType::get(Type::getVoidTy(Ctx), ArgTys, false);
+  CallInst *CI = B.CreateCall(M->getOrInsertFunction(FName, FTy), Args);
+  CI->setDebugLoc(MI->getDebugLoc());
+  OptimizationRemarkEmitter ORE(MI->getFunction());
+  ORE.emit([&]() {
+    return OptimizationRemark(DEBUG_TYPE, "BlockAccess", MI)
+           << ore::NV("Intrinsic", MI->getCalledFunction()) << " lowered to "
+           << ore::NV("Callee", FName);
+  });
+  if (AccessorAttrs) {
+    CI->addFnAttr(Attribute::InaccessibleMemOrArgMemOnly);
+    CI->addFnAttr(Attribute::NoUnwind);
+    CI->addFnAttr(Attribute::WillReturn);
+  }
+  MI->eraseFromParent();
+  return true;
+}
+
+// Memory intrinsic expanded as a loop of host accesses
+static void remarkExpandedMemIntrinsic(MemIntrinsic *MI) {
+  OptimizationRemarkEmitter ORE(MI->getFunction());
+  ORE.emit([&]() {
+    OptimizationRemarkMissed R(DEBUG_TYPE, "ExpandedMemIntrinsic", MI);
+    R << ore::NV("Intrinsic", MI->getCalledFunction())
+      << " expanded as a loop of host accesses";
+    if (MI->isVolatile()) {
+      R << " (volatile)";
+    }
+    return R;
+  });
+}
+
 // The ugly expandMem*AsLoop functions don't return a handle, so after each time
 // such a function is called we need to go through the function and add it.
 void addDbgMetadataToCallsIfNonePresent(Function &F, DebugLoc &DL) {
@@ -255,7 +433,7 @@ void addDbgMetadataToCallsIfNonePresent(Function &F, DebugLoc &DL) {
   }
 }
 
-void OmpHostPointerLegalizer::expandMemIntrinsicUses(Function &F) {
+void HostPointerLegalizer::expandMemIntrinsicUses(Function &F) {
   llvm::Intrinsic::ID IID = F.getIntrinsicID();
 
   for (auto I = F.user_begin(), E = F.user_end(); I != E;) {
@@ -270,9 +448,13 @@ void OmpHostPointerLegalizer::expandMemIntrinsicUses(Function &F) {
           Memcpy->getDestAddressSpace() == DeviceAS) {
         break;
       }
+      if (lowerToBlockAccess(Memcpy)) {
+        break;
+      }
       Function *ParentFunc = Memcpy->getParent()->getParent();
-      const TargetTransformInfo &TTI =
-          getAnalysis<TargetTransformInfoWrapperPass>().getTTI(*ParentFunc);
+      const TargetTransformInfo &TTI = GetTTI(*ParentFunc);
+      remarkExpandedMemIntrinsic(Memcpy);
+      ExpandedMemIntrinsics[&userF]++;
       DebugLoc DL = Memcpy->getDebugLoc();
       expandMemCpyAsLoop(Memcpy, TTI);
       addDbgMetadataToCallsIfNonePresent(userF, DL);
@@ -285,6 +467,11 @@ void OmpHostPointerLegalizer::expandMemIntrinsicUses(Function &F) {
           Memmove->getDestAddressSpace() == DeviceAS) {
         break;
       }
+      if (lowerToBlockAccess(Memmove)) {
+        break;
+      }
+      remarkExpandedMemIntrinsic(Memmove);
+      ExpandedMemIntrinsics[&userF]++;
       DebugLoc DL = Memmove->getDebugLoc();
       expandMemMoveAsLoop(Memmove);
       addDbgMetadataToCallsIfNonePresent(userF, DL);
@@ -296,6 +483,11 @@ void OmpHostPointerLegalizer::expandMemIntrinsicUses(Function &F) {
       if (Memset->getDestAddressSpace() == DeviceAS) {
         break;
       }
+      if (lowerToBlockAccess(Memset)) {
+        break;
+      }
+      remarkExpandedMemIntrinsic(Memset);
+      ExpandedMemIntrinsics[&userF]++;
       DebugLoc DL = Memset->getDebugLoc();
       expandMemSetAsLoop(Memset);
       addDbgMetadataToCallsIfNonePresent(userF, DL);
@@ -308,7 +500,111 @@ void OmpHostPointerLegalizer::expandMemIntrinsicUses(Function &F) {
   }
 }
 
-bool OmpHostPointerLegalizer::runOnModule(Module &M) {
+void HostPointerLegalizer::coalesceHostAccesses(
+    Function &F, SmallPtrSetImpl<Instruction *> &Windowed) {
+  Module *M = F.getParent();
+  LLVMContext &Ctx = M->getContext();
+  FunctionType *OpenTy = FunctionType::get(Type::getInt32Ty(Ctx), false);
+  FunctionType *CloseTy = FunctionType::get(Type::getVoidTy(Ctx),
+                                            {Type::getInt32Ty(Ctx)}, false);
+  SmallVector<Instruction *, 16> Run;
+
+  // Bracket the run with a single window, its accesses become plain accesses
+  auto CloseRun = [&]() {
+    if (Run.size() >= 2) {
+      Value *Open = M->getOrInsertFunction(OMP_WINDOW_OPEN, OpenTy).getCallee();
+      Value *Close =
+          M->getOrInsertFunction(OMP_WINDOW_CLOSE, CloseTy).getCallee();
+      CallInst *OCI = CallInst::Create(OpenTy, Open, {}, "", Run.front());
+      OCI->setDebugLoc(Run.front()->getDebugLoc());
+      CallInst *CCI = CallInst::Create(CloseTy, Close, {OCI});
+      CCI->insertAfter(Run.back());
+      CCI->setDebugLoc(Run.back()->getDebugLoc());
+      // They write the CSRs, modeled as host memory so that the window
+      // accesses stay in between
+      for (CallInst *CI : {OCI, CCI}) {
+        if (AccessorAttrs) {
+          CI->addFnAttr(Attribute::InaccessibleMemOnly);
+          CI->addFnAttr(Attribute::NoUnwind);
+          CI->addFnAttr(Attribute::WillReturn);
+        }
+      }
+      Windowed.insert(Run.begin(), Run.end());
+    }
+    Run.clear();
+  };
+
+  for (auto &Block : F) {
+    for (auto &Inst : Block) {
+      if (isCoalescableHostAccess(Inst)) {
+        Run.push_back(&Inst);
+        if (Run.size() >= WindowMaxAccesses) {
+          CloseRun();
+        }
+        continue;
+      }
+      // Only computations may run within a window
+      if (Inst.mayReadOrWriteMemory() || isa<CallBase>(Inst) ||
+          Inst.isTerminator()) {
+        CloseRun();
+      }
+    }
+    CloseRun();
+  }
+}
+
+void HostPointerLegalizer::hoistInvariantHostLoads(Function &F,
+                                                      LoopInfo &LI,
+                                                      DominatorTree &DT) {
+  // Inner loops first, so that the loads climb the whole loop nest
+  SmallVector<Loop *, 8> Loops = LI.getLoopsInPreorder();
+  for (Loop *L : reverse(Loops)) {
+    BasicBlock *PH = L->getLoopPreheader();
+    SmallVector<LoadInst *, 8> Loads;
+    bool Clobbered = false;
+    if (!PH) {
+      continue;
+    }
+
+    // Device stores don't reach the host memory, only host stores and
+    // anything that may write memory behind our back clobber it
+    for (BasicBlock *BB : L->blocks()) {
+      for (Instruction &I : *BB) {
+        if (auto *LD = dyn_cast<LoadInst>(&I)) {
+          if (LD->getPointerAddressSpace() == HostAS && LD->isSimple()) {
+            Loads.push_back(LD);
+          }
+          continue;
+        }
+        if (auto *SI = dyn_cast<StoreInst>(&I)) {
+          Clobbered |= SI->getPointerAddressSpace() == HostAS;
+          continue;
+        }
+        auto *II = dyn_cast<IntrinsicInst>(&I);
+        if (II && II->isAssumeLikeIntrinsic()) {
+          continue;
+        }
+        Clobbered |= I.mayWriteToMemory();
+      }
+    }
+    if (Clobbered || Loads.empty()) {
+      continue;
+    }
+
+    ICFLoopSafetyInfo SafetyInfo;
+    SafetyInfo.computeLoopSafetyInfo(L);
+    for (LoadInst *LD : Loads) {
+      if (!L->isLoopInvariant(LD->getPointerOperand()) ||
+          !SafetyInfo.isGuaranteedToExecute(*LD, &DT, L)) {
+        continue;
+      }
+      LD->moveBefore(PH->getTerminator());
+      LD->updateLocationAfterHoist();
+    }
+  }
+}
+
+bool HostPointerLegalizer::run(Module &M) {
   DeviceAS = M.getDataLayout().getProgramAddressSpace();
   if (DeviceAS == 0) {
     HostAS = 1;
@@ -324,28 +620,349 @@ bool OmpHostPointerLegalizer::runOnModule(Module &M) {
     expandMemIntrinsicUses(Func);
   }
 
+  // Move the host ranges of affine loops to L1, before the remaining host
+  // accesses are patched one by one
+  for (auto &Func : M) {
+    if (Func.isDeclaration()) {
+      continue;
+    }
+    LoopAnalyses LA = GetLoopAnalyses(Func);
+    DominatorTree &DT = LA.DT;
+    LoopInfo &LI = LA.LI;
+    ScalarEvolution &SE = LA.SE;
+    // Once the host loads are calls, LICM can't tell that the device stores
+    // of the loop don't clobber them
+    if (AccessorAttrs && !Func.getName().startswith("hero_")) {
+      hoistInvariantHostLoads(Func, LI, DT);
+    }
+    stageHostPointerLoops(Func, LI, DT, SE, HostAS, DeviceAS);
+  }
+
+  // Share one host window between adjacent host accesses
+  SmallPtrSet<Instruction *, 32> Windowed;
+  for (auto &Func : M) {
+    if (Func.isDeclaration() || Func.getName().startswith("hero_")) {
+      continue;
+    }
+    coalesceHostAccesses(Func, Windowed);
+  }
+
   // Patch instructions
-  HostPointerVisitor HPV(&M);
+  HostPointerVisitor HPV(&M, Windowed);
   HPV.visit(M);
 
   // Patch constant expressions in functions and globals
   // FIXME: there is a lack of functionality to iterate over ConstantExprs
+  SmallPtrSet<ConstantExpr *, 32> VisitedCEs;
   for (auto &Func : M) {
     for (auto &Block : Func) {
       for (auto &Inst : Block) {
         for (auto &Op : Inst.operands()) {
           auto CE = dyn_cast<ConstantExpr>(Op.get());
           if (CE) {
-            handleConstExpr(CE, HPV, &M);
+            handleConstExpr(CE, &M, VisitedCEs);
           }
         }
       }
     }
   }
 
+  if (DeviceGC) {
+    stripUnreachableFunctions(M);
+  }
+  reportHostAccesses(M);
+  ExpandedMemIntrinsics.clear();
+  StrippedFunctions.clear();
   return true;
 }
 
+// The host accessors and helpers of hero_64.h
+static bool isHostAccessor(const Function &Func) {
+  StringRef Name = Func.getName();
+  if (Name.startswith(OMP_LOAD_PREFIX) || Name.startswith(OMP_STORE_PREFIX) ||
+      Name.startswith("hero_window_") || Name.startswith("__hero_64")) {
+    return true;
+  }
+  for (const char *Prefix : OMP_BLOCK_PREFIXES) {
+    if (Name.startswith(Prefix)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// The accessors have to be kept until the legalization calls them, hence
+// `used`. Once it is done, the accessors that nothing live reaches are dead:
+// the roots are the global variables, among them the offload entries, and
+// all the other functions. Those may be `used` for other reasons, e.g. an
+// interrupt handler called from module asm.
+void HostPointerLegalizer::stripUnreachableFunctions(Module &M) {
+  SmallPtrSet<GlobalValue *, 32> Live;
+  SmallPtrSet<Constant *, 32> Visited;
+  SmallVector<Constant *, 64> Work;
+  auto Mark = [&](Constant *C) {
+    if (Visited.insert(C).second) {
+      Work.push_back(C);
+    }
+  };
+  for (auto &G : M.globals()) {
+    if (G.getName() != "llvm.used" && G.getName() != "llvm.compiler.used") {
+      Mark(&G);
+    }
+  }
+  for (auto &Func : M) {
+    if (!Func.hasLocalLinkage() || !isHostAccessor(Func)) {
+      Mark(&Func);
+    }
+  }
+  for (auto &A : M.aliases()) {
+    Mark(&A);
+  }
+  while (!Work.empty()) {
+    Constant *C = Work.pop_back_val();
+    if (auto *GV = dyn_cast<GlobalValue>(C)) {
+      Live.insert(GV);
+    }
+    if (auto *Func = dyn_cast<Function>(C)) {
+      for (auto &Inst : instructions(*Func)) {
+        for (auto &Op : Inst.operands()) {
+          if (auto *OpC = dyn_cast<Constant>(Op.get())) {
+            Mark(OpC);
+          }
+        }
+      }
+    }
+    // Initializers, aliasees, personalities and constant expressions
+    for (auto &Op : C->operands()) {
+      if (auto *OpC = dyn_cast<Constant>(Op.get())) {
+        Mark(OpC);
+      }
+    }
+  }
+
+  SmallVector<Function *, 32> Dead;
+  for (auto &Func : M) {
+    if (!Func.isDeclaration() && !Live.count(&Func)) {
+      Dead.push_back(&Func);
+    }
+  }
+  if (Dead.empty()) {
+    return;
+  }
+  SmallPtrSet<GlobalValue *, 32> DeadSet(Dead.begin(), Dead.end());
+  for (bool CompilerUsed : {false, true}) {
+    SmallVector<GlobalValue *, 32> Used;
+    GlobalVariable *List = collectUsedGlobalVariables(M, Used, CompilerUsed);
+    if (!List) {
+      continue;
+    }
+    List->eraseFromParent();
+    llvm::erase_if(Used, [&](GlobalValue *GV) { return DeadSet.count(GV); });
+    if (Used.empty()) {
+      continue;
+    }
+    if (CompilerUsed) {
+      appendToCompilerUsed(M, Used);
+    } else {
+      appendToUsed(M, Used);
+    }
+  }
+
+  for (Function *Func : Dead) {
+    OptimizationRemarkEmitter ORE(Func);
+    ORE.emit([&]() {
+      return OptimizationRemark(DEBUG_TYPE, "Stripped", Func)
+             << ore::NV("Function", Func)
+             << " is not reachable from the offload entries, removed "
+             << ore::NV("Instructions", Func->getInstructionCount())
+             << " instructions";
+    });
+    StrippedFunctions.push_back(Func->getName().str());
+    Func->dropAllReferences();
+  }
+  for (Function *Func : Dead) {
+    Func->removeDeadConstantUsers();
+    Func->eraseFromParent();
+  }
+}
+
+namespace {
+struct HostAccessCounts {
+  unsigned Loads = 0, LoopLoads = 0;
+  unsigned Stores = 0, LoopStores = 0;
+  unsigned Blocks = 0, LoopBlocks = 0;
+  unsigned Windows = 0;
+};
+} // namespace
+
+void HostPointerLegalizer::reportHostAccesses(Module &M) {
+  // Counting needs the loops of every function, only when asked for
+  LLVMContext &Ctx = M.getContext();
+  if (ReportFile.empty() && !Ctx.getLLVMRemarkStreamer() &&
+      !Ctx.getDiagHandlerPtr()->isAnyRemarkEnabled(DEBUG_TYPE)) {
+    return;
+  }
+
+  // The offload entries point to the kernels, or to their wrappers
+  SmallPtrSet<const Function *, 8> Kernels;
+  for (auto &G : M.globals()) {
+    if (G.getName().startswith(".omp_offloading.entry.") &&
+        G.hasInitializer()) {
+      auto *Entry = dyn_cast<ConstantStruct>(G.getInitializer());
+      if (Entry) {
+        Kernels.insert(
+            dyn_cast<Function>(Entry->getOperand(0)->stripPointerCasts()));
+      }
+    }
+  }
+
+  std::string Report;
+  raw_string_ostream RS(Report);
+  json::OStream J(RS, 2);
+  J.objectBegin();
+  J.attribute("module", M.getSourceFileName());
+  J.attributeBegin("functions");
+  J.arrayBegin();
+  for (auto &Func : M) {
+    if (Func.isDeclaration() || Func.getName().startswith("hero_")) {
+      continue;
+    }
+    DominatorTree DT(Func);
+    LoopInfo LI(DT);
+    OptimizationRemarkEmitter ORE(&Func);
+    HostAccessCounts C;
+
+    for (auto &Block : Func) {
+      bool InLoop = LI.getLoopFor(&Block) != nullptr;
+      for (auto &Inst : Block) {
+        auto *CI = dyn_cast<CallInst>(&Inst);
+        Function *Callee = CI ? CI->getCalledFunction() : nullptr;
+        if (!Callee) {
+          continue;
+        }
+        StringRef Name = Callee->getName();
+        const char *What = nullptr;
+        if (Name.startswith(OMP_LOAD_PREFIX "_") ||
+            Name.startswith(OMP_WINDOW_LOAD_PREFIX "_")) {
+          C.Loads++;
+          C.LoopLoads += InLoop;
+          What = "host load";
+        } else if (Name.startswith(OMP_STORE_PREFIX "_") ||
+                   Name.startswith(OMP_WINDOW_STORE_PREFIX "_")) {
+          C.Stores++;
+          C.LoopStores += InLoop;
+          What = "host store";
+        } else if (Name == OMP_WINDOW_OPEN) {
+          C.Windows++;
+        } else {
+          for (const char *Prefix : OMP_BLOCK_PREFIXES) {
+            if (Name.startswith(Prefix)) {
+              C.Blocks++;
+              C.LoopBlocks += InLoop;
+              What = "host block access";
+            }
+          }
+        }
+        // One access per iteration is where the time goes
+        if (What && InLoop) {
+          ORE.emit([&]() {
+            return OptimizationRemarkAnalysis(DEBUG_TYPE, "HostAccessInLoop",
+                                              CI)
+                   << What << " in a loop: " << ore::NV("Callee", Callee);
+          });
+        }
+      }
+    }
+
+    unsigned Expanded = ExpandedMemIntrinsics.lookup(&Func);
+    bool IsKernel = Kernels.count(&Func);
+    if (!IsKernel && !C.Loads && !C.Stores && !C.Blocks && !Expanded) {
+      continue;
+    }
+    ORE.emit([&]() {
+      return OptimizationRemarkAnalysis(DEBUG_TYPE, "HostAccesses",
+                                        &Func.getEntryBlock().front())
+             << ore::NV("Loads", C.Loads) << " host loads ("
+             << ore::NV("LoopLoads", C.LoopLoads) << " in loops), "
+             << ore::NV("Stores", C.Stores) << " host stores ("
+             << ore::NV("LoopStores", C.LoopStores) << " in loops), "
+             << ore::NV("Blocks", C.Blocks) << " block accesses, "
+             << ore::NV("Windows", C.Windows) << " host windows, "
+             << ore::NV("Expanded", Expanded)
+             << " memory intrinsics expanded as loops";
+    });
+
+    J.objectBegin();
+    J.attribute("name", Func.getName());
+    J.attribute("kernel", IsKernel);
+    J.attribute("host_loads", C.Loads);
+    J.attribute("host_loads_in_loops", C.LoopLoads);
+    J.attribute("host_stores", C.Stores);
+    J.attribute("host_stores_in_loops", C.LoopStores);
+    J.attribute("block_accesses", C.Blocks);
+    J.attribute("block_accesses_in_loops", C.LoopBlocks);
+    J.attribute("host_windows", C.Windows);
+    J.attribute("expanded_mem_intrinsics", Expanded);
+    J.attribute("instructions", Func.getInstructionCount());
+    J.objectEnd();
+  }
+  J.arrayEnd();
+  J.attributeEnd();
+  if (DeviceGC) {
+    J.attributeArray("stripped_functions", [&]() {
+      for (auto &Name : StrippedFunctions) {
+        J.value(Name);
+      }
+    });
+  }
+  J.objectEnd();
+
+  if (ReportFile.empty()) {
+    return;
+  }
+  std::error_code EC;
+  raw_fd_ostream OS(ReportFile, EC, sys::fs::OF_Text);
+  if (EC) {
+    errs() << "warning: can't write " << ReportFile << ": " << EC.message()
+           << "\n";
+    return;
+  }
+  OS << RS.str() << "\n";
+}
+
+bool OmpHostPointerLegalizer::runOnModule(Module &M) {
+  auto GetTTI = [&](Function &F) -> const TargetTransformInfo & {
+    return getAnalysis<TargetTransformInfoWrapperPass>().getTTI(F);
+  };
+  auto GetLoopAnalyses = [&](Function &F) {
+    return HostPointerLegalizer::LoopAnalyses{
+        getAnalysis<DominatorTreeWrapperPass>(F).getDomTree(),
+        getAnalysis<LoopInfoWrapperPass>(F).getLoopInfo(),
+        getAnalysis<ScalarEvolutionWrapperPass>(F).getSE()};
+  };
+  return HostPointerLegalizer(GetTTI, GetLoopAnalyses).run(M);
+}
+
+PreservedAnalyses OmpHostPointerLegalizerPass::run(Module &M,
+                                                   ModuleAnalysisManager &MAM) {
+  auto &FAM = MAM.getResult<FunctionAnalysisManagerModuleProxy>(M).getManager();
+  auto GetTTI = [&](Function &F) -> const TargetTransformInfo & {
+    return FAM.getResult<TargetIRAnalysis>(F);
+  };
+  // The memory intrinsics expansion changes the CFG behind the cached
+  // analyses, drop them
+  auto GetLoopAnalyses = [&](Function &F) {
+    FAM.invalidate(F, PreservedAnalyses::none());
+    return HostPointerLegalizer::LoopAnalyses{
+        FAM.getResult<DominatorTreeAnalysis>(F), FAM.getResult<LoopAnalysis>(F),
+        FAM.getResult<ScalarEvolutionAnalysis>(F)};
+  };
+  if (!HostPointerLegalizer(GetTTI, GetLoopAnalyses).run(M)) {
+    return PreservedAnalyses::all();
+  }
+  return PreservedAnalyses::none();
+}
+
 char OmpHostPointerLegalizer::ID = 3;
 static RegisterPass<OmpHostPointerLegalizer>
     Xmark("HERCULES-omp-host-pointer-legalizer",
@@ -359,3 +976,24 @@ static RegisterStandardPasses
     RegisterMyPass(PassManagerBuilder::EP_ModuleOptimizerEarly, registerMyPass);
 static RegisterStandardPasses
     RegisterMyPass0(PassManagerBuilder::EP_EnabledOnOptLevel0, registerMyPass);
+
+extern "C" LLVM_ATTRIBUTE_WEAK PassPluginLibraryInfo llvmGetPassPluginInfo() {
+  return {LLVM_PLUGIN_API_VERSION, "OmpHostPointerLegalizer",
+          LLVM_VERSION_STRING, [](PassBuilder &PB) {
+            PB.registerPipelineParsingCallback(
+                [](StringRef Name, ModulePassManager &MPM,
+                   ArrayRef<PassBuilder::PipelineElement>) {
+                  if (Name == "hero-omp-host-pointer-legalizer") {
+                    MPM.addPass(OmpHostPointerLegalizerPass());
+                    return true;
+                  }
+                  return false;
+                });
+            // With -fpass-plugin, after the kernel wrapper if it is loaded
+            // first
+            PB.registerOptimizerLastEPCallback(
+                [](ModulePassManager &MPM, OptimizationLevel) {
+                  MPM.addPass(OmpHostPointerLegalizerPass());
+                });
+          }};
+}
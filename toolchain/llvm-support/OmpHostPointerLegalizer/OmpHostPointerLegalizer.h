@@ -8,15 +8,58 @@
 #ifndef OMP_PREPROCESS_H
 #define OMP_PREPROCESS_H
 
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/ADT/STLExtras.h>
+#include <llvm/ADT/SmallPtrSet.h>
 #include <llvm/ADT/StringRef.h>
+#include <llvm/Analysis/LoopInfo.h>
+#include <llvm/Analysis/ScalarEvolution.h>
 #include <llvm/Analysis/TargetTransformInfo.h>
+#include <llvm/IR/Dominators.h>
 #include <llvm/IR/Module.h>
+#include <llvm/IR/PassManager.h>
 #include <llvm/Pass.h>
 
 #include <vector>
 
 namespace hrcl {
 
+// The legalization itself, the passes below only differ in where they get
+// the function analyses from
+class HostPointerLegalizer {
+public:
+  struct LoopAnalyses {
+    llvm::DominatorTree &DT;
+    llvm::LoopInfo &LI;
+    llvm::ScalarEvolution &SE;
+  };
+  using GetTTIFn =
+      llvm::function_ref<const llvm::TargetTransformInfo &(llvm::Function &)>;
+  using GetLoopAnalysesFn = llvm::function_ref<LoopAnalyses(llvm::Function &)>;
+
+  HostPointerLegalizer(GetTTIFn GetTTI, GetLoopAnalysesFn GetLoopAnalyses)
+      : GetTTI(GetTTI), GetLoopAnalyses(GetLoopAnalyses) {}
+
+  bool run(llvm::Module &M);
+
+private:
+  void expandMemIntrinsicUses(llvm::Function &F);
+  void hoistInvariantHostLoads(llvm::Function &F, llvm::LoopInfo &LI,
+                               llvm::DominatorTree &DT);
+  void coalesceHostAccesses(llvm::Function &F,
+                            llvm::SmallPtrSetImpl<llvm::Instruction *> &Windowed);
+  void stripUnreachableFunctions(llvm::Module &M);
+  void reportHostAccesses(llvm::Module &M);
+
+  GetTTIFn GetTTI;
+  GetLoopAnalysesFn GetLoopAnalyses;
+  // Memory intrinsics of each function expanded as loops of host accesses
+  llvm::DenseMap<const llvm::Function *, unsigned> ExpandedMemIntrinsics;
+  // Functions removed by -hero-device-gc
+  std::vector<std::string> StrippedFunctions;
+};
+
+// Legacy pass manager, used by hc-omp-pass
 class OmpHostPointerLegalizer : public llvm::ModulePass {
 public:
   static char ID;
@@ -24,11 +67,20 @@ public:
 
   void getAnalysisUsage(llvm::AnalysisUsage &AU) const override {
     AU.addRequired<llvm::TargetTransformInfoWrapperPass>();
+    AU.addRequired<llvm::DominatorTreeWrapperPass>();
+    AU.addRequired<llvm::LoopInfoWrapperPass>();
+    AU.addRequired<llvm::ScalarEvolutionWrapperPass>();
   }
 
   bool runOnModule(llvm::Module &M);
-private:
-  void expandMemIntrinsicUses(llvm::Function &F);
+};
+
+// New pass manager, -passes=hero-omp-host-pointer-legalizer or -fpass-plugin
+class OmpHostPointerLegalizerPass
+    : public llvm::PassInfoMixin<OmpHostPointerLegalizerPass> {
+public:
+  llvm::PreservedAnalyses run(llvm::Module &M,
+                              llvm::ModuleAnalysisManager &MAM);
 };
 
 } // namespace hrcl
@@ -0,0 +1,496 @@
+// Copyright 2024 ETH Zurich and University of Bologna.
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: Apache-2.0
+//
+// This file is part of the HERCULES Compiler Passes for PREM transformation
+// of code.
+
+#include "OmpKernelSpecializer.h"
+#include "OmpOffloadCalls.h"
+
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/ADT/Optional.h>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/Analysis/OptimizationRemarkEmitter.h>
+#include <llvm/Analysis/ValueTracking.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/InstIterator.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/LegacyPassManager.h>
+#include <llvm/Passes/PassBuilder.h>
+#include <llvm/Passes/PassPlugin.h>
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Support/MathExtras.h>
+#include <llvm/Support/raw_ostream.h>
+#include <llvm/Transforms/IPO/PassManagerBuilder.h>
+#include <llvm/Transforms/Utils/Cloning.h>
+
+#include <vector>
+
+#define DEBUG_TYPE "hero-kernel-specializer"
+
+#define OMP_ENTRY_PREFIX ".omp_offloading.entry."
+// Set to non-zero at run time to launch the generic kernels only, e.g. to
+// measure the speedup of the variants
+#define OMP_SPEC_GENERIC_FLAG "hero_specialize_generic"
+
+using namespace llvm;
+using namespace hero;
+
+static cl::list<std::string> Specializations(
+    "hero-specialize", cl::value_desc("function:arg=value[,value...]"),
+    cl::ZeroOrMore,
+    cl::desc("Specialize the target regions of a function for values of a "
+             "scalar kernel argument, e.g. matvec:0=64,128. Repeat for more "
+             "arguments, the variants cover all the combinations"));
+
+namespace {
+struct SpecArg {
+  std::string function;
+  unsigned int arg;
+  SmallVector<uint64_t, 4> values;
+};
+// Value of each specialized argument of a variant
+using Variant = SmallVector<std::pair<unsigned int, uint64_t>, 2>;
+} // namespace
+
+static void parseSpecializations(SmallVectorImpl<SpecArg> &specs) {
+  for (StringRef spec : Specializations) {
+    StringRef function, arg, values;
+    std::tie(function, arg) = spec.split(':');
+    std::tie(arg, values) = arg.split('=');
+    SpecArg s;
+    s.function = function.str();
+    bool valid = !function.empty() && !arg.getAsInteger(10, s.arg);
+    SmallVector<StringRef, 4> fields;
+    values.split(fields, ',');
+    for (StringRef field : fields) {
+      uint64_t value;
+      valid &= !field.trim().getAsInteger(0, value);
+      s.values.push_back(value);
+    }
+    if (!valid) {
+      errs() << "warning: ignoring -hero-specialize=" << spec
+             << ", expected function:arg=value[,value...]\n";
+      continue;
+    }
+    specs.push_back(std::move(s));
+  }
+}
+
+// Target regions are named __omp_offloading_<dev>_<file>_<function>_l<line>,
+// <dev> and <file> in hex. The function name may contain underscores, so
+// compare the whole component between them and the line.
+static bool isRegionOf(StringRef region, StringRef function) {
+  if (region == function) {
+    return true;
+  }
+  if (!region.consume_front("__omp_offloading_")) {
+    return false;
+  }
+  for (int i = 0; i < 2; i++) {
+    StringRef id;
+    std::tie(id, region) = region.split('_');
+    if (id.empty() ||
+        id.find_first_not_of("0123456789abcdef") != StringRef::npos) {
+      return false;
+    }
+  }
+  size_t line = region.rfind("_l");
+  if (line == StringRef::npos) {
+    return false;
+  }
+  return region.take_front(line) == function;
+}
+
+static std::vector<Variant> getVariants(StringRef region,
+                                        ArrayRef<SpecArg> specs) {
+  std::vector<Variant> variants = {{}};
+  bool specialized = false;
+  for (const SpecArg &s : specs) {
+    if (!isRegionOf(region, s.function)) {
+      continue;
+    }
+    std::vector<Variant> product;
+    for (const Variant &v : variants) {
+      for (uint64_t value : s.values) {
+        product.push_back(v);
+        product.back().push_back({s.arg, value});
+      }
+    }
+    variants = std::move(product);
+    specialized = true;
+  }
+  if (!specialized) {
+    return {};
+  }
+  return variants;
+}
+
+// Host and device name the variants the same, the runtime matches the
+// entries by name
+static std::string getVariantName(StringRef region, const Variant &variant) {
+  std::string name = (region + ".spec").str();
+  for (auto &argValue : variant) {
+    name += "_a" + utostr(argValue.first) + "_" + utostr(argValue.second);
+  }
+  return name;
+}
+
+static GlobalVariable *createOffloadEntry(Module &M, GlobalVariable *entry,
+                                          Constant *addr, StringRef name) {
+  auto *init = cast<ConstantStruct>(entry->getInitializer());
+  Constant *nameInit = ConstantDataArray::getString(M.getContext(), name);
+  auto *nameVar = new GlobalVariable(M, nameInit->getType(), true,
+                                     GlobalValue::InternalLinkage, nameInit,
+                                     ".omp_offloading.entry_name");
+  nameVar->setUnnamedAddr(GlobalValue::UnnamedAddr::Global);
+  Value *index = ConstantInt::get(Type::getInt32Ty(M.getContext()), 0);
+
+  SmallVector<Constant *, 5> fields;
+  for (unsigned int i = 0; i < init->getNumOperands(); i++) {
+    fields.push_back(init->getOperand(i));
+  }
+  fields[0] = ConstantExpr::getPointerCast(addr, fields[0]->getType());
+  fields[1] = ConstantExpr::getPointerCast(
+      ConstantExpr::getInBoundsGetElementPtr(nameInit->getType(), nameVar,
+                                             ArrayRef<Value *>{index, index}),
+      fields[1]->getType());
+  auto *newEntry = new GlobalVariable(
+      M, init->getType(), entry->isConstant(), entry->getLinkage(),
+      ConstantStruct::get(init->getType(), fields), OMP_ENTRY_PREFIX + name);
+  newEntry->setSection(entry->getSection());
+  newEntry->setAlignment(entry->getAlign());
+  return newEntry;
+}
+
+// Replace an argument of a kernel variant by its value: a scalar passed by
+// value directly, a mapped scalar where it is loaded. Returns the number of
+// uses replaced, none if the mapped scalar is written or escapes.
+static unsigned int substituteArg(Argument *arg, uint64_t value) {
+  Type *type = arg->getType();
+  if (type->isIntegerTy()) {
+    unsigned int uses = arg->getNumUses();
+    arg->replaceAllUsesWith(ConstantInt::get(type, value));
+    return uses;
+  }
+  if (!type->isPointerTy()) {
+    return 0;
+  }
+
+  SmallVector<LoadInst *, 8> loads;
+  SmallVector<Value *, 8> work = {arg};
+  while (!work.empty()) {
+    Value *V = work.pop_back_val();
+    for (User *U : V->users()) {
+      auto *LI = dyn_cast<LoadInst>(U);
+      auto *GEP = dyn_cast<GetElementPtrInst>(U);
+      if (LI && LI->isSimple() && LI->getType()->isIntegerTy() &&
+          LI->getType()->getIntegerBitWidth() <= 64) {
+        loads.push_back(LI);
+      } else if (isa<BitCastInst>(U) || isa<AddrSpaceCastInst>(U) ||
+                 (GEP && GEP->hasAllZeroIndices())) {
+        work.push_back(U);
+      } else {
+        return 0;
+      }
+    }
+  }
+  for (LoadInst *LI : loads) {
+    LI->replaceAllUsesWith(ConstantInt::get(LI->getType(), value));
+    LI->eraseFromParent();
+  }
+  return loads.size();
+}
+
+static Function *specializeKernel(Function *kernel, const Variant &variant,
+                                  StringRef name) {
+  ValueToValueMapTy VMap;
+  Function *clone = CloneFunction(kernel, VMap);
+  clone->setName(name);
+
+  // A variant that keeps an argument generic is still correct, the host
+  // dispatches to it anyway
+  OptimizationRemarkEmitter ORE(clone);
+  for (auto &argValue : variant) {
+    Argument *arg = argValue.first < clone->arg_size()
+                        ? clone->getArg(argValue.first)
+                        : nullptr;
+    unsigned int uses = arg ? substituteArg(arg, argValue.second) : 0;
+    if (uses) {
+      ORE.emit([&]() {
+        return OptimizationRemark(DEBUG_TYPE, "Specialized", clone)
+               << ore::NV("Kernel", clone) << ": argument "
+               << ore::NV("Arg", argValue.first) << " replaced by "
+               << ore::NV("Value", argValue.second) << " in "
+               << ore::NV("Uses", uses) << " places";
+      });
+    } else {
+      ORE.emit([&]() {
+        return OptimizationRemarkMissed(DEBUG_TYPE, "NotSpecialized", clone)
+               << ore::NV("Kernel", clone) << ": argument "
+               << ore::NV("Arg", argValue.first)
+               << " is not a scalar only read by the kernel, left generic";
+      });
+    }
+  }
+  return clone;
+}
+
+static GlobalVariable *getGenericFlag(Module &M) {
+  Type *i32 = Type::getInt32Ty(M.getContext());
+  GlobalVariable *flag = M.getGlobalVariable(OMP_SPEC_GENERIC_FLAG);
+  if (!flag) {
+    flag = new GlobalVariable(M, i32, false, GlobalValue::WeakAnyLinkage,
+                              ConstantInt::get(i32, 0), OMP_SPEC_GENERIC_FLAG);
+  } else if (flag->isDeclaration() && flag->getValueType() == i32) {
+    flag->setLinkage(GlobalValue::WeakAnyLinkage);
+    flag->setInitializer(ConstantInt::get(i32, 0));
+  }
+  return flag->getValueType() == i32 ? flag : nullptr;
+}
+
+// Pick the region id of the variant matching the argument values before the
+// launch, the generic one if none matches
+static bool dispatchLaunch(
+    CallInst *launch, unsigned int argNumIdx,
+    ArrayRef<std::pair<Variant, GlobalVariable *>> variants) {
+  Module &M = *launch->getModule();
+  const DataLayout &DL = M.getDataLayout();
+  Value *generic = launch->getArgOperand(argNumIdx - 1);
+  StringRef kernel = generic->stripPointerCasts()->getName().ltrim('.');
+  kernel.consume_back(".region_id");
+  OptimizationRemarkEmitter ORE(launch->getFunction());
+  auto notDispatched = [&](unsigned int arg, const char *reason) {
+    ORE.emit([&]() {
+      return OptimizationRemarkMissed(DEBUG_TYPE, "NotDispatched", launch)
+             << "launch of " << ore::NV("Kernel", kernel)
+             << " keeps the generic kernel: argument " << ore::NV("Arg", arg)
+             << " " << reason;
+    });
+    return false;
+  };
+
+  SmallVector<uint64_t, 16> types;
+  auto *argNum = dyn_cast<ConstantInt>(launch->getArgOperand(argNumIdx));
+  if (!argNum || !getConstArray(launch->getArgOperand(argNumIdx + 4), types) ||
+      argNum->getZExtValue() != types.size()) {
+    return false;
+  }
+  SmallVector<Optional<uint64_t>, 16> sizes;
+  getMapSizes(launch->getArgOperand(argNumIdx + 3), types.size(), sizes);
+  // The kernel arguments are the entries with TARGET_PARAM
+  SmallVector<unsigned int, 16> params;
+  for (unsigned int i = 0; i < types.size(); i++) {
+    if (types[i] & OMP_TGT_MAPTYPE_TARGET_PARAM) {
+      params.push_back(i);
+    }
+  }
+
+  // Read each specialized argument once: the literals are passed in the
+  // argument array, the mapped scalars are pointed to
+  IRBuilder<> builder(launch);
+  Type *i8p = builder.getInt8PtrTy();
+  Value *args = builder.CreateBitCast(launch->getArgOperand(argNumIdx + 2),
+                                      i8p->getPointerTo());
+  DenseMap<unsigned int, Value *> argValues;
+  for (auto &argValue : variants.front().first) {
+    unsigned int p = argValue.first;
+    if (p >= params.size()) {
+      return notDispatched(p, "doesn't exist");
+    }
+    unsigned int i = params[p];
+    if (!sizes[i] || !isPowerOf2_64(*sizes[i]) || *sizes[i] > 8) {
+      return notDispatched(p, "isn't a scalar");
+    }
+    IntegerType *argTy = builder.getIntNTy(*sizes[i] * 8);
+    Value *slot = builder.CreateLoad(
+        i8p, builder.CreateConstInBoundsGEP1_32(i8p, args, i));
+    if (types[i] & OMP_TGT_MAPTYPE_LITERAL) {
+      argValues[p] = builder.CreateZExtOrTrunc(
+          builder.CreatePtrToInt(slot, DL.getIntPtrType(i8p)), argTy);
+    } else {
+      argValues[p] = builder.CreateLoad(
+          argTy, builder.CreateBitCast(slot, argTy->getPointerTo()));
+    }
+  }
+
+  Value *target = generic;
+  unsigned int dispatched = 0;
+  for (auto it = variants.rbegin(); it != variants.rend(); ++it) {
+    // A value that doesn't fit the argument can't match
+    bool fits = true;
+    for (auto &argValue : it->first) {
+      Value *argVal = argValues[argValue.first];
+      fits &= isUIntN(argVal->getType()->getIntegerBitWidth(), argValue.second);
+    }
+    if (!fits) {
+      continue;
+    }
+    Value *match = nullptr;
+    for (auto &argValue : it->first) {
+      Value *argVal = argValues[argValue.first];
+      Value *eq = builder.CreateICmpEQ(
+          argVal, ConstantInt::get(argVal->getType(), argValue.second));
+      match = match ? builder.CreateAnd(match, eq) : eq;
+    }
+    target = builder.CreateSelect(
+        match, ConstantExpr::getPointerCast(it->second, generic->getType()),
+        target);
+    dispatched++;
+  }
+  if (GlobalVariable *flag = getGenericFlag(M)) {
+    Value *useGeneric = builder.CreateICmpNE(
+        builder.CreateLoad(flag->getValueType(), flag), builder.getInt32(0));
+    target = builder.CreateSelect(useGeneric, generic, target);
+  }
+  launch->setArgOperand(argNumIdx - 1, target);
+
+  ORE.emit([&]() {
+    return OptimizationRemark(DEBUG_TYPE, "Dispatched", launch)
+           << "launch of " << ore::NV("Kernel", kernel) << " dispatches to "
+           << ore::NV("Variants", dispatched) << " specialized variants";
+  });
+  return true;
+}
+
+static bool specializeKernels(Module &M) {
+  SmallVector<SpecArg, 4> specs;
+  parseSpecializations(specs);
+  if (specs.empty()) {
+    return false;
+  }
+
+  // The app may declare the flag to set it
+  if (GlobalVariable *flag = M.getGlobalVariable(OMP_SPEC_GENERIC_FLAG)) {
+    if (flag->isDeclaration()) {
+      getGenericFlag(M);
+    }
+  }
+
+  SmallVector<GlobalVariable *, 16> entries;
+  for (GlobalVariable &G : M.globals()) {
+    if (G.getName().startswith(OMP_ENTRY_PREFIX) && G.hasInitializer() &&
+        isa<ConstantStruct>(G.getInitializer())) {
+      entries.push_back(&G);
+    }
+  }
+
+  // Device side: the kernel variants. Host side: their region ids, to which
+  // the launches below dispatch.
+  bool changed = false;
+  DenseMap<GlobalVariable *, std::vector<std::pair<Variant, GlobalVariable *>>>
+      regionVariants;
+  for (GlobalVariable *entry : entries) {
+    auto *init = cast<ConstantStruct>(entry->getInitializer());
+    StringRef region;
+    if (init->getNumOperands() < 2 ||
+        !getConstantStringInfo(init->getOperand(1), region)) {
+      continue;
+    }
+    std::vector<Variant> variants = getVariants(region, specs);
+    Value *addr = init->getOperand(0)->stripPointerCasts();
+    auto *kernel = dyn_cast<Function>(addr);
+    auto *regionId = dyn_cast<GlobalVariable>(addr);
+    // The string data goes away with the new globals
+    std::string regionName = region.str();
+
+    for (const Variant &variant : variants) {
+      std::string name = getVariantName(regionName, variant);
+      if (kernel && !kernel->isDeclaration()) {
+        Function *clone = specializeKernel(kernel, variant, name);
+        createOffloadEntry(M, entry, clone, name);
+        changed = true;
+      } else if (regionId) {
+        auto *id = new GlobalVariable(
+            M, regionId->getValueType(), regionId->isConstant(),
+            regionId->getLinkage(), regionId->getInitializer(),
+            "." + name + ".region_id");
+        createOffloadEntry(M, entry, id, name);
+        regionVariants[regionId].push_back({variant, id});
+        changed = true;
+      }
+    }
+  }
+  if (regionVariants.empty()) {
+    return changed;
+  }
+
+  for (Function &F : M) {
+    unsigned int argNumIdx = getOffloadArgNumIdx(F, false);
+    if (!argNumIdx) {
+      continue;
+    }
+
+    SmallVector<CallInst *, 8> launches;
+    for (User *U : F.users()) {
+      auto *CI = dyn_cast<CallInst>(U);
+      if (CI && CI->getCalledFunction() == &F) {
+        launches.push_back(CI);
+      }
+    }
+    for (CallInst *CI : launches) {
+      auto *regionId = dyn_cast<GlobalVariable>(
+          CI->getArgOperand(argNumIdx - 1)->stripPointerCasts());
+      auto it = regionVariants.find(regionId);
+      if (it != regionVariants.end()) {
+        dispatchLaunch(CI, argNumIdx, it->second);
+      }
+    }
+  }
+  return changed;
+}
+
+bool OmpKernelSpecializer::runOnModule(Module &M) {
+  return specializeKernels(M);
+}
+
+PreservedAnalyses OmpKernelSpecializerPass::run(Module &M,
+                                                ModuleAnalysisManager &MAM) {
+  if (!specializeKernels(M)) {
+    return PreservedAnalyses::all();
+  }
+  return PreservedAnalyses::none();
+}
+
+char OmpKernelSpecializer::ID = 5;
+static RegisterPass<OmpKernelSpecializer>
+    Xmark("HERCULES-omp-kernel-specializer",
+          "Specializes OpenMP target regions for argument values", false,
+          false);
+
+static void registerMyPass(const PassManagerBuilder &PMB,
+                           legacy::PassManagerBase &PM) {}
+
+static RegisterStandardPasses
+    RegisterMyPass(PassManagerBuilder::EP_ModuleOptimizerEarly, registerMyPass);
+static RegisterStandardPasses
+    RegisterMyPass0(PassManagerBuilder::EP_EnabledOnOptLevel0, registerMyPass);
+
+llvm::Pass *hero::createOmpKernelSpecializer() {
+  return new OmpKernelSpecializer();
+}
+
+// Load before the kernel wrapper plugin, the wrapper then wraps the variants
+// like any other kernel
+extern "C" LLVM_ATTRIBUTE_WEAK PassPluginLibraryInfo llvmGetPassPluginInfo() {
+  return {LLVM_PLUGIN_API_VERSION, "OmpKernelSpecializer", LLVM_VERSION_STRING,
+          [](PassBuilder &PB) {
+            PB.registerPipelineParsingCallback(
+                [](StringRef name, ModulePassManager &MPM,
+                   ArrayRef<PassBuilder::PipelineElement>) {
+                  if (name == "hero-omp-kernel-specializer") {
+                    MPM.addPass(OmpKernelSpecializerPass());
+                    return true;
+                  }
+                  return false;
+                });
+            PB.registerOptimizerLastEPCallback(
+                [](ModulePassManager &MPM, OptimizationLevel) {
+                  MPM.addPass(OmpKernelSpecializerPass());
+                });
+          }};
+}
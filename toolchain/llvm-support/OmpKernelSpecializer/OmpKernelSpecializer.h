@@ -0,0 +1,43 @@
+// Copyright 2024 ETH Zurich and University of Bologna.
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: Apache-2.0
+//
+// This file is part of the HERCULES Compiler Passes for PREM transformation
+// of code.
+
+#ifndef OMP_KERNEL_SPECIALIZER_H
+#define OMP_KERNEL_SPECIALIZER_H
+
+#include <llvm/IR/Module.h>
+#include <llvm/IR/PassManager.h>
+#include <llvm/Pass.h>
+
+namespace hero {
+
+// Specialize target regions for given values of their scalar arguments
+// (-hero-specialize). On the device side, each variant is a copy of the
+// kernel with the argument replaced by the value, with its own offload entry.
+// On the host side, each launch picks the variant matching the argument
+// values and falls back to the generic kernel. Runs before the kernel
+// wrapper, with the same options on the host and the device modules.
+class OmpKernelSpecializer : public llvm::ModulePass {
+public:
+  static char ID;
+  OmpKernelSpecializer() : llvm::ModulePass(ID) {}
+
+  bool runOnModule(llvm::Module &M);
+};
+
+// New pass manager, -passes=hero-omp-kernel-specializer or -fpass-plugin
+class OmpKernelSpecializerPass
+    : public llvm::PassInfoMixin<OmpKernelSpecializerPass> {
+public:
+  llvm::PreservedAnalyses run(llvm::Module &M,
+                              llvm::ModuleAnalysisManager &MAM);
+};
+
+llvm::Pass *createOmpKernelSpecializer();
+
+} // namespace hero
+
+#endif
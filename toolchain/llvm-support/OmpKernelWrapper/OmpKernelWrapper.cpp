@@ -6,15 +6,24 @@
 // of code.
 
 #include "OmpKernelWrapper.h"
+#include "OmpOffloadCalls.h"
 
 #include <llvm/ADT/SmallVector.h>
+#include <llvm/Analysis/OptimizationRemarkEmitter.h>
 #include <llvm/IR/Constants.h>
 #include <llvm/IR/Function.h>
+#include <llvm/IR/InstIterator.h>
 #include <llvm/IR/IRBuilder.h>
 #include <llvm/IR/Instructions.h>
 #include <llvm/IR/LegacyPassManager.h>
 #include <llvm/IR/Operator.h>
 #include <llvm/IR/Value.h>
+#include <llvm/Passes/PassBuilder.h>
+#include <llvm/Passes/PassPlugin.h>
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/FormatVariadic.h>
+#include <llvm/Support/raw_ostream.h>
 #include <llvm/Transforms/IPO.h>
 #include <llvm/Transforms/IPO/PassManagerBuilder.h>
 #include <llvm/Transforms/Utils/BasicBlockUtils.h>
@@ -24,9 +33,24 @@
 #define OMP_WRAPPER_PREFIX "__wrapper_omp"
 #define OMP_WRAPPED_PREFIX "__wrapped_omp"
 
+#define DEBUG_TYPE "hero-kernel-wrapper"
+
 using namespace llvm;
 using namespace hero;
 
+// The argument block holds one 8-byte slot per kernel argument: pointers to
+// the mapped data and the firstprivate scalars by value
+static cl::opt<bool> PackedArgs(
+    "hero-packed-args", cl::init(true),
+    cl::desc("Copy the argument block of a kernel to the device in one "
+             "burst instead of loading each argument from host memory"));
+
+// Argument blocks on the device side, map clauses on the host side
+static cl::opt<std::string> ReportFile(
+    "hero-wrapper-report", cl::value_desc("filename"),
+    cl::desc("Write the argument block size of each kernel and the bytes "
+             "mapped by each offload to a JSON file"));
+
 std::vector<llvm::CallInst *> getKMPForkCalls(llvm::Module &M) {
   Function *kfc = M.getFunction("__kmpc_fork_call");
   if (!kfc) {
@@ -44,16 +68,6 @@ std::vector<llvm::CallInst *> getKMPForkCalls(llvm::Module &M) {
   return calls;
 }
 
-std::vector<GlobalVariable *> getOmpOffloadEntries(Module &M) {
-  std::vector<GlobalVariable *> entries;
-  for (auto &G : M.globals()) {
-    if (G.getName().startswith(".omp_offloading.entry.")) {
-      entries.push_back(&G);
-    }
-  }
-  return entries;
-}
-
 Function *getOmpOffloadFunction(GlobalVariable *offloadingEntry) {
   ConstantStruct *initializer =
       dyn_cast<ConstantStruct>(offloadingEntry->getInitializer());
@@ -61,16 +75,28 @@ Function *getOmpOffloadFunction(GlobalVariable *offloadingEntry) {
   return dyn_cast_or_null<Function>(fnPtrs->stripPointerCasts());
 }
 
-Optional<GlobalVariable *> getOmpOffloadEntry(Function *kernel) {
-  Module *M = kernel->getParent();
-  for (auto &G : M->globals()) {
+// Scan the globals once for the offload entries, the lookups by kernel then
+// don't rescan the module
+void KernelWrapper::indexOffloadEntries(Module &M) {
+  offloadEntries.clear();
+  kernelEntries.clear();
+  for (auto &G : M.globals()) {
     if (G.getName().startswith(".omp_offloading.entry.")) {
-      if (getOmpOffloadFunction(&G) == kernel) {
-        return Optional<GlobalVariable *>(&G);
+      Function *kernel = getOmpOffloadFunction(&G);
+      offloadEntries.push_back({&G, kernel});
+      if (kernel) {
+        kernelEntries.try_emplace(kernel, &G);
       }
     }
   }
-  return Optional<GlobalVariable *>(None);
+}
+
+Optional<GlobalVariable *> KernelWrapper::getOmpOffloadEntry(Function *kernel) {
+  auto it = kernelEntries.find(kernel);
+  if (it == kernelEntries.end()) {
+    return Optional<GlobalVariable *>(None);
+  }
+  return Optional<GlobalVariable *>(it->second);
 }
 
 void setOmpOffloadFunction(GlobalVariable *offloadingEntry,
@@ -86,7 +112,18 @@ void setOmpOffloadFunction(GlobalVariable *offloadingEntry,
 
 void OmpKernelWrapper::getAnalysisUsage(AnalysisUsage &AU) const {}
 
-bool OmpKernelWrapper::runOnModule(Module &M) {
+bool OmpKernelWrapper::runOnModule(Module &M) { return KernelWrapper().run(M); }
+
+PreservedAnalyses OmpKernelWrapperPass::run(Module &M,
+                                            ModuleAnalysisManager &MAM) {
+  if (!KernelWrapper().run(M)) {
+    return PreservedAnalyses::all();
+  }
+  return PreservedAnalyses::none();
+}
+
+bool KernelWrapper::run(Module &M) {
+  indexOffloadEntries(M);
   // Workaround to convert arg_sizes arrays from i32* to i64*
   if (M.getTargetTriple() == "armv6kz-unknown-linux-gnueabihf") {
     this->changeTypeOfArgSizes(M, "__tgt_target_data_begin", 4);
@@ -118,6 +155,7 @@ bool OmpKernelWrapper::runOnModule(Module &M) {
     // Snitch's OpenMP RT is based on LLVM's implementation and does not require it
     this->wrapOmpOutlinedFuncs(M);
   }
+  this->reportOffloads(M);
   return true;
 }
 
@@ -173,7 +211,7 @@ std::pair<Value *, GlobalVariable *> rebuildArgSizesArgument(Module &M,
 // Workaround for OpenMP bug on ARM32:
 // Replaces i32 type of arg_sizes argument in __tgt_target with i64 to match
 // interface in omptarget.h
-void OmpKernelWrapper::changeTypeOfArgSizes(Module &M, StringRef fnName,
+void KernelWrapper::changeTypeOfArgSizes(Module &M, StringRef fnName,
                                             unsigned int argIdx) {
   Function *tgt_target = M.getFunction(fnName);
   if (!tgt_target) {
@@ -238,7 +276,7 @@ void OmpKernelWrapper::changeTypeOfArgSizes(Module &M, StringRef fnName,
 
 // Find OMP kernels and wrap list of T* args to single void** arg:
 // fn(A*, B*, C*) => fn(void**)
-void OmpKernelWrapper::wrapOmpKernels(Module &M) {
+void KernelWrapper::wrapOmpKernels(Module &M) {
   unsigned DeviceAS = M.getDataLayout().getProgramAddressSpace();
   unsigned HostAS = 1;
   if (DeviceAS == 0) {
@@ -251,8 +289,9 @@ void OmpKernelWrapper::wrapOmpKernels(Module &M) {
   Type *voidTy = Type::getVoidTy(M.getContext());
   FunctionType *wrapperTy = FunctionType::get(voidTy, {rawArgTy}, false);
 
-  for (GlobalVariable *entry : getOmpOffloadEntries(M)) {
-    Function *kernel = getOmpOffloadFunction(entry);
+  for (auto &entryKernel : offloadEntries) {
+    GlobalVariable *entry = entryKernel.first;
+    Function *kernel = entryKernel.second;
     if (kernel == nullptr) {
       // This is not a function, but some other global variable defined in a
       // target declare section.
@@ -270,10 +309,28 @@ void OmpKernelWrapper::wrapOmpKernels(Module &M) {
     Value *rawArg = &(*(wrapper->arg_begin()));
     Value *arg = builder.CreateIntToPtr(rawArg, argTy);
     FunctionType *kernelTy = kernel->getFunctionType();
+    unsigned argAS = HostAS;
+
+    // bring the whole block to the device stack at once, the host pointer
+    // legalizer turns the memcpy into a single block access. Up to two
+    // arguments, the loads share a host window anyway.
+    unsigned numParams = kernelTy->getNumParams();
+    if (PackedArgs && numParams > 2) {
+      const DataLayout &DL = M.getDataLayout();
+      Type *blockTy = ArrayType::get(rawArgTy, numParams);
+      AllocaInst *block = builder.CreateAlloca(blockTy, DL.getAllocaAddrSpace(),
+                                               nullptr, "args");
+      block->setAlignment(Align(8));
+      builder.CreateMemCpy(block, Align(8), arg, Align(8),
+                           numParams * DL.getTypeAllocSize(rawArgTy));
+      arg = builder.CreateBitCast(
+          block, rawArgTy->getPointerTo(DL.getAllocaAddrSpace()));
+      argAS = DL.getAllocaAddrSpace();
+    }
 
     // dereference arguments from buffer and cast to respective pointer types
     SmallVector<Value *, 8> derefArgs;
-    for (unsigned int i = 0; i < kernelTy->getNumParams(); i++) {
+    for (unsigned int i = 0; i < numParams; i++) {
       Value *index = ConstantInt::get(Type::getInt32Ty(M.getContext()), i);
 
       // ptr to ptr to argument of type i8
@@ -282,7 +339,7 @@ void OmpKernelWrapper::wrapOmpKernels(Module &M) {
       // cast ptr to ptr type to parameter type
       Type *paramType = kernelTy->getParamType(i);
       Value *paramPtr =
-          builder.CreateBitCast(argBufPtr, paramType->getPointerTo(HostAS));
+          builder.CreateBitCast(argBufPtr, paramType->getPointerTo(argAS));
 
       // load parameter
       Value *param = builder.CreateLoad(paramType, paramPtr);
@@ -290,11 +347,32 @@ void OmpKernelWrapper::wrapOmpKernels(Module &M) {
     }
 
     // Call original kernel, finish function
-    builder.CreateCall(kernel, derefArgs);
+    CallInst *call = builder.CreateCall(kernel, derefArgs);
     builder.CreateRetVoid();
 
+    bool packed = argAS != HostAS;
+    unsigned blockBytes = numParams * 8;
+    OptimizationRemarkEmitter ORE(wrapper);
+    ORE.emit([&]() {
+      OptimizationRemarkAnalysis R(DEBUG_TYPE, "ArgumentBlock", call);
+      R << ore::NV("Bytes", blockBytes) << " bytes argument block for "
+        << ore::NV("Args", numParams) << " arguments, ";
+      R << (packed ? "copied to the device in one burst"
+                   : "loaded from host memory one argument at a time");
+      return R;
+    });
+    json::Object kernelReport;
+    kernelReport["name"] = kernel->getName();
+    kernelReport["args"] = numParams;
+    kernelReport["arg_block_bytes"] = blockBytes;
+    kernelReport["packed_args"] = packed;
+    reportKernels.push_back(std::move(kernelReport));
+
     // replace function in OpenMP offload table
     setOmpOffloadFunction(entry, wrapper);
+    entryKernel.second = wrapper;
+    kernelEntries.erase(kernel);
+    kernelEntries[wrapper] = entry;
 
     std::string oldName = kernel->getName().str();
     kernel->setName(OMP_WRAPPED_PREFIX + oldName);
@@ -304,7 +382,7 @@ void OmpKernelWrapper::wrapOmpKernels(Module &M) {
 
 // Find OMP kernels and wrap list of T* args to single void** arg:
 // fn(A*, B*, C*) => fn(void**)
-void OmpKernelWrapper::wrapOmpOutlinedFuncs(Module &M) {
+void KernelWrapper::wrapOmpOutlinedFuncs(Module &M) {
   unsigned DeviceAS = M.getDataLayout().getProgramAddressSpace();
   Type *argTy = Type::getInt8PtrTy(M.getContext(), DeviceAS)->getPointerTo(DeviceAS);
   Type *thdTy = Type::getInt32Ty(M.getContext())->getPointerTo(DeviceAS);
@@ -367,6 +445,126 @@ void OmpKernelWrapper::wrapOmpOutlinedFuncs(Module &M) {
   }
 }
 
+// Report the argument blocks of the kernels wrapped on the device side and the
+// map clauses of the offloads on the host side. The __tgt_target_kernel
+// launches of newer runtimes pack the arguments in a struct and are skipped.
+void KernelWrapper::reportOffloads(Module &M) {
+  json::Array launches, dataMaps;
+
+  for (Function &F : M) {
+    unsigned int argNumIdx = getOffloadArgNumIdx(F, true);
+    if (!argNumIdx) {
+      continue;
+    }
+    StringRef name = F.getName();
+    bool isData = name.startswith("__tgt_target_data_");
+
+    for (User *U : F.users()) {
+      auto *CI = dyn_cast<CallInst>(U);
+      if (!CI || CI->getCalledFunction() != &F) {
+        continue;
+      }
+      auto *argNum = dyn_cast<ConstantInt>(CI->getArgOperand(argNumIdx));
+      SmallVector<uint64_t, 16> types;
+      if (!argNum ||
+          !getConstArray(CI->getArgOperand(argNumIdx + 4), types)) {
+        continue;
+      }
+      unsigned int n = std::min<uint64_t>(argNum->getZExtValue(), types.size());
+      SmallVector<Optional<uint64_t>, 16> sizes;
+      getMapSizes(CI->getArgOperand(argNumIdx + 3), n, sizes);
+
+      // Literals are passed by value in the argument block, the rest is
+      // copied if mapped to or from
+      unsigned int params = 0, literals = 0, runtimeSized = 0;
+      uint64_t toBytes = 0, fromBytes = 0;
+      for (unsigned int i = 0; i < n; i++) {
+        params += (types[i] & OMP_TGT_MAPTYPE_TARGET_PARAM) != 0;
+        if (types[i] & OMP_TGT_MAPTYPE_LITERAL) {
+          literals++;
+          continue;
+        }
+        if (!(types[i] & (OMP_TGT_MAPTYPE_TO | OMP_TGT_MAPTYPE_FROM))) {
+          continue;
+        }
+        if (!sizes[i]) {
+          runtimeSized++;
+          continue;
+        }
+        if (types[i] & OMP_TGT_MAPTYPE_TO) {
+          toBytes += *sizes[i];
+        }
+        if (types[i] & OMP_TGT_MAPTYPE_FROM) {
+          fromBytes += *sizes[i];
+        }
+      }
+
+      json::Object entry;
+      StringRef kernel;
+      if (!isData) {
+        // @.__omp_offloading_<id>.region_id identifies the kernel
+        kernel = CI->getArgOperand(argNumIdx - 1)
+                     ->stripPointerCasts()
+                     ->getName()
+                     .ltrim('.');
+        kernel.consume_back(".region_id");
+        entry["kernel"] = kernel;
+        entry["args"] = params;
+        entry["arg_block_bytes"] = params * 8;
+        entry["literal_args"] = literals;
+      } else {
+        entry["call"] = name;
+      }
+      entry["caller"] = CI->getFunction()->getName();
+      if (const DebugLoc &DL = CI->getDebugLoc()) {
+        entry["line"] = DL.getLine();
+      }
+      entry["to_bytes"] = toBytes;
+      entry["from_bytes"] = fromBytes;
+      entry["runtime_sized_maps"] = runtimeSized;
+      (isData ? dataMaps : launches).push_back(std::move(entry));
+
+      OptimizationRemarkEmitter ORE(CI->getFunction());
+      ORE.emit([&]() {
+        OptimizationRemarkAnalysis R(DEBUG_TYPE, isData ? "DataMap" : "Offload",
+                                     CI);
+        if (!isData) {
+          R << "offload of " << ore::NV("Kernel", kernel) << ": "
+            << ore::NV("Args", params) << " arguments ("
+            << ore::NV("Literals", literals) << " by value), ";
+        }
+        R << ore::NV("ToBytes", toBytes) << " bytes mapped to and "
+          << ore::NV("FromBytes", fromBytes) << " bytes from the device";
+        if (runtimeSized) {
+          R << ", plus " << ore::NV("RuntimeSized", runtimeSized)
+            << " maps sized at run time";
+        }
+        return R;
+      });
+    }
+  }
+
+  json::Array kernels = std::move(reportKernels);
+  reportKernels = json::Array();
+  if (ReportFile.empty()) {
+    return;
+  }
+  json::Object report;
+  report["module"] = M.getSourceFileName();
+  report["kernels"] = std::move(kernels);
+  report["launches"] = std::move(launches);
+  report["data_maps"] = std::move(dataMaps);
+
+  std::error_code EC;
+  raw_fd_ostream OS(ReportFile, EC, sys::fs::OF_Text);
+  if (EC) {
+    errs() << "warning: can't write " << ReportFile << ": " << EC.message()
+           << "\n";
+    return;
+  }
+  OS << formatv("{0:2}", json::Value(std::move(report))) << "\n";
+}
+
 char OmpKernelWrapper::ID = 1;
 static RegisterPass<OmpKernelWrapper>
     Xmark("HERCULES-omp-kernel-wrapper",
@@ -381,3 +579,22 @@ static RegisterStandardPasses
     RegisterMyPass0(PassManagerBuilder::EP_EnabledOnOptLevel0, registerMyPass);
 
 llvm::Pass *hero::createOmpKernelWrapper() { return new OmpKernelWrapper(); }
+
+extern "C" LLVM_ATTRIBUTE_WEAK PassPluginLibraryInfo llvmGetPassPluginInfo() {
+  return {LLVM_PLUGIN_API_VERSION, "OmpKernelWrapper", LLVM_VERSION_STRING,
+          [](PassBuilder &PB) {
+            PB.registerPipelineParsingCallback(
+                [](StringRef name, ModulePassManager &MPM,
+                   ArrayRef<PassBuilder::PipelineElement>) {
+                  if (name == "hero-omp-kernel-wrapper") {
+                    MPM.addPass(OmpKernelWrapperPass());
+                    return true;
+                  }
+                  return false;
+                });
+            PB.registerOptimizerLastEPCallback(
+                [](ModulePassManager &MPM, OptimizationLevel) {
+                  MPM.addPass(OmpKernelWrapperPass());
+                });
+          }};
+}
@@ -8,22 +8,45 @@
 #ifndef OMP_PREPROCESS_H
 #define OMP_PREPROCESS_H
 
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/ADT/Optional.h>
 #include <llvm/ADT/StringRef.h>
+#include <llvm/IR/GlobalVariable.h>
 #include <llvm/IR/Module.h>
+#include <llvm/IR/PassManager.h>
 #include <llvm/Pass.h>
+#include <llvm/Support/JSON.h>
 
 #include <vector>
 
 namespace hero {
 
-class OmpKernelWrapper : public llvm::ModulePass {
+// The wrapping itself, shared by both pass managers
+class KernelWrapper {
+public:
+  bool run(llvm::Module &M);
+
 private:
+  void indexOffloadEntries(llvm::Module &M);
+  llvm::Optional<llvm::GlobalVariable *>
+  getOmpOffloadEntry(llvm::Function *kernel);
   void changeTypeOfArgSizes(llvm::Module &M, llvm::StringRef fnName,
                             unsigned int argIdx);
   void wrapOmpKernels(llvm::Module &M);
 
   void wrapOmpOutlinedFuncs(llvm::Module &M);
+  void reportOffloads(llvm::Module &M);
+
+  // Offload entries with the kernel they point to, and the other way round
+  std::vector<std::pair<llvm::GlobalVariable *, llvm::Function *>>
+      offloadEntries;
+  llvm::DenseMap<llvm::Function *, llvm::GlobalVariable *> kernelEntries;
+  // Argument blocks of the kernels wrapped in this module
+  llvm::json::Array reportKernels;
+};
 
+// Legacy pass manager, used by hc-omp-pass
+class OmpKernelWrapper : public llvm::ModulePass {
 public:
   static char ID;
   OmpKernelWrapper() : llvm::ModulePass(ID) {}
@@ -32,6 +55,13 @@ public:
   bool runOnModule(llvm::Module &M);
 };
 
+// New pass manager, -passes=hero-omp-kernel-wrapper or -fpass-plugin
+class OmpKernelWrapperPass : public llvm::PassInfoMixin<OmpKernelWrapperPass> {
+public:
+  llvm::PreservedAnalyses run(llvm::Module &M,
+                              llvm::ModuleAnalysisManager &MAM);
+};
+
 llvm::Pass *createOmpKernelWrapper();
 
 } // namespace hrcl
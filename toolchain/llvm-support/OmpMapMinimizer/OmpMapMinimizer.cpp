@@ -0,0 +1,488 @@
+// Copyright 2024 ETH Zurich and University of Bologna.
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: Apache-2.0
+//
+// This file is part of the HERCULES Compiler Passes for PREM transformation
+// of code.
+
+#include "OmpMapMinimizer.h"
+#include "OmpOffloadCalls.h"
+
+#include <llvm/ADT/STLExtras.h>
+#include <llvm/ADT/SmallPtrSet.h>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/Analysis/OptimizationRemarkEmitter.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/InstIterator.h>
+#include <llvm/IR/IntrinsicInst.h>
+#include <llvm/IR/LegacyPassManager.h>
+#include <llvm/IR/Operator.h>
+#include <llvm/IRReader/IRReader.h>
+#include <llvm/Passes/PassBuilder.h>
+#include <llvm/Passes/PassPlugin.h>
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/FormatVariadic.h>
+#include <llvm/Support/JSON.h>
+#include <llvm/Support/SourceMgr.h>
+#include <llvm/Support/raw_ostream.h>
+#include <llvm/Transforms/IPO/PassManagerBuilder.h>
+
+#define DEBUG_TYPE "hero-map-minimizer"
+
+using namespace llvm;
+using namespace hero;
+
+static cl::opt<bool>
+    EnableMinimizer("hero-map-minimize", cl::init(true),
+                    cl::desc("Drop the copies of the map clauses that the "
+                             "target regions don't need"));
+
+// A private copy is taken from the host memory, while an enclosing data
+// region may hold a newer device copy. Data regions of other translation
+// units can't be seen from here, hence opt-in.
+static cl::opt<bool> MapFirstprivate(
+    "hero-map-firstprivate", cl::init(false),
+    cl::desc("Pass the mapped arguments that a target region only reads as "
+             "firstprivate, assumes that no target data region of another "
+             "module encloses the target regions"));
+
+// The host fallbacks can't be analyzed instead, the body of most target
+// regions is only compiled for the device (#ifdef __HERO_DEV)
+static cl::list<std::string> DeviceIR(
+    "hero-map-device-ir", cl::value_desc("filename"),
+    cl::desc("Device module of the target regions, once per device. Only the "
+             "target regions found in all of them are changed"));
+
+static cl::opt<std::string> ReportFile(
+    "hero-map-report", cl::value_desc("filename"),
+    cl::desc("Write the map clauses changed in each target region and the "
+             "bytes saved to a JSON file"));
+
+namespace {
+enum ArgAccess {
+  ReadAccess = 1,
+  WriteAccess = 2,
+  // The whole mapped object is written when the region starts
+  FullWrite = 4,
+};
+} // namespace
+
+// A local slot a pointer is spilled to, as at -O0
+static bool isPointerSlot(Value *V) {
+  auto *slot = dyn_cast<AllocaInst>(V->stripPointerCasts());
+  if (!slot) {
+    return false;
+  }
+  for (User *U : slot->users()) {
+    auto *SI = dyn_cast<StoreInst>(U);
+    if (!isa<LoadInst>(U) && !(SI && SI->getPointerOperand() == slot)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// How the region accesses the memory behind a pointer argument, following it
+// through the outlined parallel regions and the calls to defined functions.
+// Anything we can't follow counts as a read and a write.
+static unsigned int getArgAccesses(Argument *arg, Optional<uint64_t> size) {
+  const DataLayout &DL = arg->getParent()->getParent()->getDataLayout();
+  const BasicBlock *regionEntry = &arg->getParent()->getEntryBlock();
+  unsigned int acc = 0;
+  // A direct pointer still points to the start of the object
+  SmallVector<std::pair<Value *, bool>, 16> work = {{arg, true}};
+  SmallPtrSet<Value *, 16> seen = {arg};
+  auto push = [&](Value *V, bool direct) {
+    if (seen.insert(V).second) {
+      work.push_back({V, direct});
+    }
+  };
+  auto isFullWrite = [&](Instruction *I, bool direct, uint64_t bytes) {
+    return direct && size && bytes == *size && I->getParent() == regionEntry;
+  };
+
+  while (!work.empty()) {
+    Value *V = work.back().first;
+    bool direct = work.back().second;
+    work.pop_back();
+
+    for (User *U : V->users()) {
+      if (isa<LoadInst>(U)) {
+        acc |= ReadAccess;
+      } else if (auto *SI = dyn_cast<StoreInst>(U)) {
+        if (SI->getPointerOperand() == V) {
+          acc |= WriteAccess;
+          uint64_t bytes =
+              DL.getTypeStoreSize(SI->getValueOperand()->getType());
+          if (!SI->isVolatile() && isFullWrite(SI, direct, bytes)) {
+            acc |= FullWrite;
+          }
+        } else if (isPointerSlot(SI->getPointerOperand())) {
+          Value *slot = SI->getPointerOperand()->stripPointerCasts();
+          for (User *SU : slot->users()) {
+            if (isa<LoadInst>(SU)) {
+              push(SU, direct);
+            }
+          }
+        } else {
+          acc |= ReadAccess | WriteAccess;
+        }
+      } else if (auto *GEP = dyn_cast<GetElementPtrInst>(U)) {
+        push(GEP, direct && GEP->hasAllZeroIndices());
+      } else if (isa<BitCastInst>(U) || isa<AddrSpaceCastInst>(U)) {
+        push(U, direct);
+      } else if (isa<PHINode>(U) || isa<SelectInst>(U)) {
+        push(U, false);
+      } else if (isa<ICmpInst>(U)) {
+        continue;
+      } else if (auto *CB = dyn_cast<CallBase>(U)) {
+        auto *II = dyn_cast<IntrinsicInst>(CB);
+        if (II && (isa<DbgInfoIntrinsic>(II) || II->isLifetimeStartOrEnd())) {
+          continue;
+        }
+        if (auto *MI = dyn_cast<MemIntrinsic>(CB)) {
+          if (MI->getRawDest() == V) {
+            acc |= WriteAccess;
+            auto *len = dyn_cast<ConstantInt>(MI->getLength());
+            if (len && !MI->isVolatile() &&
+                isFullWrite(MI, direct, len->getZExtValue())) {
+              acc |= FullWrite;
+            }
+          }
+          auto *MT = dyn_cast<MemTransferInst>(MI);
+          if (MT && MT->getRawSource() == V) {
+            acc |= ReadAccess;
+          }
+          continue;
+        }
+
+        Function *callee = CB->getCalledFunction();
+        for (unsigned int i = 0; i < CB->arg_size(); i++) {
+          if (CB->getArgOperand(i) != V) {
+            continue;
+          }
+          // __kmpc_fork_call(loc, argc, microtask, args...) calls
+          // microtask(gtid, btid, args...)
+          if (callee && (callee->getName() == "__kmpc_fork_call" ||
+                         callee->getName() == "__kmpc_fork_teams")) {
+            auto *microtask =
+                dyn_cast<Function>(CB->getArgOperand(2)->stripPointerCasts());
+            if (i >= 3 && microtask && !microtask->isDeclaration() &&
+                i - 1 < microtask->arg_size()) {
+              push(microtask->getArg(i - 1), false);
+            } else {
+              acc |= ReadAccess | WriteAccess;
+            }
+          } else if (callee && !callee->isDeclaration() &&
+                     !callee->isVarArg() && i < callee->arg_size()) {
+            push(callee->getArg(i), false);
+          } else if (CB->doesNotAccessMemory(i)) {
+            continue;
+          } else if (CB->onlyReadsMemory(i)) {
+            acc |= ReadAccess;
+          } else if (CB->paramHasAttr(i, Attribute::WriteOnly)) {
+            acc |= WriteAccess;
+          } else {
+            acc |= ReadAccess | WriteAccess;
+          }
+        }
+      } else {
+        acc |= ReadAccess | WriteAccess;
+      }
+    }
+  }
+  return acc;
+}
+
+static const char *getMapName(uint64_t type) {
+  if (type & OMP_TGT_MAPTYPE_PRIVATE) {
+    return "firstprivate";
+  }
+  switch (type & (OMP_TGT_MAPTYPE_TO | OMP_TGT_MAPTYPE_FROM)) {
+  case OMP_TGT_MAPTYPE_TO | OMP_TGT_MAPTYPE_FROM:
+    return "tofrom";
+  case OMP_TGT_MAPTYPE_TO:
+    return "to";
+  case OMP_TGT_MAPTYPE_FROM:
+    return "from";
+  default:
+    return "alloc";
+  }
+}
+
+static bool minimizeMaps(CallInst *launch, unsigned int argNumIdx,
+                         ArrayRef<std::unique_ptr<Module>> devices,
+                         bool hasDataRegions, json::Array &report) {
+  Module &M = *launch->getModule();
+  auto *argNum = dyn_cast<ConstantInt>(launch->getArgOperand(argNumIdx));
+  SmallVector<uint64_t, 16> types;
+  GlobalVariable *offloadTypes =
+      getConstArray(launch->getArgOperand(argNumIdx + 4), types);
+  if (!argNum || !offloadTypes || argNum->getZExtValue() != types.size()) {
+    return false;
+  }
+  unsigned int n = types.size();
+  SmallVector<Optional<uint64_t>, 16> sizes;
+  getMapSizes(launch->getArgOperand(argNumIdx + 3), n, sizes);
+
+  // The device kernel @__omp_offloading_<id> takes the mapped arguments in
+  // order, identified by @.__omp_offloading_<id>.region_id
+  StringRef kernel = launch->getArgOperand(argNumIdx - 1)
+                         ->stripPointerCasts()
+                         ->getName()
+                         .ltrim('.');
+  kernel.consume_back(".region_id");
+  SmallVector<Function *, 2> regions;
+  for (const std::unique_ptr<Module> &D : devices) {
+    Function *region = D->getFunction(kernel);
+    if (!region || region->isDeclaration()) {
+      return false;
+    }
+    regions.push_back(region);
+  }
+  SmallVector<unsigned int, 16> params;
+  SmallVector<bool, 16> isParent(n, false);
+  for (unsigned int i = 0; i < n; i++) {
+    if (types[i] & OMP_TGT_MAPTYPE_TARGET_PARAM) {
+      params.push_back(i);
+    }
+    // MEMBER_OF holds the index of the parent entry plus one
+    uint64_t parent = (types[i] & OMP_TGT_MAPTYPE_MEMBER_OF) >> 48;
+    if (parent && parent <= n) {
+      isParent[parent - 1] = true;
+    }
+  }
+  for (Function *region : regions) {
+    if (params.size() != region->arg_size()) {
+      return false;
+    }
+  }
+
+  OptimizationRemarkEmitter ORE(launch->getFunction());
+  json::Array maps;
+  uint64_t toSaved = 0, fromSaved = 0;
+  unsigned int runtimeSized = 0;
+  bool changed = false;
+  for (unsigned int p = 0; p < params.size(); p++) {
+    unsigned int i = params[p];
+    uint64_t type = types[i];
+    Argument *arg = regions.front()->getArg(p);
+    // Leave the struct members, the pointer attachments, the literals and
+    // the copies the user forced alone
+    if ((type & (OMP_TGT_MAPTYPE_ALWAYS | OMP_TGT_MAPTYPE_PTR_AND_OBJ |
+                 OMP_TGT_MAPTYPE_PRIVATE | OMP_TGT_MAPTYPE_LITERAL |
+                 OMP_TGT_MAPTYPE_MEMBER_OF)) ||
+        !(type & (OMP_TGT_MAPTYPE_TO | OMP_TGT_MAPTYPE_FROM)) ||
+        isParent[i] ||
+        any_of(regions, [&](Function *region) {
+          return !region->getArg(p)->getType()->isPointerTy();
+        })) {
+      continue;
+    }
+
+    // Nothing to copy back if not written on any device, nothing to copy in
+    // if not read, unless only part of it is written
+    unsigned int acc = 0;
+    bool fullWrite = true;
+    for (Function *region : regions) {
+      unsigned int devAcc = getArgAccesses(region->getArg(p), sizes[i]);
+      acc |= devAcc & ~FullWrite;
+      fullWrite &= (devAcc & FullWrite) != 0;
+    }
+    if (fullWrite) {
+      acc |= FullWrite;
+    }
+    uint64_t newType = type;
+    if (!(acc & WriteAccess)) {
+      newType &= ~(uint64_t)OMP_TGT_MAPTYPE_FROM;
+    }
+    if (!(acc & ReadAccess) && (!(acc & WriteAccess) || (acc & FullWrite))) {
+      newType &= ~(uint64_t)OMP_TGT_MAPTYPE_TO;
+    }
+    if (MapFirstprivate && !hasDataRegions &&
+        (newType & (OMP_TGT_MAPTYPE_TO | OMP_TGT_MAPTYPE_FROM)) ==
+            OMP_TGT_MAPTYPE_TO) {
+      newType |= OMP_TGT_MAPTYPE_PRIVATE;
+    }
+    if (newType == type) {
+      continue;
+    }
+
+    uint64_t dropped = type & ~newType;
+    if (sizes[i]) {
+      toSaved += dropped & OMP_TGT_MAPTYPE_TO ? *sizes[i] : 0;
+      fromSaved += dropped & OMP_TGT_MAPTYPE_FROM ? *sizes[i] : 0;
+    } else if (dropped & (OMP_TGT_MAPTYPE_TO | OMP_TGT_MAPTYPE_FROM)) {
+      runtimeSized++;
+    }
+    types[i] = newType;
+    changed = true;
+
+    ORE.emit([&]() {
+      return OptimizationRemark(DEBUG_TYPE, "MapDowngraded", launch)
+             << "map(" << getMapName(type) << ") of argument "
+             << ore::NV("Arg", arg) << " of " << ore::NV("Kernel", kernel)
+             << " downgraded to " << getMapName(newType);
+    });
+    json::Object map;
+    map["arg"] = arg->getName();
+    map["map"] = getMapName(type);
+    map["new_map"] = getMapName(newType);
+    if (sizes[i]) {
+      map["size"] = *sizes[i];
+    }
+    maps.push_back(std::move(map));
+  }
+  if (!changed) {
+    return false;
+  }
+
+  // The map types are usually private to the region, but clone them anyway
+  Constant *newInit = ConstantDataArray::get(M.getContext(), types);
+  auto *newTypes = new GlobalVariable(M, newInit->getType(), true,
+                                      GlobalValue::PrivateLinkage, newInit,
+                                      offloadTypes->getName());
+  newTypes->setUnnamedAddr(GlobalValue::UnnamedAddr::Global);
+  Value *index = ConstantInt::get(Type::getInt32Ty(M.getContext()), 0);
+  Constant *newArg = ConstantExpr::getPointerCast(
+      ConstantExpr::getInBoundsGetElementPtr(newInit->getType(), newTypes,
+                                             ArrayRef<Value *>{index, index}),
+      launch->getArgOperand(argNumIdx + 4)->getType());
+  launch->setArgOperand(argNumIdx + 4, newArg);
+  offloadTypes->removeDeadConstantUsers();
+  if (offloadTypes->use_empty()) {
+    offloadTypes->eraseFromParent();
+  }
+
+  ORE.emit([&]() {
+    OptimizationRemark R(DEBUG_TYPE, "MapBytesSaved", launch);
+    R << "maps of " << ore::NV("Kernel", kernel) << " copy "
+      << ore::NV("ToBytes", toSaved) << " bytes less to and "
+      << ore::NV("FromBytes", fromSaved) << " bytes less from the device";
+    if (runtimeSized) {
+      R << ", plus " << ore::NV("RuntimeSized", runtimeSized)
+        << " maps sized at run time";
+    }
+    return R;
+  });
+  json::Object entry;
+  entry["kernel"] = kernel;
+  entry["caller"] = launch->getFunction()->getName();
+  if (const DebugLoc &DL = launch->getDebugLoc()) {
+    entry["line"] = DL.getLine();
+  }
+  entry["maps"] = std::move(maps);
+  entry["to_bytes_saved"] = toSaved;
+  entry["from_bytes_saved"] = fromSaved;
+  entry["runtime_sized_maps"] = runtimeSized;
+  report.push_back(std::move(entry));
+  return true;
+}
+
+static bool minimizeMapClauses(Module &M) {
+  if (!EnableMinimizer || DeviceIR.empty()) {
+    return false;
+  }
+
+  // Parsed in the context of the host module, only read
+  SmallVector<std::unique_ptr<Module>, 2> devices;
+  for (const std::string &file : DeviceIR) {
+    SMDiagnostic Err;
+    std::unique_ptr<Module> D = parseIRFile(file, Err, M.getContext());
+    if (!D) {
+      errs() << "warning: can't read " << file << ", map clauses kept: "
+             << Err.getMessage() << "\n";
+      return false;
+    }
+    devices.push_back(std::move(D));
+  }
+
+  bool hasDataRegions = false;
+  for (Function &F : M) {
+    if (F.getName().startswith("__tgt_target_data_begin") && !F.use_empty()) {
+      hasDataRegions = true;
+    }
+  }
+
+  json::Array report;
+  bool changed = false;
+  for (Function &F : M) {
+    unsigned int argNumIdx = getOffloadArgNumIdx(F, false);
+    if (!argNumIdx) {
+      continue;
+    }
+
+    SmallVector<CallInst *, 8> launches;
+    for (User *U : F.users()) {
+      auto *CI = dyn_cast<CallInst>(U);
+      if (CI && CI->getCalledFunction() == &F) {
+        launches.push_back(CI);
+      }
+    }
+    for (CallInst *CI : launches) {
+      changed |= minimizeMaps(CI, argNumIdx, devices, hasDataRegions, report);
+    }
+  }
+
+  if (ReportFile.empty()) {
+    return changed;
+  }
+  std::error_code EC;
+  raw_fd_ostream OS(ReportFile, EC, sys::fs::OF_Text);
+  if (EC) {
+    errs() << "warning: can't write " << ReportFile << ": " << EC.message()
+           << "\n";
+    return changed;
+  }
+  json::Object root;
+  root["module"] = M.getSourceFileName();
+  root["regions"] = std::move(report);
+  OS << formatv("{0:2}", json::Value(std::move(root))) << "\n";
+  return changed;
+}
+
+bool OmpMapMinimizer::runOnModule(Module &M) { return minimizeMapClauses(M); }
+
+PreservedAnalyses OmpMapMinimizerPass::run(Module &M,
+                                           ModuleAnalysisManager &MAM) {
+  if (!minimizeMapClauses(M)) {
+    return PreservedAnalyses::all();
+  }
+  return PreservedAnalyses::none();
+}
+
+char OmpMapMinimizer::ID = 4;
+static RegisterPass<OmpMapMinimizer>
+    Xmark("HERCULES-omp-map-minimizer",
+          "Downgrades the map clauses of OpenMP target regions", false, false);
+
+static void registerMyPass(const PassManagerBuilder &PMB,
+                           legacy::PassManagerBase &PM) {}
+
+static RegisterStandardPasses
+    RegisterMyPass(PassManagerBuilder::EP_ModuleOptimizerEarly, registerMyPass);
+static RegisterStandardPasses
+    RegisterMyPass0(PassManagerBuilder::EP_EnabledOnOptLevel0, registerMyPass);
+
+llvm::Pass *hero::createOmpMapMinimizer() { return new OmpMapMinimizer(); }
+
+extern "C" LLVM_ATTRIBUTE_WEAK PassPluginLibraryInfo llvmGetPassPluginInfo() {
+  return {LLVM_PLUGIN_API_VERSION, "OmpMapMinimizer", LLVM_VERSION_STRING,
+          [](PassBuilder &PB) {
+            PB.registerPipelineParsingCallback(
+                [](StringRef name, ModulePassManager &MPM,
+                   ArrayRef<PassBuilder::PipelineElement>) {
+                  if (name == "hero-omp-map-minimizer") {
+                    MPM.addPass(OmpMapMinimizerPass());
+                    return true;
+                  }
+                  return false;
+                });
+            PB.registerOptimizerLastEPCallback(
+                [](ModulePassManager &MPM, OptimizationLevel) {
+                  MPM.addPass(OmpMapMinimizerPass());
+                });
+          }};
+}
@@ -0,0 +1,40 @@
+// Copyright 2024 ETH Zurich and University of Bologna.
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: Apache-2.0
+//
+// This file is part of the HERCULES Compiler Passes for PREM transformation
+// of code.
+
+#ifndef OMP_MAP_MINIMIZER_H
+#define OMP_MAP_MINIMIZER_H
+
+#include <llvm/IR/Module.h>
+#include <llvm/IR/PassManager.h>
+#include <llvm/Pass.h>
+
+namespace hero {
+
+// Drop the copies of the map clauses of the target regions that the region
+// doesn't need: `from` of the arguments it never writes, `to` of the
+// arguments it never reads. Runs on the host module, the accesses are taken
+// from the device kernels of the device modules (-hero-map-device-ir).
+class OmpMapMinimizer : public llvm::ModulePass {
+public:
+  static char ID;
+  OmpMapMinimizer() : llvm::ModulePass(ID) {}
+
+  bool runOnModule(llvm::Module &M);
+};
+
+// New pass manager, -passes=hero-omp-map-minimizer or -fpass-plugin
+class OmpMapMinimizerPass : public llvm::PassInfoMixin<OmpMapMinimizerPass> {
+public:
+  llvm::PreservedAnalyses run(llvm::Module &M,
+                              llvm::ModuleAnalysisManager &MAM);
+};
+
+llvm::Pass *createOmpMapMinimizer();
+
+} // namespace hero
+
+#endif
@@ -0,0 +1,115 @@
+// Copyright 2024 ETH Zurich and University of Bologna.
+// Licensed under the Apache License, Version 2.0, see LICENSE for details.
+// SPDX-License-Identifier: Apache-2.0
+//
+// This file is part of the HERCULES Compiler Passes for PREM transformation
+// of code.
+
+#ifndef OMP_OFFLOAD_CALLS_H
+#define OMP_OFFLOAD_CALLS_H
+
+#include <llvm/ADT/None.h>
+#include <llvm/ADT/Optional.h>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/GlobalVariable.h>
+#include <llvm/IR/InstIterator.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/Module.h>
+
+// Map type bits of the offloading entries, see omptarget.h
+#define OMP_TGT_MAPTYPE_TO 0x001
+#define OMP_TGT_MAPTYPE_FROM 0x002
+#define OMP_TGT_MAPTYPE_ALWAYS 0x004
+#define OMP_TGT_MAPTYPE_PTR_AND_OBJ 0x010
+#define OMP_TGT_MAPTYPE_TARGET_PARAM 0x020
+#define OMP_TGT_MAPTYPE_PRIVATE 0x080
+#define OMP_TGT_MAPTYPE_LITERAL 0x100
+#define OMP_TGT_MAPTYPE_MEMBER_OF 0xffff000000000000
+
+namespace hero {
+
+// Index of the arg_num operand of the calls to the offloading entry point F,
+// 0 if F isn't one whose map arrays can be read:
+//   int __tgt_target_mapper(ident_t *loc, int64_t device_id, void *host_ptr,
+//                           int32_t arg_num, void **args_base, void **args,
+//                           int64_t *arg_sizes, int64_t *arg_types, ...);
+// The data calls don't have the host_ptr, the older ones no ident_t. The
+// region id is the operand before arg_num, the sizes and types come 3 and 4
+// after it. The __tgt_target_kernel launches of newer runtimes pack the
+// arguments in a struct and are left alone.
+inline unsigned int getOffloadArgNumIdx(const llvm::Function &F,
+                                        bool withData) {
+  llvm::StringRef name = F.getName();
+  bool isData = name.startswith("__tgt_target_data_");
+  if (!F.isDeclaration() || !name.startswith("__tgt_target") ||
+      (isData && !withData) || name.startswith("__tgt_target_kernel")) {
+    return 0;
+  }
+  unsigned int argNumIdx = isData ? 1 : 2;
+  if (F.arg_size() > 0 && F.getArg(0)->getType()->isPointerTy()) {
+    argNumIdx++;
+  }
+  return (F.arg_size() < argNumIdx + 5) ? 0 : argNumIdx;
+}
+
+// Constant i64 array behind a pointer argument of the offloading calls
+inline llvm::GlobalVariable *
+getConstArray(llvm::Value *V, llvm::SmallVectorImpl<uint64_t> &vals) {
+  auto *G = llvm::dyn_cast<llvm::GlobalVariable>(V->stripPointerCasts());
+  if (!G || !G->isConstant() || !G->hasInitializer()) {
+    return nullptr;
+  }
+  llvm::Constant *init = G->getInitializer();
+  if (auto *CDA = llvm::dyn_cast<llvm::ConstantDataArray>(init)) {
+    for (unsigned int i = 0; i < CDA->getNumElements(); i++) {
+      vals.push_back(CDA->getElementAsInteger(i));
+    }
+    return G;
+  }
+  if (auto *CAZ = llvm::dyn_cast<llvm::ConstantAggregateZero>(init)) {
+    vals.append(CAZ->getElementCount().getFixedValue(), 0);
+    return G;
+  }
+  return nullptr;
+}
+
+// Sizes of the mapped items, None if only known at run time. With
+// non-constant sizes, clang fills an array on the stack instead of a global.
+inline void getMapSizes(llvm::Value *V, unsigned int n,
+                        llvm::SmallVectorImpl<llvm::Optional<uint64_t>> &sizes) {
+  llvm::SmallVector<uint64_t, 16> constSizes;
+  sizes.assign(n, llvm::None);
+  if (getConstArray(V, constSizes)) {
+    for (unsigned int i = 0; i < n && i < constSizes.size(); i++) {
+      sizes[i] = constSizes[i];
+    }
+    return;
+  }
+  auto *sizesArray = llvm::dyn_cast<llvm::AllocaInst>(V->stripPointerCasts());
+  if (!sizesArray) {
+    return;
+  }
+  const llvm::DataLayout &DL = sizesArray->getModule()->getDataLayout();
+  for (auto &I : llvm::instructions(*sizesArray->getFunction())) {
+    auto *SI = llvm::dyn_cast<llvm::StoreInst>(&I);
+    if (!SI) {
+      continue;
+    }
+    llvm::APInt offset(DL.getIndexTypeSizeInBits(SI->getPointerOperandType()),
+                       0);
+    llvm::Value *base =
+        SI->getPointerOperand()->stripAndAccumulateConstantOffsets(DL, offset,
+                                                                   true);
+    auto *size = llvm::dyn_cast<llvm::ConstantInt>(SI->getValueOperand());
+    uint64_t i = offset.getZExtValue() / 8;
+    if (base == sizesArray && size && i < n) {
+      sizes[i] = size->getZExtValue();
+    }
+  }
+}
+
+} // namespace hero
+
+#endif